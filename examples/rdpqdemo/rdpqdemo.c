@@ -86,12 +86,17 @@ void render(int cur_frame)
     rdpq_mode_filter(FILTER_BILINEAR);
     rdpq_mode_alphacompare(1);                // colorkey (draw pixel with alpha >= 1)
 
+    // All the sprites share the same texture, so draw them as a single batch:
+    // this way, the texture is uploaded to TMEM only once.
+    static rdpq_blitinst_t insts[NUM_OBJECTS];
     for (uint32_t i = 0; i < num_objs; i++)
     {
-        rdpq_sprite_blit(brew_sprite, objects[i].x, objects[i].y, &(rdpq_blitparms_t){
+        insts[i] = (rdpq_blitinst_t){
+            .x = objects[i].x, .y = objects[i].y,
             .scale_x = objects[i].scale_factor, .scale_y = objects[i].scale_factor,
-        });
+        };
     }
+    rdpq_sprite_blit_batch(brew_sprite, insts, num_objs, NULL);
 
     rdpq_detach_show();
 }
@@ -43,6 +43,13 @@
  * If you know that the file will never be compressed and you absolutely need
  * to freely seek, simply use the standard fopen() function.
  * 
+ * Large files that require random access (eg: data packs) can instead be
+ * compressed in blocks, using the "--blocks" option of mkasset. Each block
+ * is compressed independently, and a block offset table is stored in the
+ * header, so that the FILE* returned by #asset_fopen can be seeked freely:
+ * only the block containing the requested data is decompressed. This trades
+ * a bit of compression ratio for random access.
+ * 
  * ## Asset compression
  * 
  * To compress your own data files, you can use the mkasset tool.
@@ -66,6 +73,7 @@
  */
 
 #include <stdio.h>
+#include <stdbool.h>
 
 #ifdef N64
 #include "debug.h"
@@ -78,6 +86,9 @@ extern "C" {
 /// @private
 extern void __asset_init_compression_lvl2(void);
 
+/** @brief Amount of decompressed data produced by each #asset_async_poll call */
+#define ASSET_ASYNC_SLICE_SIZE      (16*1024)
+
 /**
  * @brief Enable a non-default compression level
  * 
@@ -134,6 +145,8 @@ void *asset_load(const char *fn, int *sz);
  * to do efficiently on a compressed file. Seeking forward is supported and is
  * simulated by reading (decompressing) and discarding data. You can rewind
  * the file to the start though, (by using either fseek or rewind).
+ * Files compressed in blocks (mkasset --blocks) can instead be seeked
+ * freely in any direction.
  * 
  * This behavior of the returned file is enforced also for non compressed
  * assets, so that the code is ready to switch to compressed assets if
@@ -146,6 +159,145 @@ void *asset_load(const char *fn, int *sz);
  */
 FILE *asset_fopen(const char *fn, int *sz);
 
+/** @brief Handle of an asynchronous asset load (see #asset_load_async) */
+typedef struct asset_async_s asset_async_t;
+
+/**
+ * @brief Callback invoked when an asynchronous asset load is completed
+ * 
+ * @param ctx       Opaque pointer passed to #asset_load_async
+ * @param buf       Loaded asset (must be freed with free() when done)
+ * @param size      Size of the loaded asset in bytes
+ */
+typedef void (*asset_async_cb_t)(void *ctx, void *buf, int size);
+
+/**
+ * @brief Start loading an asset file asynchronously
+ * 
+ * This function works like #asset_load, but it returns immediately after
+ * reading the asset header. The actual loading (and decompression) is
+ * performed incrementally by calling #asset_async_poll, typically once per
+ * frame, so that a level can be streamed in without stalling the game loop.
+ * 
+ * For files in ROM, the compressed data is fetched by PI DMA in chunks:
+ * the DMA of the next chunk runs in background while the current chunk is
+ * being decompressed, so PI latency is overlapped with CPU work.
+ * 
+ * Blocked assets (see the "--blocks" option of mkasset) are decompressed
+ * one block per call to #asset_async_poll, whatever their compression level.
+ * 
+ * @note Non-blocked assets using a compression level that does not support
+ *       streaming decompression (see #asset_fopen), such as level 3, are
+ *       loaded in one go by the first call to #asset_async_poll, which can
+ *       cause a frame hitch for large files. Compress them with blocks to
+ *       spread their loading over multiple frames.
+ * 
+ * @code{.c}
+ *      static void level_loaded(void *ctx, void *buf, int size) {
+ *          // ...
+ *      }
+ * 
+ *      asset_async_t *h = asset_load_async("rom:/level1.dat", level_loaded, NULL);
+ *      while (!asset_async_poll(h)) {
+ *          // Game loop: draw a loading screen, play music, etc.
+ *      }
+ * @endcode
+ * 
+ * @param fn        Filename to load (including filesystem prefix, eg: "rom:/foo.dat")
+ * @param cb        Callback invoked when the load is completed (can be NULL)
+ * @param ctx       Opaque pointer passed to the callback
+ * @return          Handle to the pending load
+ * 
+ * @see #asset_async_poll
+ * @see #asset_async_wait
+ */
+asset_async_t *asset_load_async(const char *fn, asset_async_cb_t cb, void *ctx);
+
+/**
+ * @brief Advance an asynchronous asset load
+ * 
+ * Each call performs a bounded amount of work (#ASSET_ASYNC_SLICE_SIZE bytes
+ * of decompressed output, or one block for blocked assets). When the load is completed, the callback passed to
+ * #asset_load_async (if any) is invoked, and the function returns true.
+ * 
+ * If a callback was specified, the handle is released when the function
+ * returns true, and must not be used anymore. Otherwise, call #asset_async_wait
+ * to retrieve the loaded asset and release the handle.
+ * 
+ * @param h         Handle returned by #asset_load_async
+ * @return true     The load is completed
+ * @return false    The load is still in progress
+ */
+bool asset_async_poll(asset_async_t *h);
+
+/**
+ * @brief Wait for an asynchronous asset load to complete
+ * 
+ * Runs the load to completion (if needed), invokes the callback (if any),
+ * and releases the handle.
+ * 
+ * @param h         Handle returned by #asset_load_async
+ * @param sz        If not NULL, this will be filed with the uncompressed size of the loaded file
+ * @return void*    Pointer to the loaded file (must be freed with free() when done)
+ */
+void *asset_async_wait(asset_async_t *h, int *sz);
+
+/**
+ * @brief Load the shared dictionary used to decompress assets
+ *
+ * Families of small assets with shared structure can be compressed with a
+ * shared dictionary, which greatly improves the compression ratio. The
+ * dictionary is built once by mkasset (see its "--build-dict" option), stored
+ * once in the ROM, and must be loaded at runtime via this function before
+ * loading any asset that was compressed with it (mkasset "--dict" option).
+ *
+ * Only one dictionary can be loaded at a time: calling this function again
+ * replaces the current dictionary. Loading an asset that was compressed with
+ * a different dictionary will trigger an assertion.
+ *
+ * Dictionaries are supported by compression levels 1 and 2.
+ *
+ * @param fn        Filename of the dictionary (including filesystem prefix,
+ *                  eg: "rom:/assets.dict"), or NULL to free the current one.
+ */
+void asset_set_dictionary(const char *fn);
+
+/**
+ * @brief Enable or disable the collection of asset load statistics
+ *
+ * While enabled, every file loaded via #asset_load or opened via #asset_fopen
+ * is tracked, recording the compressed and decompressed bytes, the time
+ * spent waiting for I/O (file reads and DMA waits), the time spent
+ * decompressing, and whether the in-place decompression path was taken.
+ *
+ * Statistics are disabled by default, as they add a small overhead to
+ * each load.
+ *
+ * Notice that when an in-place decompression runs in parallel with the
+ * DMA transfer from ROM, the time spent waiting for the DMA cannot be
+ * measured separately, and it is accounted as decompression time.
+ *
+ * @param enable    True to start collecting statistics, false to stop
+ *
+ * @see #asset_stats_dump
+ */
+void asset_stats_enable(bool enable);
+
+/**
+ * @brief Clear all the asset load statistics collected so far
+ */
+void asset_stats_reset(void);
+
+/**
+ * @brief Dump the asset load statistics as a table on the debug channel
+ *
+ * Each line of the table is prefixed by "[asset_stats]", so that the
+ * dumps can be extracted from a debug log and aggregated with the
+ * assetstats host tool, to select compression levels and window sizes
+ * based on measured data.
+ */
+void asset_stats_dump(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,142 @@
+/**
+ * @file atlas.h
+ * @brief Texture atlases
+ * @ingroup graphics
+ */
+#ifndef __LIBDRAGON_ATLAS_H
+#define __LIBDRAGON_ATLAS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+///@cond
+typedef struct sprite_s sprite_t;
+///@endcond
+
+/**
+ * @brief A texture atlas
+ * 
+ * An atlas is a set of images packed together into one or more sprites
+ * ("pages"), plus an index that allows to find each image by name. Packing
+ * many small images (eg: UI elements, icons, particles) into a few pages
+ * reduces the number of files to load, and allows to draw images from the
+ * same page without switching texture.
+ * 
+ * Atlases are created with mksprite in atlas mode, which packs all the input
+ * PNG files into pages and names each image after its input file (without
+ * the extension):
+ * 
+ * @code{.sh}
+ *      $ mksprite --atlas ui -f RGBA16 -o filesystem button.png cursor.png frame.png
+ * @endcode
+ * 
+ * This writes the index as `ui.atlas` and the pages as `ui.0.sprite`,
+ * `ui.1.sprite`, etc. (if multiple pages are needed).
+ * 
+ * To draw an image, look up its rectangle and upload it to TMEM:
+ * 
+ * @code{.c}
+ *      atlas_t *ui = atlas_load("rom:/ui.atlas");
+ * 
+ *      // Lookups are O(1), but the index can be saved to skip hashing the name
+ *      int button = atlas_find(ui, "button");
+ * 
+ *      atlas_rect_t r = atlas_get_rect(ui, button);
+ *      surface_t page = sprite_get_pixels(r.page);
+ *      rdpq_tex_upload_sub(TILE0, &page, NULL, r.s0, r.t0, r.s1, r.t1);
+ *      rdpq_texture_rectangle(TILE0, x, y, x + r.s1 - r.s0, y + r.t1 - r.t0, r.s0, r.t0);
+ * @endcode
+ * 
+ * Rectangles can also be passed as sub-rects to #rdpq_tex_blit or
+ * #rdpq_tex_blit_batch. If the pages use a color-indexed format, each page has
+ * its own palette, that must be uploaded with #rdpq_tex_upload_tlut (see
+ * #sprite_get_palette).
+ */
+typedef struct atlas_s atlas_t;
+
+/** @brief Position of an image within an atlas */
+typedef struct atlas_rect_s {
+    sprite_t *page;     ///< Page containing the image
+    int16_t s0;         ///< Top-left X coordinate of the image in the page
+    int16_t t0;         ///< Top-left Y coordinate of the image in the page
+    int16_t s1;         ///< Bottom-right X coordinate of the image in the page (exclusive)
+    int16_t t1;         ///< Bottom-right Y coordinate of the image in the page (exclusive)
+} atlas_rect_t;
+
+/**
+ * @brief Load an atlas from a file
+ * 
+ * This function loads the atlas index and all its pages. The pages are expected
+ * to be in the same directory of the index, with the same basename (eg: loading
+ * `rom:/ui.atlas` will also load `rom:/ui.0.sprite`, `rom:/ui.1.sprite`, etc.)
+ * 
+ * @param fn        Filename of the atlas index (including filesystem prefix)
+ * @return atlas_t* The loaded atlas
+ */
+atlas_t *atlas_load(const char *fn);
+
+/**
+ * @brief Free an atlas and all its pages
+ * 
+ * @param atlas     Atlas to free
+ */
+void atlas_free(atlas_t *atlas);
+
+/**
+ * @brief Find an image in the atlas by name
+ * 
+ * The name is the filename of the image passed to mksprite, without the
+ * directory and the extension. The lookup uses a hash table created by
+ * mksprite, so it runs in constant time.
+ * 
+ * @param atlas     Atlas
+ * @param name      Name of the image
+ * @return          Index of the image, or -1 if there is no image with this name
+ */
+int atlas_find(atlas_t *atlas, const char *name);
+
+/**
+ * @brief Return the number of images in the atlas
+ * 
+ * Images are indexed from 0 in the order in which they were passed to mksprite.
+ * 
+ * @param atlas     Atlas
+ * @return          Number of images
+ */
+int atlas_get_count(atlas_t *atlas);
+
+/**
+ * @brief Get the position of an image within the atlas
+ * 
+ * @param atlas     Atlas
+ * @param idx       Index of the image (see #atlas_find)
+ * @return          Page and rectangle of the image
+ */
+atlas_rect_t atlas_get_rect(atlas_t *atlas, int idx);
+
+/**
+ * @brief Return the number of pages in the atlas
+ * 
+ * @param atlas     Atlas
+ * @return          Number of pages
+ */
+int atlas_get_page_count(atlas_t *atlas);
+
+/**
+ * @brief Access a page of the atlas
+ * 
+ * @param atlas     Atlas
+ * @param page      Index of the page
+ * @return          Sprite containing the page
+ */
+sprite_t *atlas_get_page(atlas_t *atlas, int page);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
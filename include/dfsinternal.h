@@ -6,6 +6,8 @@
 #ifndef __LIBDRAGON_DFSINTERNAL_H
 #define __LIBDRAGON_DFSINTERNAL_H
 
+#include "fnv.h"
+
 /**
  * @addtogroup dfs
  * @{
@@ -41,6 +43,80 @@ _Static_assert(sizeof(struct directory_entry) == SECTOR_SIZE, "invalid directory
 /** @brief Type definition */
 typedef struct directory_entry directory_entry_t;
 
+/** @brief Magic value at the start of the path index ("DFSI") */
+#define INDEX_MAGIC             0x44465349
+/** @brief Flag in #dfs_index_entry_t::dirent marking a hash shared by multiple paths */
+#define INDEX_FLAG_COLLISION    0x1
+
+/**
+ * @brief Entry of the path index
+ *
+ * The path index is an optional table appended to the filesystem image by
+ * mkdfs, and referenced by the #directory_entry::file_pointer field of the
+ * root sector (which is zero in images without an index). It contains one
+ * entry per file and directory, sorted by #dfs_path_hash of its full path
+ * (relative to the root, without leading slash), so that files can be found
+ * with a binary search instead of walking directory entries one sector at a time.
+ *
+ * Each entry also records the directory entry of its parent directory, so that
+ * a lookup can verify every component of a path and not only the last one: a
+ * hash hit alone does not prove that the path exists.
+ *
+ * Directory entries are always sector-aligned, so the lowest bits of the
+ * offset are used for flags (see #INDEX_FLAG_COLLISION).
+ */
+typedef struct
+{
+    /** @brief Hash of the full path of the file or directory */
+    uint32_t hash;
+    /** @brief Offset of the directory entry, plus flags */
+    uint32_t dirent;
+    /** @brief Offset of the directory entry of the parent directory (0 for the root) */
+    uint32_t parent;
+} dfs_index_entry_t;
+
+/** @brief Header of the path index */
+typedef struct
+{
+    /** @brief Magic value (#INDEX_MAGIC) */
+    uint32_t magic;
+    /** @brief Number of entries that follow */
+    uint32_t count;
+} dfs_index_header_t;
+
+/**
+ * @brief Compute the hash of a path, as stored in the path index
+ *
+ * This is 32-bit FNV-1a over the first len bytes of path.
+ */
+static inline uint32_t dfs_path_hash(const char *path, int len)
+{
+    return fnv1a32(path, len);
+}
+
+/**
+ * @brief Readahead state of an open file
+ *
+ * Two buffers are used: while the caller consumes one, the next chunk of the
+ * file is being fetched into the other by an asynchronous PI DMA. Both buffers
+ * are allocated in a single block, right after this structure.
+ */
+typedef struct
+{
+    /** @brief Size in bytes of each buffer */
+    int size;
+    /** @brief Data buffers (16-byte aligned) */
+    uint8_t *buf[2];
+    /** @brief File offset of the contents of each buffer */
+    uint32_t start[2];
+    /** @brief Number of valid bytes in each buffer (0 if empty) */
+    int len[2];
+    /** @brief Index of the buffer being filled by a pending DMA, or -1 */
+    int pending;
+    /** @brief File offset right after the last read, to detect sequential access */
+    uint32_t next_loc;
+} dfs_readahead_t;
+
 /** @brief Open file handle structure */
 typedef struct dfs_open_file_s
 {
@@ -50,6 +126,10 @@ typedef struct dfs_open_file_s
     uint32_t loc;
     /** @brief The offset within the filesystem where the file is stored */
     uint32_t cart_start_loc;
+    /** @brief Size of each readahead buffer (0 if readahead is disabled) */
+    int ra_size;
+    /** @brief Readahead state (allocated on the first small read), or NULL */
+    dfs_readahead_t *ra;
 } dfs_open_file_t;
 
 /** @} */ /* dfs */
@@ -6,6 +6,8 @@
 #ifndef __LIBDRAGON_DRAGONFS_H
 #define __LIBDRAGON_DRAGONFS_H
 
+#include <stdbool.h>
+
 /** 
  * @addtogroup dfs
  * @{
@@ -77,6 +79,17 @@
 #define FLAGS_EOF           0x2
 /** @} */
 
+/**
+ * @brief Callback receiving the lines of the file access trace
+ *
+ * @param line      A trace line, terminated by a newline, in the format read
+ *                  by "mkdfs --trace"
+ * @param ctx       Opaque pointer passed to #dfs_trace_set_output
+ *
+ * @see #dfs_trace_set_output
+ */
+typedef void (*dfs_trace_output_t)(const char *line, void *ctx);
+
 /** @} */
 
 #ifdef __cplusplus
@@ -96,6 +109,10 @@ int dfs_close(uint32_t handle);
 int dfs_eof(uint32_t handle);
 int dfs_size(uint32_t handle);
 uint32_t dfs_rom_addr(const char *path);
+int dfs_readahead(uint32_t handle, int size);
+void dfs_set_default_readahead(int size);
+void dfs_trace_enable(bool enable);
+void dfs_trace_set_output(dfs_trace_output_t output, void *ctx);
 
 const char *dfs_strerror(int error);
 
@@ -0,0 +1,55 @@
+/**
+ * @file fnv.h
+ * @brief FNV-1a hash
+ *
+ * Internal header shared by the library and the host tools, so that hashes
+ * computed at build time (eg: DFS path index, sprite atlas names) match the
+ * ones computed at runtime. This is not a cryptographic hash: callers that need
+ * to be sure that two buffers are identical must still compare their contents.
+ */
+#ifndef __LIBDRAGON_FNV_H
+#define __LIBDRAGON_FNV_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/** @brief Initial value of a 32-bit FNV-1a hash */
+#define FNV1A32_INIT    0x811C9DC5u
+/** @brief Initial value of a 64-bit FNV-1a hash */
+#define FNV1A64_INIT    0xCBF29CE484222325ull
+
+/** @brief Continue a 32-bit FNV-1a hash over len bytes of data */
+static inline uint32_t fnv1a32_update(uint32_t hash, const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t*)data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 0x01000193u;
+    }
+    return hash;
+}
+
+/** @brief 32-bit FNV-1a hash of len bytes of data */
+static inline uint32_t fnv1a32(const void *data, size_t len)
+{
+    return fnv1a32_update(FNV1A32_INIT, data, len);
+}
+
+/** @brief Continue a 64-bit FNV-1a hash over len bytes of data */
+static inline uint64_t fnv1a64_update(uint64_t hash, const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t*)data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 0x100000001B3ull;
+    }
+    return hash;
+}
+
+/** @brief 64-bit FNV-1a hash of len bytes of data */
+static inline uint64_t fnv1a64(const void *data, size_t len)
+{
+    return fnv1a64_update(FNV1A64_INIT, data, len);
+}
+
+#endif
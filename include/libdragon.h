@@ -68,6 +68,7 @@
 #include "rdpq_macros.h"
 #include "surface.h"
 #include "sprite.h"
+#include "atlas.h"
 #include "debugcpp.h"
 
 #endif
@@ -283,6 +283,90 @@ bool mixer_ch_playing(int ch);
  */
 void mixer_ch_set_limits(int ch, int max_bits, float max_frequency, int max_buf_sz);
 
+/** @brief Maximum number of virtual voices (see #mixer_voice_play) */
+#define MIXER_MAX_VOICES        64
+
+/** @brief Invalid voice handle, returned by #mixer_voice_play when no voice is available */
+#define MIXER_VOICE_NONE        (-1)
+
+/**
+ * @brief Reserve a range of mixer channels for virtual voices.
+ *
+ * Virtual voices are an alternative to manually managing channels with
+ * #mixer_ch_play. An application can play up to #MIXER_MAX_VOICES voices at the
+ * same time (for instance, all the sound effects of a scene), and the mixer
+ * will only play the most audible ones on the reserved channels. Voices that do
+ * not fit the channels become "virtual": they are not mixed (so they cost no
+ * RSP time), but their playback position keeps advancing, so that they resume
+ * at the correct position as soon as a channel is available again.
+ *
+ * Audibility is defined first by the priority specified in #mixer_voice_play,
+ * and then by the volume of the voice. Voices with zero volume are never
+ * mixed.
+ *
+ * The reserved channels are fully managed by the mixer: the application must
+ * not call other mixer_ch_* functions on them. Call this function with
+ * num_ch = 0 to release them (all voices are stopped).
+ *
+ * Virtual voices do not fetch nor decode samples, so the CPU and RSP cost of
+ * the audio stays bounded by the number of reserved channels, however many
+ * voices are playing.
+ *
+ * @param[in]   first_ch        First channel reserved for the voices
+ * @param[in]   num_ch          Number of channels reserved for the voices
+ */
+void mixer_voices_init(int first_ch, int num_ch);
+
+/**
+ * @brief Start playing a waveform on a virtual voice.
+ *
+ * The voice starts playing at the next #mixer_poll, with the volume set to
+ * 1.0 and the frequency of the waveform. If all voices are busy, the least
+ * audible voice with the same or lower priority is stopped to make room
+ * for the new one; if there is none, #MIXER_VOICE_NONE is returned.
+ *
+ * The returned handle stays valid until the voice is stopped (or the waveform
+ * finishes). After that, all mixer_voice_* functions silently ignore it, so
+ * it is safe to keep using a handle without checking for the end of the
+ * playback.
+ *
+ * Only mono waveforms are supported. Since a voice might be resumed at any
+ * position, the waveform must support seeking (wav64 does, both raw and
+ * VADPCM).
+ *
+ * @param[in]   wave            Waveform to playback
+ * @param[in]   priority        Priority of the voice (higher is more important)
+ * @return                      Handle of the voice, or #MIXER_VOICE_NONE
+ */
+int mixer_voice_play(waveform_t *wave, int priority);
+
+/** @brief Change the volume of a voice (see #mixer_ch_set_vol). */
+void mixer_voice_set_vol(int voice, float lvol, float rvol);
+
+/** @brief Change the volume of a voice using panning (see #mixer_ch_set_vol_pan). */
+void mixer_voice_set_vol_pan(int voice, float vol, float pan);
+
+/** @brief Change the playback frequency of a voice (see #mixer_ch_set_freq). */
+void mixer_voice_set_freq(int voice, float frequency);
+
+/** @brief Read the playback position of a voice, in samples (see #mixer_ch_get_pos). */
+float mixer_voice_get_pos(int voice);
+
+/** @brief Stop playing a voice. */
+void mixer_voice_stop(int voice);
+
+/** @brief Return true if the voice is playing (either mixed or virtual). */
+bool mixer_voice_playing(int voice);
+
+/**
+ * @brief Return the channel a voice is being mixed on.
+ *
+ * @param[in]   voice           Handle of the voice
+ * @return                      Channel index, or -1 if the voice is currently
+ *                              virtual (or not playing).
+ */
+int mixer_voice_get_ch(int voice);
+
 /**
  * @brief Run the mixer to produce output samples.
  * 
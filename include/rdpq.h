@@ -163,6 +163,7 @@ enum {
     RDPQ_CMD_NOOP                       = 0x00,
     RDPQ_CMD_SET_LOOKUP_ADDRESS         = 0x01,
     RDPQ_CMD_FILL_RECTANGLE_EX          = 0x02,
+    RDPQ_CMD_TRIANGLE_BATCH             = 0x03,
     RDPQ_CMD_RESET_RENDER_MODE          = 0x04,
     RDPQ_CMD_SET_COMBINE_MODE_2PASS     = 0x05,
     RDPQ_CMD_PUSH_RENDER_MODE           = 0x06,
@@ -225,7 +226,8 @@ enum {
 #define RDPQ_CFG_AUTOSYNCLOAD   (1 << 1)     ///< Configuration flag: enable automatic generation of SYNC_LOAD commands
 #define RDPQ_CFG_AUTOSYNCTILE   (1 << 2)     ///< Configuration flag: enable automatic generation of SYNC_TILE commands
 #define RDPQ_CFG_AUTOSCISSOR    (1 << 3)     ///< Configuration flag: enable automatic generation of SET_SCISSOR commands on render target change
-#define RDPQ_CFG_DEFAULT        (0xFFFF)     ///< Configuration flag: default configuration
+#define RDPQ_CFG_TEXCACHE       (1 << 4)     ///< Configuration flag: skip texture uploads of data already in TMEM (see #rdpq_tex_upload)
+#define RDPQ_CFG_DEFAULT        (0xFFFF & ~RDPQ_CFG_TEXCACHE)     ///< Configuration flag: default configuration
 
 ///@cond
 // Used in inline functions as part of the autosync engine. Not part of public API.
@@ -27,6 +27,13 @@
 #define RDPQ_BLOCK_MIN_SIZE   64    ///< RDPQ block minimum size (in 32-bit words)
 #define RDPQ_BLOCK_MAX_SIZE   4192  ///< RDPQ block minimum size (in 32-bit words)
 
+/** @brief Size of a vertex in the format used by RDPQCmd_TriangleBatch (see rdpq_trivtx_t) */
+#define RDPQ_TRIVTX_SIZE           24
+/** @brief Number of triangles whose indices are fetched at once by RDPQCmd_TriangleBatch */
+#define RDPQ_TRI_BATCH_CHUNK       16
+/** @brief Number of vertices cached in DMEM by RDPQCmd_TriangleBatch (must be a power of two) */
+#define RDPQ_TRI_BATCH_VCACHE_SIZE 8
+
 /** @brief Set to 1 for the reference implementation of RDPQ_TRIANGLE (on CPU) */
 #define RDPQ_TRIANGLE_REFERENCE    0
 
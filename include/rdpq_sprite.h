@@ -22,6 +22,7 @@ extern "C" {
 typedef struct sprite_s sprite_t;
 typedef struct rdpq_texparms_s rdpq_texparms_t;
 typedef struct rdpq_blitparms_s rdpq_blitparms_t;
+typedef struct rdpq_blitinst_s rdpq_blitinst_t;
 ///@endcond
 
 /**
@@ -120,6 +121,23 @@ int rdpq_sprite_upload(rdpq_tile_t tile, sprite_t *sprite, const rdpq_texparms_t
  */
 void rdpq_sprite_blit(sprite_t *sprite, float x0, float y0, const rdpq_blitparms_t *parms);
 
+/**
+ * @brief Blit many instances of a sprite to the active framebuffer
+ * 
+ * This is the sprite version of #rdpq_tex_blit_batch: it draws @p count instances
+ * of the sprite (each one with its own position, sub-rect and transformation),
+ * uploading each portion of the sprite to TMEM only once. Like #rdpq_sprite_blit,
+ * the sprite palette is uploaded and activated if needed.
+ * 
+ * @param sprite    Sprite to blit
+ * @param insts     Array of instances to draw
+ * @param count     Number of instances in the array
+ * @param parms     Parameters shared by all instances (or NULL for default)
+ * 
+ * @see #rdpq_tex_blit_batch
+ */
+void rdpq_sprite_blit_batch(sprite_t *sprite, const rdpq_blitinst_t *insts, int count, const rdpq_blitparms_t *parms);
+
 #ifdef __cplusplus
 }
 #endif
@@ -106,6 +106,18 @@ int tex_loader_calc_max_height(tex_loader_t *tload, int width);
  * #surface_make_sub and pass it to #rdpq_tex_upload. See #rdpq_tex_upload_sub
  * for an example of both techniques.
  * 
+ * If the texture cache is enabled (via `rdpq_config_enable(RDPQ_CFG_TEXCACHE)`),
+ * rdpq remembers which textures and palettes are currently loaded in TMEM. If
+ * the same portion of a texture is uploaded again at the same TMEM address,
+ * the load is skipped and only the tile descriptor is configured. This is
+ * useful when drawing the same texture many times in a row (eg: tilemaps).
+ * The cache is invalidated by any other command that writes to TMEM, by
+ * #rdpq_sync_load, by running a block, and by #rdpq_attach / #rdpq_detach
+ * (as the new render target might be a texture). Since the cache identifies
+ * textures by the address of their pixels, call #rdpq_tex_cache_invalidate
+ * after modifying the contents of a texture (or palette) that is going to be
+ * uploaded again. Also, TMEM writes done by custom RSP ucodes are not tracked.
+ * 
  * @param tile       Tile descriptor that will be initialized with this texture
  * @param tex        Surface containing the texture to load
  * @param parms      All optional parameters on where to load the texture and how to sample it. Refer to #rdpq_texparms_t for more information.
@@ -285,6 +297,18 @@ void rdpq_tex_multi_begin(void);
  */
 int rdpq_tex_multi_end(void);
 
+/**
+ * @brief Forget the contents of TMEM known to the texture cache
+ * 
+ * When the texture cache is enabled (see #RDPQ_CFG_TEXCACHE), this function
+ * must be called after modifying the contents of a texture or palette in RDRAM,
+ * so that the next upload reloads it into TMEM. It must be also called if TMEM
+ * is modified in ways that rdpq cannot track (eg: by a custom RSP ucode).
+ * 
+ * @see #rdpq_tex_upload
+ */
+void rdpq_tex_cache_invalidate(void);
+
 
 /**
  * @brief Blitting parameters for #rdpq_tex_blit.
@@ -399,6 +423,73 @@ typedef struct rdpq_blitparms_s {
  */
 void rdpq_tex_blit(const surface_t *surf, float x0, float y0, const rdpq_blitparms_t *parms);
 
+/**
+ * @brief A single instance to draw with #rdpq_tex_blit_batch
+ * 
+ * The fields have the same meaning as the homonymous fields of #rdpq_blitparms_t,
+ * and again 0 is always the default value. The structure is kept small so that
+ * large arrays of instances (eg: particles) can be stored compactly.
+ */
+typedef struct rdpq_blitinst_s {
+    float x;            ///< X coordinate on the framebuffer where to draw the instance
+    float y;            ///< Y coordinate on the framebuffer where to draw the instance
+    int16_t s0;         ///< Source sub-rect top-left X coordinate
+    int16_t t0;         ///< Source sub-rect top-left Y coordinate
+    int16_t width;      ///< Source sub-rect width. If 0, the width of the surface is used
+    int16_t height;     ///< Source sub-rect height. If 0, the height of the surface is used
+    int16_t cx;         ///< Transformation center (aka "hotspot") X coordinate, relative to (s0, t0)
+    int16_t cy;         ///< Transformation center (aka "hotspot") Y coordinate, relative to (s0, t0)
+    float scale_x;      ///< Horizontal scale factor. If 0, no scaling is performed (the same as 1.0f)
+    float scale_y;      ///< Vertical scale factor. If 0, no scaling is performed (the same as 1.0f)
+    float theta;        ///< Rotation angle in radians
+    bool flip_x;        ///< Flip horizontally (before all other transformations)
+    bool flip_y;        ///< Flip vertically (before all other transformations)
+} rdpq_blitinst_t;
+
+/**
+ * @brief Blit many instances of the same surface to the active framebuffer
+ * 
+ * This function draws @p count instances of a surface (typically a sprite sheet
+ * or texture atlas), each one with its own position, source sub-rect and
+ * transformation. The result is the same as calling #rdpq_tex_blit once per
+ * instance, but it is much faster for large numbers of instances (eg: particles,
+ * bullets, tilemaps), as the texture is split into TMEM-sized strips only once
+ * for the whole batch, and each strip is uploaded to TMEM only once.
+ * 
+ * If the area of the surface covered by all the instances fits in TMEM, it is
+ * uploaded once and then all instances are drawn in order. Otherwise, the
+ * instances are drawn strip by strip, so instances that use different strips
+ * of the surface might be drawn out of order; if they overlap on screen and the
+ * order matters, split the batch.
+ * 
+ * As with #rdpq_tex_blit, the render mode and the palette (if any) must be
+ * configured by the caller.
+ * 
+ * @code{.c}
+ *      // Draw all the particles, using 8x8 frames from a spritemap
+ *      rdpq_blitinst_t insts[MAX_PARTICLES];
+ *      for (int i=0; i<num_particles; i++) {
+ *          insts[i] = (rdpq_blitinst_t){
+ *              .x = particles[i].x, .y = particles[i].y,
+ *              .s0 = particles[i].frame * 8, .width = 8, .height = 8,
+ *              .cx = 4, .cy = 4, .theta = particles[i].angle,
+ *          };
+ *      }
+ *      rdpq_tex_blit_batch(spritemap, insts, num_particles, NULL);
+ * @endcode
+ * 
+ * @param surf           Surface to draw
+ * @param insts          Array of instances to draw
+ * @param count          Number of instances in the array
+ * @param parms          Parameters shared by all instances (or NULL for default).
+ *                       Only the @p tile and @p filtering fields are used, the
+ *                       other fields are specified per-instance.
+ * 
+ * @see #rdpq_tex_blit
+ * @see #rdpq_sprite_blit_batch
+ */
+void rdpq_tex_blit_batch(const surface_t *surf, const rdpq_blitinst_t *insts, int count, const rdpq_blitparms_t *parms);
+
 ///@cond
 __attribute__((deprecated("use rdpq_tex_upload instead")))
 static inline int rdpq_tex_load(rdpq_tile_t tile, surface_t *tex, const rdpq_texparms_t *parms) {
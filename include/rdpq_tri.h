@@ -8,7 +8,16 @@
 #ifndef LIBDRAGON_RDPQ_TRI_H
 #define LIBDRAGON_RDPQ_TRI_H
 
+#ifdef N64
 #include "rdpq.h"
+#else
+// Host builds of the triangle setup (see tools/rdpqtri) only need the tile index
+#include <stdint.h>
+#include <stdbool.h>
+/// @cond
+typedef int rdpq_tile_t;
+/// @endcond
+#endif
 
 #ifdef __cplusplus
 extern "C" {
@@ -240,6 +249,86 @@ extern const rdpq_trifmt_t TRIFMT_ZBUF_SHADE_TEX;
  */
 void rdpq_triangle(const rdpq_trifmt_t *fmt, const float *v1, const float *v2, const float *v3);
 
+/**
+ * @brief A vertex in the fixed-point format used by the RSP triangle setup
+ * 
+ * This is the format of the vertex arrays passed to #rdpq_triangle_batch. Since
+ * the RSP cannot handle floating point numbers, the vertices must be converted
+ * into this format before drawing, via #rdpq_trivtx_convert. The conversion is
+ * done once per vertex, so that vertices shared by multiple triangles (and
+ * static meshes drawn in multiple frames) are converted only once.
+ * 
+ * Components that are not used by the triangle format are ignored.
+ */
+typedef struct rdpq_trivtx_s {
+    int16_t x;          ///< X coordinate (s13.2)
+    int16_t y;          ///< Y coordinate (s13.2)
+    int16_t z;          ///< Depth (0..0x7FFF)
+    int16_t __padding;  ///< Unused
+    uint32_t rgba;      ///< Shade color (RGBA8888)
+    int16_t s;          ///< S texture coordinate (s10.5)
+    int16_t t;          ///< T texture coordinate (s10.5)
+    int32_t w;          ///< W (s15.16)
+    int32_t inv_w;      ///< Inverse of W (s15.16)
+} rdpq_trivtx_t;
+
+/**
+ * @brief Convert an array of vertices to the format used by #rdpq_triangle_batch
+ * 
+ * Each input vertex is an array of floats, with the components laid out as
+ * described by the triangle format (see #rdpq_triangle). Vertices must be
+ * stored consecutively, with the specified stride between them.
+ * 
+ * The output array must be 8-byte aligned. After conversion, it is written
+ * back from the CPU cache, so that it is ready to be read by the RSP.
+ * 
+ * @param fmt            Format of the vertices
+ * @param vtx            Input vertices
+ * @param stride         Distance between two vertices in the input array
+ *                       (in number of floats)
+ * @param num_vertices   Number of vertices to convert
+ * @param out            Output array (num_vertices elements)
+ */
+void rdpq_trivtx_convert(const rdpq_trifmt_t *fmt, const float *vtx, int stride, int num_vertices, rdpq_trivtx_t *out);
+
+/**
+ * @brief Draw a batch of indexed triangles, with the setup performed by the RSP
+ * 
+ * This function draws multiple triangles sharing the same format. The CPU only
+ * enqueues a single command with the address of the arrays: the RSP then
+ * fetches the vertices of each triangle via DMA and computes the edge and
+ * attribute gradients, so that the CPU is free to do other work. The RSP keeps
+ * the last fetched vertices in a small cache, indexed by the vertex index modulo
+ * #RDPQ_TRI_BATCH_VCACHE_SIZE, so meshes whose triangles reference nearby indices
+ * (eg: strips and fans) transfer most of their shared vertices only once.
+ * 
+ * Each triangle is made of three consecutive 16-bit indices in the index array,
+ * which refer to vertices of the vertex array. As with #rdpq_triangle, the
+ * vertices of a triangle can be in any order, and no culling is performed.
+ * 
+ * Both arrays are read by the RSP asynchronously, so they must not be modified
+ * or freed until the RSP has processed the batch (eg: wait for #rspq_wait, or
+ * for a syncpoint). This also applies to batches recorded in a block
+ * (#rspq_block_begin), which will read the arrays every time the block is run.
+ * 
+ * Flat shading (#rdpq_trifmt_t::shade_flat) is not supported by this function.
+ * 
+ * @code
+ *      // Convert the mesh once, at loading time
+ *      rdpq_trivtx_t *vtx = malloc_uncached(num_vertices * sizeof(rdpq_trivtx_t));
+ *      rdpq_trivtx_convert(&TRIFMT_SHADE, mesh_vertices, 6, num_vertices, vtx);
+ * 
+ *      // Draw it in each frame
+ *      rdpq_triangle_batch(&TRIFMT_SHADE, vtx, mesh_indices, num_triangles);
+ * @endcode
+ * 
+ * @param fmt            Format of the triangles
+ * @param vertices       Vertex array (8-byte aligned), converted with #rdpq_trivtx_convert
+ * @param indices        Index array (8-byte aligned), 3 indices per triangle
+ * @param num_triangles  Number of triangles to draw
+ */
+void rdpq_triangle_batch(const rdpq_trifmt_t *fmt, const rdpq_trivtx_t *vertices, const uint16_t *indices, int num_triangles);
+
 #ifdef __cplusplus
 }
 #endif
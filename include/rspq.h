@@ -90,9 +90,28 @@
  * they can be used by end-users to record and replay batch of commands, similar
  * to OpenGL 1.x display lists.
  * 
- * Notice that this library does not support static (compile-time) blocks.
- * Blocks must always be created at runtime once (eg: at init time) before
- * being used.
+ * Blocks are normally created at runtime (eg: at init time) before being used.
+ * To avoid recording static blocks at every boot, a block can also be saved
+ * to a file with #rspq_block_save, and loaded back with #rspq_block_load
+ * (eg: from ROM): see #rspq_block_save for the limitations.
+ * 
+ * ## Profiling
+ * 
+ * To find out whether a frame is CPU-, RSP- or RDP-bound, the queue engine
+ * can be built with a command profiler, by setting #RSPQ_PROFILE to 1 in
+ * rspq_constants.h (and rebuilding libdragon and all the RSP ucodes). The RSP
+ * then timestamps the dispatch of each command with the RCP clock counter,
+ * and logs its duration to RDRAM. Call #rspq_profile_start to start profiling,
+ * #rspq_profile_next_frame once per frame, and #rspq_profile_dump to print
+ * per-command duration histograms and per-frame RDP counters, that can be
+ * analyzed with the rspqprof host tool.
+ * 
+ * Each overlay switch requires the RSP to save the state of the current
+ * overlay and to load the code and data of the new one, which takes a few
+ * microseconds. The profiler reports the number of switches per frame and
+ * the time spent doing them. If several independent command streams are
+ * interleaved, switches can be reduced by batching commands per overlay
+ * with #rspq_batch_begin / #rspq_batch_end.
  * 
  * ## Syncpoints
  * 
@@ -231,6 +250,30 @@ typedef int rspq_syncpoint_t;
  */
 void rspq_init(void);
 
+/**
+ * @brief Initialize the RSP command list, configuring the lowpri queue buffers.
+ * 
+ * This function works like #rspq_init, but allows to configure the ring of
+ * buffers used by the lowpri queue. By default, the lowpri queue is double
+ * buffered (#RSPQ_DRAM_LOWPRI_BUFFER_COUNT buffers of #RSPQ_DRAM_LOWPRI_BUFFER_SIZE
+ * words each): when the CPU fills both buffers faster than the RSP can run
+ * them, #rspq_write stalls waiting for the RSP. With more (or larger) buffers,
+ * the CPU can run several buffers ahead of the RSP, which absorbs spikes in
+ * heavy frames at the cost of RDRAM and latency.
+ * 
+ * Use #rspq_get_stats to measure how often the CPU stalls, and tune the
+ * configuration accordingly.
+ * 
+ * It must be called before any other library calling #rspq_init (eg: #rdpq_init),
+ * as further calls to #rspq_init are ignored.
+ * 
+ * @param lowpri_buffers        Number of buffers in the ring (at least 2)
+ * @param lowpri_buffer_size    Size of each buffer in 32-bit words
+ * 
+ * @see #rspq_get_stats
+ */
+void rspq_init_ex(int lowpri_buffers, int lowpri_buffer_size);
+
 /**
  * @brief Shut down the RSPQ library.
  * 
@@ -251,8 +294,11 @@ void rspq_close(void);
  * 
  * The function returns the overlay ID, which is the ID to use to enqueue
  * commands for this overlay. The overlay ID must be passed to #rspq_write
- * when adding new commands. rspq allows up to 16 overlays to be registered
- * simultaneously, as the overlay ID occupies the top 4 bits of each command.
+ * when adding new commands. The overlay ID occupies the top 4 bits of each
+ * command (and ID 0 is reserved for builtin commands), so there are 15 IDs
+ * available. By default, up to 7 overlays can be registered simultaneously;
+ * the limit can be raised up to 15 at build time via #RSPQ_MAX_OVERLAY_COUNT,
+ * at the cost of some DMEM in all ucodes.
  * The lower 4 bits specify the command ID, so in theory each overlay could
  * offer a maximum of 16 commands. To overcome this limitation, this function 
  * will reserve multiple consecutive IDs in case an overlay with more than 16
@@ -732,6 +778,126 @@ void rspq_block_run(rspq_block_t *block);
  */
 void rspq_block_free(rspq_block_t *block);
 
+/**
+ * @brief Serialize a block into a relocatable memory buffer.
+ * 
+ * This function creates a copy of the block in a format that does not
+ * depend on the memory address at which the block was recorded, so that
+ * it can be stored and loaded back later via #rspq_block_deserialize.
+ * This is mostly useful via #rspq_block_save and #rspq_block_load.
+ * 
+ * The internal addresses of the block (like those of the RDP static buffers
+ * created by rdpq) are relocated, but any address that was written into
+ * a command by the code recording the block (eg: the address of a texture
+ * or of a framebuffer) is saved as-is, and will not be valid anymore in
+ * a different run of the program. To refer to buffers in saved blocks, use
+ * the rdpq address lookup slots instead (see #rdpq_set_lookup_address), which
+ * can be patched at runtime before running the block.
+ * 
+ * Moreover, a serialized block:
+ * 
+ *   * cannot call other blocks.
+ *   * can only be loaded by the same program that recorded it (as it
+ *     refers to overlays by their ID, and the commands depend on the
+ *     version of the library).
+ * 
+ * @param  block  The block to serialize
+ * @param  size   If not NULL, will be filled with the size of the buffer in bytes
+ * @return        The serialized block (must be freed with free() when done)
+ * 
+ * @see #rspq_block_deserialize
+ */
+void* rspq_block_serialize(rspq_block_t *block, int *size);
+
+/**
+ * @brief Create a block from a buffer created by #rspq_block_serialize.
+ * 
+ * The block is created in a single memory allocation, and can be used
+ * and freed as any other block. The buffer is not referenced anymore after
+ * this function returns.
+ * 
+ * @param  buf    The serialized block
+ * @param  size   Size of the buffer in bytes
+ * @return        The loaded block
+ */
+rspq_block_t* rspq_block_deserialize(const void *buf, int size);
+
+/**
+ * @brief Save a block to a file.
+ * 
+ * This function serializes the block via #rspq_block_serialize and writes
+ * it to the specified file (eg: on a SD card, see #debug_init_sdfs).
+ * The file can then be added to the ROM filesystem, optionally compressed
+ * via mkasset, and loaded back via #rspq_block_load, to avoid recording
+ * static blocks (like UI or background display lists) at every boot.
+ * See #rspq_block_serialize for the limitations of saved blocks.
+ * 
+ * @code{.c}
+ *      // Development build: record the block once and save it
+ *      rspq_block_begin();
+ *          draw_background();
+ *      rspq_block_t *bkg = rspq_block_end();
+ *      rspq_block_save(bkg, "sd:/background.rspqb");
+ * 
+ *      // Release build: load the block from ROM
+ *      rspq_block_t *bkg = rspq_block_load("rom:/background.rspqb");
+ * @endcode
+ * 
+ * @param  block  The block to save
+ * @param  fn     Filename to write
+ */
+void rspq_block_save(rspq_block_t *block, const char *fn);
+
+/**
+ * @brief Load a block saved with #rspq_block_save.
+ * 
+ * The file is loaded via #asset_load, so it can be compressed with mkasset.
+ * 
+ * @param  fn     Filename to load (including filesystem prefix, eg: "rom:/bkg.rspqb")
+ * @return        The loaded block (free it with #rspq_block_free when done)
+ */
+rspq_block_t* rspq_block_load(const char *fn);
+
+/**
+ * @brief Begin batching commands per overlay.
+ * 
+ * While batching, all calls to #rspq_write collect the commands into
+ * a CPU-side buffer. When the buffer is full, or when #rspq_batch_end is
+ * called, the commands are submitted to the queue grouped by overlay, so
+ * that the RSP loads each overlay only once per batch, instead of switching
+ * back and forth between overlays. This is useful when several independent
+ * command streams (eg: audio, a 3D pipeline and custom overlays) are
+ * interleaved, as each overlay switch costs a few microseconds of DMA
+ * (see #rspq_profile_dump and #rspq_stats_t).
+ * 
+ * Commands of the same overlay are always submitted in order, but commands
+ * of different overlays are reordered. Batch only command streams that do
+ * not depend on each other: for instance, two overlays that both generate
+ * RDP commands must not be batched together, as their RDP commands would
+ * be reordered. For the same reason, commands are never reordered when rdpq
+ * commands are batched with them, as the sync commands emitted by the rdpq
+ * autosync engine must stay next to the commands they guard. Builtin commands
+ * like #rspq_block_run, #rspq_dma_to_rdram or #rspq_dma_to_dmem are never
+ * reordered and act as barriers: no command is moved across them.
+ * 
+ * Syncpoints cannot be created while batching (so #rspq_wait cannot be called
+ * either), nor blocks, nor the high-priority queue. Calls to #rspq_flush are
+ * ignored, as the commands are not in the queue yet.
+ * 
+ * @see #rspq_batch_end
+ */
+void rspq_batch_begin(void);
+
+/**
+ * @brief Finish batching commands per overlay.
+ * 
+ * The commands collected since #rspq_batch_begin are submitted to the queue,
+ * grouped by overlay. All subsequent #rspq_write will add commands to the
+ * queue as usual. Notice that, as with #rspq_write, the commands might not
+ * run until #rspq_flush is called.
+ */
+void rspq_batch_end(void);
+
 /**
  * @brief Start building a high-priority queue.
  * 
@@ -834,6 +1000,131 @@ void rspq_dma_to_rdram(void *rdram_addr, uint32_t dmem_addr, uint32_t len, bool
  */
 void rspq_dma_to_dmem(uint32_t dmem_addr, void *rdram_addr, uint32_t len, bool is_async);
 
+/** @brief Statistics about the lowpri queue buffers (see #rspq_get_stats) */
+typedef struct {
+    uint32_t buffers;               ///< Number of lowpri buffers filled by the CPU and submitted to RSP
+    uint32_t stalls;                ///< Number of times the CPU had to wait for the RSP to free a buffer
+    uint64_t stall_ticks;           ///< Total time spent waiting (in CPU ticks, see #TICKS_READ)
+    uint32_t max_stall_ticks;       ///< Longest wait (in CPU ticks)
+    int max_buffers_ahead;          ///< Maximum number of submitted buffers not yet executed by RSP
+    uint32_t batch_switches;        ///< Number of overlay switches in the commands submitted by batches (see #rspq_batch_begin)
+    uint32_t batch_switches_saved;  ///< Number of overlay switches avoided by batches
+} rspq_stats_t;
+
+/**
+ * @brief Get the statistics about the lowpri queue buffers
+ * 
+ * Statistics are collected since #rspq_init (or the last call to
+ * #rspq_reset_stats). If the CPU stalls often, and the maximum number of
+ * buffers ahead is equal to the number of buffers, increasing the number of
+ * buffers via #rspq_init_ex might help smoothing heavy frames. If instead
+ * the CPU stalls consistently, the frame is simply RSP-bound.
+ * 
+ * @param stats     Structure filled with the statistics
+ */
+void rspq_get_stats(rspq_stats_t *stats);
+
+/**
+ * @brief Clear the statistics about the lowpri queue buffers
+ */
+void rspq_reset_stats(void);
+
+/**
+ * @brief Start the command profiler
+ * 
+ * From now on, the RSP logs the duration of each command to a RDRAM buffer,
+ * and the log is parsed into per-command statistics at each call to
+ * #rspq_profile_next_frame. Statistics are accumulated until
+ * #rspq_profile_reset is called.
+ * 
+ * The profiler is only available if libdragon was built with #RSPQ_PROFILE
+ * set to 1 (otherwise, this function asserts).
+ * 
+ * The RCP clock counter is 24-bit wide, so each frame (and each command)
+ * must be shorter than about 268 ms to be measured correctly.
+ * 
+ * @see #rspq_profile_dump
+ */
+void rspq_profile_start(void);
+
+/**
+ * @brief Mark the end of a frame for the command profiler
+ * 
+ * This function should be called once per frame, for instance right after
+ * #rdpq_detach_show. It enqueues a command that closes the current profiling
+ * frame, recording the RDP busy, pipe and TMEM counters, and then resets
+ * them. The frame is parsed at the next call, so that the CPU does not
+ * need to wait for the RSP.
+ */
+void rspq_profile_next_frame(void);
+
+/**
+ * @brief Stop the command profiler
+ * 
+ * The last frame is closed and parsed (so this function waits for the RSP
+ * to reach the end of the queue). Statistics are kept until
+ * #rspq_profile_reset is called, so that they can be dumped.
+ */
+void rspq_profile_stop(void);
+
+/**
+ * @brief Clear all the statistics collected by the command profiler
+ */
+void rspq_profile_reset(void);
+
+/**
+ * @brief Dump the command profiler statistics on the debug channel
+ * 
+ * The first line contains the totals of the profiled frames: number of frames,
+ * duration measured by the CPU (in microseconds), and RCP cycles, RDP busy
+ * cycles, RDP pipeline busy cycles, TMEM busy cycles, number of dropped
+ * log entries, number of overlay switches and RCP cycles spent switching
+ * overlays. Then, there is one line per executed command ID, with the
+ * overlay name, the number of executions, the total and maximum duration in
+ * RCP cycles, and a histogram of durations (log2 buckets of cycles).
+ * Command 0x00 is the RSP waiting for new commands (idle time).
+ * 
+ * Each line is prefixed by "[rspq_profile]", so that the dumps can be
+ * extracted from a debug log and analyzed with the rspqprof host tool.
+ */
+void rspq_profile_dump(void);
+
+/** @brief Number of buckets of the command duration histograms (log2 of cycles) */
+#define RSPQ_PROFILE_HIST_BUCKETS   16
+
+/** @brief Profiling statistics of a command ID (see #rspq_profile_data_t) */
+typedef struct {
+    uint64_t count;                                 ///< Number of executions
+    uint64_t total;                                 ///< Total duration (RCP cycles)
+    uint32_t max;                                   ///< Maximum duration (RCP cycles)
+    uint32_t hist[RSPQ_PROFILE_HIST_BUCKETS];       ///< Histogram of durations (bucket N: [2^(N-1), 2^N) cycles)
+} rspq_profile_cmd_t;
+
+/** @brief Statistics collected by the command profiler (see #rspq_profile_get_data) */
+typedef struct {
+    uint64_t frames;                ///< Number of profiled frames
+    uint64_t cpu_ticks;             ///< Total duration of the frames, as measured by the CPU (in CPU ticks)
+    uint64_t clock;                 ///< Total RCP cycles (DP_CLOCK)
+    uint64_t rdp_busy;              ///< Total RDP busy cycles (DP_BUSY)
+    uint64_t rdp_pipe;              ///< Total RDP pipeline busy cycles (DP_PIPE_BUSY)
+    uint64_t rdp_tmem;              ///< Total TMEM busy cycles (DP_TMEM_BUSY)
+    uint64_t dropped;               ///< Total number of dropped log entries
+    uint64_t switches;              ///< Total number of overlay switches
+    uint64_t switch_cycles;         ///< Total RCP cycles spent switching overlays
+    rspq_profile_cmd_t cmds[256];   ///< Statistics per command ID
+} rspq_profile_data_t;
+
+/**
+ * @brief Get the statistics collected by the command profiler
+ * 
+ * This returns the same data printed by #rspq_profile_dump, for the frames
+ * parsed so far (see #rspq_profile_next_frame). If the profiler is not
+ * available, all the statistics are zero.
+ * 
+ * @param data      Structure filled with the statistics
+ */
+void rspq_profile_get_data(rspq_profile_data_t *data);
+
 /** @cond */
 __attribute__((deprecated("may not work anymore. use rspq_syncpoint_new/rspq_syncpoint_check instead")))
 void rspq_signal(uint32_t signal);
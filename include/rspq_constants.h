@@ -3,22 +3,52 @@
 
 #define RSPQ_DEBUG                     1
 
-#define RSPQ_DRAM_LOWPRI_BUFFER_SIZE   0x200   ///< Size of each RSPQ RDRAM buffer for lowpri queue (in 32-bit words)
+/**
+ * Enable the command profiler (see #rspq_profile_start). This adds a few
+ * instructions to the dispatch of each command, and uses some DMEM, so it is
+ * disabled by default. Changing it requires rebuilding libdragon and all
+ * the RSP ucodes.
+ */
+#ifndef RSPQ_PROFILE
+#define RSPQ_PROFILE                   0
+#endif
+
+#define RSPQ_DRAM_LOWPRI_BUFFER_COUNT  2       ///< Default number of RSPQ RDRAM buffers for lowpri queue (see #rspq_init_ex)
+#define RSPQ_DRAM_LOWPRI_BUFFER_SIZE   0x200   ///< Default size of each RSPQ RDRAM buffer for lowpri queue (in 32-bit words)
 #define RSPQ_DRAM_HIGHPRI_BUFFER_SIZE  0x80    ///< Size of each RSPQ RDRAM buffer for highpri queue (in 32-bit words)
+#define RSPQ_BATCH_BUFFER_SIZE         0x400   ///< Size of the buffer collecting batched commands (in 32-bit words, see #rspq_batch_begin)
 
 #define RSPQ_DMEM_BUFFER_SIZE          0x100   ///< Size of the RSPQ DMEM buffer (in bytes)
 #define RSPQ_OVERLAY_TABLE_SIZE        0x10    ///< Number of overlay IDs (0-F)
 #define RSPQ_OVERLAY_DESC_SIZE         0x10    ///< Size of a single overlay descriptor
 
-/** Maximum number of overlays that can be registered (affects DMEM table size) */
+/**
+ * Maximum number of overlays that can be registered (affects DMEM table size).
+ *
+ * Index 0 is reserved for the builtin commands. Each overlay uses
+ * #RSPQ_OVERLAY_DESC_SIZE bytes of DMEM in the rspq state, which is linked
+ * into every ucode, so every additional overlay takes 16 bytes of DMEM away
+ * from all overlays. The maximum is #RSPQ_OVERLAY_TABLE_SIZE, that allows to
+ * register a different overlay for each overlay ID (128 more bytes of DMEM
+ * than the default). Changing it requires rebuilding libdragon and all the
+ * RSP ucodes with the same value.
+ */
+#ifndef RSPQ_MAX_OVERLAY_COUNT
 #define RSPQ_MAX_OVERLAY_COUNT         8
-#define RSPQ_OVERLAY_ID_COUNT          16
-#define RSPQ_MAX_OVERLAY_COMMAND_COUNT ((RSPQ_MAX_OVERLAY_COUNT - 1) * 16)
+#endif
+/** Maximum number of commands of an overlay (it can span all overlay IDs but 0) */
+#define RSPQ_MAX_OVERLAY_COMMAND_COUNT ((RSPQ_OVERLAY_TABLE_SIZE - 1) * 16)
 
 /** Minimum / maximum size of a block's chunk (contiguous memory buffer) */
 #define RSPQ_BLOCK_MIN_SIZE            64
 #define RSPQ_BLOCK_MAX_SIZE            4192
 
+/** Command profiler buffers */
+#define RSPQ_PROFILE_LOG_SIZE          32          ///< Number of entries of the profiling log in DMEM
+#define RSPQ_PROFILE_HEADER_SIZE       32          ///< Size of the header at the start of each profiling buffer (in bytes)
+#define RSPQ_PROFILE_BUFFER_SIZE       0x8000      ///< Size of each RDRAM profiling buffer (in bytes)
+#define RSPQ_PROFILE_PAD               0xFFFFFFFF  ///< Filler entry used to keep the log 8-byte aligned
+
 /** Maximum number of nested block calls */
 #define RSPQ_MAX_BLOCK_NESTING_LEVEL   8
 #define RSPQ_LOWPRI_CALL_SLOT          (RSPQ_MAX_BLOCK_NESTING_LEVEL+0)  ///< Special slot used to store the current lowpri pointer
@@ -49,7 +79,7 @@
 #define SP_WSTATUS_SET_SIG_BUFDONE_HIGH        SP_WSTATUS_SET_SIG5
 #define SP_WSTATUS_CLEAR_SIG_BUFDONE_HIGH      SP_WSTATUS_CLEAR_SIG5
 
-/** Signal used by RSP to notify that has finished one of the two buffers of the lowpri queue */
+/** Signal used by RSP to notify that has finished one of the two buffers of the lowpri queue (currently unused: see RSPQ_CMD_BUFFER_DONE) */
 #define SP_STATUS_SIG_BUFDONE_LOW              SP_STATUS_SIG6
 #define SP_WSTATUS_SET_SIG_BUFDONE_LOW         SP_WSTATUS_SET_SIG6
 #define SP_WSTATUS_CLEAR_SIG_BUFDONE_LOW       SP_WSTATUS_CLEAR_SIG6
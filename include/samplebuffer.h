@@ -18,7 +18,7 @@ extern "C" {
  * Tagged pointer to an array of samples. It contains both the void*
  * sample pointer, and byte-per-sample information (encoded as shift value).
  */
-typedef uint32_t sample_ptr_t;
+typedef uintptr_t sample_ptr_t;
 
 /**
  * SAMPLES_BPS_SHIFT extracts the byte-per-sample information from a sample_ptr_t.
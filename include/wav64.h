@@ -37,8 +37,19 @@ typedef struct {
 
 	int format;			     ///< Internal format of the file
 	void *ext;               ///< Pointer to extended data (internal use)
+	void *stream;            ///< Streaming state (internal use, see #wav64_set_streaming)
 } wav64_t;
 
+/**
+ * @brief Statistics of a streaming WAV64 (see #wav64_get_stream_stats)
+ */
+typedef struct {
+	int buffer_size;         ///< Size of the ring buffer (in bytes)
+	int min_level;           ///< Minimum amount of data found in the buffer by the decoder (in bytes)
+	float min_level_ms;      ///< Same as min_level, in milliseconds of playback
+	int underruns;           ///< Number of times the buffer ran dry, forcing a blocking read
+} wav64_stream_stats_t;
+
 /** @brief Open a WAV64 file for playback.
  * 
  * This function opens the file, parses the header, and initializes for
@@ -53,6 +64,41 @@ void wav64_open(wav64_t *wav, const char *fn);
 /** @brief Configure a WAV64 file for looping playback. */
 void wav64_set_loop(wav64_t *wav, bool loop);
 
+/**
+ * @brief Enable streaming with readahead for a VADPCM WAV64 file.
+ *
+ * By default, compressed data is read from ROM with a blocking DMA every time
+ * the mixer needs more samples. This is fine for sound effects, but long
+ * music tracks compete with other PI transfers (eg: loading assets), and
+ * the audio glitches if the read is delayed.
+ *
+ * In streaming mode, the compressed data is kept in a ring buffer that is
+ * refilled in background via asynchronous DMA (scheduled through the mixer
+ * events, and only issued when the PI is idle), and frames are decoded by
+ * the RSP in larger batches. If the buffer runs dry, a blocking read is done
+ * and counted as an underrun (see #wav64_get_stream_stats).
+ *
+ * Streaming is only supported for VADPCM-compressed files. It must be
+ * enabled before starting the playback.
+ *
+ * @param   wav             Pointer to wav64_t structure
+ * @param   buffer_size     Size of the ring buffer in bytes, or 0 for the
+ *                          default (about half a second of audio).
+ */
+void wav64_set_streaming(wav64_t *wav, int buffer_size);
+
+/**
+ * @brief Get the statistics of a streaming WAV64 file.
+ *
+ * This allows to check how close the ring buffer came to run dry, to tune its
+ * size (see #wav64_set_streaming).
+ *
+ * @param   wav             Pointer to wav64_t structure
+ * @param   stats           Statistics (output)
+ * @param   reset           If true, reset the statistics after reading them
+ */
+void wav64_get_stream_stats(wav64_t *wav, wav64_stream_stats_t *stats, bool reset);
+
 /** @brief Start playing a WAV64 file.
  * 
  * This is just a simple wrapper that calls #mixer_ch_play on the WAV64's
@@ -31,6 +31,13 @@
  *   * XM64 contains also the precalculated amount of sample buffer memory
  *     required for playing back, per each channel. This allows for precise
  *     memory allocations even within the mixer.
+ *   * Optionally, XM64 can contain a pre-baked stream of per-tick events
+ *     (audioconv64 --xm-bake-ticks, off by default). In this case, the player
+ *     does not run the XM effects at all, but just applies the recorded
+ *     channel state to the mixer, which is much faster. The patterns are not
+ *     stored in the file, but the stream is usually larger than them, so the
+ *     file is bigger. Volumes are stored with 16-bit precision, so the output
+ *     can differ from the non-baked player by a few LSBs.
  */
 
 #ifndef __LIBDRAGON_AUDIO_XM64_H
@@ -64,6 +71,7 @@ typedef struct xm64player_s {
 	struct {
 		int patidx, row, tick;
 	} seek;                   ///< seeking to be performed
+	void *ticks;              ///< reader of the baked tick stream (if any)
 } xm64player_t;
 
 /**
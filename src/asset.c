@@ -14,6 +14,7 @@
 #include "n64sys.h"
 #include "dma.h"
 #include "dragonfs.h"
+#include "utils.h"
 #else
 #include <stdlib.h>
 #include <assert.h>
@@ -33,6 +34,7 @@ static asset_compression_t algos[3] = {
         .decompress_init = decompress_lz4_init,
         .decompress_read = decompress_lz4_read,
         .decompress_reset = decompress_lz4_reset,
+        .decompress_set_dict = decompress_lz4_set_dict,
         .decompress_full_inplace = decompress_lz4_full_inplace,
     }
 };
@@ -44,6 +46,7 @@ void __asset_init_compression_lvl2(void)
         .decompress_init = decompress_aplib_init,
         .decompress_read = decompress_aplib_read,
         .decompress_reset = decompress_aplib_reset,
+        .decompress_set_dict = decompress_aplib_set_dict,
         #if DECOMPRESS_APLIB_FULL_USE_ASM
         .decompress_full_inplace = decompress_aplib_full_inplace,
         #else
@@ -63,6 +66,125 @@ void __asset_init_compression_lvl3(void)
     };
 }
 
+#ifdef N64
+
+bool __asset_stats_enabled = false;
+uint64_t __asset_stats_io_ticks = 0;
+
+/** @brief Statistics collected for a single asset file */
+typedef struct {
+    char *fn;               ///< Filename
+    uint8_t algo;           ///< Compression algorithm (0 = not compressed)
+    bool inplace;           ///< True if the in-place decompression path was taken
+    bool stream;            ///< True if the file was opened via #asset_fopen
+    int winsize;            ///< Window size (0 = not compressed)
+    int loads;              ///< Number of times the file was loaded or opened
+    uint64_t cmp_bytes;     ///< Total compressed bytes read
+    uint64_t dec_bytes;     ///< Total decompressed bytes produced
+    uint64_t io_ticks;      ///< Total ticks spent waiting for I/O
+    uint64_t dec_ticks;     ///< Total ticks spent decompressing
+} asset_stats_entry_t;
+
+static asset_stats_entry_t *stats_entries;
+static int stats_count;
+
+/** @brief Timer used to measure a single operation */
+typedef struct {
+    uint32_t t0;            ///< Ticks at start
+    uint64_t io0;           ///< I/O ticks at start
+} asset_stats_timer_t;
+
+void asset_stats_enable(bool enable)
+{
+    __asset_stats_enabled = enable;
+}
+
+void asset_stats_reset(void)
+{
+    for (int i = 0; i < stats_count; i++)
+        free(stats_entries[i].fn);
+    free(stats_entries);
+    stats_entries = NULL;
+    stats_count = 0;
+}
+
+void asset_stats_dump(void)
+{
+    debugf("[asset_stats] %-32s %4s %4s %4s %4s %5s %12s %12s %10s %10s\n",
+        "file", "algo", "win", "inpl", "strm", "loads", "cmp_bytes", "dec_bytes", "io_us", "dec_us");
+    for (int i = 0; i < stats_count; i++) {
+        asset_stats_entry_t *e = &stats_entries[i];
+        debugf("[asset_stats] %-32s %4d %3dK %4d %4d %5d %12llu %12llu %10llu %10llu\n",
+            e->fn, e->algo, e->winsize / 1024, e->inplace, e->stream, e->loads,
+            e->cmp_bytes, e->dec_bytes, TICKS_TO_US(e->io_ticks), TICKS_TO_US(e->dec_ticks));
+    }
+}
+
+/** @brief Register a load of a file, returning the index of its statistics (or -1 if disabled) */
+static int asset_stats_open(const char *fn, int algo, int winsize, bool inplace, bool stream, int cmp_size)
+{
+    if (!__asset_stats_enabled)
+        return -1;
+
+    int idx;
+    for (idx = 0; idx < stats_count; idx++) {
+        asset_stats_entry_t *e = &stats_entries[idx];
+        if (e->stream == stream && !strcmp(e->fn, fn))
+            break;
+    }
+    if (idx == stats_count) {
+        stats_entries = realloc(stats_entries, (stats_count+1) * sizeof(asset_stats_entry_t));
+        stats_entries[stats_count++] = (asset_stats_entry_t){ .fn = strdup(fn), .stream = stream };
+    }
+
+    asset_stats_entry_t *e = &stats_entries[idx];
+    e->algo = algo;
+    e->winsize = winsize;
+    e->inplace = inplace;
+    e->loads++;
+    e->cmp_bytes += cmp_size;
+    return idx;
+}
+
+static void asset_stats_start(asset_stats_timer_t *t)
+{
+    t->t0 = TICKS_READ();
+    t->io0 = __asset_stats_io_ticks;
+}
+
+/** @brief Account an operation that produced the specified decompressed bytes */
+static void asset_stats_stop(int idx, asset_stats_timer_t *t, int dec_bytes)
+{
+    if (idx < 0 || idx >= stats_count)
+        return;
+
+    // Everything that was not spent waiting for I/O is accounted as decompression
+    asset_stats_entry_t *e = &stats_entries[idx];
+    uint64_t io = __asset_stats_io_ticks - t->io0;
+    uint64_t total = (uint32_t)TICKS_SINCE(t->t0);
+    e->io_ticks += io;
+    e->dec_ticks += total > io ? total - io : 0;
+    e->dec_bytes += dec_bytes;
+}
+
+#else
+
+typedef struct { int dummy; } asset_stats_timer_t;
+static int asset_stats_open(const char *fn, int algo, int winsize, bool inplace, bool stream, int cmp_size) { return -1; }
+static void asset_stats_start(asset_stats_timer_t *t) {}
+static void asset_stats_stop(int idx, asset_stats_timer_t *t, int dec_bytes) {}
+
+#endif
+
+/** @brief fread() with I/O time accounting for statistics */
+static size_t asset_fread(void *buf, size_t size, FILE *fp)
+{
+    uint32_t t0 = asset_stats_io_begin();
+    size_t n = fread(buf, 1, size, fp);
+    asset_stats_io_end(t0);
+    return n;
+}
+
 FILE *must_fopen(const char *fn)
 {
     FILE *f = fopen(fn, "rb");
@@ -89,6 +211,101 @@ FILE *must_fopen(const char *fn)
     return f;
 }
 
+/** @brief Shared dictionary data (see #asset_set_dictionary) */
+static uint8_t *dict_data;
+/** @brief Size of the shared dictionary */
+static int dict_size;
+/** @brief ID of the shared dictionary */
+static uint32_t dict_id;
+
+void asset_set_dictionary(const char *fn)
+{
+    free(dict_data);
+    dict_data = NULL;
+    dict_size = 0;
+    dict_id = 0;
+    if (!fn)
+        return;
+
+    FILE *f = must_fopen(fn);
+    asset_dict_header_t header;
+    fread(&header, 1, sizeof(header), f);
+    assertf(!memcmp(header.magic, ASSET_DICT_MAGIC, 3), "asset: invalid dictionary file: %s", fn);
+    assertf(header.version == '1', "unsupported dictionary version: %c\nMake sure to rebuild libdragon tools and your assets", header.version);
+    #ifndef N64
+    header.id = __builtin_bswap32(header.id);
+    header.size = __builtin_bswap32(header.size);
+    #endif
+
+    dict_data = malloc(header.size);
+    assertf(dict_data, "asset_set_dictionary: out of memory");
+    fread(dict_data, 1, header.size, f);
+    fclose(f);
+    dict_size = header.size;
+    dict_id = header.id;
+}
+
+/** @brief Check that the dictionary required by an asset is loaded */
+static void asset_check_dict(const char *fn, asset_header_t *header)
+{
+    assertf(dict_data, "asset: %s was compressed with a dictionary\nCall asset_set_dictionary() first", fn);
+    assertf(header->dict_id == dict_id, "asset: %s was compressed with a different dictionary (%08lx, loaded: %08lx)",
+        fn, (unsigned long)header->dict_id, (unsigned long)dict_id);
+}
+
+static void* decompress_dict(asset_compression_t *algo, const char *fn, FILE *fp, size_t cmp_size, size_t size, int winsize)
+{
+    assertf(algo->decompress_set_dict, "asset: invalid dictionary compression in file %s", fn);
+    int n;
+
+    #ifdef N64
+    if (algo->decompress_full_inplace) {
+        // Matches never go farther than the window, so only the tail of the
+        // dictionary is needed.
+        int dsize = MIN(dict_size, winsize);
+
+        // Decompress right after a copy of the dictionary, so that the matches
+        // can refer to it. Add 8 because the assembly decompressors do writes
+        // up to 8 bytes out-of-bounds.
+        uint8_t *buf = memalign(ASSET_ALIGNMENT, dsize + size + 8);
+        int cmp_bufsize = ROUND_UP(cmp_size, 16);
+        uint8_t *cmp = memalign(16, cmp_bufsize);
+        assertf(buf && cmp, "asset_load: out of memory");
+        memcpy(buf, dict_data + dict_size - dsize, dsize);
+
+        if (fn && strncmp(fn, "rom:/", 5) == 0) {
+            // Loading from ROM: run the decompression racing with the DMA.
+            data_cache_hit_invalidate(cmp, cmp_bufsize);
+            uint32_t addr = dfs_rom_addr(fn+5) & 0x1FFFFFFF;
+            dma_read_async(cmp, addr+sizeof(asset_header_t), cmp_size);
+        } else {
+            asset_fread(cmp, cmp_size, fp);
+        }
+        n = algo->decompress_full_inplace(cmp, cmp_size, buf+dsize, size); (void)n;
+        assertf(n == size, "asset: decompression error on file %s: corrupted? (%d/%d)", fn, n, size);
+        free(cmp);
+
+        memmove(buf, buf+dsize, size);
+        void *ptr = realloc(buf, size); (void)ptr;
+        assertf(buf == ptr, "asset: realloc moved the buffer"); // guaranteed by newlib
+        return ptr;
+    }
+    #endif
+
+    // Streaming decompression, with the window primed by the dictionary. This
+    // is also used on PC, where the full decompressors check that matches do
+    // not go before the start of the output buffer.
+    void *state = malloc(algo->state_size + winsize);
+    uint8_t *out = memalign(ASSET_ALIGNMENT, size);
+    assertf(state && out, "asset_load: out of memory");
+    algo->decompress_init(state, fp, winsize);
+    algo->decompress_set_dict(state, dict_data, dict_size);
+    n = algo->decompress_read(state, out, size); (void)n;
+    assertf(n == size, "asset: decompression error on file %s: corrupted? (%d/%d)", fn, n, size);
+    free(state);
+    return out;
+}
+
 static void* decompress_inplace(asset_compression_t *algo, const char *fn, FILE *fp, size_t cmp_size, size_t size, int margin)
 {
     // Consistency check on input data
@@ -129,14 +346,16 @@ static void* decompress_inplace(asset_compression_t *algo, const char *fn, FILE
         uint32_t addr = dfs_rom_addr(fn+5) & 0x1FFFFFFF;
         dma_read_async(s+cmp_offset, addr+sizeof(asset_header_t), cmp_size);
 
-        // Run the decompression racing with the DMA.
+        // Run the decompression racing with the DMA. Notice that the time spent
+        // waiting for the DMA cannot be separated from the decompression time
+        // here, so it is all accounted as decompression in statistics.
         n = algo->decompress_full_inplace(s+cmp_offset, cmp_size, s, size); (void)n;
     #else
     if (false) {
     #endif
     } else {
         // Standard loading via stdio. We have to wait for the whole file to be read.
-        fread(s+cmp_offset, 1, cmp_size, fp);
+        asset_fread(s+cmp_offset, cmp_size, fp);
 
         // Run the decompression.
         n = algo->decompress_full_inplace(s+cmp_offset, cmp_size, s, size); (void)n;
@@ -147,10 +366,99 @@ static void* decompress_inplace(asset_compression_t *algo, const char *fn, FILE
     return ptr;
 }
 
+/** @brief Read the block table of a blocked asset, converting it to native endianness */
+static asset_block_table_t *asset_read_block_table(FILE *fp)
+{
+    uint32_t info[2];
+    asset_fread(info, sizeof(info), fp);
+    #ifndef N64
+    info[0] = __builtin_bswap32(info[0]);
+    info[1] = __builtin_bswap32(info[1]);
+    #endif
+
+    asset_block_table_t *table = malloc(ASSET_BLOCK_TABLE_SIZE(info[1]));
+    assertf(table, "asset: out of memory");
+    table->block_size = info[0];
+    table->num_blocks = info[1];
+    asset_fread(table->offsets, (table->num_blocks+1) * sizeof(uint32_t), fp);
+    #ifndef N64
+    for (int i = 0; i <= table->num_blocks; i++)
+        table->offsets[i] = __builtin_bswap32(table->offsets[i]);
+    #endif
+    return table;
+}
+
+/** @brief Size of the largest compressed block in a block table */
+static int asset_max_block_size(asset_block_table_t *table)
+{
+    int max_size = 0;
+    for (int i = 0; i < table->num_blocks; i++) {
+        int cmp_size = table->offsets[i+1] - table->offsets[i];
+        if (cmp_size > max_size) max_size = cmp_size;
+    }
+    return max_size;
+}
+
+/**
+ * @brief Decompress a single block of a blocked asset
+ * 
+ * @param algo      Decompression algorithm
+ * @param fn        Filename of the asset
+ * @param fp        File of the asset
+ * @param offset    Offset of the compressed block in the file
+ * @param cmp       Scratch buffer for the compressed block (at least @p cmp_size bytes)
+ * @param cmp_size  Size of the compressed block
+ * @param out       Output buffer. Notice that up to 8 bytes past the end of the block
+ *                  might be written by the assembly decompressors.
+ * @param size      Size of the decompressed block
+ */
+static void decompress_block(asset_compression_t *algo, const char *fn, FILE *fp, int offset, uint8_t *cmp, int cmp_size, uint8_t *out, int size)
+{
+    fseek(fp, offset, SEEK_SET);
+    if (algo->decompress_full_inplace) {
+        asset_fread(cmp, cmp_size, fp);
+        int n = algo->decompress_full_inplace(cmp, cmp_size, out, size); (void)n;
+        assertf(n == size, "asset: decompression error on file %s: corrupted? (%d/%d)", fn, n, size);
+    } else {
+        void *buf = algo->decompress_full(fn, fp, cmp_size, size);
+        memcpy(out, buf, size);
+        free(buf);
+    }
+}
+
+static void* decompress_blocks(asset_compression_t *algo, const char *fn, FILE *fp, int size)
+{
+    asset_block_table_t *table = asset_read_block_table(fp);
+    int block_size = table->block_size;
+    int data_offset = sizeof(asset_header_t) + ASSET_BLOCK_TABLE_SIZE(table->num_blocks);
+
+    // add 8 because the assembly decompressors do writes up to 8 bytes out-of-bounds.
+    // Within the buffer, this just overwrites the beginning of the next block
+    // that is decompressed afterwards.
+    uint8_t *out = memalign(ASSET_ALIGNMENT, size + 8);
+    uint8_t *cmp = memalign(ASSET_ALIGNMENT, asset_max_block_size(table));
+    assertf(out && cmp, "asset_load: out of memory");
+
+    for (int i = 0; i < table->num_blocks; i++) {
+        int off = i * block_size;
+        int len = size - off < block_size ? size - off : block_size;
+        decompress_block(algo, fn, fp, data_offset + table->offsets[i],
+            cmp, table->offsets[i+1] - table->offsets[i], out + off, len);
+    }
+
+    free(cmp);
+    free(table);
+    void *ptr = realloc(out, size); (void)ptr;
+    assertf(out == ptr, "asset: realloc moved the buffer"); // guaranteed by newlib
+    return ptr;
+}
+
 void *asset_load(const char *fn, int *sz)
 {
-    uint8_t *s; int size;
+    uint8_t *s; int size; int stats;
     FILE *f = must_fopen(fn);
+    asset_stats_timer_t timer;
+    asset_stats_start(&timer);
 
     // Disable buffering. This is optimal both for the no-compression case
     // (where we just read the whole file in one go, so we want to avoid
@@ -160,9 +468,9 @@ void *asset_load(const char *fn, int *sz)
    
     // Check if file is compressed
     asset_header_t header;
-    fread(&header, 1, sizeof(asset_header_t), f);
+    asset_fread(&header, sizeof(asset_header_t), f);
     if (!memcmp(header.magic, ASSET_MAGIC, 3)) {
-        if (header.version != '3') {
+        if (header.version != '3' && header.version != '4') {
             assertf(0, "unsupported asset version: %c\nMake sure to rebuild libdragon tools and your assets", header.version);
             return NULL;
         }
@@ -181,7 +489,14 @@ void *asset_load(const char *fn, int *sz)
             "asset: compression level %d not initialized. Call asset_init_compression(%d) at initialization time", header.algo, header.algo);
 
         size = header.orig_size;
-        if ((header.flags & ASSET_FLAG_INPLACE) && algos[header.algo-1].decompress_full_inplace)
+        bool inplace = header.version == '3' && (header.flags & (ASSET_FLAG_INPLACE|ASSET_FLAG_DICT)) == ASSET_FLAG_INPLACE && algos[header.algo-1].decompress_full_inplace;
+        stats = asset_stats_open(fn, header.algo, asset_winsize_from_flags(header.flags), inplace, false, header.cmp_size);
+        if (header.version == '4')
+            s = decompress_blocks(&algos[header.algo-1], fn, f, size);
+        else if (header.flags & ASSET_FLAG_DICT) {
+            asset_check_dict(fn, &header);
+            s = decompress_dict(&algos[header.algo-1], fn, f, header.cmp_size, size, asset_winsize_from_flags(header.flags));
+        } else if (inplace)
             s = decompress_inplace(&algos[header.algo-1], fn, f, header.cmp_size, size, header.inplace_margin);
         else
             s = algos[header.algo-1].decompress_full(fn, f, header.cmp_size, size);
@@ -195,10 +510,12 @@ void *asset_load(const char *fn, int *sz)
         s = memalign(ASSET_ALIGNMENT, size);
 
         fseek(f, 0, SEEK_SET);
-        fread(s, 1, size, f);
+        stats = asset_stats_open(fn, 0, 0, false, false, size);
+        asset_fread(s, size, f);
     }
 
     fclose(f);
+    asset_stats_stop(stats, &timer, size);
     if (sz) *sz = size;
     return s;
 }
@@ -208,6 +525,7 @@ void *asset_load(const char *fn, int *sz)
 typedef struct  {
     FILE *fp;
     bool seeked;
+    int stats;
 } cookie_none_t;
 
 static fpos_t seekfn_none(void *c, fpos_t pos, int whence)
@@ -231,7 +549,11 @@ static int readfn_none(void *c, char *buf, int sz)
 {
     cookie_none_t *cookie = c;
     assertf(!cookie->seeked, "Cannot seek in file opened via asset_fopen (it might be compressed)");
-    return fread(buf, 1, sz, cookie->fp);
+    asset_stats_timer_t timer;
+    asset_stats_start(&timer);
+    int n = asset_fread(buf, sz, cookie->fp);
+    asset_stats_stop(cookie->stats, &timer, n);
+    return n;
 }
 
 static int closefn_none(void *c)
@@ -246,7 +568,9 @@ typedef struct  {
     FILE *fp;
     int pos;
     bool seeked;
+    int stats;
     void (*reset)(void *state);
+    void (*set_dict)(void *state, const uint8_t *dict, size_t size);
     ssize_t (*read)(void *state, void *buf, size_t len);
     uint8_t alignas(8) state[];
 } cookie_cmp_t;
@@ -255,7 +579,10 @@ static int readfn_cmp(void *c, char *buf, int sz)
 {
     cookie_cmp_t *cookie = (cookie_cmp_t*)c;
     assertf(!cookie->seeked, "Cannot seek in file opened via asset_fopen (it might be compressed)");
+    asset_stats_timer_t timer;
+    asset_stats_start(&timer);
     int n = cookie->read(cookie->state, (uint8_t*)buf, sz);
+    asset_stats_stop(cookie->stats, &timer, n);
     cookie->pos += n;
     return n;
 }
@@ -272,6 +599,8 @@ static fpos_t seekfn_cmp(void *c, fpos_t pos, int whence)
         cookie->pos = 0;
         fseek(cookie->fp, sizeof(asset_header_t), SEEK_SET);
         cookie->reset(cookie->state);
+        if (cookie->set_dict)
+            cookie->set_dict(cookie->state, dict_data, dict_size);
         return 0;
     }
 
@@ -290,6 +619,83 @@ static int closefn_cmp(void *c)
     return 0;
 }
 
+typedef struct {
+    FILE *fp;                       ///< Underlying file
+    char *fn;                       ///< Filename
+    asset_compression_t *algo;      ///< Decompression algorithm
+    asset_block_table_t *table;     ///< Block table
+    int data_offset;                ///< Offset of the first compressed block in the file
+    int size;                       ///< Decompressed size of the file
+    int pos;                        ///< Current read position
+    int cur_block;                  ///< Block currently decompressed in buf (or -1)
+    uint8_t *cmp;                   ///< Scratch buffer for compressed blocks
+    uint8_t *buf;                   ///< Decompressed block
+    int stats;                      ///< Index of the statistics entry (or -1)
+} cookie_blk_t;
+
+static int readfn_blk(void *c, char *buf, int sz)
+{
+    cookie_blk_t *cookie = c;
+    int block_size = cookie->table->block_size;
+    int total = 0;
+    asset_stats_timer_t timer;
+    asset_stats_start(&timer);
+
+    while (sz > 0 && cookie->pos < cookie->size) {
+        int blk = cookie->pos / block_size;
+        int off = blk * block_size;
+        int len = MIN(block_size, cookie->size - off);
+        if (blk != cookie->cur_block) {
+            asset_block_table_t *table = cookie->table;
+            decompress_block(cookie->algo, cookie->fn, cookie->fp,
+                cookie->data_offset + table->offsets[blk], cookie->cmp,
+                table->offsets[blk+1] - table->offsets[blk], cookie->buf, len);
+            cookie->cur_block = blk;
+        }
+
+        int n = MIN(sz, off + len - cookie->pos);
+        memcpy(buf, cookie->buf + cookie->pos - off, n);
+        cookie->pos += n;
+        buf += n;
+        sz -= n;
+        total += n;
+    }
+
+    asset_stats_stop(cookie->stats, &timer, total);
+    return total;
+}
+
+static fpos_t seekfn_blk(void *c, fpos_t pos, int whence)
+{
+    cookie_blk_t *cookie = c;
+
+    // Blocks are compressed independently, so any position can be reached
+    // by decompressing just the block that contains it (at the next read).
+    switch (whence) {
+    case SEEK_SET: break;
+    case SEEK_CUR: pos += cookie->pos; break;
+    case SEEK_END: pos += cookie->size; break;
+    default: return -1;
+    }
+    if (pos < 0 || pos > cookie->size)
+        return -1;
+
+    cookie->pos = pos;
+    return pos;
+}
+
+static int closefn_blk(void *c)
+{
+    cookie_blk_t *cookie = c;
+    fclose(cookie->fp); cookie->fp = NULL;
+    free(cookie->fn);
+    free(cookie->table);
+    free(cookie->cmp);
+    free(cookie->buf);
+    free(cookie);
+    return 0;
+}
+
 FILE *asset_fopen(const char *fn, int *sz)
 {
     FILE *f = must_fopen(fn);
@@ -302,7 +708,7 @@ FILE *asset_fopen(const char *fn, int *sz)
     asset_header_t header;
     fread(&header, 1, sizeof(asset_header_t), f);
     if (!memcmp(header.magic, ASSET_MAGIC, 3)) {
-        if (header.version != '3') {
+        if (header.version != '3' && header.version != '4') {
             assertf(0, "unsupported asset version: %c\nMake sure to rebuild libdragon tools and your assets", header.version);
             return NULL;
         }
@@ -321,6 +727,29 @@ FILE *asset_fopen(const char *fn, int *sz)
             "unsupported compression algorithm: %d", header.algo);
         assertf(algos[header.algo-1].decompress_full || algos[header.algo-1].decompress_full_inplace, 
             "asset: compression level %d not initialized. Call asset_init_compression(%d) at initialization time", header.algo, header.algo);
+
+        if (header.version == '4') {
+            // Blocked asset: this supports random access, and does not require
+            // a streaming decompressor.
+            cookie_blk_t *cookie = malloc(sizeof(cookie_blk_t));
+            assertf(cookie, "asset_fopen: out of memory");
+            cookie->fp = f;
+            cookie->fn = strdup(fn);
+            cookie->algo = &algos[header.algo-1];
+            cookie->table = asset_read_block_table(f);
+            cookie->data_offset = sizeof(asset_header_t) + ASSET_BLOCK_TABLE_SIZE(cookie->table->num_blocks);
+            cookie->size = header.orig_size;
+            cookie->pos = 0;
+            cookie->cur_block = -1;
+            cookie->cmp = memalign(ASSET_ALIGNMENT, asset_max_block_size(cookie->table));
+            // add 8 because the assembly decompressors do writes up to 8 bytes out-of-bounds
+            cookie->buf = memalign(ASSET_ALIGNMENT, cookie->table->block_size + 8);
+            assertf(cookie->cmp && cookie->buf, "asset_fopen: out of memory");
+            cookie->stats = asset_stats_open(fn, header.algo, asset_winsize_from_flags(header.flags), false, true, header.cmp_size);
+            if (sz) *sz = header.orig_size;
+            return funopen(cookie, readfn_blk, NULL, seekfn_blk, closefn_blk);
+        }
+
         assertf(algos[header.algo-1].decompress_init, 
             "asset: compression level %d does not currently support asset_fopen()", header.algo);
 
@@ -329,25 +758,314 @@ FILE *asset_fopen(const char *fn, int *sz)
         cookie->read = algos[header.algo-1].decompress_read;
         cookie->reset = algos[header.algo-1].decompress_reset;
         algos[header.algo-1].decompress_init(cookie->state, f, winsize);
+        cookie->set_dict = NULL;
+        if (header.flags & ASSET_FLAG_DICT) {
+            asset_check_dict(fn, &header);
+            cookie->set_dict = algos[header.algo-1].decompress_set_dict;
+            cookie->set_dict(cookie->state, dict_data, dict_size);
+        }
 
         cookie->fp = f;
         cookie->pos = 0;
         cookie->seeked = false;
+        cookie->stats = asset_stats_open(fn, header.algo, winsize, false, true, header.cmp_size);
         if (sz) *sz = header.orig_size;
         return funopen(cookie, readfn_cmp, NULL, seekfn_cmp, closefn_cmp);
     }
 
     // Not compressed. Return a wrapped FILE* without the seeking capability,
     // so that it matches the behavior of the compressed file.
-    if (sz) {
-        fseek(f, 0, SEEK_END);
-        *sz = ftell(f);
-    }
+    fseek(f, 0, SEEK_END);
+    int size = ftell(f);
+    if (sz) *sz = size;
     fseek(f, 0, SEEK_SET);
     cookie_none_t *cookie = malloc(sizeof(cookie_none_t));
     cookie->fp = f;
     cookie->seeked = false;
+    cookie->stats = asset_stats_open(fn, 0, 0, false, true, size);
     return funopen(cookie, readfn_none, NULL, seekfn_none, closefn_none);
 }
 
+/** @brief Size of each DMA transfer performed by asynchronous loads from ROM */
+#define ASSET_ASYNC_CHUNK_SIZE      4096
+
+/** 
+ * @brief Double-buffered ROM reader used by asynchronous loads
+ * 
+ * While the decompressor consumes one buffer, the next chunk of data is
+ * transferred into the other one via an asynchronous PI DMA.
+ */
+typedef struct {
+    uint32_t rom_addr;              ///< ROM address of the next chunk to fetch
+    int rom_left;                   ///< Bytes left to fetch from ROM
+    uint8_t *buf[2];                ///< Double buffer (same 2-byte phase of ROM address)
+    int buf_len[2];                 ///< Valid bytes in each buffer
+    int cur;                        ///< Buffer being consumed
+    int pos;                        ///< Read position in the current buffer
+    bool pending;                   ///< True if a DMA is in flight to the other buffer
+    uint8_t *mem[2];                ///< Buffer memory (uncached, see #malloc_uncached)
+} romstream_t;
+
+static void romstream_fetch(romstream_t *rs)
+{
+    if (rs->rom_left == 0)
+        return;
+
+    int next = rs->cur ^ 1;
+    int n = MIN(rs->rom_left, ASSET_ASYNC_CHUNK_SIZE);
+    dma_read_async(rs->buf[next], rs->rom_addr, n);
+
+    rs->buf_len[next] = n;
+    rs->rom_addr += n;
+    rs->rom_left -= n;
+    rs->pending = true;
+}
+
+static int readfn_rom(void *c, char *buf, int sz)
+{
+    romstream_t *rs = c;
+    int total = 0;
+
+    while (sz > 0) {
+        if (rs->pos == rs->buf_len[rs->cur]) {
+            if (!rs->pending)
+                break;
+            // Wait for the chunk in flight, and immediately start fetching
+            // the next one while the caller processes this one.
+            dma_wait();
+            rs->cur ^= 1;
+            rs->pos = 0;
+            rs->pending = false;
+            romstream_fetch(rs);
+        }
+
+        int n = MIN(sz, rs->buf_len[rs->cur] - rs->pos);
+        memcpy(buf, rs->buf[rs->cur] + rs->pos, n);
+        rs->pos += n;
+        buf += n;
+        sz -= n;
+        total += n;
+    }
+
+    return total;
+}
+
+static int closefn_rom(void *c)
+{
+    romstream_t *rs = c;
+    // Make sure no DMA is still writing into the buffers
+    if (rs->pending)
+        dma_wait();
+    free_uncached(rs->mem[0]);
+    free_uncached(rs->mem[1]);
+    free(rs);
+    return 0;
+}
+
+/** @brief Open a FILE that reads ROM data through the double-buffered reader */
+static FILE *romstream_open(uint32_t rom_addr, int size)
+{
+    romstream_t *rs = malloc(sizeof(romstream_t));
+    assertf(rs, "asset_load_async: out of memory");
+
+    // The buffers are written by DMA and only read through uncached accesses,
+    // so allocate them on their own cachelines: a writeback of the cached
+    // reader state must never overwrite data just delivered by DMA.
+    for (int i = 0; i < 2; i++) {
+        rs->mem[i] = malloc_uncached(ASSET_ASYNC_CHUNK_SIZE + 16);
+        assertf(rs->mem[i], "asset_load_async: out of memory");
+    }
+
+    // Use the same 2-byte phase of the ROM address, as required by DMA
+    rs->buf[0] = rs->mem[0] + (rom_addr & 1);
+    rs->buf[1] = rs->mem[1] + (rom_addr & 1);
+    rs->buf_len[0] = rs->buf_len[1] = 0;
+    rs->rom_addr = rom_addr;
+    rs->rom_left = size;
+    rs->cur = 1;
+    rs->pos = 0;
+    rs->pending = false;
+
+    // Start fetching the first chunk right away
+    romstream_fetch(rs);
+
+    FILE *f = funopen(rs, readfn_rom, NULL, NULL, closefn_rom);
+    setvbuf(f, NULL, _IONBF, 0);
+    return f;
+}
+
+struct asset_async_s {
+    char *fn;                       ///< Filename (only for non-streamable and blocked assets)
+    FILE *fp;                       ///< File to read the (compressed) data from
+    asset_compression_t *algo;      ///< Decompression algorithm, or NULL if not compressed
+    uint8_t *buf;                   ///< Output buffer
+    int size;                       ///< Size of the output
+    int pos;                        ///< Bytes produced so far
+    bool done;                      ///< True if the load is completed
+    asset_block_table_t *table;     ///< Block table (only for blocked assets)
+    int data_offset;                ///< Offset of the first compressed block in the file
+    int cur_block;                  ///< Next block to decompress
+    uint8_t *cmp;                   ///< Scratch buffer for compressed blocks
+    asset_async_cb_t cb;            ///< Completion callback
+    void *ctx;                      ///< Callback context
+    uint8_t alignas(8) state[];     ///< Decompression state
+};
+
+asset_async_t *asset_load_async(const char *fn, asset_async_cb_t cb, void *ctx)
+{
+    FILE *f = must_fopen(fn);
+    setvbuf(f, NULL, _IONBF, 0);
+
+    asset_compression_t *algo = NULL;
+    int state_size = 0, winsize = 0, offset = 0, size;
+
+    // Check if file is compressed
+    asset_header_t header;
+    fread(&header, 1, sizeof(asset_header_t), f);
+    if (!memcmp(header.magic, ASSET_MAGIC, 3)) {
+        assertf(header.version == '3' || header.version == '4', "unsupported asset version: %c\nMake sure to rebuild libdragon tools and your assets", header.version);
+        assertf(header.algo >= 1 && header.algo <= 3,
+            "unsupported compression algorithm: %d", header.algo);
+        algo = &algos[header.algo-1];
+        assertf(algo->decompress_full || algo->decompress_full_inplace, 
+            "asset: compression level %d not initialized. Call asset_init_compression(%d) at initialization time", header.algo, header.algo);
+
+        if (header.version == '4') {
+            // Blocked asset: decompress one block per poll. Each block is
+            // fetched with a seek and a read, so go through the filesystem.
+            asset_async_t *h = malloc(sizeof(asset_async_t));
+            assertf(h, "asset_load_async: out of memory");
+            *h = (asset_async_t){ .fn = strdup(fn), .fp = f, .algo = algo, .size = header.orig_size, .cb = cb, .ctx = ctx };
+            h->table = asset_read_block_table(f);
+            h->data_offset = sizeof(asset_header_t) + ASSET_BLOCK_TABLE_SIZE(h->table->num_blocks);
+            // See decompress_blocks() for the extra 8 bytes
+            h->buf = memalign(ASSET_ALIGNMENT, h->size + 8);
+            h->cmp = memalign(ASSET_ALIGNMENT, asset_max_block_size(h->table));
+            assertf(h->buf && h->cmp, "asset_load_async: out of memory");
+            return h;
+        }
+
+        if (!algo->decompress_init) {
+            // This level does not support streaming: it will be loaded in
+            // one go at the first poll.
+            fclose(f);
+            asset_async_t *h = malloc(sizeof(asset_async_t));
+            assertf(h, "asset_load_async: out of memory");
+            *h = (asset_async_t){ .fn = strdup(fn), .size = header.orig_size, .cb = cb, .ctx = ctx };
+            return h;
+        }
+
+        winsize = asset_winsize_from_flags(header.flags);
+        state_size = algo->state_size + winsize;
+        offset = sizeof(asset_header_t);
+        size = header.orig_size;
+    } else {
+        fseek(f, 0, SEEK_END);
+        size = ftell(f);
+        fseek(f, 0, SEEK_SET);
+    }
+
+    asset_async_t *h = malloc(sizeof(asset_async_t) + state_size);
+    assertf(h, "asset_load_async: out of memory");
+    *h = (asset_async_t){ .algo = algo, .size = size, .cb = cb, .ctx = ctx };
+
+    h->buf = memalign(ASSET_ALIGNMENT, size);
+    assertf(h->buf, "asset_load_async: out of memory");
+
+    if (strncmp(fn, "rom:/", 5) == 0) {
+        // Loading from ROM: bypass the filesystem and stream the data via
+        // asynchronous DMA.
+        int rom_size = algo ? (int)header.cmp_size : size;
+        uint32_t addr = dfs_rom_addr(fn+5) & 0x1FFFFFFF;
+        fclose(f);
+        f = romstream_open(addr + offset, rom_size);
+    }
+
+    h->fp = f;
+    if (algo) {
+        algo->decompress_init(h->state, f, winsize);
+        if (header.flags & ASSET_FLAG_DICT) {
+            asset_check_dict(fn, &header);
+            algo->decompress_set_dict(h->state, dict_data, dict_size);
+        }
+    }
+    return h;
+}
+
+static void asset_async_complete(asset_async_t *h)
+{
+    h->done = true;
+    if (h->fp) {
+        fclose(h->fp);
+        h->fp = NULL;
+    }
+    free(h->fn);
+    h->fn = NULL;
+    if (h->table) {
+        free(h->table);
+        free(h->cmp);
+        h->table = NULL;
+        h->cmp = NULL;
+        void *ptr = realloc(h->buf, h->size); (void)ptr;
+        assertf(h->buf == ptr, "asset: realloc moved the buffer"); // guaranteed by newlib
+    }
+}
+
+bool asset_async_poll(asset_async_t *h)
+{
+    if (!h->done) {
+        if (h->table) {
+            // Blocked asset: decompress the next block
+            asset_block_table_t *table = h->table;
+            int blk = h->cur_block++;
+            int len = MIN((int)table->block_size, h->size - h->pos);
+            decompress_block(h->algo, h->fn, h->fp, h->data_offset + table->offsets[blk],
+                h->cmp, table->offsets[blk+1] - table->offsets[blk], h->buf + h->pos, len);
+            h->pos += len;
+        } else if (h->fn) {
+            // Non-streamable asset: load it synchronously
+            h->buf = asset_load(h->fn, &h->size);
+            h->pos = h->size;
+        } else {
+            int n = MIN(h->size - h->pos, ASSET_ASYNC_SLICE_SIZE);
+            if (n > 0) {
+                if (h->algo)
+                    n = h->algo->decompress_read(h->state, h->buf + h->pos, n);
+                else
+                    n = fread(h->buf + h->pos, 1, n, h->fp);
+                assertf(n > 0, "asset: read error on asynchronous load (%d/%d)", h->pos, h->size);
+                h->pos += n;
+            }
+        }
+
+        if (h->pos < h->size)
+            return false;
+        asset_async_complete(h);
+    }
+
+    if (h->cb) {
+        h->cb(h->ctx, h->buf, h->size);
+        free(h);
+    }
+    return true;
+}
+
+void *asset_async_wait(asset_async_t *h, int *sz)
+{
+    asset_async_cb_t cb = h->cb;
+    void *ctx = h->ctx;
+
+    // Run the load to completion, without letting poll invoke the callback
+    h->cb = NULL;
+    while (!asset_async_poll(h)) {}
+
+    void *buf = h->buf;
+    int size = h->size;
+    free(h);
+
+    if (sz) *sz = size;
+    if (cb) cb(ctx, buf, size);
+    return buf;
+}
+
 #endif /* N64 */
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <stdbool.h>
 
 #define ASSET_MAGIC                 "DCA"   ///< Magic compressed asset header
 #define ASSET_FLAG_WINSIZE_MASK     0x0007  ///< Mask to isolate the window size in the flags
@@ -15,6 +16,7 @@
 #define ASSET_FLAG_WINSIZE_128K     0x0006  ///< 128 KiB window size
 #define ASSET_FLAG_WINSIZE_256K     0x0007  ///< 256 KiB window size
 #define ASSET_FLAG_INPLACE          0x0100  ///< Decompress in-place
+#define ASSET_FLAG_DICT             0x0200  ///< Compressed with a shared dictionary (see #asset_dict_header_t)
 #define ASSET_ALIGNMENT             32
 
 __attribute__((used))
@@ -47,11 +49,53 @@ typedef struct {
     uint16_t flags;         ///< Flags
     uint32_t cmp_size;      ///< Compressed size in bytes
     uint32_t orig_size;     ///< Original size in bytes
-    uint32_t inplace_margin; ///< Margin for in-place decompression
+    union {
+        uint32_t inplace_margin; ///< Margin for in-place decompression
+        uint32_t dict_id;   ///< ID of the dictionary (if #ASSET_FLAG_DICT is set)
+    };
 } asset_header_t;
 
 _Static_assert(sizeof(asset_header_t) == 20, "invalid sizeof(asset_header_t)");
 
+/**
+ * @brief Block table of a blocked compressed asset (header version '4')
+ *
+ * In blocked assets, the original data is split into blocks of block_size
+ * bytes (the last one might be shorter), and each block is compressed
+ * independently. The table immediately follows #asset_header_t, and is
+ * followed by the compressed blocks. This allows to decompress any block
+ * without decompressing the previous ones, so that asset_fopen() can
+ * seek freely.
+ */
+typedef struct {
+    uint32_t block_size;    ///< Size of each block (before compression)
+    uint32_t num_blocks;    ///< Number of blocks
+    uint32_t offsets[];     ///< Offsets of the compressed blocks (num_blocks+1 entries), relative to the end of the table
+} asset_block_table_t;
+
+#define ASSET_DICT_MAGIC            "DCD"   ///< Magic header of a dictionary file
+#define ASSET_DICT_MAX_SIZE         (64*1024) ///< Maximum size of a dictionary
+
+/**
+ * @brief Header of a dictionary file
+ *
+ * Assets flagged with #ASSET_FLAG_DICT were compressed with a shared
+ * dictionary: the decompressor window is primed with the dictionary contents
+ * before decompression, so that matches can refer to it. The header is
+ * followed by the dictionary data.
+ */
+typedef struct {
+    char magic[3];          ///< Magic header
+    uint8_t version;        ///< Version of the dictionary format ('1')
+    uint32_t id;            ///< Dictionary ID (hash of the contents)
+    uint32_t size;          ///< Size of the dictionary in bytes
+} asset_dict_header_t;
+
+_Static_assert(sizeof(asset_dict_header_t) == 12, "invalid sizeof(asset_dict_header_t)");
+
+/** @brief Size in bytes of a block table with the specified number of blocks */
+#define ASSET_BLOCK_TABLE_SIZE(num_blocks)   (sizeof(asset_block_table_t) + ((num_blocks)+1) * sizeof(uint32_t))
+
 /** @brief A decompression algorithm used by the asset library */
 typedef struct {
     int state_size;     ///< Basic size of the decompression state (without ringbuffer)
@@ -65,6 +109,9 @@ typedef struct {
     /** @brief Reset decompression state after rewind */
     void (*decompress_reset)(void *state);
 
+    /** @brief Prime the window with a dictionary, after init or reset */
+    void (*decompress_set_dict)(void *state, const uint8_t *dict, size_t size);
+
     /** @brief Decompress a full file in one go */
     void* (*decompress_full)(const char *fn, FILE *fp, size_t cmp_size, size_t len);
 
@@ -75,4 +122,29 @@ typedef struct {
 
 FILE *must_fopen(const char *fn);
 
+#ifdef N64
+#include "n64sys.h"
+
+/** @brief True if asset load statistics are being collected (see #asset_stats_enable) */
+extern bool __asset_stats_enabled;
+/** @brief Total ticks spent by the asset library waiting for I/O (only while collecting statistics) */
+extern uint64_t __asset_stats_io_ticks;
+
+/** @brief Begin accounting a blocking I/O operation (fread, DMA wait) */
+static inline uint32_t asset_stats_io_begin(void)
+{
+    return __asset_stats_enabled ? TICKS_READ() : 0;
+}
+
+/** @brief End accounting a blocking I/O operation started with #asset_stats_io_begin */
+static inline void asset_stats_io_end(uint32_t t0)
+{
+    if (__asset_stats_enabled)
+        __asset_stats_io_ticks += TICKS_SINCE(t0);
+}
+#else
+static inline uint32_t asset_stats_io_begin(void) { return 0; }
+static inline void asset_stats_io_end(uint32_t t0) {}
+#endif
+
 #endif
@@ -0,0 +1,101 @@
+/**
+ * @file atlas.c
+ * @brief Texture atlases
+ * @ingroup graphics
+ */
+#include "atlas.h"
+#include "atlas_internal.h"
+#include "sprite.h"
+#include "asset.h"
+#include "debug.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** @brief A loaded atlas */
+typedef struct atlas_s {
+    atlas_header_t *header;     ///< Index file (owned)
+    atlas_entry_t *entries;     ///< Images (within the index file)
+    uint16_t *table;            ///< Hash table (within the index file)
+    const char *names;          ///< Names (within the index file)
+    sprite_t *pages[];          ///< Loaded pages
+} atlas_t;
+
+atlas_t *atlas_load(const char *fn)
+{
+    int sz;
+    atlas_header_t *header = asset_load(fn, &sz);
+    assertf(sz >= sizeof(atlas_header_t) && memcmp(header->id, ATLAS_ID, 4) == 0,
+        "%s: not an atlas file", fn);
+    assertf(header->version == ATLAS_FILE_VERSION,
+        "%s: invalid atlas version (%d); please regenerate your asset files", fn, header->version);
+
+    atlas_t *atlas = malloc(sizeof(atlas_t) + header->num_pages * sizeof(sprite_t*));
+    atlas->header = header;
+    atlas->entries = (atlas_entry_t*)(header + 1);
+    atlas->table = (uint16_t*)(atlas->entries + header->num_entries);
+    atlas->names = (const char*)(atlas->table + header->hash_size);
+
+    // Load the pages, that are stored next to the index: "ui.atlas" => "ui.0.sprite"
+    int baselen = strlen(fn);
+    const char *ext = strrchr(fn, '.');
+    if (ext && !strchr(ext, '/')) baselen = ext - fn;
+    char *pagefn = malloc(baselen + 16);
+    for (int i=0; i<header->num_pages; i++) {
+        sprintf(pagefn, "%.*s.%d.sprite", baselen, fn, i);
+        atlas->pages[i] = sprite_load(pagefn);
+    }
+    free(pagefn);
+
+    return atlas;
+}
+
+void atlas_free(atlas_t *atlas)
+{
+    for (int i=0; i<atlas->header->num_pages; i++)
+        sprite_free(atlas->pages[i]);
+    free(atlas->header);
+    free(atlas);
+}
+
+int atlas_find(atlas_t *atlas, const char *name)
+{
+    uint32_t hash = atlas_hash(name);
+    uint32_t mask = atlas->header->hash_size - 1;
+
+    for (uint32_t slot = hash & mask; ; slot = (slot + 1) & mask) {
+        int idx = atlas->table[slot];
+        if (idx == ATLAS_EMPTY_SLOT)
+            return -1;
+        atlas_entry_t *e = &atlas->entries[idx];
+        if (e->hash == hash && strcmp(atlas->names + e->name_offset, name) == 0)
+            return idx;
+    }
+}
+
+int atlas_get_count(atlas_t *atlas)
+{
+    return atlas->header->num_entries;
+}
+
+atlas_rect_t atlas_get_rect(atlas_t *atlas, int idx)
+{
+    assertf(idx >= 0 && idx < atlas->header->num_entries, "invalid atlas image index: %d", idx);
+    atlas_entry_t *e = &atlas->entries[idx];
+    return (atlas_rect_t){
+        .page = atlas->pages[e->page],
+        .s0 = e->s0, .t0 = e->t0,
+        .s1 = e->s0 + e->width, .t1 = e->t0 + e->height,
+    };
+}
+
+int atlas_get_page_count(atlas_t *atlas)
+{
+    return atlas->header->num_pages;
+}
+
+sprite_t *atlas_get_page(atlas_t *atlas, int page)
+{
+    assertf(page >= 0 && page < atlas->header->num_pages, "invalid atlas page: %d", page);
+    return atlas->pages[page];
+}
@@ -0,0 +1,52 @@
+#ifndef __LIBDRAGON_ATLAS_INTERNAL_H
+#define __LIBDRAGON_ATLAS_INTERNAL_H
+
+#include <stdint.h>
+#include <string.h>
+#include "fnv.h"
+
+#define ATLAS_ID            "AT64"    ///< ID of an atlas index file
+#define ATLAS_FILE_VERSION  1         ///< Version of the atlas index file
+#define ATLAS_EMPTY_SLOT    0xFFFF    ///< Value of an empty slot in the hash table
+#define ATLAS_MAX_ENTRIES   0x4000    ///< Maximum number of images (the hash table, twice as large, must fit 16-bit sizes)
+
+/** 
+ * @brief Header of an atlas index file
+ * 
+ * The header is followed by the array of entries (#atlas_entry_t), then by the
+ * hash table (hash_size 16-bit entry indices, or #ATLAS_EMPTY_SLOT), and finally
+ * by the names (NUL-terminated strings). The hash table uses linear probing.
+ */
+typedef struct __attribute__((packed)) {
+    char id[4];             ///< ID of the file (#ATLAS_ID)
+    uint8_t version;        ///< Version of the file (#ATLAS_FILE_VERSION)
+    uint8_t num_pages;      ///< Number of pages (sprites)
+    uint16_t num_entries;   ///< Number of images in the atlas
+    uint16_t hash_size;     ///< Number of slots in the hash table (power of two)
+    uint16_t padding;       ///< Padding
+    uint32_t names_size;    ///< Size of the names area in bytes
+} atlas_header_t;
+
+_Static_assert(sizeof(atlas_header_t) == 16, "invalid atlas_header_t size");
+
+/** @brief An image in the atlas */
+typedef struct __attribute__((packed)) {
+    uint32_t hash;          ///< Hash of the name (see #atlas_hash)
+    uint16_t name_offset;   ///< Offset of the name in the names area
+    uint8_t page;           ///< Page containing the image
+    uint8_t padding;        ///< Padding
+    int16_t s0;             ///< Top-left X coordinate in the page
+    int16_t t0;             ///< Top-left Y coordinate in the page
+    int16_t width;          ///< Width of the image
+    int16_t height;         ///< Height of the image
+} atlas_entry_t;
+
+_Static_assert(sizeof(atlas_entry_t) == 16, "invalid atlas_entry_t size");
+
+/** @brief Hash of an image name (32-bit FNV-1a), as computed by mksprite */
+static inline uint32_t atlas_hash(const char *name)
+{
+    return fnv1a32(name, strlen(name));
+}
+
+#endif
@@ -0,0 +1,106 @@
+/**
+ * @file audio_host.h
+ * @brief Host build of the audio library
+ * @ingroup mixer
+ *
+ * The mixer, the sample buffers and the WAV64/XM64/YM64 players can also be
+ * compiled for the host, so that audio can be rendered and profiled offline
+ * (see tools/mixer_render). This header replaces the system headers they use
+ * on N64:
+ *
+ *  * The RSP ucode is replaced by its C reference (see #MIXER_RSP_REFERENCE
+ *    in mixer.c), and VADPCM is decoded with the reference C decoder.
+ *  * Caches do not exist: uncached addresses are plain pointers and cache
+ *    operations are no-ops.
+ *  * The ROM is emulated by the host program, which must implement the DFS
+ *    and PI DMA functions declared below, plus #audio_get_frequency and
+ *    #must_fopen.
+ *  * Ticks are nanoseconds of the host monotonic clock.
+ *
+ * Sample buffers keep the same memory layout as on the console: 16-bit samples
+ * are stored big-endian, exactly as they are found in ROM. Code that writes
+ * samples with the CPU must convert them with #HOST_TO_BE16.
+ */
+#ifndef __LIBDRAGON_AUDIO_HOST_H
+#define __LIBDRAGON_AUDIO_HOST_H
+
+#ifdef N64
+#error "audio_host.h must only be used in host builds"
+#endif
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include "audio.h"
+#include "utils.h"
+
+#define assertf(expr, ...)              assert(expr)
+
+/** @brief Log to stderr (no format checks: N64 code assumes 32-bit longs) */
+static inline void debugf(const char *fmt, ...) {
+    va_list va;
+    va_start(va, fmt);
+    vfprintf(stderr, fmt, va);
+    va_end(va);
+}
+
+#define UncachedAddr(addr)              ((void*)(addr))
+#define CachedAddr(addr)                ((void*)(addr))
+#define malloc_uncached(size)           aligned_alloc(16, ROUND_UP((size), 16))
+#define free_uncached(ptr)              free(ptr)
+#define data_cache_hit_writeback(addr, sz)             ((void)(addr), (void)(sz))
+#define data_cache_hit_writeback_invalidate(addr, sz)  ((void)(addr), (void)(sz))
+
+#define disable_interrupts()            ((void)0)
+#define enable_interrupts()             ((void)0)
+#define exception_reset_time()          0
+
+#define TICKS_PER_SECOND                1000000000
+#define RESET_TIME_LENGTH               (TICKS_PER_SECOND / 5)
+
+/** @brief Read the host tick counter (nanoseconds, wrapping like C0_COUNT) */
+static inline uint32_t TICKS_READ(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * TICKS_PER_SECOND + ts.tv_nsec;
+}
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define BE16_TO_HOST(x)                 __builtin_bswap16(x)
+#define BE32_TO_HOST(x)                 __builtin_bswap32(x)
+#else
+#define BE16_TO_HOST(x)                 (x)
+#define BE32_TO_HOST(x)                 (x)
+#endif
+#define HOST_TO_BE16(x)                 BE16_TO_HOST(x)
+#define HOST_TO_BE32(x)                 BE32_TO_HOST(x)
+
+/** @brief strlcpy (missing from older glibc) */
+static inline size_t audio_host_strlcpy(char *dst, const char *src, size_t size) {
+    size_t len = strlen(src);
+    if (size) {
+        size_t n = len < size-1 ? len : size-1;
+        memcpy(dst, src, n);
+        dst[n] = 0;
+    }
+    return len;
+}
+#define strlcpy audio_host_strlcpy
+
+// Emulated ROM (implemented by the host program)
+int dfs_open(const char * const path);
+int dfs_read(void * const buf, int size, int count, uint32_t handle);
+int dfs_close(uint32_t handle);
+uint32_t dfs_rom_addr(const char *path);
+const char *dfs_strerror(int error);
+void dma_read(void *ram_address, unsigned long pi_address, unsigned long len);
+void dma_read_async(void *ram_address, unsigned long pi_address, unsigned long len);
+void dma_wait(void);
+FILE *must_fopen(const char *fn);
+
+#endif
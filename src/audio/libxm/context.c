@@ -107,7 +107,7 @@ int xm_create_context_safe(xm_context_t** ctxp, const char* moddata, size_t modd
 
 #if !defined(N64) && !XM_STREAM_PATTERNS && !XM_STREAM_WAVEFORMS
 
-void xm_context_save(xm_context_t* ctx, FILE* out) {
+void xm_context_save(xm_context_t* ctx, FILE* out, const uint8_t* ticks, uint32_t ticks_size) {
 
 	#undef _W64 // defined by mingw
 	#define _CHKSZ(x,n) _Static_assert(sizeof(x) == n, "invalid type size");
@@ -127,14 +127,18 @@ void xm_context_save(xm_context_t* ctx, FILE* out) {
 	#define WALIGN()  ({ while (ftell(out) % 8) _W8(0); })
 
 
-	const uint8_t version = 6;
+	// Files without a baked tick stream are still saved as version 6,
+	// so that they can be played by older players.
+	const uint8_t version = ticks ? 7 : 6;
 	WA("XM64", 4);
 	W8(version);
 	W32(ctx->ctx_size);
 	W32(ctx->ctx_size_all_patterns);
 	W32(ctx->ctx_size_all_samples);
-	W32(ctx->ctx_size_stream_pattern_buf);
+	W32(ticks ? 0 : ctx->ctx_size_stream_pattern_buf);
 	for (int i=0; i<32; i++) W32(ctx->ctx_size_stream_sample_buf[i]);
+	uint32_t ticks_off_pos = ftell(out);
+	if (version >= 7) W32(0); // will fill later
 
 	W16(ctx->module.tempo);
 	W16(ctx->module.bpm);
@@ -263,6 +267,16 @@ void xm_context_save(xm_context_t* ctx, FILE* out) {
 
 		uint32_t pos = ftell(out);
 
+		// With a baked tick stream, patterns are never played, so their
+		// data is dropped. Only the number of rows is kept (see above).
+		if (ticks) {
+			fseek(out, pat_off[pat_off_idx++], SEEK_SET);
+			W32(pos);
+			W16((uint16_t)0);
+			fseek(out, pos, SEEK_SET);
+			continue;
+		}
+
 		xm_pattern_t *p = &ctx->module.patterns[i];
 
 		int pat_size = p->num_rows*ctx->module.num_channels*5;
@@ -360,6 +374,16 @@ void xm_context_save(xm_context_t* ctx, FILE* out) {
 
 	WA("END!", 4);
 
+	if (ticks) {
+		WA("TICK", 4);
+		W32(ticks_size);
+		uint32_t pos = ftell(out);
+		WA(ticks, ticks_size);
+		fseek(out, ticks_off_pos, SEEK_SET);
+		W32(pos);
+		fseek(out, pos+ticks_size, SEEK_SET);
+	}
+
 	#undef _CHKSZ
 	#undef _W8
 	#undef _W16
@@ -409,7 +433,7 @@ int xm_context_decompress_pattern(uint8_t *in, int sz, xm_pattern_slot_t *pat) {
 }
 
 
-int xm_context_load(xm_context_t** ctxp, FILE* in, uint32_t rate) {
+int xm_context_load(xm_context_t** ctxp, FILE* in, uint32_t rate, uint32_t* ticks_offset) {
 
 	#define _CHKSZ(x,n) ({ _Static_assert(sizeof(x) == n, "invalid type size"); })
 	#define _R8(x)     ({ uint8_t u8; fread(&u8, 1, 1, in); x=u8; })
@@ -445,19 +469,22 @@ int xm_context_load(xm_context_t** ctxp, FILE* in, uint32_t rate) {
 	//  5: first public version
 	//  6: added overread for non-looping samples. The size of optimal
 	//     stream sample buffer size must change, hance the version bump.
+	//  7: added offset of the baked tick stream (audioconv64 --xm-bake-ticks)
 	R8(version);
-	if (version != 5 && version != 6) {
+	if (version < 5 || version > 7) {
 		DEBUG("invalid XM64 version %d\n", version);
 		return 1;		
 	}
 
 	uint32_t ctx_size, ctx_size_all_samples, ctx_size_all_patterns, ctx_size_stream_pattern_buf, ctx_size_stream_sample_buf[32];
+	uint32_t ticks_off = 0;
 
 	R32(ctx_size);
 	R32(ctx_size_all_patterns);
 	R32(ctx_size_all_samples);
 	R32(ctx_size_stream_pattern_buf);
 	for (int i=0;i<32;i++) R32(ctx_size_stream_sample_buf[i]);
+	if (version >= 7) R32(ticks_off);
 	if (version == 5) {
 		for (int i=0;i<32;i++) {
 			// Add the overread size to all (non-empty) channels. This is a small pessimization,
@@ -475,6 +502,12 @@ int xm_context_load(xm_context_t** ctxp, FILE* in, uint32_t rate) {
 	#if XM_STREAM_WAVEFORMS
 	alloc_bytes -= ctx_size_all_samples;
 	#endif
+	#if XM_STREAM_WAVEFORMS && !defined(N64)
+	// The host build of the streaming player (see tools/mixer_render) has
+	// 64-bit pointers, so xm_sample_t is larger than the size used by audioconv64.
+	// Reserve space for the maximum number of samples (128 instruments * 16).
+	alloc_bytes += 128 * 16 * (sizeof(xm_sample_t) - 80);
+	#endif
 
 	char *mempool = malloc(alloc_bytes);
 	char *mempool_end = mempool+alloc_bytes;
@@ -647,6 +680,12 @@ int xm_context_load(xm_context_t** ctxp, FILE* in, uint32_t rate) {
 		mempool += sizeof(xm_pattern_slot_t) * ctx->module.num_channels * p->num_rows;
 		if ((size_t)mempool & 7) mempool += 8 - ((size_t)mempool & 7);
 
+		// Patterns without data come from files with a baked tick stream
+		if (cmp_size == 0) {
+			memset(p->slots, 0, dec_size);
+			continue;
+		}
+
 		uint8_t *cmp_data = (uint8_t*)p->slots + dec_size - cmp_size;
 		RA(cmp_data, cmp_size);
 
@@ -724,6 +763,7 @@ int xm_context_load(xm_context_t** ctxp, FILE* in, uint32_t rate) {
 		// Anyway, allocating 100-200 bytes more isn't going to hurt for now.
 	}
 
+	if (ticks_offset) *ticks_offset = ticks_off;
 	return 0;
 }
 
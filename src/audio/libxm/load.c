@@ -27,7 +27,9 @@
 #define READ_U32(offset) READ_U32_BOUND(offset, moddata_length)
 #define READ_MEMCPY(ptr, offset, length) READ_MEMCPY_BOUND(ptr, offset, length, moddata_length)
 
+#ifndef MIN
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
 
 static inline void memcpy_pad(void* dst, size_t dst_len, const void* src, size_t src_len, size_t offset) {
 	uint8_t* dst_c = dst;
@@ -884,6 +884,7 @@ static void xm_row(xm_context_t* ctx) {
 		// RLE compression guarantees that this is safe.
 		int cmp_size = cur->slots_size;
 		int dec_size = sizeof(xm_pattern_slot_t) * cur->num_rows * ctx->module.num_channels;
+		assert(cmp_size > 0); // files with a baked tick stream have no pattern data
 		uint8_t *cmp_data = (uint8_t*)ctx->slot_buffer + dec_size - cmp_size;
 
 		fseek(ctx->fh, cur->slots_offset, SEEK_SET);
@@ -22,8 +22,9 @@
 #define XM_DEBUG                     1
 #define XM_DEFENSIVE                 0
 
-// Activate RSP-based XM implementation
-#ifdef N64
+// Activate RSP-based XM implementation (also used by the host build of
+// the XM64 player, see tools/mixer_render)
+#if defined(N64) || defined(XM64_HOST_PLAYER)
 #define XM_STREAM_PATTERNS           1    // Load one pattern at a time
 #define XM_STREAM_WAVEFORMS          1    // Load portion of samples as they are played
 #else
@@ -82,19 +83,21 @@ void xm_free_context(xm_context_t*);
 /** Save a context into a XM64 file.
  * 
  * Saving a context can be done only on PC, and with a non-streaming loader that 
- * fetched everything.
+ * fetched everything. If ticks is not NULL, the baked tick stream is saved
+ * as well (see audioconv64 --xm-bake-ticks).
  */
 #if !defined(N64) && !XM_STREAM_PATTERNS && !XM_STREAM_WAVEFORMS
-void xm_context_save(xm_context_t* ctx, FILE* out);
+void xm_context_save(xm_context_t* ctx, FILE* out, const uint8_t* ticks, uint32_t ticks_size);
 #endif
 
 /** Load a context from a XM64 file.
  * 
  * Returns 0 in case of success, 1 in case of generic error (file corrupted),
  * or 2 in case the memory size estimated by the writer wasn't enough to load
- * the file.
+ * the file. If ticks_offset is not NULL, it is set to the file offset of the
+ * baked tick stream (0 if the file does not contain one).
  */
-int xm_context_load(xm_context_t** ctxp, FILE* in, uint32_t rate);
+int xm_context_load(xm_context_t** ctxp, FILE* in, uint32_t rate, uint32_t* ticks_offset);
 
 /** Play the module and put the sound samples in an output buffer.
  *
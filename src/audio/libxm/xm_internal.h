@@ -20,6 +20,32 @@
 typedef struct waveform_s waveform_t;
 #endif
 
+// Opcodes of the baked tick stream (see audioconv64 --xm-bake-ticks). The
+// stream is a sequence of ticks, each made of a list of opcodes terminated
+// by XM_TICK_OP_END. Fixed-size values are big-endian. Channel parameters
+// are encoded as deltas against their previous value in the same channel
+// (all zero at the start of the stream), as zigzag LEB128 varints.
+#define XM_TICK_OP_END            0x00  ///< End of tick
+#define XM_TICK_OP_ROW            0x01  ///< New position: u8 table index, u8 row
+#define XM_TICK_OP_BPM            0x02  ///< New BPM: u16
+#define XM_TICK_OP_LOOP           0x03  ///< The song has looped (loop_count++)
+#define XM_TICK_OP_JUMP           0x04  ///< Continue at stream offset: u32
+#define XM_TICK_OP_CHANNEL        0x20  ///< Channel update (| channel): u8 flags, then payload
+#define XM_TICK_OP_CHANNEL_SHORT  0x40  ///< Channel update (| channel) with implicit flags, see below
+
+#define XM_TICK_CH_SAMPLE         0x01  ///< u8 instrument (1-based, 0=none), u8 sample
+#define XM_TICK_CH_POS            0x02  ///< varint sample position + 1 (0=stop)
+#define XM_TICK_CH_FREQ           0x04  ///< delta of the frequency (IEEE float bits)
+#define XM_TICK_CH_VOL            0x08  ///< delta of the volume (0..65535, global volume included)
+#define XM_TICK_CH_PAN            0x10  ///< delta of the panning (0..65535)
+#define XM_TICK_CH_EFFECT         0x20  ///< u8 effect type, u8 param (for the effect callback)
+
+// Flags of the channel updates without the flags byte, that are the most
+// frequent ones: opcode XM_TICK_OP_CHANNEL_SHORT + 0x20*i uses entry i.
+#define XM_TICK_SHORT_FLAGS       { XM_TICK_CH_VOL, XM_TICK_CH_PAN, XM_TICK_CH_VOL | XM_TICK_CH_PAN, XM_TICK_CH_FREQ }
+
+#define XM_TICK_MAX_OP_SIZE       24    ///< Upper bound of the size of a single opcode
+
 #if XM_DEBUG
 #include <stdio.h>
 #define DEBUG(fmt, ...) do {										\
@@ -123,7 +149,9 @@ struct xm_sample_s {
 	};
 };
 typedef struct xm_sample_s xm_sample_t;
+#if defined(N64) || !XM_STREAM_WAVEFORMS
 _Static_assert(sizeof(xm_sample_t) == 80, "invalid sizeof(sample_t)");
+#endif
 _Static_assert(sizeof(xm_sample_t) % 8 == 0, "sizeof(xm_sample_t) must be multiple of 8");
 
 struct xm_instrument_s {
@@ -6,15 +6,20 @@
 
 #include "mixer.h"
 #include "mixer_internal.h"
+#include "samplebuffer.h"
+#ifdef N64
 #include "regsinternal.h"
 #include "utils.h"
 #include "rsp.h"
 #include "rspq.h"
 #include "debug.h"
-#include "samplebuffer.h"
 #include "audio.h"
 #include "n64sys.h"
 #include "interrupt.h"
+#else
+// Host build (see tools/mixer_render)
+#include "audio_host.h"
+#endif
 #include <memory.h>
 #include <stdlib.h>
 #include <math.h>
@@ -24,6 +29,13 @@
 /** @brief Set to 1 to activate debug logs */
 #define MIXER_TRACE   0
 
+/** @brief Set to 1 to mix with the C reference of the RSP ucode (always used in host builds) */
+#ifdef N64
+#define MIXER_RSP_REFERENCE   0
+#else
+#define MIXER_RSP_REFERENCE   1
+#endif
+
 #if MIXER_TRACE
 /** @brief like debugf(), but writes only if #MIXER_TRACE is not 0 */
 #define tracef(fmt, ...)  debugf(fmt, ##__VA_ARGS__)
@@ -52,10 +64,12 @@
  */
 #define MIXER_POLL_PER_SECOND   8
 
+#ifdef N64
 /**
  * RSP mixer ucode (rsp_mixer.S)
  */
 DEFINE_RSP_UCODE(rsp_mixer);
+#endif
 
 /** @brief Size of the ucode state that is automatically persisted by rspq */
 #define MIXER_STATE_SIZE 128
@@ -117,7 +131,9 @@ typedef struct rsp_mixer_channel_s {
 } __attribute__((packed)) rsp_mixer_channel_t;
 
 /// @cond
+#ifdef N64
 _Static_assert(sizeof(rsp_mixer_channel_t) == 6*4);
+#endif
 /// @endcond
 
 /** @brief Mixer ucode settings. 
@@ -141,6 +157,18 @@ typedef struct {
 	int max_buf_sz;         ///< Maximum sample buffer size (bytes)
 } channel_limit_t;
 
+/** @brief A virtual voice (see #mixer_voice_play) */
+typedef struct {
+	waveform_t *wave;      ///< Waveform being played (NULL if the voice is free)
+	mixer_fx64_t pos;      ///< Current position within the waveform (in samples)
+	mixer_fx64_t step;     ///< Step between samples (in samples)
+	mixer_fx15_t lvol;     ///< Left volume
+	mixer_fx15_t rvol;     ///< Right volume
+	int priority;          ///< Priority of the voice
+	int ch;                ///< Channel the voice is mixed on (or -1 if virtual)
+	int gen;               ///< Generation of the voice, used to detect stale handles
+} mixer_voice_t;
+
 /** @brief A mixer event (synchronized with sample playback) */
 typedef struct {
 	int64_t ticks;          ///< Absolute time at which the event will trigger (ticks = output samples)
@@ -165,8 +193,16 @@ static struct {
 	mixer_fx15_t lvol[MIXER_MAX_CHANNELS];
 	mixer_fx15_t rvol[MIXER_MAX_CHANNELS];
 
+	int voice_first_ch;
+	int voice_num_ch;
+	mixer_voice_t voices[MIXER_MAX_VOICES];
+
 	rsp_mixer_settings_t ucode_settings __attribute__((aligned(16)));
 
+#if MIXER_RSP_REFERENCE
+	// Persistent ucode state (XVOL_L / XVOL_R in rsp_mixer.S)
+	int16_t ref_xvol[2][MIXER_MAX_CHANNELS];
+#endif
 } Mixer;
 
 /** @brief Count of ticks spent in mixer RSP, used for debugging purposes. */
@@ -190,12 +226,14 @@ void mixer_init(int num_channels) {
 		mixer_ch_set_limits(ch, 16, Mixer.sample_rate, 0);
 	}
 
+#ifdef N64
 	void *mixer_state = rspq_overlay_get_state(&rsp_mixer);
 	memset(mixer_state, 0, MIXER_STATE_SIZE);
 	data_cache_hit_writeback(mixer_state, MIXER_STATE_SIZE);
 
 	rspq_init();
     __mixer_overlay_id = rspq_overlay_register(&rsp_mixer);
+#endif
 }
 
 static void mixer_init_samplebuffers(void) {
@@ -244,7 +282,9 @@ void mixer_set_vol(float vol) {
 void mixer_close(void) {
 	assert(mixer_initialized());
 
+#ifdef N64
 	rspq_overlay_unregister(__mixer_overlay_id);
+#endif
 	__mixer_overlay_id = 0;
 
 	if (Mixer.ch_buf_mem) {
@@ -324,12 +364,16 @@ static void waveform_read(void *ctx, samplebuffer_t *sbuf, int wpos, int wlen, b
 		// No loop defined: just call the waveform's read function.
 		wave->read(wave->ctx, sbuf, wpos, wlen, seeking);
 	} else {
-		// Calculate wrapped position
-		if (wpos >= wave->len)
+		// Calculate wrapped position. If we are requesting a read from the
+		// loop start after wrapping, we force seeking because it means that
+		// previous read finished just exactly at the loop point.
+		if (wpos >= wave->len) {
 			wpos = waveform_wrap_wpos(wpos, wave->len, wave->loop_len);
+			if (wpos == wave->len - wave->loop_len)
+				seeking = true;
+		}
 
-		// If we are requesting a read from 0, we force seeking because it
-		// means that previous read finished just exactly at the loop point.
+		// Same for reads from 0 (eg: when the whole waveform loops).
 		if (wpos == 0)
 			seeking = true;
 
@@ -473,6 +517,428 @@ void mixer_ch_set_limits(int ch, int max_bits, float max_frequency, int max_buf_
 	}
 }
 
+// Given a position within a waveform (in samples), wrap it within the loop
+// if the waveform loops and the position went past its end.
+static mixer_fx64_t mixer_voice_wrap_pos(waveform_t *wave, mixer_fx64_t pos) {
+	mixer_fx64_t len = MIXER_FX64((int64_t)wave->len);
+	if (wave->loop_len && pos >= len) {
+		mixer_fx64_t loop_len = MIXER_FX64((int64_t)wave->loop_len);
+		pos = (pos - len) % loop_len + (len - loop_len);
+	}
+	return pos;
+}
+
+// Return the voice corresponding to a handle, or NULL if the handle is
+// stale (the voice was stopped, and possibly reused).
+static mixer_voice_t* mixer_voice_get(int voice) {
+	if (voice < 0)
+		return NULL;
+	mixer_voice_t *v = &Mixer.voices[voice % MIXER_MAX_VOICES];
+	if (!v->wave || v->gen != voice / MIXER_MAX_VOICES)
+		return NULL;
+	return v;
+}
+
+// Audibility of a voice, used to choose which voices are mixed: first the
+// priority, then the loudest side of the volume. Voices already being
+// mixed win ties, to avoid swapping voices back and forth.
+static int64_t mixer_voice_audibility(mixer_voice_t *v) {
+	int vol = MAX(abs(v->lvol), abs(v->rvol));
+	return (int64_t)v->priority * (1<<17) + vol * 2 + (v->ch >= 0 ? 1 : 0);
+}
+
+static void mixer_voice_free(mixer_voice_t *v) {
+	if (v->ch >= 0)
+		mixer_ch_stop(v->ch);
+	v->wave = NULL;
+	v->ch = -1;
+}
+
+// Start mixing a virtual voice on the specified channel, resuming
+// from its current position.
+static void mixer_voice_map(mixer_voice_t *v, int ch) {
+	mixer_channel_t *c = &Mixer.channels[ch];
+	mixer_ch_play(ch, v->wave);
+
+	int bps = c->flags & CH_FLAGS_BPS_SHIFT;
+	c->pos = v->pos << bps;
+	c->step = v->step << bps;
+	Mixer.lvol[ch] = v->lvol;
+	Mixer.rvol[ch] = v->rvol;
+	v->ch = ch;
+	tracef("mixer_voice_map: voice=%d ch=%d pos=%llx\n", (int)(v - Mixer.voices), ch, v->pos >> MIXER_FX64_FRAC);
+}
+
+// Stop mixing a voice, which becomes virtual.
+static void mixer_voice_unmap(mixer_voice_t *v) {
+	mixer_channel_t *c = &Mixer.channels[v->ch];
+	v->pos = mixer_voice_wrap_pos(v->wave, c->pos >> (c->flags & CH_FLAGS_BPS_SHIFT));
+	mixer_ch_stop(v->ch);
+	tracef("mixer_voice_unmap: voice=%d ch=%d pos=%llx\n", (int)(v - Mixer.voices), v->ch, v->pos >> MIXER_FX64_FRAC);
+	v->ch = -1;
+}
+
+// Map the most audible voices onto the reserved channels. Called before
+// mixing each block of samples.
+static void mixer_voices_update(void) {
+	int num_ch = Mixer.voice_num_ch;
+	if (!num_ch)
+		return;
+
+	// Select the most audible voices, sorted by decreasing audibility.
+	// Voices with no volume are never mixed.
+	int best[MIXER_MAX_CHANNELS];
+	int64_t best_aud[MIXER_MAX_CHANNELS];
+	int nbest = 0;
+	for (int i=0;i<MIXER_MAX_VOICES;i++) {
+		mixer_voice_t *v = &Mixer.voices[i];
+		if (!v->wave || (!v->lvol && !v->rvol))
+			continue;
+		int64_t aud = mixer_voice_audibility(v);
+		if (nbest == num_ch && aud <= best_aud[nbest-1])
+			continue;
+		int j = nbest < num_ch ? nbest++ : nbest-1;
+		while (j > 0 && best_aud[j-1] < aud) {
+			best[j] = best[j-1];
+			best_aud[j] = best_aud[j-1];
+			j--;
+		}
+		best[j] = i;
+		best_aud[j] = aud;
+	}
+
+	bool selected[MIXER_MAX_VOICES] = {0};
+	for (int j=0;j<nbest;j++)
+		selected[best[j]] = true;
+
+	// Make virtual the voices that are not audible enough anymore, and
+	// collect the channels that are left free.
+	uint32_t free_chs = 0;
+	for (int ch=0;ch<num_ch;ch++)
+		free_chs |= 1u << (Mixer.voice_first_ch + ch);
+	for (int i=0;i<MIXER_MAX_VOICES;i++) {
+		mixer_voice_t *v = &Mixer.voices[i];
+		if (!v->wave || v->ch < 0)
+			continue;
+		if (selected[i])
+			free_chs &= ~(1u << v->ch);
+		else
+			mixer_voice_unmap(v);
+	}
+
+	// Start mixing the selected voices that are still virtual
+	for (int j=0;j<nbest;j++) {
+		mixer_voice_t *v = &Mixer.voices[best[j]];
+		if (v->ch >= 0)
+			continue;
+		int ch = __builtin_ctz(free_chs);
+		free_chs &= ~(1u << ch);
+		mixer_voice_map(v, ch);
+	}
+}
+
+// Advance the position of all voices after mixing num_samples samples.
+// Mixed voices follow their channel, while virtual voices are advanced
+// as if they were being mixed.
+static void mixer_voices_advance(int num_samples) {
+	if (!Mixer.voice_num_ch)
+		return;
+
+	for (int i=0;i<MIXER_MAX_VOICES;i++) {
+		mixer_voice_t *v = &Mixer.voices[i];
+		if (!v->wave)
+			continue;
+
+		if (v->ch >= 0) {
+			mixer_channel_t *c = &Mixer.channels[v->ch];
+			if (!c->ptr) {
+				// The channel reached the end of the waveform
+				mixer_voice_free(v);
+				continue;
+			}
+			v->pos = c->pos >> (c->flags & CH_FLAGS_BPS_SHIFT);
+		} else {
+			v->pos = mixer_voice_wrap_pos(v->wave, v->pos + v->step * num_samples);
+		}
+
+		if (!v->wave->loop_len && (v->pos >> MIXER_FX64_FRAC) >= v->wave->len)
+			mixer_voice_free(v);
+	}
+}
+
+void mixer_voices_init(int first_ch, int num_ch) {
+	assertf(first_ch >= 0 && num_ch >= 0 && first_ch+num_ch <= Mixer.num_channels,
+		"mixer_voices_init: invalid channel range %d-%d (mixer has %d channels)",
+		first_ch, first_ch+num_ch-1, Mixer.num_channels);
+
+	for (int i=0;i<MIXER_MAX_VOICES;i++)
+		if (Mixer.voices[i].wave)
+			mixer_voice_free(&Mixer.voices[i]);
+	for (int ch=first_ch;ch<first_ch+num_ch;ch++)
+		mixer_ch_stop(ch);
+
+	Mixer.voice_first_ch = first_ch;
+	Mixer.voice_num_ch = num_ch;
+}
+
+int mixer_voice_play(waveform_t *wave, int priority) {
+	assertf(Mixer.voice_num_ch > 0, "mixer_voice_play: no channels reserved for voices (see mixer_voices_init)");
+	assertf(wave->channels == 1, "mixer_voice_play: waveform %s: only mono waveforms are supported", wave->name);
+
+	mixer_voice_t *v = NULL;
+	for (int i=0;i<MIXER_MAX_VOICES;i++) {
+		if (!Mixer.voices[i].wave) {
+			v = &Mixer.voices[i];
+			break;
+		}
+	}
+
+	if (!v) {
+		// All voices are busy: steal the least audible one, as long as its
+		// priority is not higher than the new voice.
+		int64_t min_aud = INT64_MAX;
+		for (int i=0;i<MIXER_MAX_VOICES;i++) {
+			mixer_voice_t *v2 = &Mixer.voices[i];
+			int64_t aud = mixer_voice_audibility(v2);
+			if (v2->priority <= priority && aud < min_aud) {
+				v = v2;
+				min_aud = aud;
+			}
+		}
+		if (!v)
+			return MIXER_VOICE_NONE;
+		tracef("mixer_voice_play: stealing voice %d (%s)\n", (int)(v - Mixer.voices), v->wave->name);
+		mixer_voice_free(v);
+	}
+
+	v->wave = wave;
+	v->pos = 0;
+	v->step = MIXER_FX64(wave->frequency / (float)Mixer.sample_rate);
+	v->lvol = v->rvol = MIXER_FX15(1.0f);
+	v->priority = priority;
+	v->ch = -1;
+	v->gen = (v->gen + 1) % (INT32_MAX / MIXER_MAX_VOICES);
+	return v->gen * MIXER_MAX_VOICES + (v - Mixer.voices);
+}
+
+void mixer_voice_set_vol(int voice, float lvol, float rvol) {
+	mixer_voice_t *v = mixer_voice_get(voice);
+	if (!v) return;
+	v->lvol = MIXER_FX15(lvol);
+	v->rvol = MIXER_FX15(rvol);
+	if (v->ch >= 0) {
+		Mixer.lvol[v->ch] = v->lvol;
+		Mixer.rvol[v->ch] = v->rvol;
+	}
+}
+
+void mixer_voice_set_vol_pan(int voice, float vol, float pan) {
+	mixer_voice_set_vol(voice, vol * (1.f - pan), vol * pan);
+}
+
+void mixer_voice_set_freq(int voice, float frequency) {
+	mixer_voice_t *v = mixer_voice_get(voice);
+	if (!v) return;
+	assertf(frequency >= 0, "mixer_voice_set_freq: cannot set negative frequency on voice %d: %f", voice, frequency);
+	v->step = MIXER_FX64(frequency / (float)Mixer.sample_rate);
+	if (v->ch >= 0) {
+		mixer_channel_t *c = &Mixer.channels[v->ch];
+		c->step = v->step << (c->flags & CH_FLAGS_BPS_SHIFT);
+	}
+}
+
+float mixer_voice_get_pos(int voice) {
+	mixer_voice_t *v = mixer_voice_get(voice);
+	if (!v) return 0;
+	mixer_fx64_t pos = v->pos;
+	if (v->ch >= 0) {
+		mixer_channel_t *c = &Mixer.channels[v->ch];
+		pos = mixer_voice_wrap_pos(v->wave, c->pos >> (c->flags & CH_FLAGS_BPS_SHIFT));
+	}
+	return (float)pos / (float)(1<<MIXER_FX64_FRAC);
+}
+
+void mixer_voice_stop(int voice) {
+	mixer_voice_t *v = mixer_voice_get(voice);
+	if (v)
+		mixer_voice_free(v);
+}
+
+bool mixer_voice_playing(int voice) {
+	return mixer_voice_get(voice) != NULL;
+}
+
+int mixer_voice_get_ch(int voice) {
+	mixer_voice_t *v = mixer_voice_get(voice);
+	return v ? v->ch : -1;
+}
+
+#if MIXER_RSP_REFERENCE
+/** @brief Maximum number of samples processed per loop by the ucode (MAX_SAMPLES_PER_LOOP) */
+#define REF_MAX_SAMPLES_PER_LOOP   32
+/** @brief Size of the window of samples fetched by the ucode via DMA (SAMPLE_CACHE_SIZE) */
+#define REF_SAMPLE_CACHE_SIZE      64
+/** @brief One-tap volume filter coefficient (k_alpha, 0.16) */
+#define REF_ALPHA                  0xe076
+/** @brief One-tap volume filter coefficient (k_1malpha, 0.16) */
+#define REF_1MALPHA                0x1f8a
+
+/** @brief Clamp an accumulator value to 16-bit, like the VU does when reading it back */
+static inline int16_t ref_clamp16(int64_t v) {
+	return v < -0x8000 ? -0x8000 : (v > 0x7FFF ? 0x7FFF : v);
+}
+
+/**
+ * @brief C reference of UpdateAndFetch (rsp_mixer.S)
+ *
+ * Resample num_samples samples of each channel into chbuf. Samples are read
+ * through the same 64-byte window that the ucode fetches via DMA: the end of
+ * the waveform is only checked when the window is exhausted, so overreads
+ * past the end of the waveform return the same bytes.
+ */
+static void mixer_ref_update_and_fetch(volatile rsp_mixer_channel_t *wvs, int num_channels,
+	int num_samples, int16_t chbuf[REF_MAX_SAMPLES_PER_LOOP][MIXER_MAX_CHANNELS])
+{
+	memset(chbuf, 0, sizeof(int16_t) * REF_MAX_SAMPLES_PER_LOOP * MIXER_MAX_CHANNELS);
+
+	for (int ch=0; ch<num_channels; ch++) {
+		volatile rsp_mixer_channel_t *wv = &wvs[ch];
+		const uint8_t *addr = wv->ptr;
+		if (!addr)
+			continue;
+
+		uint32_t pos = wv->pos, step = wv->step;
+		uint32_t len = wv->len, loop_len = wv->loop_len;
+		bool stereo = wv->flags & CH_FLAGS_STEREO;
+		bool bit16 = wv->flags & CH_FLAGS_16BIT;
+		int t = 0;
+
+		while (t < num_samples) {
+			// WaveStart: apply the loop, then fetch a new window
+			while (pos >= len) {
+				if (!loop_len)
+					goto epilog;
+				pos -= loop_len;
+			}
+			// DMA transfers are 8-byte aligned: the window starts at the
+			// beginning of the 8-byte line containing the current sample.
+			uint32_t misalign = ((uintptr_t)addr + (pos >> MIXER_FX64_FRAC)) & 7;
+			const uint8_t *cache = addr + (pos >> MIXER_FX64_FRAC) - misalign;
+
+			// Position relative to the start of the window (wv_pos as DMEM pointer)
+			uint32_t pos_to_cache = ((pos >> MIXER_FX64_FRAC) - misalign) << MIXER_FX64_FRAC;
+			uint32_t cpos = pos - pos_to_cache;
+			const int32_t cache_end = REF_SAMPLE_CACHE_SIZE << MIXER_FX64_FRAC;
+
+			for (; t < num_samples && (int32_t)cpos < cache_end; t++) {
+				int16_t *out = &chbuf[t][ch];
+				const uint8_t *s;
+				// 8-bit samples are stored in the high byte; 16-bit samples are big-endian
+				if (!stereo) {
+					if (!bit16) {
+						s = cache + (cpos >> MIXER_FX64_FRAC);
+						out[0] = s[0] << 8;
+					} else {
+						s = cache + ((cpos >> (MIXER_FX64_FRAC+1)) << 1);
+						out[0] = (s[0] << 8) | s[1];
+					}
+				} else {
+					if (!bit16) {
+						s = cache + ((cpos >> (MIXER_FX64_FRAC+1)) << 1);
+						out[0] = s[0] << 8;
+						out[1] = s[1] << 8;
+					} else {
+						s = cache + ((cpos >> (MIXER_FX64_FRAC+2)) << 2);
+						out[0] = (s[0] << 8) | s[1];
+						out[1] = (s[2] << 8) | s[3];
+					}
+				}
+				cpos += step;
+			}
+			pos = cpos + pos_to_cache;
+		}
+
+	epilog:
+		wv->pos = pos;
+		// Stereo waveforms also fill the next channel
+		if (stereo)
+			ch++;
+	}
+}
+
+/**
+ * @brief C reference of Mixer (rsp_mixer.S)
+ *
+ * Mix num_samples samples of chbuf into out (16-bit stereo), and run the
+ * one-tap volume filter every 8 samples. The VU operations are emulated
+ * exactly: VMULF/VMACF round and clamp the weighted sum of each lane once,
+ * lanes are then summed with VADDC (wrapping, no saturation), and the filter
+ * uses VMUDM/VMADM.
+ */
+static void mixer_ref_mix(int16_t *out, int num_samples, int num_channels,
+	int16_t chbuf[REF_MAX_SAMPLES_PER_LOOP][MIXER_MAX_CHANNELS],
+	int16_t chvol[2][MIXER_MAX_CHANNELS], int16_t xvol[2][MIXER_MAX_CHANNELS])
+{
+	// The ucode switches to a single vector (8 channels) when it can
+	int nvol = num_channels <= 8 ? 8 : MIXER_MAX_CHANNELS;
+
+	for (int i=0; i<num_samples; i+=8) {
+		int n = MIN(num_samples-i, 8);
+		for (int j=0; j<n; j++) {
+			const int16_t *samples = chbuf[i+j];
+			for (int lr=0; lr<2; lr++) {
+				uint16_t mix = 0;
+				for (int lane=0; lane<8; lane++) {
+					int64_t acc = 0x8000;
+					for (int k=lane; k<nvol; k+=8)
+						acc += 2 * (int64_t)samples[k] * xvol[lr][k];
+					mix += ref_clamp16(acc >> 16);
+				}
+				*out++ = mix;
+			}
+		}
+
+		for (int lr=0; lr<2; lr++)
+			for (int k=0; k<nvol; k++)
+				xvol[lr][k] = ref_clamp16(((int64_t)xvol[lr][k] * REF_ALPHA +
+					(int64_t)chvol[lr][k] * REF_1MALPHA) >> 16);
+	}
+}
+
+/**
+ * @brief C reference of the mixer ucode (command_exec in rsp_mixer.S)
+ *
+ * This is bit-exact with the RSP, including the way the output buffer is
+ * split in loops (which affects when the volume filter runs).
+ */
+static void mixer_exec_reference(int32_t *out, int num_samples, uint16_t gvol,
+	const int16_t lvol[MIXER_MAX_CHANNELS], const int16_t rvol[MIXER_MAX_CHANNELS],
+	volatile rsp_mixer_settings_t *settings)
+{
+	int16_t chbuf[REF_MAX_SAMPLES_PER_LOOP][MIXER_MAX_CHANNELS];
+	int16_t chvol[2][MIXER_MAX_CHANNELS];
+
+	// SetupMixer: apply the global volume (VMUDL)
+	for (int ch=0; ch<MIXER_MAX_CHANNELS; ch++) {
+		chvol[0][ch] = ((uint32_t)(uint16_t)lvol[ch] * gvol) >> 16;
+		chvol[1][ch] = ((uint32_t)(uint16_t)rvol[ch] * gvol) >> 16;
+	}
+
+	while (num_samples > 0) {
+		// Process one sample less if the output is not 8-byte aligned,
+		// so that the next loop is aligned again.
+		int ns = REF_MAX_SAMPLES_PER_LOOP - (((uintptr_t)out & 7) != 0);
+		ns = MIN(ns, num_samples);
+
+		mixer_ref_update_and_fetch(settings->channels, Mixer.num_channels, ns, chbuf);
+		mixer_ref_mix(UncachedAddr(out), ns, Mixer.num_channels, chbuf, chvol, Mixer.ref_xvol);
+
+		out += ns;
+		num_samples -= ns;
+	}
+}
+#endif /* MIXER_RSP_REFERENCE */
+
 static void mixer_exec(int32_t *out, int num_samples) {
 	if (!Mixer.ch_buf_mem) {
 		// If we have not yet allocated the memory for the sample buffers,
@@ -480,6 +946,9 @@ static void mixer_exec(int32_t *out, int num_samples) {
 		mixer_init_samplebuffers();
 	}
 
+	// Choose which virtual voices are going to be mixed
+	mixer_voices_update();
+
 	tracef("mixer_exec: 0x%x samples\n", num_samples);
 
 	uint32_t fake_loop = 0;
@@ -667,6 +1136,9 @@ static void mixer_exec(int32_t *out, int num_samples) {
 	}
 
 	uint32_t t0 = TICKS_READ();
+	#if MIXER_RSP_REFERENCE
+	mixer_exec_reference(out, num_samples, MIXER_FX16(gvol), lvol, rvol, settings);
+	#else
 	rspq_highpri_begin();
 	rspq_write(__mixer_overlay_id, 0,
 		(((uint32_t)MIXER_FX16(gvol)) & 0xFFFF),
@@ -676,6 +1148,7 @@ static void mixer_exec(int32_t *out, int num_samples) {
 	rspq_highpri_end();
 
 	rspq_highpri_sync();
+	#endif
 
 	__mixer_profile_rsp += TICKS_READ() - t0;
 
@@ -685,6 +1158,8 @@ static void mixer_exec(int32_t *out, int num_samples) {
 			ch->pos += (uint64_t)rsp_wv[i].pos - (uint64_t)(ch->pos & 0x7FFFFFFF);
 	}
 
+	mixer_voices_advance(num_samples);
+
 	Mixer.ticks += num_samples;
 }
 
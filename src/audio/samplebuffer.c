@@ -6,10 +6,15 @@
 
 #include "mixer.h"
 #include "samplebuffer.h"
-#include "n64sys.h"
 #include "n64types.h"
+#ifdef N64
+#include "n64sys.h"
 #include "utils.h"
 #include "debug.h"
+#else
+// Host build (see tools/mixer_render)
+#include "audio_host.h"
+#endif
 #include <string.h>
 
 /** @brief Set to 1 to activate debug logs */
@@ -31,7 +36,7 @@ void samplebuffer_init(samplebuffer_t *buf, uint8_t* uncached_mem, int nbytes) {
 	// that content is committed to RDRAM (not cache).
 	assertf(UncachedAddr(uncached_mem) == uncached_mem, 
 		"specified buffer must be in the uncached segment.\nTry using malloc_uncached() to allocate it");
-	buf->ptr_and_flags = (uint32_t)uncached_mem;
+	buf->ptr_and_flags = (sample_ptr_t)uncached_mem;
 	assert((buf->ptr_and_flags & 7) == 0);
 	buf->size = nbytes;
 	buf->wnext = -1;
@@ -205,7 +210,7 @@ void samplebuffer_discard(samplebuffer_t *buf, int wpos) {
 		// as in general a sample could be used more than once for resampling).
 		uint8_t *src = SAMPLES_PTR(buf) + (idx << SAMPLES_BPS_SHIFT(buf));
 		uint8_t *dst = SAMPLES_PTR(buf);
-		assert(((uint32_t)dst & 7) == 0);
+		assert(((uintptr_t)dst & 7) == 0);
 
 		// Optimized copy of samples. We work on uncached memory directly
 		// so that we don't need to flush, and use only 64-bits ops. We round up
@@ -8,13 +8,19 @@
 #include "wav64internal.h"
 #include "mixer.h"
 #include "mixer_internal.h"
+#include "samplebuffer.h"
+#ifdef N64
 #include "dragonfs.h"
 #include "n64sys.h"
 #include "dma.h"
-#include "samplebuffer.h"
 #include "debug.h"
 #include "utils.h"
 #include "rspq.h"
+#include "audio.h"
+#else
+// Host build (see tools/mixer_render)
+#include "audio_host.h"
+#endif
 #include <stdbool.h>
 #include <string.h>
 #include <assert.h>
@@ -23,17 +29,66 @@
 #include <limits.h>
 #include <stdalign.h>
 
-/** @brief Set to 1 to use the reference C decode for VADPCM */
+/** @brief Set to 1 to use the reference C decode for VADPCM (always used in host builds) */
+#ifdef N64
 #define VADPCM_REFERENCE_DECODER     0
+#else
+#define VADPCM_REFERENCE_DECODER     1
+#endif
 
 /** ID of a standard WAV file */
 #define WAV_RIFF_ID   "RIFF"
 /** ID of a WAVX file (big-endian WAV) */
 #define WAV_RIFX_ID   "RIFX"
 
+/** @brief Default size of the streaming ring buffer (in milliseconds of audio) */
+#define WAV64_STREAM_DEFAULT_MS      500
+/** @brief Minimum size of the streaming ring buffer (in bytes) */
+#define WAV64_STREAM_MIN_SIZE        (16*1024)
+/** @brief Period of the streaming refill event (in milliseconds) */
+#define WAV64_STREAM_REFILL_MS       10
+/** @brief Number of VADPCM frames decoded at once while streaming, when possible */
+#define WAV64_STREAM_DECODE_BATCH    64
+/** @brief Maximum number of DMA chunks buffered in the ring */
+#define WAV64_STREAM_MAX_CHUNKS      16
+/** @brief Number of frames past the end of the waveform read before following the loop */
+#define WAV64_STREAM_OVERREAD        2
+
 /** @brief Profile of DMA usage by WAV64, used for debugging purposes. */
 int64_t __wav64_profile_dma = 0;
 
+/** @brief A contiguous run of VADPCM frames read from ROM into the ring buffer */
+typedef struct {
+	uint64_t pos;           ///< Position of the first frame in the ring (byte counter)
+	uint32_t frame;         ///< Index of the first frame in the waveform
+	int nframes;            ///< Number of frames
+} wav64_stream_chunk_t;
+
+/**
+ * @brief Streaming state of a VADPCM waveform (see #wav64_set_streaming)
+ *
+ * Positions in the ring buffer are kept as ever-increasing byte counters
+ * (modulo the size gives the offset). The ring is split in three areas:
+ * [done, rd) has been consumed by the decoder but might still be in use by
+ * RSP commands in flight, [rd, wr) holds the chunks still to decode, and the
+ * rest is free.
+ */
+typedef struct {
+	uint8_t *buf;           ///< Ring buffer (uncached)
+	int size;               ///< Size of the ring buffer in bytes
+	uint64_t wr;            ///< Write counter
+	uint64_t rd;            ///< Read counter
+	uint64_t done;          ///< Counter of bytes released by the RSP
+	uint32_t wr_frame;      ///< Next frame of the waveform to read into the ring
+	int level;              ///< Number of frames buffered in the ring
+	wav64_stream_chunk_t chunks[WAV64_STREAM_MAX_CHUNKS]; ///< FIFO of chunks in the ring
+	int chunk_head;         ///< Index of the first chunk in the FIFO
+	int num_chunks;         ///< Number of chunks in the FIFO
+	bool dma_pending;       ///< True if the last chunk might still be in transfer
+	int min_level;          ///< Minimum number of bytes found in the ring (see #wav64_stream_stats_t)
+	int underruns;          ///< Number of underruns (see #wav64_stream_stats_t)
+} wav64_stream_t;
+
 #if VADPCM_REFERENCE_DECODER
 /** @brief VADPCM decoding errors */
 typedef enum {
@@ -167,48 +222,224 @@ static void waveform_read(void *ctx, samplebuffer_t *sbuf, int wpos, int wlen, b
 	raw_waveform_read(sbuf, wav->rom_addr, wpos, wlen, bps);
 }
 
-static void waveform_vadpcm_read(void *ctx, samplebuffer_t *sbuf, int wpos, int wlen, bool seeking) {
-	wav64_t *wav = (wav64_t*)ctx;
-	wav64_header_vadpcm_t *vhead = (wav64_header_vadpcm_t*)wav->ext;
+/** @brief Check if the PI is busy with a DMA or I/O transfer */
+static bool wav64_pi_busy(void) {
+	#ifdef N64
+	return *PI_STATUS & 3;
+	#else
+	return false;
+	#endif
+}
 
-	if (seeking) {
-		if (wpos == 0) {
-			memset(&vhead->state, 0, sizeof(vhead->state));
-			vhead->current_rom_addr = wav->rom_addr;
-		} else {
-			assertf(wpos == wav->wave.len - wav->wave.loop_len,
-				"wav64: seeking to %x not supported (%x %x)\n", wpos, wav->wave.len, wav->wave.loop_len);
-			memcpy(&vhead->state, &vhead->loop_state, sizeof(vhead->state));
-			vhead->current_rom_addr = wav->rom_addr + (wav->wave.len - wav->wave.loop_len) / 16 * 9;
+// Frame at which the readahead follows the loop (or stops, if not looping)
+static uint32_t stream_end_frame(wav64_t *wav) {
+	return (wav->wave.len + 15) / 16 + WAV64_STREAM_OVERREAD;
+}
+
+// Return the next frame to read into the ring, following the loop.
+static uint32_t stream_next_frame(wav64_t *wav, wav64_stream_t *s) {
+	if (wav->wave.loop_len && s->wr_frame == stream_end_frame(wav))
+		s->wr_frame = (wav->wave.len - wav->wave.loop_len) / 16;
+	return s->wr_frame;
+}
+
+// Read up to maxframes frames starting at the specified one into the ring as
+// a new chunk. Returns the number of frames read, which is 0 if there is no
+// space left.
+static int stream_push(wav64_t *wav, wav64_stream_t *s, uint32_t frame, int maxframes, bool async) {
+	int fs = 9 * wav->wave.channels;
+	if (s->num_chunks == WAV64_STREAM_MAX_CHUNKS)
+		return 0;
+
+	uint32_t rom_addr = wav->rom_addr + frame * fs;
+
+	// PI DMA requires RAM and ROM addresses to have the same parity, so skip
+	// a byte if needed. Frames are not split across the end of the ring.
+	int off = s->wr % s->size;
+	int pad = (off ^ rom_addr) & 1;
+	if (off + pad + fs > s->size)
+		pad = s->size - off + (rom_addr & 1);
+	int avail = s->size - (int)(s->wr - s->done) - pad;
+	if (avail < fs)
+		return 0;
+	off = (off + pad) % s->size;
+
+	int n = MIN(maxframes, MIN(avail, s->size - off) / fs);
+	uint32_t end = stream_end_frame(wav);
+	if (frame < end)
+		n = MIN(n, end - frame);
+
+	uint32_t t0 = TICKS_READ();
+	if (async) {
+		dma_read_async(s->buf + off, rom_addr, n * fs);
+		s->dma_pending = true;
+	} else {
+		dma_read(s->buf + off, rom_addr, n * fs);
+		s->dma_pending = false;
+	}
+	__wav64_profile_dma += TICKS_READ() - t0;
+
+	int idx = (s->chunk_head + s->num_chunks++) % WAV64_STREAM_MAX_CHUNKS;
+	s->chunks[idx] = (wav64_stream_chunk_t){ .pos = s->wr + pad, .frame = frame, .nframes = n };
+	s->wr += pad + n * fs;
+	s->wr_frame = frame + n;
+	s->level += n;
+	return n;
+}
+
+// Drop the first chunk of the ring
+static void stream_pop(wav64_stream_t *s) {
+	s->level -= s->chunks[s->chunk_head].nframes;
+	s->chunk_head = (s->chunk_head + 1) % WAV64_STREAM_MAX_CHUNKS;
+	s->num_chunks--;
+	s->rd = s->num_chunks ? s->chunks[s->chunk_head].pos : s->wr;
+}
+
+// Start a background read if the PI is idle and enough space was released
+static void stream_refill(wav64_t *wav, wav64_stream_t *s) {
+	if (wav64_pi_busy())
+		return;
+	s->dma_pending = false;
+
+	// Wait for a good portion of the ring to be free, to do fewer and larger
+	// transfers. Without a loop, stop at the end of the waveform.
+	if (s->size - (int)(s->wr - s->done) < s->size / 4)
+		return;
+	uint32_t frame = stream_next_frame(wav, s);
+	if (frame >= stream_end_frame(wav))
+		return;
+	stream_push(wav, s, frame, INT_MAX, true);
+}
+
+// Get the compressed data for up to *nframes frames starting at the specified
+// frame, and consume them from the ring. *nframes is updated with the number
+// of frames returned, which are contiguous in memory. Returns NULL if the ring
+// is full of data that the RSP might still be reading: the caller must wait
+// for the RSP, release it, and try again.
+static void* stream_fetch(wav64_t *wav, wav64_stream_t *s, uint32_t frame, int *nframes, bool seeking) {
+	int fs = 9 * wav->wave.channels;
+
+	// Skip buffered frames up to the requested one. This happens when the
+	// mixer goes back to the loop start before reading all the overread,
+	// while any other seek just empties the ring.
+	while (s->num_chunks) {
+		wav64_stream_chunk_t *c = &s->chunks[s->chunk_head];
+		if (frame >= c->frame && frame < c->frame + c->nframes) {
+			int skip = frame - c->frame;
+			c->frame += skip;
+			c->pos += skip * fs;
+			c->nframes -= skip;
+			s->level -= skip;
+			s->rd = c->pos;
+			break;
 		}
+		stream_pop(s);
 	}
 
-	wlen = ROUND_UP(wlen, 32);
-	if (wlen == 0) return;
+	bool restarted = false;
+	if (!s->num_chunks) {
+		// If the readahead was going to read this frame next, it was too slow
+		// and this is an underrun. Otherwise, it is a seek.
+		uint32_t next = stream_next_frame(wav, s);
+		if (!stream_push(wav, s, frame, *nframes, false))
+			return NULL;
+		if (frame == next && frame < stream_end_frame(wav) && !seeking)
+			s->underruns++;
+		restarted = frame != next;
+	}
+
+	wav64_stream_chunk_t *c = &s->chunks[s->chunk_head];
+	if (s->dma_pending && s->num_chunks == 1) {
+		dma_wait();
+		s->dma_pending = false;
+	}
+
+	int n = MIN(*nframes, c->nframes);
+	void *src = s->buf + c->pos % s->size;
+	c->frame += n;
+	c->pos += n * fs;
+	c->nframes -= n;
+	s->level -= n;
+	s->rd = c->pos;
+	if (!c->nframes)
+		stream_pop(s);
+
+	// Without a loop, the ring naturally drains at the end of the waveform
+	if (!seeking && !restarted && stream_next_frame(wav, s) < stream_end_frame(wav))
+		s->min_level = MIN(s->min_level, s->level * fs);
+	*nframes = n;
+	return src;
+}
 
+// Mixer event that keeps the ring buffer filled
+static int stream_event(void *ctx) {
+	wav64_t *wav = (wav64_t*)ctx;
+	wav64_stream_t *s = (wav64_stream_t*)wav->stream;
+
+	// Events run after mixer_exec waited for the RSP, so all the data
+	// consumed so far has been decoded.
+	s->done = s->rd;
+	stream_refill(wav, s);
+	return audio_get_frequency() * WAV64_STREAM_REFILL_MS / 1000;
+}
+
+// Decode the next wlen samples (a multiple of 16) of a VADPCM waveform,
+// appending them to the sample buffer.
+static void waveform_vadpcm_decode(wav64_t *wav, samplebuffer_t *sbuf, int wlen, bool seeking) {
+	wav64_header_vadpcm_t *vhead = (wav64_header_vadpcm_t*)wav->ext;
+	wav64_stream_t *stream = (wav64_stream_t*)wav->stream;
+	int fs = 9 * wav->wave.channels;
+
+	#if !VADPCM_REFERENCE_DECODER
 	bool highpri = false;
+	#endif
 	while (wlen > 0) {
 		int nframes = wlen / 16;
-		// Most of the code here would be ready to loop over multiple blocks of
-		// 256 frames, but the problem is that we don't doublebuffer the RDRAM
-		// buffers, so the RSP doesn't get to process the data in time. This
-		// would require CPU-spinning here. Since it's a very rare case, just
-		// block it for now.
-		assert(nframes <= 256);
-		nframes = MIN(nframes, 256);
-
-		// Acquire destination buffer from the sample buffer
-		int16_t *dest = (int16_t*)samplebuffer_append(sbuf, nframes*16);
-
-		// Calculate source pointer at the end of the destination buffer.
-		// VADPCM decoding can be safely made in-place, so no auxillary buffer
-		// is necessary.
-		int src_bytes = 9 * nframes * wav->wave.channels;
-		void *src = (void*)dest + ((nframes*16) << SAMPLES_BPS_SHIFT(sbuf)) - src_bytes;
-
-		// Fetch compressed data
-		dma_read(src, vhead->current_rom_addr, src_bytes);
-		vhead->current_rom_addr += src_bytes;
+		int16_t *dest;
+		void *src;
+
+		if (stream) {
+			// Compressed data comes from the ring buffer, so there is no
+			// limit other than the size of a RSP command.
+			nframes = MIN(nframes, 256);
+			uint32_t frame = (vhead->current_rom_addr - wav->rom_addr) / fs;
+			src = stream_fetch(wav, stream, frame, &nframes, seeking);
+			if (!src) {
+				// Wait for the RSP to finish decoding what was queued so far,
+				// so that the whole ring can be reused.
+				#if !VADPCM_REFERENCE_DECODER
+				if (highpri) {
+					rspq_highpri_end();
+					highpri = false;
+				}
+				rspq_highpri_sync();
+				#endif
+				stream->done = stream->rd;
+				src = stream_fetch(wav, stream, frame, &nframes, seeking);
+				assert(src);
+			}
+			dest = (int16_t*)samplebuffer_append(sbuf, nframes*16);
+		} else {
+			// Most of the code here would be ready to loop over multiple blocks of
+			// 256 frames, but the problem is that we don't doublebuffer the RDRAM
+			// buffers, so the RSP doesn't get to process the data in time. This
+			// would require CPU-spinning here. Since it's a very rare case, just
+			// block it for now.
+			assert(nframes <= 256);
+			nframes = MIN(nframes, 256);
+
+			// Acquire destination buffer from the sample buffer
+			dest = (int16_t*)samplebuffer_append(sbuf, nframes*16);
+
+			// Calculate source pointer at the end of the destination buffer.
+			// VADPCM decoding can be safely made in-place, so no auxillary buffer
+			// is necessary.
+			src = (void*)dest + ((nframes*16) << SAMPLES_BPS_SHIFT(sbuf)) - nframes * fs;
+
+			// Fetch compressed data
+			dma_read(src, vhead->current_rom_addr, nframes * fs);
+		}
+		vhead->current_rom_addr += nframes * fs;
 
 		#if VADPCM_REFERENCE_DECODER
 		if (wav->wave.channels == 1) {
@@ -235,6 +466,11 @@ static void waveform_vadpcm_read(void *ctx, samplebuffer_t *sbuf, int wpos, int
 				}
 			}
 		}
+		#ifndef N64
+		// Sample buffers hold big-endian samples, as on the console
+		for (int i=0; i<nframes*16*wav->wave.channels; i++)
+			dest[i] = HOST_TO_BE16(dest[i]);
+		#endif
 		#else
 		// Switch to highpri as late as possible
 		if (!highpri) {
@@ -247,8 +483,73 @@ static void waveform_vadpcm_read(void *ctx, samplebuffer_t *sbuf, int wpos, int
 		wlen -= 16*nframes;
 	}
 
+	#if !VADPCM_REFERENCE_DECODER
 	if (highpri)
 		rspq_highpri_end();
+	#endif
+
+	if (stream)
+		stream_refill(wav, stream);
+}
+
+static void waveform_vadpcm_read(void *ctx, samplebuffer_t *sbuf, int wpos, int wlen, bool seeking) {
+	wav64_t *wav = (wav64_t*)ctx;
+	wav64_header_vadpcm_t *vhead = (wav64_header_vadpcm_t*)wav->ext;
+
+	if (seeking) {
+		// The decoder state is only known at the start and at the loop point,
+		// so restart from the closest of the two.
+		int loop_pos = wav->wave.len - wav->wave.loop_len;
+		int restart_pos = 0;
+		if (wav->wave.loop_len && wpos >= loop_pos) {
+			restart_pos = loop_pos;
+			memcpy(&vhead->state, &vhead->loop_state, sizeof(vhead->state));
+			vhead->current_rom_addr = wav->rom_addr + loop_pos / 16 * 9 * wav->wave.channels;
+		} else {
+			memset(&vhead->state, 0, sizeof(vhead->state));
+			vhead->current_rom_addr = wav->rom_addr;
+		}
+
+		// VADPCM frames can only be decoded in sequence. To seek anywhere
+		// else (eg: when the mixer resumes a virtual voice), decode and
+		// throw away all the frames before the one containing wpos, using
+		// the (just flushed) sample buffer as scratch space. Then, rewind
+		// the buffer position to the start of the frame.
+		int frame_pos = wpos & ~15;
+		if (frame_pos != wpos || frame_pos > restart_pos) {
+			assertf(sbuf->widx == 0, "wav64 %s: seeking to %x on a non-empty sample buffer", wav->wave.name, wpos);
+			int buf_wpos = sbuf->wpos - (wpos - frame_pos);
+			int skip = frame_pos - restart_pos;
+			int chunk = MIN(sbuf->size & ~15, 256*16);
+			while (skip > 0) {
+				int n = MIN(skip, chunk);
+				waveform_vadpcm_decode(wav, sbuf, n, true);
+				#if !VADPCM_REFERENCE_DECODER
+				// The next chunk is going to reuse the same memory
+				rspq_highpri_sync();
+				#endif
+				samplebuffer_flush(sbuf);
+				skip -= n;
+			}
+			sbuf->wpos = buf_wpos;
+			wlen += wpos - frame_pos;
+			wpos = frame_pos;
+		}
+	}
+
+	if (wav->stream && wlen > 0) {
+		// Decode in larger batches while streaming, as long as the samples
+		// fit the sample buffer and do not cross the end of the waveform
+		// (where the mixer follows the loop).
+		int space = sbuf->size - (sbuf->widx - sbuf->ridx) - 4;
+		int batch = MIN(WAV64_STREAM_DECODE_BATCH*16, MIN(space, wav->wave.len - wpos)) & ~31;
+		wlen = MAX(wlen, batch);
+	}
+
+	wlen = ROUND_UP(wlen, 32);
+	if (wlen == 0) return;
+
+	waveform_vadpcm_decode(wav, sbuf, wlen, false);
 }
 
 void wav64_open(wav64_t *wav, const char *fn) {
@@ -267,6 +568,13 @@ void wav64_open(wav64_t *wav, const char *fn) {
 
 	wav64_header_t head = {0};
 	dfs_read(&head, 1, sizeof(head), fh);
+	#ifndef N64
+	// The header is big-endian
+	head.freq = BE32_TO_HOST(head.freq);
+	head.len = BE32_TO_HOST(head.len);
+	head.loop_len = BE32_TO_HOST(head.loop_len);
+	head.start_offset = BE32_TO_HOST(head.start_offset);
+	#endif
 	if (memcmp(head.id, WAV64_ID, 4) != 0) {
 		assertf(memcmp(head.id, WAV_RIFF_ID, 4) != 0 && memcmp(head.id, WAV_RIFX_ID, 4) != 0,
 			"wav64 %s: use audioconv64 to convert to wav64 format", fn);
@@ -300,6 +608,15 @@ void wav64_open(wav64_t *wav, const char *fn) {
 		void *ext = malloc_uncached(sizeof(vhead) + codebook_size);
 		memcpy(ext, &vhead, sizeof(vhead));
 		dfs_read(ext + sizeof(vhead), 1, codebook_size, fh);
+		#ifndef N64
+		// Convert the decoder state and the codebook from big-endian
+		wav64_header_vadpcm_t *vh = ext;
+		vh->current_rom_addr = BE32_TO_HOST(vh->current_rom_addr);
+		int16_t *v = (int16_t*)vh->loop_state;
+		int nv = (sizeof(vhead.loop_state) + sizeof(vhead.state) + codebook_size) / sizeof(int16_t);
+		for (int i=0; i<nv; i++)
+			v[i] = BE16_TO_HOST(v[i]);
+		#endif
 		wav->ext = ext;
 		wav->wave.read = waveform_vadpcm_read;
 		wav->wave.ctx = wav;
@@ -335,6 +652,42 @@ void wav64_set_loop(wav64_t *wav, bool loop) {
 		wav->wave.loop_len -= 1;
 }
 
+void wav64_set_streaming(wav64_t *wav, int buffer_size) {
+	assertf(wav->format == WAV64_FORMAT_VADPCM, "wav64 %s: streaming is only supported for VADPCM files", wav->wave.name);
+	assertf(!wav->stream, "wav64 %s: streaming already enabled", wav->wave.name);
+
+	int fs = 9 * wav->wave.channels;
+	if (buffer_size == 0)
+		buffer_size = (int)(wav->wave.frequency * WAV64_STREAM_DEFAULT_MS / 1000) / 16 * fs;
+	buffer_size = ROUND_UP(MAX(buffer_size, WAV64_STREAM_MIN_SIZE), 16);
+
+	wav64_stream_t *s = malloc(sizeof(wav64_stream_t));
+	memset(s, 0, sizeof(wav64_stream_t));
+	s->buf = malloc_uncached(buffer_size);
+	s->size = buffer_size;
+	s->min_level = buffer_size;
+	wav->stream = s;
+
+	// Fill the ring now, so that the playback does not start with an underrun
+	uint32_t frame;
+	while ((frame = stream_next_frame(wav, s)) < stream_end_frame(wav) && stream_push(wav, s, frame, INT_MAX, false)) {}
+	mixer_add_event(0, stream_event, wav);
+}
+
+void wav64_get_stream_stats(wav64_t *wav, wav64_stream_stats_t *stats, bool reset) {
+	wav64_stream_t *s = (wav64_stream_t*)wav->stream;
+	assertf(s, "wav64 %s: streaming is not enabled", wav->wave.name);
+
+	stats->buffer_size = s->size;
+	stats->min_level = s->min_level;
+	stats->min_level_ms = (float)s->min_level / (9 * wav->wave.channels) * 16 * 1000 / wav->wave.frequency;
+	stats->underruns = s->underruns;
+	if (reset) {
+		s->min_level = s->size;
+		s->underruns = 0;
+	}
+}
+
 int wav64_get_bitrate(wav64_t *wav) {
 	if (wav->ext) {
 		switch (wav->format) {
@@ -347,6 +700,16 @@ int wav64_get_bitrate(wav64_t *wav) {
 
 void wav64_close(wav64_t *wav)
 {
+	if (wav->stream) {
+		wav64_stream_t *s = (wav64_stream_t*)wav->stream;
+		mixer_remove_event(stream_event, wav);
+		// A background read might still be writing into the ring
+		if (s->dma_pending)
+			dma_wait();
+		free_uncached(s->buf);
+		free(s);
+		wav->stream = NULL;
+	}
 	if (wav->ext) {
 		switch (wav->format) {
 		case WAV64_FORMAT_VADPCM:
@@ -4,7 +4,14 @@
  * @ingroup mixer
  */
 
+#ifdef N64
 #include <libdragon.h>
+#else
+// Host build (see tools/mixer_render)
+#include "audio_host.h"
+#include "mixer.h"
+#include "xm64.h"
+#endif
 #include "wav64internal.h"
 #include "asset_internal.h"
 #include "libxm/xm.h"
@@ -16,6 +23,21 @@ static void wave_read(void *ctx, samplebuffer_t *sbuf, int wpos, int wlen, bool
 	raw_waveform_read(sbuf, samp->data8_offset, wpos, wlen, samp->bits >> 4);
 }
 
+/** @brief Size of the RAM buffer used to stream the baked tick stream */
+#define XM64_TICKS_BUFFER_SIZE      512
+
+/** @brief Reader of the baked tick stream (see audioconv64 --xm-bake-ticks) */
+typedef struct {
+	uint32_t base;            ///< File offset of the stream
+	uint32_t offset;          ///< File offset of the next byte to read into the buffer
+	int pos, end;             ///< Valid range of bytes in the buffer
+	int jumps;                ///< Number of jumps done so far (to detect the end of the stream)
+	float ch_pos[32];         ///< Sample position of each channel to apply to the mixer in this tick
+	uint16_t vol[32];         ///< Current volume of each channel (stream units, see XM_TICK_CH_VOL)
+	uint16_t pan[32];         ///< Current panning of each channel (stream units, see XM_TICK_CH_PAN)
+	uint8_t buf[XM64_TICKS_BUFFER_SIZE];  ///< Stream buffer
+} xm64_ticks_t;
+
 static int tick(void *arg) {
 	xm64player_t *xmp = (xm64player_t*)arg;
 	xm_context_t *ctx = xmp->ctx;
@@ -87,6 +109,247 @@ static int tick(void *arg) {
 	// Schedule next tick according to the number of samples in this tick.
 	int delay = ceilf(ctx->remaining_samples_in_tick);
 	ctx->remaining_samples_in_tick -= delay;
+	ctx->generated_samples += delay;
+	return delay;
+}
+
+static void ticks_refill(xm64player_t *xmp, xm64_ticks_t *t) {
+	int left = t->end - t->pos;
+	memmove(t->buf, t->buf + t->pos, left);
+	fseek(xmp->fh, t->offset, SEEK_SET);
+	int n = fread(t->buf + left, 1, XM64_TICKS_BUFFER_SIZE - left, xmp->fh);
+	t->offset += n;
+	t->pos = 0;
+	t->end = left + n;
+}
+
+static void ticks_jump(xm64player_t *xmp, xm64_ticks_t *t, uint32_t offset) {
+	t->offset = t->base + offset;
+	t->pos = t->end = 0;
+}
+
+/** @brief Rewind the tick stream, resetting the player state to the beginning of the song */
+static void ticks_rewind(xm64player_t *xmp, xm64_ticks_t *t) {
+	xm_context_t *ctx = xmp->ctx;
+	ticks_jump(xmp, t, 0);
+	ctx->current_table_index = 0;
+	ctx->current_row = 0;
+	ctx->bpm = ctx->module.bpm;
+	for (int i=0;i<ctx->module.num_channels;i++) {
+		xm_channel_context_t *ch = &ctx->channels[i];
+		ch->instrument = NULL;
+		ch->sample = NULL;
+		ch->frequency = 0;
+		ch->actual_volume[0] = ch->actual_volume[1] = 0;
+		t->vol[i] = t->pan[i] = 0;
+	}
+}
+
+/** @brief Compute the volumes of a channel from the volume and panning in the stream */
+static void ticks_update_vol(xm64player_t *xmp, xm64_ticks_t *t, int i) {
+	xm_channel_context_t *ch = &xmp->ctx->channels[i];
+	// Same panning law of libxm. In baked mode, actual_volume also includes
+	// the global volume.
+	float vol = t->vol[i] * (1.0f / 65535.0f);
+	float pan = t->pan[i] * (1.0f / 65535.0f);
+	ch->actual_volume[0] = vol * sqrtf(1.0f - pan);
+	ch->actual_volume[1] = vol * sqrtf(pan);
+}
+
+static inline uint16_t ticks_u16(const uint8_t *p) { return (p[0] << 8) | p[1]; }
+static inline uint32_t ticks_u32(const uint8_t *p) { return (ticks_u16(p) << 16) | ticks_u16(p+2); }
+
+static inline uint32_t ticks_var(uint8_t **p) {
+	uint32_t v = 0;
+	for (int shift = 0; ; shift += 7) {
+		uint8_t b = *(*p)++;
+		v |= (uint32_t)(b & 0x7F) << shift;
+		if (!(b & 0x80)) return v;
+	}
+}
+
+/** @brief Apply a delta (zigzag varint) to a value of the stream */
+static inline uint32_t ticks_delta(uint8_t **p, uint32_t last) {
+	uint32_t z = ticks_var(p);
+	return last + ((z >> 1) ^ -(z & 1));
+}
+
+static uint8_t ticks_peek(xm64player_t *xmp, xm64_ticks_t *t) {
+	if (t->end - t->pos < XM_TICK_MAX_OP_SIZE)
+		ticks_refill(xmp, t);
+	return t->buf[t->pos];
+}
+
+/**
+ * @brief Process one tick of the baked tick stream
+ *
+ * The player state in the libxm context (position, BPM and channels) is
+ * updated, so that it can be queried as usual. If silent is false, the new
+ * sample positions are also stored in t->ch_pos, and the effect callback is
+ * called, like xm_tick() would do.
+ *
+ * @return Number of samples to generate for this tick
+ */
+static int ticks_process(xm64player_t *xmp, xm64_ticks_t *t, bool silent) {
+	xm_context_t *ctx = xmp->ctx;
+
+	while (1) {
+		uint8_t op = ticks_peek(xmp, t);
+		uint8_t *p = t->buf + t->pos + 1;
+
+		switch (op) {
+		case XM_TICK_OP_END:
+			t->pos++;
+			ctx->remaining_samples_in_tick += (float)ctx->rate / ((float)ctx->bpm * 0.4f);
+			int delay = ceilf(ctx->remaining_samples_in_tick);
+			ctx->remaining_samples_in_tick -= delay;
+			ctx->generated_samples += delay;
+			return delay;
+		case XM_TICK_OP_ROW:
+			ctx->current_table_index = p[0];
+			ctx->current_row = p[1];
+			p += 2;
+			break;
+		case XM_TICK_OP_BPM:
+			ctx->bpm = ticks_u16(p);
+			p += 2;
+			break;
+		case XM_TICK_OP_LOOP:
+			ctx->loop_count++;
+			break;
+		case XM_TICK_OP_JUMP:
+			ticks_jump(xmp, t, ticks_u32(p));
+			t->jumps++;
+			continue;
+		default: {
+			static const uint8_t short_flags[] = XM_TICK_SHORT_FLAGS;
+			int kind = (op - XM_TICK_OP_CHANNEL_SHORT) >> 5;
+			assertf(op >= XM_TICK_OP_CHANNEL && kind < (int)sizeof(short_flags), "invalid XM64 tick stream opcode: %02x", op);
+			int i = op & 0x1F;
+			xm_channel_context_t *ch = &ctx->channels[i];
+			uint8_t flags = kind < 0 ? *p++ : short_flags[kind];
+
+			if (flags & XM_TICK_CH_SAMPLE) {
+				if (p[0]) {
+					ch->instrument = &ctx->module.instruments[p[0]-1];
+					ch->sample = &ch->instrument->samples[p[1]];
+				} else {
+					ch->instrument = NULL;
+					ch->sample = NULL;
+				}
+				p += 2;
+			}
+			if (flags & XM_TICK_CH_POS) {
+				float pos = (float)ticks_var(&p) - 1;
+				if (!silent) t->ch_pos[i] = pos;
+			}
+			if (flags & XM_TICK_CH_FREQ) {
+				uint32_t v;
+				memcpy(&v, &ch->frequency, 4);
+				v = ticks_delta(&p, v);
+				memcpy(&ch->frequency, &v, 4);
+			}
+			if (flags & XM_TICK_CH_VOL)
+				t->vol[i] = ticks_delta(&p, t->vol[i]);
+			if (flags & XM_TICK_CH_PAN)
+				t->pan[i] = ticks_delta(&p, t->pan[i]);
+			if (flags & (XM_TICK_CH_VOL | XM_TICK_CH_PAN))
+				ticks_update_vol(xmp, t, i);
+			if (flags & XM_TICK_CH_EFFECT) {
+				if (!silent && ctx->effect_callback)
+					ctx->effect_callback(ctx->effect_callback_ctx, i, p[0], p[1]);
+				p += 2;
+			}
+		}	break;
+		}
+
+		t->pos = p - t->buf;
+	}
+}
+
+/**
+ * @brief Seek the baked tick stream to the specified position
+ *
+ * The stream is replayed silently from the beginning until the requested
+ * row is about to be played. If the row is never reached, playback restarts
+ * from the beginning.
+ */
+static void ticks_seek(xm64player_t *xmp, xm64_ticks_t *t, int patidx, int row, int tick) {
+	xm_context_t *ctx = xmp->ctx;
+	uint8_t loop_count = ctx->loop_count;
+	uint64_t generated_samples = ctx->generated_samples;
+
+	ticks_rewind(xmp, t);
+	int jumps = t->jumps;
+	while (t->jumps == jumps) {
+		// A tick that starts a new row always begins with a ROW opcode
+		// (possibly preceded by LOOP).
+		uint8_t op = ticks_peek(xmp, t);
+		bool new_row = op == XM_TICK_OP_ROW || op == XM_TICK_OP_LOOP || op == XM_TICK_OP_JUMP;
+		if (new_row && ctx->current_table_index == patidx && ctx->current_row == row)
+			break;
+		ticks_process(xmp, t, true);
+	}
+
+	if (t->jumps != jumps)
+		ticks_rewind(xmp, t);
+	else {
+		for (int i=0;i<tick;i++)
+			ticks_process(xmp, t, true);
+	}
+
+	// Like xm_seek(), do not reset the loop count and the playback time
+	ctx->loop_count = loop_count;
+	ctx->generated_samples = generated_samples;
+	ctx->remaining_samples_in_tick = 0;
+}
+
+static int tick_baked(void *arg) {
+	xm64player_t *xmp = (xm64player_t*)arg;
+	xm_context_t *ctx = xmp->ctx;
+	xm64_ticks_t *t = xmp->ticks;
+	int first_ch = xmp->first_ch;
+
+	for (int i=0;i<ctx->module.num_channels;i++)
+		t->ch_pos[i] = mixer_ch_get_pos(first_ch+i);
+
+	// If we're requested to stop playback, do it.
+	if (!xmp->playing || (!xmp->looping && ctx->loop_count > 0)) {
+		for (int i=0;i<ctx->module.num_channels;i++)
+			mixer_ch_stop(xmp->first_ch+i);
+		xmp->playing = false;
+		// Do not reschedule again
+		return 0;
+	}
+
+	if (xmp->seek.patidx >= 0) {
+		ticks_seek(xmp, t, xmp->seek.patidx, xmp->seek.row, xmp->seek.tick);
+		xmp->seek.patidx = -1;
+		for (int i=0;i<ctx->module.num_channels;i++)
+			mixer_ch_stop(first_ch+i);
+	}
+
+	assert(ctx->remaining_samples_in_tick <= 0);
+	int delay = ticks_process(xmp, t, false);
+
+	// Configure the mixer exactly like tick() does after xm_tick(), so that
+	// the output is the same of the non-baked player. In baked mode,
+	// actual_volume already includes the global volume.
+	for (int i=0;i<ctx->module.num_channels;i++) {
+		xm_channel_context_t *ch = &ctx->channels[i];
+		if (ch->sample) {
+			bool muted = ch->muted || ch->instrument->muted;
+			mixer_ch_play(first_ch+i, ch->sample->wave);
+			mixer_ch_set_pos(first_ch+i, t->ch_pos[i]);
+			mixer_ch_set_freq(first_ch+i, ch->frequency);
+			mixer_ch_set_vol(first_ch+i,
+				muted ? 0 : ctx->amplification * ch->actual_volume[0],
+				muted ? 0 : ctx->amplification * ch->actual_volume[1]);
+		} else {
+			mixer_ch_stop(first_ch+i);
+		}
+	}
+
 	return delay;
 }
 
@@ -101,7 +364,8 @@ void xm64player_open(xm64player_t *player, const char *fn) {
 	// Load the XM context
 	int sample_rate = audio_get_frequency();
 	assertf(sample_rate >= 0, "audio_init() and mixer_init() must be called before xm64player_open()");
-	int err = xm_context_load(&player->ctx, player->fh, sample_rate);
+	uint32_t ticks_offset;
+	int err = xm_context_load(&player->ctx, player->fh, sample_rate, &ticks_offset);
 	if (err != 0) {
 		if (err == 2) {
 			assertf(0, "error loading XM64 file: %s\nMemory size estimation by audioconv64 was wrong\n", fn);
@@ -160,6 +424,16 @@ void xm64player_open(xm64player_t *player, const char *fn) {
 		}
 	}
 
+	// If the file contains a baked tick stream, prepare to read it
+	if (ticks_offset) {
+		xm64_ticks_t *t = malloc(sizeof(xm64_ticks_t));
+		assert(t);
+		memset(t, 0, sizeof(xm64_ticks_t));
+		t->base = ticks_offset;
+		ticks_jump(player, t, 0);
+		player->ticks = t;
+	}
+
 	// By default XM64 files loop
 	player->looping = true;
 }
@@ -189,7 +463,7 @@ void xm64player_play(xm64player_t *player, int first_ch) {
 				mixer_ch_set_limits(first_ch+i, 0, 1e9, player->ctx->ctx_size_stream_sample_buf[i]);
 		}
 
-		mixer_add_event(0, tick, player);
+		mixer_add_event(0, player->ticks ? tick_baked : tick, player);
 		player->first_ch = first_ch;
 		player->playing = true;
 	}
@@ -240,7 +514,7 @@ void xm64player_close(xm64player_t *player) {
 	// This is not correct and may crash.
 	disable_interrupts();
 	if (player->playing) {
-		mixer_remove_event(tick, player);
+		mixer_remove_event(player->ticks ? tick_baked : tick, player);
 		player->playing = false;
 	}
 	for (int i=0;i<player->ctx->module.num_channels;i++) {
@@ -261,6 +535,11 @@ void xm64player_close(xm64player_t *player) {
 		player->waves = NULL;
 	}
 
+	if (player->ticks) {
+		free(player->ticks);
+		player->ticks = NULL;
+	}
+
 	if (player->ctx) {
 		xm_free_context(player->ctx);
 		player->ctx = NULL;
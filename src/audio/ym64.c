@@ -8,9 +8,14 @@
 #include "ay8910.h"
 #include "../compress/lzh5_internal.h"
 #include "samplebuffer.h"
-#include "debug.h"
 #include "asset_internal.h"
+#ifdef N64
+#include "debug.h"
 #include "utils.h"
+#else
+// Host build (see tools/mixer_render)
+#include "audio_host.h"
+#endif
 #include <assert.h>
 #include <string.h>
 #include <stdio.h>
@@ -95,6 +100,11 @@ static void ym_wave_read(void *ctx, samplebuffer_t *sbuf, int wpos, int wlen, bo
 		// Generate the required number of samples, and store them into the
 		// sample buffer.
 		ay8910_gen(&player->ay, out, samples_per_frame);
+		#ifndef N64
+		// Sample buffers hold big-endian samples, as on the console
+		for (int j=0; j<samples_per_frame*num_channels; j++)
+			out[j] = HOST_TO_BE16(out[j]);
+		#endif
 		out += (int)samples_per_frame * num_channels;
 		player->curframe++;
 	}
@@ -137,6 +147,15 @@ void ym64player_open(ym64player_t *player, const char *fn, ym64player_songinfo_t
 
 		ym5header h; char buf[512];
 		_ymread(&h, sizeof(h));
+		#ifndef N64
+		// The header is big-endian
+		h.nframes = BE32_TO_HOST(h.nframes);
+		h.attrs = BE32_TO_HOST(h.attrs);
+		h.ndigidrums = BE16_TO_HOST(h.ndigidrums);
+		h.chipfreq = BE32_TO_HOST(h.chipfreq);
+		h.playfreq = BE16_TO_HOST(h.playfreq);
+		h.loop = BE32_TO_HOST(h.loop);
+		#endif
 
 		// Interleaved format is hard to support while streaming (especially compressed)
 		// so let's punt for now.
@@ -153,6 +172,9 @@ void ym64player_open(ym64player_t *player, const char *fn, ym64player_songinfo_t
 			for (int i=0;i<h.ndigidrums;i++) {
 				uint32_t sz;
 				_ymread(&sz, 4);
+				#ifndef N64
+				sz = BE32_TO_HOST(sz);
+				#endif
 				while (sz > 0)
 					sz -= _ymread(buf, MIN(sz, sizeof(buf)));
 			}
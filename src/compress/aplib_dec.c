@@ -51,6 +51,8 @@ static void refill(aplib_decompressor_t *d)
 {
     int buf_size;
 
+    // dma_read_raw_async() also blocks waiting for the previous transfer
+    uint32_t t0 = asset_stats_io_begin();
     d->cur_buf ^= 1;
     #ifdef N64
     if (d->rom_addr) {
@@ -64,6 +66,7 @@ static void refill(aplib_decompressor_t *d)
     #else
     buf_size = fread(d->buf[d->cur_buf], 1, sizeof(d->buf[0]), d->f);
     #endif
+    asset_stats_io_end(t0);
 
     d->buf_ptr = d->buf[d->cur_buf];
     d->buf_end = d->buf[d->cur_buf] + buf_size;
@@ -310,6 +313,12 @@ void decompress_aplib_reset(void *state)
     decompress_reset(d);
 }
 
+void decompress_aplib_set_dict(void *state, const uint8_t *dict, size_t size)
+{
+    aplib_decompressor_t *d = state;
+    __ringbuf_prime(&d->partial.ringbuf, dict, size);
+}
+
 ssize_t decompress_aplib_read(void *state, void *buf, size_t len)
 {
     aplib_decompressor_t *d = state;
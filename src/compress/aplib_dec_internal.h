@@ -9,12 +9,14 @@
 #endif
 
 #include <stdio.h>
+#include <stdint.h>
 
 #define DECOMPRESS_APLIB_STATE_SIZE       348
 
 void decompress_aplib_init(void *state, FILE *fp, int winsize);
 ssize_t decompress_aplib_read(void *state, void *buf, size_t len);
 void decompress_aplib_reset(void *state);
+void decompress_aplib_set_dict(void *state, const uint8_t *dict, size_t size);
 
 #if DECOMPRESS_APLIB_FULL_USE_ASM
 int decompress_aplib_full_inplace(const uint8_t* in, size_t cmp_size, uint8_t *out, size_t size);
@@ -214,7 +214,9 @@ _Static_assert(sizeof(lz4dec_state_t) == DECOMPRESS_LZ4_STATE_SIZE, "decompress_
 
 static void lz4_refill(lz4dec_state_t *lz4)
 {
+   uint32_t t0 = asset_stats_io_begin();
    lz4->buf_size = fread(lz4->buf, 1, sizeof(lz4->buf), lz4->fp);
+   asset_stats_io_end(t0);
    lz4->buf_idx = 0;
    lz4->eof = (lz4->buf_size == 0);
 }
@@ -257,6 +259,12 @@ void decompress_lz4_reset(void *state)
    lz4->ringbuf.ringbuf_pos = 0;
 }
 
+void decompress_lz4_set_dict(void *state, const uint8_t *dict, size_t size)
+{
+   lz4dec_state_t *lz4 = (lz4dec_state_t*)state;
+   __ringbuf_prime(&lz4->ringbuf, dict, size);
+}
+
 ssize_t decompress_lz4_read(void *state, void *buf, size_t len)
 {
    lz4dec_state_t *lz4 = (lz4dec_state_t*)state;
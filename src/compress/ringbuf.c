@@ -23,6 +23,13 @@ void __ringbuf_write(decompress_ringbuf_t *ringbuf, uint8_t *src, int count)
     }
 }
 
+void __ringbuf_prime(decompress_ringbuf_t *ringbuf, const uint8_t *dict, int size)
+{
+    // Only the last part of the dictionary fits in the window
+    int n = MIN(size, ringbuf->ringbuf_size);
+    __ringbuf_write(ringbuf, (uint8_t*)dict + size - n, n);
+}
+
 void __ringbuf_copy(decompress_ringbuf_t *ringbuf, int copy_offset, uint8_t *dst, int count)
 {
     int ringbuf_copy_pos = (ringbuf->ringbuf_pos - copy_offset) & (ringbuf->ringbuf_size - 1);
@@ -30,6 +30,19 @@ static inline void __ringbuf_writebyte(decompress_ringbuf_t *ringbuf, uint8_t by
  */
 void __ringbuf_write(decompress_ringbuf_t *ringbuf, uint8_t *src, int count);
 
+/**
+ * @brief Prime the ring buffer with a dictionary.
+ * 
+ * The tail of the dictionary is written into the ring buffer, as if it was
+ * the data decompressed so far, so that matches can refer to it. This must
+ * be called right after initialization or reset.
+ * 
+ * @param ringbuf   The ring buffer to prime.
+ * @param dict      The dictionary.
+ * @param size      Size of the dictionary in bytes.
+ */
+void __ringbuf_prime(decompress_ringbuf_t *ringbuf, const uint8_t *dict, int size);
+
 /**
  * @brief Extract data from the ring buffer, updating it at the same time
  * 
@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "../asset_internal.h"
 #ifdef N64
 #include "debug.h"
 #else
@@ -182,7 +183,9 @@ int shr_unpack(uint8_t *dst, uint8_t *src)
 void* decompress_shrinkler_full(const char *fn, FILE *fp, size_t cmp_size, size_t size)
 {
     void *in = malloc(cmp_size);
+    uint32_t t0 = asset_stats_io_begin();
     fread(in, 1, cmp_size, fp);
+    asset_stats_io_end(t0);
 
     void *out = malloc(size);
     if (!out) return 0;
@@ -4,8 +4,10 @@
  * @ingroup dfs
  */
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
 #include <stdint.h>
+#include <malloc.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include "libdragon.h"
@@ -47,6 +49,28 @@
  * Files can be opened using both sets of API calls simultaneously as long as no more than
  * four files are open at any one time.
  * 
+ * Images created by recent versions of 'mkdfs' also contain a path index: a table
+ * of hashes of all paths, which is loaded into RDRAM by #dfs_init. This allows
+ * #dfs_open and #dfs_rom_addr to locate a file with a binary search and one
+ * PI DMA per path component, instead of walking the directory entries one sector
+ * at a time. Images
+ * without an index (and paths that the index cannot resolve, such as relative
+ * paths containing "..") still go through the directory walk.
+ *
+ * Streaming many small sequential reads from a file (eg: music or video, read
+ * through fread) costs a blocking PI DMA for each read. To overlap the PI
+ * latency with CPU work, a file can be configured with #dfs_readahead (or
+ * all files, via #dfs_set_default_readahead): small reads are then served
+ * from a pair of buffers, and when sequential access is detected, the next
+ * chunk of the file is fetched by an asynchronous DMA while the current
+ * one is being consumed.
+ *
+ * To help laying out the filesystem image, file accesses can be traced with
+ * #dfs_trace_enable: each open and read is logged (to stderr, or to a custom
+ * output set with #dfs_trace_set_output, also in NDEBUG builds), and
+ * the resulting log can be passed to 'mkdfs' (option "--trace"), which will
+ * store files accessed together contiguously, in the order they were accessed.
+ *
  * DragonFS does not support file compression; if you want to compress your assets,
  * use the asset API (#asset_load / #asset_fopen).
  * 
@@ -85,11 +109,50 @@ static uint32_t directories[MAX_DIRECTORY_DEPTH];
 static uint32_t directory_top = 0;
 /** @brief Pointer to next directory entry set when doing a directory walk */
 static directory_entry_t *next_entry = 0;
+/** @brief Path index of the filesystem, or NULL if the image does not have one */
+static dfs_index_entry_t *path_index = NULL;
+/** @brief Number of entries in the path index */
+static uint32_t path_index_count = 0;
+/** @brief Size of the readahead buffers of newly opened files (0 if disabled) */
+static int default_readahead = 0;
+/** @brief True if file accesses are being logged (see #dfs_trace_enable) */
+static bool trace_enabled = false;
+/** @brief Output of the access trace (see #dfs_trace_set_output), or NULL for stderr */
+static dfs_trace_output_t trace_output = NULL;
+/** @brief Opaque pointer passed to #trace_output */
+static void *trace_output_ctx = NULL;
+/** @brief Prefix of the access trace lines */
+#define TRACE_PREFIX    "[dfs_trace]"
 /** @brief Convert an open file pointer to a handle */
 #define OPENFILE_TO_HANDLE(file)        ((int)PhysicalAddr(file))
 /** @brief Convert a handle to an open file pointer */
 #define HANDLE_TO_OPENFILE(handle)      ((dfs_open_file_t*)((uint32_t)(handle) | 0x80000000))
 
+/**
+ * @brief Log a line of the file access trace
+ *
+ * The trace does not use #debugf, so that it is also available in NDEBUG
+ * builds, where performance traces are most meaningful.
+ */
+__attribute__((format(printf, 1, 2)))
+static void trace_printf(const char *fmt, ...)
+{
+    char line[512];
+    va_list va;
+    va_start(va, fmt);
+    int n = vsnprintf(line, sizeof(line), fmt, va);
+    va_end(va);
+
+    /* Make sure that truncated lines are still terminated */
+    if (n >= (int)sizeof(line))
+        line[sizeof(line)-2] = '\n';
+
+    if (trace_output)
+        trace_output(line, trace_output_ctx);
+    else
+        fputs(line, stderr);
+}
+
 /**
  * @brief Read a sector from cartspace
  *
@@ -580,6 +643,227 @@ static int recurse_path(const char * const path, int mode, directory_entry_t **d
     return ret;
 }
 
+/**
+ * @brief Find the entry of a hash in the path index
+ *
+ * @param[in] hash
+ *            Hash of the path, as computed by #dfs_path_hash
+ *
+ * @return The first index entry with this hash, or NULL if there is none.
+ */
+static dfs_index_entry_t *find_index_entry(uint32_t hash)
+{
+    /* Binary search for the first entry with this hash */
+    uint32_t lo = 0, hi = path_index_count;
+    while(lo < hi)
+    {
+        uint32_t mid = (lo + hi) / 2;
+        if(path_index[mid].hash < hash) { lo = mid + 1; }
+        else { hi = mid; }
+    }
+
+    if(lo == path_index_count || path_index[lo].hash != hash)
+    {
+        return NULL;
+    }
+
+    return &path_index[lo];
+}
+
+/**
+ * @brief Look up a file in the path index
+ *
+ * The index can only resolve paths that do not depend on the directory stack:
+ * absolute paths, or relative paths while the current directory is the root.
+ * Paths with empty, "." or ".." components are left to #recurse_path.
+ *
+ * Every prefix of the path ("a", "a/b", "a/b/c") is looked up in turn. Since
+ * the index contains all the files and directories in the image, a missing
+ * hash means that the path does not exist. On a hit, the parent recorded in
+ * the index entry must be the directory found for the previous prefix, and the
+ * directory entry is fetched to check its name and type, so that a path whose
+ * hash collides with an existing one is never resolved to the wrong file. This
+ * costs one sector read per path component, which is still much cheaper than
+ * walking all the entries of each directory.
+ *
+ * @param[in]  path
+ *             Path of the file to look up
+ * @param[out] node
+ *             Directory entry of the file, if found
+ *
+ * @return DFS_ESUCCESS if the file was found, DFS_ENOFILE if it does not exist,
+ *         or a positive value if the index cannot be used for this path.
+ */
+static int lookup_index(const char * const path, directory_entry_t *node)
+{
+    if(!path_index || !path)
+    {
+        /* No index in this image */
+        return 1;
+    }
+
+    const char *cur_path = path;
+
+    if(cur_path[0] == '/')
+    {
+        cur_path++;
+    }
+    else if(directory_top != 0)
+    {
+        /* Relative to a directory other than root */
+        return 1;
+    }
+
+    /* Validate the path components before touching the index */
+    const char *p = cur_path;
+
+    while(1)
+    {
+        const char *end = p;
+        while(*end && *end != '/') { end++; }
+        int len = end - p;
+
+        if(len == 0 || len > MAX_FILENAME_LEN ||
+           (len == 1 && p[0] == '.') || (len == 2 && p[0] == '.' && p[1] == '.'))
+        {
+            /* Let the directory walk handle this */
+            return 1;
+        }
+
+        if(!*end) { break; }
+        p = end + 1;
+    }
+
+    /* Resolve one component at a time, starting from the root sector */
+    uint32_t parent = 0;
+    p = cur_path;
+
+    while(1)
+    {
+        const char *end = p;
+        while(*end && *end != '/') { end++; }
+        int len = end - p;
+        bool last = !*end;
+
+        dfs_index_entry_t *entry = find_index_entry(dfs_path_hash(cur_path, end - cur_path));
+
+        if(!entry)
+        {
+            /* No file or directory has this hash, so it does not exist */
+            return DFS_ENOFILE;
+        }
+
+        if(entry->dirent & INDEX_FLAG_COLLISION)
+        {
+            /* Several paths share this hash: walk the directories */
+            return 1;
+        }
+
+        if(entry->parent != parent)
+        {
+            /* The hash belongs to a path in another directory */
+            return DFS_ENOFILE;
+        }
+
+        grab_sector((void *)(base_ptr + entry->dirent), node);
+
+        if(FILETYPE(get_flags(node)) != (last ? FLAGS_FILE : FLAGS_DIR) ||
+           strncmp(node->path, p, len) != 0 || node->path[len] != 0)
+        {
+            /* The hash belongs to another file or directory */
+            return DFS_ENOFILE;
+        }
+
+        if(last) { break; }
+
+        parent = entry->dirent;
+        p = end + 1;
+    }
+
+    return DFS_ESUCCESS;
+}
+
+/**
+ * @brief Find the directory entry of a file given a path
+ *
+ * Uses the path index when possible, falling back to the directory walk.
+ *
+ * @param[in]  path
+ *             Path of the file to find
+ * @param[out] node
+ *             Directory entry of the file
+ *
+ * @return DFS_ESUCCESS on success, or a negative error on failure.
+ */
+static int find_file(const char * const path, directory_entry_t *node)
+{
+    int ret = lookup_index(path, node);
+
+    if(ret <= 0)
+    {
+        /* The index gave a definitive answer */
+        return ret;
+    }
+
+    directory_entry_t *dirent;
+    ret = recurse_path(path, WALK_OPEN, &dirent, TYPE_FILE);
+
+    if(ret != DFS_ESUCCESS)
+    {
+        /* File not found, or other error */
+        return ret;
+    }
+
+    grab_sector(dirent, node);
+    return DFS_ESUCCESS;
+}
+
+/**
+ * @brief Load the path index of the filesystem, if present
+ *
+ * The index is read with a single DMA and kept in RDRAM, so that
+ * lookups only need to fetch the directory entries along the path.
+ *
+ * @param[in] root
+ *            The root sector of the filesystem
+ */
+static void load_index(directory_entry_t *root)
+{
+    free(path_index);
+    path_index = NULL;
+    path_index_count = 0;
+
+    if(!root->file_pointer)
+    {
+        /* Image created without an index */
+        return;
+    }
+
+    uint32_t index_loc = base_ptr + root->file_pointer;
+    if(io_read(index_loc) != INDEX_MAGIC)
+    {
+        return;
+    }
+
+    uint32_t count = io_read(index_loc + 4);
+    if(!count)
+    {
+        return;
+    }
+
+    int size = count * sizeof(dfs_index_entry_t);
+    path_index = malloc(size);
+    if(!path_index)
+    {
+        /* Not critical: lookups will walk the directories */
+        return;
+    }
+
+    data_cache_hit_writeback_invalidate(path_index, size);
+    dma_read(path_index, index_loc + sizeof(dfs_index_header_t), size);
+    path_index_count = count;
+}
+
 /**
  * @brief Helper functioner to initialize the filesystem
  *
@@ -600,6 +884,7 @@ static int __dfs_init(uint32_t base_fs_loc)
         /* Passes, set up the FS */
         base_ptr = base_fs_loc;
         clear_directory();
+        load_index(&id_node);
 
         /* Good FS */
         return DFS_ESUCCESS;
@@ -723,8 +1008,8 @@ int dfs_dir_findnext(char *buf)
 int dfs_open(const char * const path)
 {
     /* Try to find file */
-    directory_entry_t *dirent;
-    int ret = recurse_path(path, WALK_OPEN, &dirent, TYPE_FILE);
+    directory_entry_t t_node;
+    int ret = find_file(path, &t_node);
 
     if(ret != DFS_ESUCCESS)
     {
@@ -740,18 +1025,182 @@ int dfs_open(const char * const path)
         return DFS_ENOMEM;
     }
 
-    /* We now have the pointer to the file entry */
-    directory_entry_t t_node;
-    grab_sector(dirent, &t_node);
-
     /* Set up file handle */
     file->size = get_size(&t_node);
     file->loc = 0;
     file->cart_start_loc = get_start_location(&t_node);
+    file->ra_size = default_readahead;
+    file->ra = NULL;
+
+    if(trace_enabled)
+    {
+        trace_printf(TRACE_PREFIX " open %08x %s\n", (unsigned int)OPENFILE_TO_HANDLE(file), path);
+    }
 
     return OPENFILE_TO_HANDLE(file);
 }
 
+/**
+ * @brief Release the readahead state of a file
+ *
+ * If a fetch is still in flight, wait for it, as the DMA is writing
+ * into the buffers that are going to be freed.
+ *
+ * @param[in] file
+ *            Open file
+ */
+static void readahead_free(dfs_open_file_t *file)
+{
+    if(file->ra)
+    {
+        if(file->ra->pending >= 0)
+        {
+            dma_wait();
+        }
+
+        free(file->ra);
+        file->ra = NULL;
+    }
+}
+
+/**
+ * @brief Allocate the readahead state of a file, if not done yet
+ *
+ * @param[in] file
+ *            Open file with readahead enabled
+ *
+ * @return The readahead state, or NULL if out of memory.
+ */
+static dfs_readahead_t *readahead_alloc(dfs_open_file_t *file)
+{
+    if(!file->ra)
+    {
+        int hdr_size = ROUND_UP(sizeof(dfs_readahead_t), 16);
+        dfs_readahead_t *ra = memalign(16, hdr_size + file->ra_size * 2);
+
+        if(!ra)
+        {
+            return NULL;
+        }
+
+        ra->size = file->ra_size;
+        ra->buf[0] = (uint8_t*)ra + hdr_size;
+        ra->buf[1] = ra->buf[0] + ra->size;
+        ra->start[0] = ra->start[1] = 0;
+        ra->len[0] = ra->len[1] = 0;
+        ra->pending = -1;
+        ra->next_loc = 0;
+        file->ra = ra;
+    }
+
+    return file->ra;
+}
+
+/**
+ * @brief Start fetching a chunk of a file into a readahead buffer
+ *
+ * The DMA runs in background. Since the PI performs one transfer at a
+ * time, only one fetch is kept in flight: if another one is pending,
+ * wait for it first.
+ *
+ * @param[in] file
+ *            Open file with readahead state
+ * @param[in] b
+ *            Index of the buffer to fill
+ * @param[in] start
+ *            Offset in the file of the chunk. This must be 8-byte aligned,
+ *            so that the DMA has the same phase of the buffer.
+ */
+static void readahead_fetch(dfs_open_file_t *file, int b, uint32_t start)
+{
+    dfs_readahead_t *ra = file->ra;
+
+    if(ra->pending >= 0)
+    {
+        dma_wait();
+    }
+
+    int len = MIN(ra->size, (int)(file->size - start));
+    uint32_t rom_address = ((file->cart_start_loc + start) | 0x10000000) & 0x1FFFFFFF;
+
+    /* The buffer is never accessed while the DMA is in flight, so it is
+     * enough to invalidate it before starting the transfer. */
+    data_cache_hit_invalidate(ra->buf[b], ra->size);
+    dma_read_async(ra->buf[b], rom_address, len);
+
+    ra->start[b] = start;
+    ra->len[b] = len;
+    ra->pending = b;
+}
+
+/**
+ * @brief Read data from a file through the readahead buffers
+ *
+ * @param[in]  file
+ *             Open file with readahead state
+ * @param[out] data
+ *             Buffer to read into
+ * @param[in]  to_read
+ *             Number of bytes to read (already clamped to the file size)
+ *
+ * @return The number of bytes read.
+ */
+static int readahead_read(dfs_open_file_t *file, uint8_t *data, int to_read)
+{
+    dfs_readahead_t *ra = file->ra;
+    bool sequential = (file->loc == ra->next_loc);
+    int read = 0;
+
+    while(to_read)
+    {
+        /* Find the buffer holding the current location (possibly still
+         * being fetched) */
+        int b = -1;
+
+        for(int i = 0; i < 2; i++)
+        {
+            if(file->loc >= ra->start[i] && file->loc < ra->start[i] + ra->len[i])
+            {
+                b = i;
+            }
+        }
+
+        if(b < 0)
+        {
+            /* Miss (first read, or after a seek): fetch the chunk now */
+            b = 0;
+            readahead_fetch(file, b, file->loc & ~7);
+        }
+
+        if(ra->pending == b)
+        {
+            dma_wait();
+            ra->pending = -1;
+        }
+
+        int n = MIN(to_read, (int)(ra->start[b] + ra->len[b] - file->loc));
+        memcpy(data, ra->buf[b] + (file->loc - ra->start[b]), n);
+
+        file->loc += n;
+        data += n;
+        to_read -= n;
+        read += n;
+
+        /* On sequential access, fetch the chunk following this buffer into
+         * the other one, so that it is ready by the time it is needed. */
+        uint32_t next = ra->start[b] + ra->len[b];
+        int nb = b ^ 1;
+
+        if(sequential && next < file->size && (ra->len[nb] == 0 || ra->start[nb] != next))
+        {
+            readahead_fetch(file, nb, next);
+        }
+    }
+
+    ra->next_loc = file->loc;
+    return read;
+}
+
 /**
  * @brief Close an already open file handle.
  *
@@ -770,6 +1219,7 @@ int dfs_close(uint32_t handle)
     }
 
     /* Free the open file */
+    readahead_free(file);
     free(file);
 
     return DFS_ESUCCESS;
@@ -876,9 +1326,10 @@ int dfs_tell(uint32_t handle)
 /**
  * @brief Read data from a file
  * 
- * Note that no caching is performed: if you need to read small amounts
- * (eg: one byte at a time), consider using standard C API instead (fopen())
- * which performs internal buffering to avoid too much overhead.
+ * Note that no caching is performed, unless readahead is enabled on the file
+ * (see #dfs_readahead): if you need to read small amounts (eg: one byte at a
+ * time), consider using standard C API instead (fopen()) which performs
+ * internal buffering to avoid too much overhead.
  * 
  * @param[out] buf
  *             Buffer to read into
@@ -919,6 +1370,14 @@ int dfs_read(void * const buf, int size, int count, uint32_t handle)
     if (!to_read)
         return 0;
 
+    if (trace_enabled)
+        trace_printf(TRACE_PREFIX " read %08x %u %d\n", (unsigned int)handle, (unsigned int)file->loc, to_read);
+
+    /* Small reads are served by the readahead buffers, if enabled. Larger
+     * reads are better served by a direct DMA into the destination buffer. */
+    if (file->ra_size && to_read < file->ra_size && readahead_alloc(file))
+        return readahead_read(file, buf, to_read);
+
     /* Fast-path. If possibly, we want to DMA directly into the destination
      * buffer, without using any intermediate buffers. We can do that only if
      * the buffer and the ROM location have the same 2-byte phase.
@@ -1015,8 +1474,8 @@ int dfs_size(uint32_t handle)
 uint32_t dfs_rom_addr(const char *path)
 {
     /* Try to find file */
-    directory_entry_t *dirent;
-    int ret = recurse_path(path, WALK_OPEN, &dirent, TYPE_FILE);
+    directory_entry_t t_node;
+    int ret = find_file(path, &t_node);
 
     if(ret != DFS_ESUCCESS)
     {
@@ -1024,14 +1483,118 @@ uint32_t dfs_rom_addr(const char *path)
         return 0;
     }
 
-    /* We now have the pointer to the file entry */
-    directory_entry_t t_node;
-    grab_sector(dirent, &t_node);
+    if(trace_enabled)
+    {
+        trace_printf(TRACE_PREFIX " addr %s\n", path);
+    }
 
     /* Return the starting location in ROM */
     return get_start_location(&t_node);
 }
 
+/**
+ * @brief Configure readahead on an open file
+ *
+ * With readahead enabled, reads smaller than the buffer size are served from
+ * two buffers of the specified size, allocated on the first such read. When
+ * the file is read sequentially, the chunk that follows the buffer being
+ * consumed is fetched in background via PI DMA, so that the next reads do not
+ * need to wait for the PI. Larger reads are still performed as a single
+ * direct DMA into the destination buffer.
+ *
+ * This is useful to stream data (eg: music or video) that is parsed with many
+ * small reads, as it happens when reading through the standard C API
+ * (fread), which calls #dfs_read once per stdio buffer refill.
+ *
+ * @param[in] handle
+ *            A valid file handle as returned from #dfs_open.
+ * @param[in] size
+ *            Size in bytes of each readahead buffer (rounded up to 16 bytes),
+ *            or 0 to disable readahead.
+ *
+ * @return DFS_ESUCCESS on success or a negative value on error.
+ */
+int dfs_readahead(uint32_t handle, int size)
+{
+    dfs_open_file_t *file = HANDLE_TO_OPENFILE(handle);
+
+    if(!file)
+    {
+        return DFS_EBADHANDLE;
+    }
+
+    if(size < 0)
+    {
+        return DFS_EBADINPUT;
+    }
+
+    readahead_free(file);
+    file->ra_size = ROUND_UP(size, 16);
+
+    return DFS_ESUCCESS;
+}
+
+/**
+ * @brief Configure readahead for all the files opened from now on
+ *
+ * This is equivalent to calling #dfs_readahead on each file opened
+ * afterwards, including those opened via the standard C API (fopen with
+ * the "rom:/" prefix). Readahead is disabled by default.
+ *
+ * @param[in] size
+ *            Size in bytes of each readahead buffer, or 0 to disable readahead.
+ */
+void dfs_set_default_readahead(int size)
+{
+    default_readahead = size > 0 ? ROUND_UP(size, 16) : 0;
+}
+
+/**
+ * @brief Enable or disable the tracing of file accesses
+ *
+ * While enabled, each #dfs_open, #dfs_read and #dfs_rom_addr call (including
+ * those performed via the standard C API, and by the asset library) is logged
+ * with a line prefixed by "[dfs_trace]". Lines are written to stderr (so they
+ * reach the debug channels, if initialized), or to the output configured
+ * with #dfs_trace_set_output. Tracing does not depend on NDEBUG. Run the game
+ * through a typical session (eg: loading each level), save the debug log,
+ * and pass it to mkdfs via the "--trace" option: files will be laid out in
+ * the order they were first accessed, so that files loaded together are
+ * contiguous in ROM.
+ *
+ * Paths are logged as they were passed to #dfs_open, so tracing is most
+ * useful with absolute paths (as used by fopen with the "rom:/" prefix).
+ *
+ * @param[in] enable
+ *            True to start logging file accesses, false to stop
+ */
+void dfs_trace_enable(bool enable)
+{
+    trace_enabled = enable;
+}
+
+/**
+ * @brief Set the output of the file access trace
+ *
+ * By default, the trace lines logged while #dfs_trace_enable is active are
+ * written to stderr. In NDEBUG builds, the debug channels are not available,
+ * so this function can be used to collect the trace elsewhere, eg: in
+ * a memory buffer saved to SD at the end of the session.
+ *
+ * The callback is invoked synchronously by the traced functions, so it must
+ * not call DragonFS functions itself.
+ *
+ * @param[in] output
+ *            Callback receiving each trace line, or NULL to write to stderr
+ * @param[in] ctx
+ *            Opaque pointer passed to the callback
+ */
+void dfs_trace_set_output(dfs_trace_output_t output, void *ctx)
+{
+    trace_output = output;
+    trace_output_ctx = ctx;
+}
+
 /**
  * @brief Return whether the end of file has been reached
  *
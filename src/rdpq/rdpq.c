@@ -369,6 +369,7 @@
 #include "utils.h"
 #include "rdp.h"
 #include <string.h>
+#include <stdlib.h>
 #include <math.h>
 #include <float.h>
 
@@ -399,7 +400,7 @@ static rdpq_state_t *rdpq_state;
 bool __rdpq_inited = false;             ///< True if #rdpq_init was called
 
 /** @brief Current configuration of the rdpq library. */ 
-static uint32_t rdpq_config;
+uint32_t rdpq_config;
 
 /** @brief RDP block management state */
 rdpq_block_state_t rdpq_block_state;
@@ -467,6 +468,7 @@ void rdpq_init()
     memset(&rdpq_block_state, 0, sizeof(rdpq_block_state));
     rdpq_config = RDPQ_CFG_DEFAULT;
     rdpq_tracking.autosync = 0;
+    __rdpq_tex_cache_invalidate();
     rdpq_tracking.mode_freeze = false;
 
     // Register an interrupt handler for DP interrupts, and activate them.
@@ -501,6 +503,9 @@ uint32_t rdpq_config_set(uint32_t cfg)
 {
     uint32_t prev = rdpq_config;
     rdpq_config = cfg;
+    // Contents of TMEM are not tracked while the texture cache is disabled
+    if ((prev ^ cfg) & RDPQ_CFG_TEXCACHE)
+        __rdpq_tex_cache_invalidate();
     return prev;
 }
 
@@ -633,6 +638,17 @@ void __rdpq_block_begin()
     __rdpq_block_run(NULL);    
 }
 
+/** @brief Record a word of the rspq block that contains an address within the RDP buffers */
+static void __rdpq_block_add_reloc(volatile uint32_t *word)
+{
+    struct rdpq_block_state_s *st = &rdpq_block_state;
+    if (st->num_relocs == st->max_relocs) {
+        st->max_relocs = st->max_relocs ? st->max_relocs * 2 : 16;
+        st->relocs = realloc(st->relocs, st->max_relocs * sizeof(volatile uint32_t*));
+    }
+    st->relocs[st->num_relocs++] = word;
+}
+
 /** 
  * @brief Allocate a new RDP block buffer, chaining it to the current one (if any) 
  * 
@@ -667,6 +683,8 @@ void __rdpq_block_next_buffer(void)
 
         // Chain the block to the current one (if any)
         b->next = NULL;
+        b->relocs = NULL;
+        b->num_relocs = 0;
         if (st->last_node) {
             st->last_node->next = b;
         }
@@ -692,6 +710,8 @@ void __rdpq_block_next_buffer(void)
     // new buffer (though with DP_START==DP_END, as the buffer is currently empty).
     rspq_int_write(RSPQ_CMD_RDP_SET_BUFFER,
         PhysicalAddr(st->wptr), PhysicalAddr(st->wptr), PhysicalAddr(st->wend));
+    for (int i=0; i<3; i++)
+        __rdpq_block_add_reloc(st->last_rdp_append_buffer + i);
 
     // Grow size for next buffer
     // We use doubling here to reduce overheads for large blocks
@@ -720,8 +740,13 @@ rdpq_block_t* __rdpq_block_end()
 
     // Save the current autosync state in the first node of the RDP block.
     // This makes it easy to recover it when the block is run
-    if (st->first_node)
+    if (st->first_node) {
         st->first_node->tracking = rdpq_tracking;
+        st->first_node->relocs = st->relocs;
+        st->first_node->num_relocs = st->num_relocs;
+    } else {
+        free(st->relocs);
+    }
 
     // Recover tracking state before the block creation started
     rdpq_tracking = st->previous_tracking;
@@ -740,6 +765,9 @@ rdpq_block_t* __rdpq_block_end()
 /** @brief Run a block (called by #rspq_block_run). */
 void __rdpq_block_run(rdpq_block_t *block)
 {
+    // The block might load data into TMEM
+    __rdpq_tex_block_run();
+
     // We are about to run a block that contains rdpq commands.
     // During creation, we tracked some state for the block 
     // and saved it into the block structure; set it as current,
@@ -785,6 +813,9 @@ void __rdpq_block_run(rdpq_block_t *block)
  */
 void __rdpq_block_free(rdpq_block_t *block)
 {
+    if (block)
+        free(block->relocs);
+
     // Go through the chain and free all nodes
     while (block) {
         void *b = block;
@@ -873,6 +904,7 @@ void __rdpq_block_update(volatile uint32_t *wptr)
         extern volatile uint32_t *rspq_cur_pointer;
         st->last_rdp_append_buffer = rspq_cur_pointer;
         rspq_int_write(RSPQ_CMD_RDP_APPEND_BUFFER, phys_new);
+        __rdpq_block_add_reloc(st->last_rdp_append_buffer);
     }
 }
 
@@ -917,6 +949,9 @@ void __rdpq_write8_syncuse(uint32_t cmd_id, uint32_t arg0, uint32_t arg1, uint32
 __attribute__((noinline))
 void __rdpq_write8_syncchangeuse(uint32_t cmd_id, uint32_t arg0, uint32_t arg1, uint32_t autosync_c, uint32_t autosync_u)
 {
+    // This is used by all commands writing to TMEM
+    if (autosync_c & AUTOSYNC_TMEMS)
+        __rdpq_tex_cache_invalidate();
     __rdpq_autosync_change(autosync_c);
     __rdpq_autosync_use(autosync_u);
     __rdpq_write8(cmd_id, arg0, arg1);
@@ -1107,6 +1142,7 @@ void rdpq_sync_tile(void)
 
 void rdpq_sync_load(void)
 {
+    __rdpq_tex_cache_invalidate();
     __rdpq_write8(RDPQ_CMD_SYNC_LOAD, 0, 0);
     rdpq_tracking.autosync &= ~AUTOSYNC_TMEMS;
 }
@@ -32,6 +32,9 @@ static void attach(const surface_t *surf_color, const surface_t *surf_z, bool cl
     attach_stack[attach_stack_ptr][1] = surf_z;
     attach_stack_ptr++;
 
+    // The new render target might be a texture that is resident in TMEM
+    __rdpq_tex_cache_invalidate();
+
     if (clear_clr || clear_z)
         rdpq_mode_push();
 
@@ -70,6 +73,7 @@ static void detach(void)
     }
     rdpq_set_z_image(z);
     rdpq_set_color_image(color);
+    __rdpq_tex_cache_invalidate();
     rspq_flush();
 }
 
@@ -17,6 +17,9 @@ extern bool __rdpq_inited;
 /** @brief Public rdpq_fence API, redefined it */
 extern void rdpq_fence(void);
 
+/** @brief Current configuration of the rdpq library (see #rdpq_config_set) */
+extern uint32_t rdpq_config;
+
 ///@cond
 typedef struct rdpq_block_s rdpq_block_t;
 typedef struct rdpq_trifmt_s rdpq_trifmt_t;
@@ -73,6 +76,8 @@ extern rdpq_tracking_t rdpq_tracking;
 typedef struct rdpq_block_s {
     rdpq_block_t *next;                           ///< Link to next buffer (or NULL if this is the last one for this block)
     rdpq_tracking_t tracking;                     ///< Tracking state at the end of a block (this is populated only on the first link)
+    volatile uint32_t **relocs;                   ///< Words of the rspq block that refer to RDP buffers (this is populated only on the first link)
+    int num_relocs;                               ///< Number of entries in relocs
     uint32_t cmds[] __attribute__((aligned(8)));  ///< RDP commands
 } rdpq_block_t;
 
@@ -106,6 +111,17 @@ typedef struct rdpq_block_state_s {
      * @brief Tracking state before starting building the block.
      */
     rdpq_tracking_t previous_tracking;
+    /**
+     * @brief Words of the rspq block that contain addresses of the RDP buffers.
+     * 
+     * These are the arguments of the #RSPQ_CMD_RDP_SET_BUFFER and #RSPQ_CMD_RDP_APPEND_BUFFER
+     * commands, which must be relocated when a block is serialized (see #rspq_block_save).
+     */
+    volatile uint32_t **relocs;
+    /** @brief Number of entries in relocs */
+    int num_relocs;
+    /** @brief Allocated size of relocs */
+    int max_relocs;
 } rdpq_block_state_t;
 
 void __rdpq_block_begin();
@@ -123,6 +139,8 @@ inline void __rdpq_autosync_use(uint32_t res)
 void __rdpq_autosync_change(uint32_t res);
 
 void __rdpq_write8(uint32_t cmd_id, uint32_t arg0, uint32_t arg1);
+void __rdpq_tex_cache_invalidate(void);
+void __rdpq_tex_block_run(void);
 void __rdpq_write16(uint32_t cmd_id, uint32_t arg0, uint32_t arg1, uint32_t arg2, uint32_t arg3);
 
 void rdpq_triangle_cpu(const rdpq_trifmt_t *fmt, const float *v1, const float *v2, const float *v3);
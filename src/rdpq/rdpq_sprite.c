@@ -137,3 +137,13 @@ void rdpq_sprite_blit(sprite_t *sprite, float x0, float y0, const rdpq_blitparms
     surface_t surf = sprite_get_pixels(sprite);
     rdpq_tex_blit(&surf, x0, y0, parms);
 }
+
+void rdpq_sprite_blit_batch(sprite_t *sprite, const rdpq_blitinst_t *insts, int count, const rdpq_blitparms_t *parms)
+{
+    // Upload the palette and configure the render mode
+    sprite_upload_palette(sprite, 0, true);
+
+    // Get the sprite surface
+    surface_t surf = sprite_get_pixels(sprite);
+    rdpq_tex_blit_batch(&surf, insts, count, parms);
+}
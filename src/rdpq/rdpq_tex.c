@@ -12,14 +12,17 @@
 #include "rdpq_rect.h"
 #include "rdpq_tex.h"
 #include "rdpq_tex_internal.h"
+#include "rdpq_internal.h"
 #include "utils.h"
 #include <math.h>
+#include <string.h>
 
 /** @brief Non-zero if we are doing a multi-texture upload */
 typedef struct rdpq_multi_upload_s {
     int  used;
     int  bytes;
     int  limit;
+    bool untracked;     ///< True if a block was run: bytes might not match the TMEM address allocated by RSP
 } rdpq_multi_upload_t;
 static rdpq_multi_upload_t multi_upload;
 /** @brief Information on last image uploaded we are doing a multi-texture upload */
@@ -28,6 +31,33 @@ tex_loader_t last_tload;
 /** @brief Address in TMEM where the palettes must be loaded */
 #define TMEM_PALETTE_ADDR   0x800
 
+/** @brief Maximum number of TMEM regions tracked by the texture cache */
+#define TEX_CACHE_SIZE      8
+
+/** 
+ * @brief A region of TMEM whose contents are known (see #RDPQ_CFG_TEXCACHE)
+ * 
+ * The contents are identified by the RDRAM data that was loaded, its layout
+ * and the TMEM address. Tile descriptors are not part of the key, as they
+ * are configured again at every upload.
+ */
+typedef struct {
+    const void *buffer;     ///< RDRAM address of the loaded data (texture pixels or palette)
+    uint16_t stride;        ///< Stride of the texture in bytes (0 for palettes)
+    uint8_t fmt;            ///< Format of the texture (0 for palettes)
+    bool split;             ///< True if the data is split between the two halves of TMEM (RGBA32, YUV16)
+    int16_t s0, t0, s1, t1; ///< Loaded rectangle (for palettes: first color index and number of colors)
+    uint16_t tmem_addr;     ///< TMEM address of the data
+    uint16_t tmem_size;     ///< Number of bytes of TMEM used (in each half, if split)
+} tex_cache_entry_t;
+
+/** @brief State of the texture cache */
+static struct {
+    tex_cache_entry_t entries[TEX_CACHE_SIZE];  ///< Known TMEM regions (oldest first)
+    int count;                                  ///< Number of valid entries
+    bool loading;                               ///< True while the cache itself is loading data into TMEM
+} tex_cache;
+
 /// @brief Calculates the first power of 2 that is equal or larger than size
 /// @param x input in units
 /// @return Power of 2 that is equal or larger than x
@@ -313,6 +343,80 @@ static void texload_settile(tex_loader_t *tload, int s0, int t0, int s1, int t1)
     rdpq_set_tile_size_fx(tload->tile, s0, t0, s1, t1);
 }
 
+/** @brief Check whether the texture cache can be used for the next upload */
+static bool tex_cache_active(void)
+{
+    // Blocks can be run with any TMEM contents, so we cannot skip uploads
+    // while recording them. Also, during a multi-texture upload, a block run
+    // might have allocated TMEM, so the address of the next textures is unknown.
+    return (rdpq_config & RDPQ_CFG_TEXCACHE) && !rspq_in_block() &&
+        !(multi_upload.used && multi_upload.untracked);
+}
+
+/** @brief Search the cache for a TMEM region with the same contents as the specified one */
+static bool tex_cache_lookup(const tex_cache_entry_t *key)
+{
+    for (int i = 0; i < tex_cache.count; i++) {
+        tex_cache_entry_t *e = &tex_cache.entries[i];
+        if (e->buffer == key->buffer && e->tmem_addr == key->tmem_addr &&
+            e->stride == key->stride && e->fmt == key->fmt &&
+            e->s0 == key->s0 && e->t0 == key->t0 && e->s1 == key->s1 && e->t1 == key->t1)
+            return true;
+    }
+    return false;
+}
+
+/** @brief Check whether two TMEM regions overlap */
+static bool tex_cache_overlap(const tex_cache_entry_t *a, const tex_cache_entry_t *b)
+{
+    for (int i = 0; i <= a->split; i++) {
+        for (int j = 0; j <= b->split; j++) {
+            int a0 = a->tmem_addr + i * 0x800;
+            int b0 = b->tmem_addr + j * 0x800;
+            if (a0 < b0 + b->tmem_size && b0 < a0 + a->tmem_size)
+                return true;
+        }
+    }
+    return false;
+}
+
+/** @brief Record a TMEM region that was just loaded, forgetting the regions it overwrote */
+static void tex_cache_insert(const tex_cache_entry_t *entry)
+{
+    int n = 0;
+    for (int i = 0; i < tex_cache.count; i++) {
+        if (!tex_cache_overlap(&tex_cache.entries[i], entry))
+            tex_cache.entries[n++] = tex_cache.entries[i];
+    }
+    if (n == TEX_CACHE_SIZE) {
+        memmove(&tex_cache.entries[0], &tex_cache.entries[1], (n-1) * sizeof(tex_cache_entry_t));
+        n--;
+    }
+    tex_cache.entries[n++] = *entry;
+    tex_cache.count = n;
+}
+
+void __rdpq_tex_cache_invalidate(void)
+{
+    // Ignore the loads done by the cache itself
+    if (!tex_cache.loading)
+        tex_cache.count = 0;
+}
+
+void rdpq_tex_cache_invalidate(void)
+{
+    tex_cache.count = 0;
+}
+
+void __rdpq_tex_block_run(void)
+{
+    // The block might load data into TMEM, and allocate TMEM during
+    // a multi-texture upload.
+    __rdpq_tex_cache_invalidate();
+    if (multi_upload.used)
+        multi_upload.untracked = true;
+}
+
 ///@cond
 // Tex loader API, not yet documented
 int tex_loader_load(tex_loader_t *tload, int s0, int t0, int s1, int t1)
@@ -374,7 +478,38 @@ int rdpq_tex_upload_sub(rdpq_tile_t tile, const surface_t *tex, const rdpq_texpa
         tex_loader_set_tmem_addr(&last_tload, parms ? parms->tmem_addr : 0);
     }
 
-    int nbytes = tex_loader_load(&last_tload, s0, t0, s1, t1);
+    int nbytes;
+    // Placeholder surfaces are not cached, as the data they refer to
+    // depends on the lookup table.
+    if (tex_cache_active() && !surface_get_placeholder_index(tex)) {
+        // With auto-TMEM, the address is the one the RSP will allocate, which
+        // is tracked by multi_upload.bytes.
+        tex_format_t fmt = surface_get_format(tex);
+        tex_cache_entry_t key = {
+            .buffer = tex->buffer, .stride = tex->stride, .fmt = fmt,
+            .split = fmt == FMT_RGBA32 || fmt == FMT_YUV16,
+            .s0 = s0, .t0 = t0, .s1 = s1, .t1 = t1,
+            .tmem_addr = multi_upload.used ? multi_upload.bytes : (parms ? parms->tmem_addr : 0),
+        };
+
+        if (tex_cache_lookup(&key)) {
+            // The data is already in TMEM: just configure the tile, exactly
+            // as the loader would do.
+            nbytes = texload_set_rect(&last_tload, s0, t0, s1, t1);
+            if (TEX_FORMAT_BITDEPTH(fmt) == 4) {
+                s0 &= ~1; s1 = (s1+1) & ~1;
+            }
+            texload_settile(&last_tload, s0, t0, s1, t1);
+        } else {
+            tex_cache.loading = true;
+            nbytes = tex_loader_load(&last_tload, s0, t0, s1, t1);
+            tex_cache.loading = false;
+            key.tmem_size = nbytes;
+            tex_cache_insert(&key);
+        }
+    } else {
+        nbytes = tex_loader_load(&last_tload, s0, t0, s1, t1);
+    }
 
     if (multi_upload.used) {
         rdpq_set_tile_autotmem(nbytes);
@@ -669,11 +804,133 @@ void rdpq_tex_blit(const surface_t *surf, float x0, float y0, const rdpq_blitpar
     __rdpq_tex_blit(surf, x0, y0, parms, ltd_texloader);
 }
 
+/** @brief Rows of the texture that are currently loaded in TMEM by #rdpq_tex_blit_batch */
+static struct {
+    int t0;     ///< First row that can be drawn
+    int t1;     ///< Row after the last one that can be drawn
+} batch_strip;
+
+/** 
+ * @brief Implement large_tex_draw protocol for #rdpq_tex_blit_batch
+ * 
+ * The strip of texture has already been loaded in TMEM by the batch, so this
+ * function just draws the portion of the instance that falls within it.
+ */
+static void ltd_batch(rdpq_tile_t tile, const surface_t *tex, int s0, int t0, int s1, int t1, 
+    void (*draw_cb)(rdpq_tile_t tile, int s0, int t0, int s1, int t1), bool filtering)
+{
+    t0 = MAX(t0, batch_strip.t0);
+    t1 = MIN(t1, batch_strip.t1);
+    if (t0 < t1)
+        draw_cb(tile, s0, t0, s1, t1);
+}
+
+void rdpq_tex_blit_batch(const surface_t *surf, const rdpq_blitinst_t *insts, int count, const rdpq_blitparms_t *parms)
+{
+    static const rdpq_blitparms_t default_parms = {0};
+    if (!parms) parms = &default_parms;
+    if (count <= 0) return;
+
+    void blit(const rdpq_blitinst_t *inst, large_tex_draw ltd) {
+        __rdpq_tex_blit(surf, inst->x, inst->y, &(rdpq_blitparms_t){
+            .tile = parms->tile, .filtering = parms->filtering,
+            .s0 = inst->s0, .t0 = inst->t0, .width = inst->width, .height = inst->height,
+            .flip_x = inst->flip_x, .flip_y = inst->flip_y,
+            .cx = inst->cx, .cy = inst->cy,
+            .scale_x = inst->scale_x, .scale_y = inst->scale_y, .theta = inst->theta,
+        }, ltd);
+    }
+
+    // Calculate the bounding box of all the sub-rects: this is the only portion
+    // of the texture that needs to be loaded.
+    int bs0 = surf->width, bt0 = surf->height, bs1 = 0, bt1 = 0;
+    for (int i = 0; i < count; i++) {
+        const rdpq_blitinst_t *inst = &insts[i];
+        bs0 = MIN(bs0, inst->s0);
+        bt0 = MIN(bt0, inst->t0);
+        bs1 = MAX(bs1, inst->s0 + (inst->width ? inst->width : surf->width));
+        bt1 = MAX(bt1, inst->t0 + (inst->height ? inst->height : surf->height));
+    }
+
+    tex_format_t fmt = surface_get_format(surf);
+    if (TEX_FORMAT_BITDEPTH(fmt) == 4) {
+        // Align the box horizontally to bytes, so that the strip height
+        // calculated below matches the actual loads.
+        bs0 &= ~1; bs1 = MIN((bs1+1) & ~1, surf->width);
+    }
+
+    // If not even two lines of the bounding box fit in TMEM (a sparse batch on
+    // a very wide atlas), fall back to blitting each instance separately.
+    // With filtering, each strip also loads the line before it, so three
+    // lines are needed for the strips to advance.
+    int tmem_size = (fmt == FMT_RGBA32 || fmt == FMT_CI4 || fmt == FMT_CI8) ? 2048 : 4096;
+    int pitch = ROUND_UP(TEX_FORMAT_PIX2BYTES(fmt, ROUND_UP(bs1 - bs0, 2)) >> (fmt == FMT_RGBA32 ? 1 : 0), 8);
+    int min_lines = parms->filtering ? 3 : 2;
+    if (pitch * min_lines > tmem_size) {
+        for (int i = 0; i < count; i++)
+            blit(&insts[i], ltd_texloader);
+        return;
+    }
+
+    // Go through the bounding box in horizontal strips like ltd_texloader does,
+    // but load each strip only once and draw all the instances that use it.
+    tex_loader_t tload = tex_loader_init(parms->tile, surf);
+    int tile_h = tex_loader_calc_max_height(&tload, bs1 - bs0);
+    int t0 = bt0;
+    while (t0 < bt1)
+    {
+        int tm = parms->filtering ? MAX(t0 - 1, 0) : t0;
+        int tn = MIN(tm + tile_h, bt1);
+        int tx = (!parms->filtering || tn == bt1) ? tn : tn - 1;
+
+        // Check if any instance is in this strip before loading it (the
+        // bounding box might have holes).
+        int first = 0;
+        while (first < count) {
+            const rdpq_blitinst_t *inst = &insts[first];
+            int it1 = inst->t0 + (inst->height ? inst->height : surf->height);
+            if (inst->t0 < tx && it1 > t0) break;
+            first++;
+        }
+
+        if (first < count) {
+            tex_loader_load(&tload, bs0, tm, bs1, tn);
+            batch_strip.t0 = t0;
+            batch_strip.t1 = tx;
+            for (int i = first; i < count; i++) {
+                const rdpq_blitinst_t *inst = &insts[i];
+                int it1 = inst->t0 + (inst->height ? inst->height : surf->height);
+                if (inst->t0 < tx && it1 > t0)
+                    blit(inst, ltd_batch);
+            }
+        }
+
+        t0 = tx;
+    }
+}
+
 void rdpq_tex_upload_tlut(uint16_t *tlut, int color_idx, int num_colors)
 {
+    // Each palette entry is replicated 4 times in TMEM
+    bool cached = tex_cache_active();
+    tex_cache_entry_t key = {
+        .buffer = tlut, .s0 = color_idx, .s1 = num_colors,
+        .tmem_addr = TMEM_PALETTE_ADDR + color_idx*2*4, .tmem_size = num_colors*2*4,
+    };
+    if (cached) {
+        if (tex_cache_lookup(&key))
+            return;
+        tex_cache.loading = true;
+    }
+
     rdpq_set_texture_image_raw(0, PhysicalAddr(tlut), FMT_RGBA16, num_colors, 1);
     rdpq_set_tile(RDPQ_TILE_INTERNAL, FMT_I4, TMEM_PALETTE_ADDR + color_idx*2*4, num_colors, NULL);
     rdpq_load_tlut_raw(RDPQ_TILE_INTERNAL, 0, num_colors);
+
+    if (cached) {
+        tex_cache.loading = false;
+        tex_cache_insert(&key);
+    }
 }
 
 void rdpq_tex_multi_begin(void)
@@ -683,6 +940,7 @@ void rdpq_tex_multi_begin(void)
     if (multi_upload.used++ == 0) {
         multi_upload.bytes = 0;
         multi_upload.limit = 4096;
+        multi_upload.untracked = false;
         last_tload.tex = 0;
     }
 }
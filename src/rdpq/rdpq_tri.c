@@ -3,7 +3,8 @@
  * @brief RDP Command queue: triangle drawing routine
  * @ingroup rdp
  * 
- * This file contains the implementation of a single function: #rdpq_triangle.
+ * This file contains the implementation of #rdpq_triangle, and of its batched
+ * version #rdpq_triangle_batch.
  * 
  * The RDP triangle commands are complex to assemble because they are designed
  * for the hardware that will be drawing them, rather than for the programmer
@@ -17,6 +18,7 @@
 
 #include <math.h>
 #include <float.h>
+#ifdef N64
 #include "rdpq.h"
 #include "rdpq_tri.h"
 #include "rspq.h"
@@ -24,6 +26,56 @@
 #include "rdpq_constants.h"
 #include "utils.h"
 #include "debug.h"
+#else
+// Host build (see tools/rdpqtri). Only the CPU triangle setup (#rdpq_triangle_cpu)
+// is compiled: commands are written to the buffer pointed by rspq_cur_pointer
+// exactly as they would be enqueued into the RSP queue, and autosync is ignored.
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include "rdpq_tri.h"
+#include "rdpq_constants.h"
+#include "utils.h"
+#define assertf(expr, ...)              assert(expr)
+#define debugf(fmt, ...)                fprintf(stderr, fmt, ##__VA_ARGS__)
+#define RDPQ_OVL_ID                     (0xC << 28)
+#define RDPQ_CMD_TRI                    0x08
+#define AUTOSYNC_TILE(n)                (1    << (0+(n)))
+#define AUTOSYNC_TMEMS                  (0xFF << 8)
+#define AUTOSYNC_PIPE                   (1    << 16)
+#define _carg(value, mask, shift)       (((uint32_t)((value) & (mask))) << (shift))
+#define __rdpq_autosync_use(res)        ((void)(res))
+
+/** @brief Output pointer of the host build (set by the caller before each triangle) */
+uint32_t *rspq_cur_pointer;
+
+typedef struct {
+    uint32_t first_word;
+    uint32_t *pointer;
+    uint32_t *first;
+    bool is_first;
+} rspq_write_t;
+
+static inline rspq_write_t rspq_write_begin(uint32_t ovl_id, uint32_t cmd_id, int size) {
+    uint32_t *cur = rspq_cur_pointer;
+    rspq_cur_pointer += size;
+    return (rspq_write_t){ .first_word = ovl_id + (cmd_id<<24), .pointer = cur + 1, .first = cur, .is_first = 1 };
+}
+
+static inline void rspq_write_arg(rspq_write_t *w, uint32_t value) {
+    if (w->is_first) {
+        w->first_word |= value;
+        w->is_first = 0;
+    } else {
+        *w->pointer++ = value;
+    }
+}
+
+static inline void rspq_write_end(rspq_write_t *w) {
+    *w->first = w->first_word;
+}
+#endif
 
 /** @brief Set to 1 to activate tracing of all parameters of all triangles. */
 #define TRIANGLE_TRACE   0
@@ -342,7 +394,7 @@ static inline void __rdpq_write_tex_coeffs(rspq_write_t *w, rdpq_tri_edge_data_t
     rspq_write_arg(w, (DwDy_fixed&0xffff0000));
     rspq_write_arg(w, (DsDe_fixed<<16) | (DtDe_fixed&0xffff));
     rspq_write_arg(w, (DwDe_fixed<<16));
-    rspq_write_arg(w, (DsDy_fixed<<16) | (DtDy_fixed&&0xffff));
+    rspq_write_arg(w, (DsDy_fixed<<16) | (DtDy_fixed&0xffff));
     rspq_write_arg(w, (DwDy_fixed<<16));
 
     tracef("invw1-mul: %f (%08lx)\n", invw1, (int32_t)(invw1*65536));
@@ -462,6 +514,55 @@ void rdpq_triangle_cpu(const rdpq_trifmt_t *fmt, const float *v1, const float *v
     rspq_write_end(&w);
 }
 
+_Static_assert(sizeof(rdpq_trivtx_t) == RDPQ_TRIVTX_SIZE, "invalid sizeof(rdpq_trivtx_t)");
+
+/** @brief Convert a vertex to the fixed-point format used by the RSP triangle setup */
+__attribute__((always_inline))
+static inline void __rdpq_trivtx_from_float(const rdpq_trifmt_t *fmt, const float *v, const float *v_shade, rdpq_trivtx_t *out)
+{
+    // X,Y: s13.2
+    out->x = floorf(v[fmt->pos_offset+0] * 4.0f);
+    out->y = floorf(v[fmt->pos_offset+1] * 4.0f);
+
+    out->z = 0;
+    if (fmt->z_offset >= 0) {
+        out->z = v[fmt->z_offset+0] * 0x7FFF;
+    }
+    out->__padding = 0;
+
+    out->rgba = 0;
+    if (fmt->shade_offset >= 0) {
+        uint32_t r = v_shade[fmt->shade_offset+0] * 255.0;
+        uint32_t g = v_shade[fmt->shade_offset+1] * 255.0;
+        uint32_t b = v_shade[fmt->shade_offset+2] * 255.0;
+        uint32_t a = v_shade[fmt->shade_offset+3] * 255.0;
+        out->rgba = (r << 24) | (g << 16) | (b << 8) | a;
+    }
+
+    out->s = out->t = 0;
+    out->w = out->inv_w = 0;
+    if (fmt->tex_offset >= 0) {
+        out->s     = v[fmt->tex_offset+0] * 32.0f;
+        out->t     = v[fmt->tex_offset+1] * 32.0f;
+        out->w     = float_to_s16_16(1.0f / v[fmt->tex_offset+2]);
+        out->inv_w = float_to_s16_16(       v[fmt->tex_offset+2]);
+    }
+}
+
+#ifdef N64
+/** @brief Calculate the high word of the triangle command for the RSP triangle setup */
+static uint32_t __rdpq_tricmd(const rdpq_trifmt_t *fmt)
+{
+    uint32_t cmd_id = RDPQ_CMD_TRI;
+    if (fmt->shade_offset >= 0) cmd_id |= 0x4;
+    if (fmt->tex_offset >= 0)   cmd_id |= 0x2;
+    if (fmt->z_offset >= 0)     cmd_id |= 0x1;
+
+    return 0xC000 | (cmd_id << 8) | 
+        (fmt->tex_mipmaps ? (fmt->tex_mipmaps-1) << 3 : 0) | 
+        (fmt->tex_tile & 7);
+}
+
 /** @brief RDP triangle primitive assembled on the RSP */
 void rdpq_triangle_rsp(const rdpq_trifmt_t *fmt, const float *v1, const float *v2, const float *v3)
 {
@@ -475,59 +576,24 @@ void rdpq_triangle_rsp(const rdpq_trifmt_t *fmt, const float *v1, const float *v
     }
     __rdpq_autosync_use(res);
 
-    uint32_t cmd_id = RDPQ_CMD_TRI;
-    if (fmt->shade_offset >= 0) cmd_id |= 0x4;
-    if (fmt->tex_offset >= 0)   cmd_id |= 0x2;
-    if (fmt->z_offset >= 0)     cmd_id |= 0x1;
-
     const int TRI_DATA_LEN = ROUND_UP((2+1+1+3)*4, 16);
 
     const float *vtx[3] = {v1, v2, v3};
     for (int i=0;i<3;i++) {
-        const float *v = vtx[i];
-
-        // X,Y: s13.2
-        int16_t x = floorf(v[fmt->pos_offset+0] * 4.0f);
-        int16_t y = floorf(v[fmt->pos_offset+1] * 4.0f);
-        
-        int16_t z = 0;
-        if (fmt->z_offset >= 0) {
-            z = v[fmt->z_offset+0] * 0x7FFF;
-        } 
-
-        int32_t rgba = 0;
-        if (fmt->shade_offset >= 0) {
-            const float *v_shade = fmt->shade_flat ? v1 : v;
-            uint32_t r = v_shade[fmt->shade_offset+0] * 255.0;
-            uint32_t g = v_shade[fmt->shade_offset+1] * 255.0;
-            uint32_t b = v_shade[fmt->shade_offset+2] * 255.0;
-            uint32_t a = v_shade[fmt->shade_offset+3] * 255.0;
-            rgba = (r << 24) | (g << 16) | (b << 8) | a;
-        }
-
-        int16_t s=0, t=0;
-        int32_t w=0, inv_w=0;
-        if (fmt->tex_offset >= 0) {
-            s     = v[fmt->tex_offset+0] * 32.0f;
-            t     = v[fmt->tex_offset+1] * 32.0f;
-            w     = float_to_s16_16(1.0f / v[fmt->tex_offset+2]);
-            inv_w = float_to_s16_16(       v[fmt->tex_offset+2]);
-        }
+        rdpq_trivtx_t v;
+        __rdpq_trivtx_from_float(fmt, vtx[i], fmt->shade_flat ? v1 : vtx[i], &v);
 
         rspq_write(RDPQ_OVL_ID, RDPQ_CMD_TRIANGLE_DATA,
             TRI_DATA_LEN * i, 
-            (x << 16) | (y & 0xFFFF), 
-            (z << 16), 
-            rgba, 
-            (s << 16) | (t & 0xFFFF), 
-            w,
-            inv_w);
+            (v.x << 16) | (v.y & 0xFFFF), 
+            (v.z << 16), 
+            v.rgba, 
+            (v.s << 16) | (v.t & 0xFFFF), 
+            v.w,
+            v.inv_w);
     }
 
-    rspq_write(RDPQ_OVL_ID, RDPQ_CMD_TRIANGLE, 
-        0xC000 | (cmd_id << 8) | 
-        (fmt->tex_mipmaps ? (fmt->tex_mipmaps-1) << 3 : 0) | 
-        (fmt->tex_tile & 7));
+    rspq_write(RDPQ_OVL_ID, RDPQ_CMD_TRIANGLE, __rdpq_tricmd(fmt));
 }
 
 void rdpq_triangle(const rdpq_trifmt_t *fmt, const float *v1, const float *v2, const float *v3)
@@ -538,3 +604,80 @@ void rdpq_triangle(const rdpq_trifmt_t *fmt, const float *v1, const float *v2, c
     rdpq_triangle_rsp(fmt, v1, v2, v3);
 #endif
 }
+
+#endif /* N64 */
+
+void rdpq_trivtx_convert(const rdpq_trifmt_t *fmt, const float *vtx, int stride, int num_vertices, rdpq_trivtx_t *out)
+{
+    assertf(((uintptr_t)out & 7) == 0, "vertex array must be 8-byte aligned");
+
+    for (int i=0; i<num_vertices; i++) {
+        __rdpq_trivtx_from_float(fmt, vtx, vtx, &out[i]);
+        vtx += stride;
+    }
+
+    #ifdef N64
+    // Make the vertices visible to the RSP
+    data_cache_hit_writeback(out, num_vertices * sizeof(rdpq_trivtx_t));
+    #endif
+}
+
+#ifdef N64
+#if RDPQ_TRIANGLE_REFERENCE
+/** @brief Convert a vertex back to floating point, to draw a batch with the reference implementation */
+static void __rdpq_trivtx_to_float(const rdpq_trifmt_t *fmt, const rdpq_trivtx_t *v, float *out)
+{
+    out[fmt->pos_offset+0] = v->x / 4.0f;
+    out[fmt->pos_offset+1] = v->y / 4.0f;
+    if (fmt->z_offset >= 0)
+        out[fmt->z_offset+0] = v->z / (float)0x7FFF;
+    if (fmt->shade_offset >= 0) {
+        out[fmt->shade_offset+0] = ((v->rgba >> 24) & 0xFF) / 255.0f;
+        out[fmt->shade_offset+1] = ((v->rgba >> 16) & 0xFF) / 255.0f;
+        out[fmt->shade_offset+2] = ((v->rgba >>  8) & 0xFF) / 255.0f;
+        out[fmt->shade_offset+3] = ((v->rgba >>  0) & 0xFF) / 255.0f;
+    }
+    if (fmt->tex_offset >= 0) {
+        out[fmt->tex_offset+0] = v->s / 32.0f;
+        out[fmt->tex_offset+1] = v->t / 32.0f;
+        out[fmt->tex_offset+2] = v->inv_w / 65536.0f;
+    }
+}
+#endif
+
+void rdpq_triangle_batch(const rdpq_trifmt_t *fmt, const rdpq_trivtx_t *vertices, const uint16_t *indices, int num_triangles)
+{
+    assertf(!fmt->shade_flat || fmt->shade_offset < 0, "flat shading is not supported by rdpq_triangle_batch");
+    assertf(((uint32_t)vertices & 7) == 0, "vertex array must be 8-byte aligned");
+    assertf(((uint32_t)indices & 7) == 0, "index array must be 8-byte aligned");
+
+    if (num_triangles <= 0)
+        return;
+
+#if RDPQ_TRIANGLE_REFERENCE
+    for (int i=0; i<num_triangles; i++) {
+        float v[3][16];
+        for (int j=0; j<3; j++)
+            __rdpq_trivtx_to_float(fmt, &vertices[indices[i*3+j]], v[j]);
+        rdpq_triangle_cpu(fmt, v[0], v[1], v[2]);
+    }
+#else
+    uint32_t res = AUTOSYNC_PIPE;
+    if (fmt->tex_offset >= 0) {
+        res |= AUTOSYNC_TILE(fmt->tex_tile);
+        res |= AUTOSYNC_TMEM(0);
+    }
+    __rdpq_autosync_use(res);
+
+    // Make the indices visible to the RSP. The vertices were already
+    // written back by rdpq_trivtx_convert.
+    data_cache_hit_writeback(indices, num_triangles * 3 * sizeof(uint16_t));
+
+    rspq_write(RDPQ_OVL_ID, RDPQ_CMD_TRIANGLE_BATCH,
+        __rdpq_tricmd(fmt),
+        PhysicalAddr(vertices),
+        PhysicalAddr(indices),
+        num_triangles);
+#endif
+}
+#endif /* N64 */
@@ -105,15 +105,21 @@
  * 
  * ## Buffer swapping
  * 
- * Internally, double buffering is used to implement the queue. The size of
- * each of the buffers is RSPQ_DRAM_LOWPRI_BUFFER_SIZE. When a buffer is full,
- * the queue engine writes a #RSPQ_CMD_JUMP command with the address of the
- * other buffer, to tell the RSP to jump there when it is done. 
+ * Internally, a ring of buffers is used to implement the lowpri queue. By
+ * default, there are two buffers of RSPQ_DRAM_LOWPRI_BUFFER_SIZE words each
+ * (double buffering), but both the number and the size can be configured
+ * with #rspq_init_ex. When a buffer is full, the queue engine writes a
+ * #RSPQ_CMD_JUMP command with the address of the next buffer in the ring, to
+ * tell the RSP to jump there when it is done. 
  * 
- * Moreover, just before the jump, the engine also enqueue a #RSPQ_CMD_WRITE_STATUS
- * command that sets the SP_STATUS_SIG_BUFDONE_LOW signal. This is used to
- * keep track when the RSP has finished processing a buffer, so that we know
- * it becomes free again for more commands.
+ * Moreover, just before the jump, the engine also enqueues a #RSPQ_CMD_BUFFER_DONE
+ * command that writes an increasing sequence number to RDRAM. This is used to
+ * keep track of which buffers the RSP has finished processing, so that we know
+ * they become free again for more commands. With more than two buffers, the
+ * CPU can thus run several buffers ahead of the RSP before having to wait.
+ * 
+ * The highpri queue instead is always double buffered, and uses the
+ * SP_STATUS_SIG_BUFDONE_HIGH signal for the same purpose (via #RSPQ_CMD_WRITE_STATUS).
  * 
  * This logic is implemented in #rspq_next_buffer.
  *
@@ -197,7 +203,10 @@
 #include "utils.h"
 #include "n64sys.h"
 #include "debug.h"
+#include "asset.h"
 #include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
@@ -210,8 +219,32 @@
 // rsp_queue.S (see cmd_write_status there for an explanation).
 _Static_assert((RSPQ_CMD_WRITE_STATUS & 1) == 0);
 _Static_assert((RSPQ_CMD_TEST_WRITE_STATUS & 1) == 0);
+_Static_assert(RSPQ_MAX_OVERLAY_COUNT >= 2 && RSPQ_MAX_OVERLAY_COUNT <= RSPQ_OVERLAY_TABLE_SIZE,
+    "RSPQ_MAX_OVERLAY_COUNT must be between 2 and RSPQ_OVERLAY_TABLE_SIZE");
 /// @endcond
 
+/** @brief Maximum number of words written by #rspq_next_buffer at the end of a full buffer */
+#define RSPQ_BUFFER_EPILOG_SIZE     3
+
+/**
+ * @brief State of the rspq ucode as initialized in its data segment
+ * 
+ * The ucode exports the address and size of RSPQ_INTERNAL_COMMAND_TABLE
+ * through its state (see #rsp_queue_t), so that the CPU does not need to
+ * duplicate the DMEM layout of rsp_queue.inc.
+ */
+#define RSPQ_UCODE_STATE            ((const rsp_queue_t*)(rsp_queue.data + RSPQ_DATA_ADDRESS))
+
+/**
+ * @brief DMEM address of RSPQ_DMEM_BUFFER (see rsp_queue.inc)
+ * 
+ * The buffer follows the internal command table. In debug mode, it is preceded
+ * by #RSPQ_DEBUG_MARKER, which is used by the crash handler to verify that
+ * this address is correct.
+ */
+#define RSPQ_DMEM_BUFFER_ADDRESS    (ROUND_UP(RSPQ_UCODE_STATE->internal_command_table + \
+                                              RSPQ_UCODE_STATE->internal_command_table_size, 8) + (RSPQ_DEBUG ? 8 : 0))
+
 /** @brief Smaller version of rspq_write that writes to an arbitrary pointer */
 #define rspq_append1(ptr, cmd, arg1) ({ \
     ((volatile uint32_t*)(ptr))[0] = ((cmd)<<24) | (arg1); \
@@ -263,8 +296,8 @@ rsp_ucode_t *rspq_overlay_ucodes[RSPQ_MAX_OVERLAY_COUNT];
  * 
  * This structure contains the state of a RSP queue as it is built by the CPU.
  * It is instantiated two times: one for the lwopri queue, and one for the
- * highpri queue. It contains the two buffers used in the double buffering
- * scheme, and some metadata about the queue.
+ * highpri queue. It contains the ring of buffers (two buffers for the
+ * highpri queue, that is double buffering), and some metadata about the queue.
  * 
  * The current write pointer is stored in the "cur" field. The "sentinel" field
  * contains the pointer to the last byte at which a new command can start,
@@ -287,9 +320,12 @@ rsp_ucode_t *rspq_overlay_ucodes[RSPQ_MAX_OVERLAY_COUNT];
  * pointers point inside the block memory.
  */
 typedef struct {
-    void *buffers[2];                   ///< The two buffers used to build the RSP queue
+    void **buffers;                     ///< The ring of buffers used to build the RSP queue
+    int num_buffers;                    ///< Number of buffers in the ring
     int buf_size;                       ///< Size of each buffer in 32-bit words
     int buf_idx;                        ///< Index of the buffer currently being written to.
+    uint32_t *buf_seq;                  ///< Sequence number of the last submission of each buffer (lowpri only)
+    uint32_t seq;                       ///< Sequence number of the last submitted buffer (lowpri only)
     uint32_t sp_status_bufdone;         ///< SP status bit to signal that one buffer has been run by RSP
     uint32_t sp_wstatus_set_bufdone;    ///< SP mask to set the bufdone bit
     uint32_t sp_wstatus_clear_bufdone;  ///< SP mask to clear the bufdone bit
@@ -304,6 +340,12 @@ rspq_ctx_t *rspq_ctx;                   ///< Current context
 volatile uint32_t *rspq_cur_pointer;    ///< Copy of the current write pointer (see #rspq_ctx_t)
 volatile uint32_t *rspq_cur_sentinel;   ///< Copy of the current write sentinel (see #rspq_ctx_t)
 
+/** @brief Sequence number of the last lowpri buffer executed by RSP (written by #RSPQ_CMD_BUFFER_DONE) */
+static volatile uint32_t *rspq_lowpri_seq_done;
+
+/** @brief Statistics about the lowpri buffers (see #rspq_get_stats) */
+static rspq_stats_t rspq_stats;
+
 /** @brief Buffers that hold outgoing RDP commands (generated via RSP). */
 void *rspq_rdp_dynamic_buffers[2];
 
@@ -318,6 +360,13 @@ rspq_block_t *rspq_block;
 /** @brief Size of the current block memory buffer (in 32-bit words). */
 static int rspq_block_size;
 
+/** @brief State of the command batching (see #rspq_batch_begin) */
+static struct {
+    uint32_t *buffer;               ///< Buffer collecting the commands (CPU only, allocated at first use)
+    bool active;                    ///< True if commands are being collected into the buffer
+    int last_ovl;                   ///< Index of the overlay of the last submitted group (-1 if unknown)
+} rspq_batch;
+
 /** @brief ID that will be used for the next syncpoint that will be created. */
 static int rspq_syncpoints_genid;
 /** @brief ID of the last syncpoint reached by RSP. */
@@ -330,6 +379,7 @@ static bool rspq_is_running;
 static uint64_t dummy_overlay_state[2];
 
 static void rspq_flush_internal(void);
+static void rspq_batch_submit(void);
 
 /** @brief RSP interrupt handler, used for syncpoints. */
 static void rspq_sp_interrupt(void) 
@@ -381,7 +431,7 @@ static void rspq_crash_handler(rsp_snapshot_t *state)
 {
     rsp_queue_t *rspq = (rsp_queue_t*)(state->dmem + RSPQ_DATA_ADDRESS);
     uint32_t cur = rspq->rspq_dram_addr + state->gpr[28];
-    uint32_t dmem_buffer = RSPQ_DEBUG ? 0x160 : 0x100;
+    uint32_t dmem_buffer = RSPQ_DMEM_BUFFER_ADDRESS;
 
     int ovl_idx; const char *ovl_name; uint8_t ovl_id;
     rspq_get_current_ovl(rspq, &ovl_idx, &ovl_id, &ovl_name);
@@ -394,12 +444,11 @@ static void rspq_crash_handler(rsp_snapshot_t *state)
     printf("RSPQ: Current Overlay: %s (%x)\n", ovl_name, ovl_id);
 
     // Dump the command queue in DMEM. In debug mode, there is a marker to check
-    // if we know the correct address. TODO: find a way to expose the symbols
-    // from rsp_queue.inc.
+    // if we know the correct address.
     debugf("RSPQ: Command queue:\n");
     if (RSPQ_DEBUG)
         assertf(((uint32_t*)state->dmem)[dmem_buffer/4-1] == RSPQ_DEBUG_MARKER, 
-            "invalid RSPQ_DMEM_BUFFER address; please update rspq_crash_handler()");
+            "invalid RSPQ_DMEM_BUFFER address; please check RSPQ_DMEM_BUFFER_ADDRESS");
     for (int j=0;j<4;j++) {        
         for (int i=0;i<16;i++)
             debugf("%08lx%c", ((uint32_t*)state->dmem)[dmem_buffer/4+i+j*16], state->gpr[28] == (j*16+i)*4 ? '*' : ' ');
@@ -433,7 +482,7 @@ static void rspq_assert_invalid_command(rsp_snapshot_t *state)
     int ovl_idx; const char *ovl_name; uint8_t ovl_id;
     rspq_get_current_ovl(rspq, &ovl_idx, &ovl_id, &ovl_name);
 
-    uint32_t dmem_buffer = RSPQ_DEBUG ? 0x160 : 0x100;
+    uint32_t dmem_buffer = RSPQ_DMEM_BUFFER_ADDRESS;
     uint32_t cur = dmem_buffer + state->gpr[28];
     printf("Invalid command\nCommand %02x not found in overlay %s (0x%01x)\n", state->dmem[cur], ovl_name, ovl_id);
 }
@@ -499,9 +548,10 @@ static volatile uint32_t* rspq_switch_buffer(uint32_t *new, int size, bool clear
     assert(size >= RSPQ_MAX_COMMAND_SIZE);
     if (clear) memset(new, 0, size * sizeof(uint32_t));
 
-    // Switch to the new buffer, and calculate the new sentinel.
+    // Switch to the new buffer, and calculate the new sentinel. Leave room
+    // for the longest buffer epilog (see #rspq_next_buffer).
     rspq_cur_pointer = new;
-    rspq_cur_sentinel = new + size - RSPQ_MAX_SHORT_COMMAND_SIZE;
+    rspq_cur_sentinel = new + size - RSPQ_MAX_SHORT_COMMAND_SIZE - RSPQ_BUFFER_EPILOG_SIZE;
 
     // Return a pointer to the previous buffer
     return prev;
@@ -551,13 +601,16 @@ static void rspq_start(void)
 }
 
 /** @brief Initialize a rspq_ctx_t structure */
-static void rspq_init_context(rspq_ctx_t *ctx, int buf_size)
+static void rspq_init_context(rspq_ctx_t *ctx, int num_buffers, int buf_size)
 {
     memset(ctx, 0, sizeof(rspq_ctx_t));
-    ctx->buffers[0] = malloc_uncached(buf_size * sizeof(uint32_t));
-    ctx->buffers[1] = malloc_uncached(buf_size * sizeof(uint32_t));
-    memset(ctx->buffers[0], 0, buf_size * sizeof(uint32_t));
-    memset(ctx->buffers[1], 0, buf_size * sizeof(uint32_t));
+    ctx->buffers = malloc(num_buffers * sizeof(void*));
+    ctx->buf_seq = calloc(num_buffers, sizeof(uint32_t));
+    for (int i = 0; i < num_buffers; i++) {
+        ctx->buffers[i] = malloc_uncached(buf_size * sizeof(uint32_t));
+        memset(ctx->buffers[i], 0, buf_size * sizeof(uint32_t));
+    }
+    ctx->num_buffers = num_buffers;
     ctx->buf_idx = 0;
     ctx->buf_size = buf_size;
     ctx->cur = ctx->buffers[0];
@@ -566,27 +619,42 @@ static void rspq_init_context(rspq_ctx_t *ctx, int buf_size)
 
 static void rspq_close_context(rspq_ctx_t *ctx)
 {
-    free_uncached(ctx->buffers[1]);
-    free_uncached(ctx->buffers[0]);
+    for (int i = ctx->num_buffers-1; i >= 0; i--)
+        free_uncached(ctx->buffers[i]);
+    free(ctx->buffers);
+    free(ctx->buf_seq);
 }
 
 void rspq_init(void)
+{
+    rspq_init_ex(RSPQ_DRAM_LOWPRI_BUFFER_COUNT, RSPQ_DRAM_LOWPRI_BUFFER_SIZE);
+}
+
+void rspq_init_ex(int lowpri_buffers, int lowpri_buffer_size)
 {
     // Do nothing if rspq_init has already been called
     if (rspq_initialized)
         return;
 
+    assertf(lowpri_buffers >= 2, "the lowpri queue requires at least 2 buffers");
+    assertf(lowpri_buffer_size >= 2*RSPQ_MAX_COMMAND_SIZE, "lowpri buffers must be at least %d words", 2*RSPQ_MAX_COMMAND_SIZE);
+
     rspq_ctx = NULL;
     rspq_cur_pointer = NULL;
     rspq_cur_sentinel = NULL;
 
     // Allocate RSPQ contexts
-    rspq_init_context(&lowpri, RSPQ_DRAM_LOWPRI_BUFFER_SIZE);
+    rspq_init_context(&lowpri, lowpri_buffers, lowpri_buffer_size);
     lowpri.sp_status_bufdone = SP_STATUS_SIG_BUFDONE_LOW;
     lowpri.sp_wstatus_set_bufdone = SP_WSTATUS_SET_SIG_BUFDONE_LOW;
     lowpri.sp_wstatus_clear_bufdone = SP_WSTATUS_CLEAR_SIG_BUFDONE_LOW;
 
-    rspq_init_context(&highpri, RSPQ_DRAM_HIGHPRI_BUFFER_SIZE);
+    rspq_init_context(&highpri, 2, RSPQ_DRAM_HIGHPRI_BUFFER_SIZE);
+
+    // Allocate the word written by RSPQ_CMD_BUFFER_DONE (it must be 8-byte aligned)
+    rspq_lowpri_seq_done = malloc_uncached(sizeof(uint64_t));
+    *rspq_lowpri_seq_done = 0;
+    memset(&rspq_stats, 0, sizeof(rspq_stats));
     highpri.sp_status_bufdone = SP_STATUS_SIG_BUFDONE_HIGH;
     highpri.sp_wstatus_set_bufdone = SP_WSTATUS_SET_SIG_BUFDONE_HIGH;
     highpri.sp_wstatus_clear_bufdone = SP_WSTATUS_CLEAR_SIG_BUFDONE_HIGH;
@@ -602,6 +670,8 @@ void rspq_init(void)
     int banner_offset = ROUND_UP(RSPQ_DATA_ADDRESS + sizeof(rsp_queue_t), 16);
     assertf(!memcmp(rsp_queue.data + banner_offset, "Dragon RSP Queue", 16),
         "rsp_queue_t does not seem to match DMEM; did you forget to update it?");
+    assertf(RSPQ_UCODE_STATE->internal_command_table == banner_offset + 32,
+        "invalid internal command table address exported by rsp_queue.inc: %x", RSPQ_UCODE_STATE->internal_command_table);
 
     // Load initial settings
     memset(&rspq_data, 0, sizeof(rsp_queue_t));
@@ -616,6 +686,8 @@ void rspq_init(void)
     rspq_data.tables.overlay_descriptors[0].state = PhysicalAddr(dummy_overlay_state);
     rspq_data.tables.overlay_descriptors[0].data_size = sizeof(uint64_t)*2;
     rspq_data.current_ovl = 0;
+    rspq_data.internal_command_table = RSPQ_UCODE_STATE->internal_command_table;
+    rspq_data.internal_command_table_size = RSPQ_UCODE_STATE->internal_command_table_size;
     
     // Init syncpoints
     rspq_syncpoints_genid = 0;
@@ -670,6 +742,9 @@ void rspq_close(void)
 
     rspq_close_context(&highpri);
     rspq_close_context(&lowpri);
+    free_uncached((void*)rspq_lowpri_seq_done);
+    free(rspq_batch.buffer);
+    rspq_batch.buffer = NULL;
 
     set_SP_interrupt(0);
     unregister_SP_handler(rspq_sp_interrupt);
@@ -761,7 +836,7 @@ static uint32_t rspq_find_new_overlay_id(uint32_t slot_count)
 {
     uint32_t cur_free_slots = 0;
 
-    for (uint32_t i = 1; i <= RSPQ_OVERLAY_ID_COUNT - slot_count; i++)
+    for (uint32_t i = 1; i < RSPQ_OVERLAY_TABLE_SIZE; i++)
     {
         // If this slot is occupied, reset number of free slots found
         if (rspq_data.tables.overlay_table[i] != 0) {
@@ -836,6 +911,8 @@ static uint32_t rspq_overlay_register_internal(rsp_ucode_t *overlay_ucode, uint3
 
     uint32_t id = static_id >> 28;
     if (id != 0) {
+        assertf(id + slot_count <= RSPQ_OVERLAY_TABLE_SIZE,
+            "Overlay %s (%ld commands) does not fit at ID 0x%lx", overlay_ucode->name, command_count, id);
         for (uint32_t i = 0; i < slot_count; i++)
         {
             assertf(rspq_data.tables.overlay_table[id + i] == 0,
@@ -843,8 +920,8 @@ static uint32_t rspq_overlay_register_internal(rsp_ucode_t *overlay_ucode, uint3
         }
     } else {
         id = rspq_find_new_overlay_id(slot_count);
-        assertf(id != 0, "Not enough consecutive free slots available for overlay %s (%ld commands)!",
-            overlay_ucode->name, command_count);
+        assertf(id != 0, "Not enough consecutive free slots available for overlay %s (%ld commands, %ld slots)!",
+            overlay_ucode->name, command_count, slot_count);
     }
 
     // Write overlay info into descriptor table
@@ -929,11 +1006,18 @@ void rspq_overlay_unregister(uint32_t overlay_id)
  * 
  * If we're creating a block, we need to allocate a new buffer from the heap.
  * Otherwise, if we're writing into either the lowpri or the highpri queue,
- * we need to switch buffer (double buffering strategy), making sure the
- * other buffer has been already fully executed by the RSP.
+ * we need to switch to the next buffer of the ring, making sure it has been
+ * already fully executed by the RSP.
  */
 __attribute__((noinline))
 void rspq_next_buffer(void) {
+    // If we're batching commands, submit the ones collected so far, which
+    // empties the batch buffer.
+    if (rspq_batch.active) {
+        rspq_batch_submit();
+        return;
+    }
+
     // If we're creating a block
     if (rspq_block) {
         // Allocate next chunk (double the size of the current one).
@@ -956,37 +1040,80 @@ void rspq_next_buffer(void) {
     // commands.
     if (rdpq_trace) rdpq_trace();
 
-    // Wait until the previous buffer is executed by the RSP.
+    int prev_idx = rspq_ctx->buf_idx;
+    int next_idx = prev_idx + 1 < rspq_ctx->num_buffers ? prev_idx + 1 : 0;
+
+    // Wait until the next buffer is executed by the RSP.
     // We cannot write to it if it's still being executed.
     // FIXME: this should probably transition to a sync-point,
     // so that the kernel can switch away while waiting. Even
     // if the overhead of an interrupt is obviously higher.
     MEMORY_BARRIER();
-    if (!(*SP_STATUS & rspq_ctx->sp_status_bufdone)) {
-        rspq_flush_internal();
-        RSP_WAIT_LOOP(200) {
-            if (*SP_STATUS & rspq_ctx->sp_status_bufdone)
-                break;
+    if (rspq_ctx == &lowpri) {
+        // The RSP writes the sequence number of each lowpri buffer
+        // as it finishes it. Since buffers are executed in order, the next
+        // buffer is free if its last sequence number has been reached.
+        uint32_t seq = rspq_ctx->buf_seq[next_idx];
+        if ((int32_t)(seq - *rspq_lowpri_seq_done) > 0) {
+            uint32_t t0 = TICKS_READ();
+            rspq_flush_internal();
+            RSP_WAIT_LOOP(200) {
+                if ((int32_t)(seq - *rspq_lowpri_seq_done) <= 0)
+                    break;
+            }
+            uint32_t elapsed = TICKS_SINCE(t0);
+            rspq_stats.stalls++;
+            rspq_stats.stall_ticks += elapsed;
+            if (elapsed > rspq_stats.max_stall_ticks)
+                rspq_stats.max_stall_ticks = elapsed;
+        }
+    } else {
+        if (!(*SP_STATUS & rspq_ctx->sp_status_bufdone)) {
+            rspq_flush_internal();
+            RSP_WAIT_LOOP(200) {
+                if (*SP_STATUS & rspq_ctx->sp_status_bufdone)
+                    break;
+            }
         }
+        MEMORY_BARRIER();
+        *SP_STATUS = rspq_ctx->sp_wstatus_clear_bufdone;
     }
     MEMORY_BARRIER();
-    *SP_STATUS = rspq_ctx->sp_wstatus_clear_bufdone;
-    MEMORY_BARRIER();
 
     // Switch current buffer
-    rspq_ctx->buf_idx = 1-rspq_ctx->buf_idx;
-    uint32_t *new = rspq_ctx->buffers[rspq_ctx->buf_idx];
+    rspq_ctx->buf_idx = next_idx;
+    uint32_t *new = rspq_ctx->buffers[next_idx];
     volatile uint32_t *prev = rspq_switch_buffer(new, rspq_ctx->buf_size, true);
 
-    // Terminate the previous buffer with an op to set SIG_BUFDONE
-    // (to notify when the RSP finishes the buffer), plus a jump to
-    // the new buffer.
-    rspq_append1(prev, RSPQ_CMD_WRITE_STATUS, rspq_ctx->sp_wstatus_set_bufdone);
+    // Terminate the previous buffer with an op to notify when the RSP
+    // finishes the buffer, plus a jump to the new buffer.
+    if (rspq_ctx == &lowpri) {
+        uint32_t seq = ++rspq_ctx->seq;
+        rspq_ctx->buf_seq[prev_idx] = seq;
+        rspq_append2(prev, RSPQ_CMD_BUFFER_DONE, PhysicalAddr(rspq_lowpri_seq_done), seq);
+
+        int ahead = seq - *rspq_lowpri_seq_done;
+        rspq_stats.buffers++;
+        if (ahead > rspq_stats.max_buffers_ahead)
+            rspq_stats.max_buffers_ahead = ahead;
+    } else {
+        rspq_append1(prev, RSPQ_CMD_WRITE_STATUS, rspq_ctx->sp_wstatus_set_bufdone);
+    }
     rspq_append1(prev, RSPQ_CMD_JUMP, PhysicalAddr(new));
-    assert(prev+1 < (uint32_t*)(rspq_ctx->buffers[1-rspq_ctx->buf_idx]) + rspq_ctx->buf_size);
+    assert(prev <= (uint32_t*)(rspq_ctx->buffers[prev_idx]) + rspq_ctx->buf_size);
     rspq_flush_internal();
 }
 
+void rspq_get_stats(rspq_stats_t *stats)
+{
+    *stats = rspq_stats;
+}
+
+void rspq_reset_stats(void)
+{
+    memset(&rspq_stats, 0, sizeof(rspq_stats));
+}
+
 __attribute__((noinline))
 static void rspq_flush_internal(void)
 {
@@ -1015,8 +1142,9 @@ static void rspq_flush_internal(void)
 
 void rspq_flush(void)
 {
-    // If we are recording a block, flushes can be ignored.
-    if (rspq_block) return;
+    // If we are recording a block or batching commands, flushes can be
+    // ignored: the commands are not in the queue yet.
+    if (rspq_block || rspq_batch.active) return;
 
     rspq_flush_internal();
     if (rdpq_trace) rdpq_trace();
@@ -1026,6 +1154,7 @@ void rspq_highpri_begin(void)
 {
     assertf(rspq_ctx != &highpri, "already in highpri mode");
     assertf(!rspq_block, "cannot switch to highpri mode while creating a block");
+    assertf(!rspq_batch.active, "cannot switch to highpri mode while batching commands");
 
     rspq_switch_context(&highpri);
 
@@ -1103,12 +1232,14 @@ void rspq_block_begin(void)
 {
     assertf(!rspq_block, "a block was already being created");
     assertf(rspq_ctx != &highpri, "cannot create a block in highpri mode");
+    assertf(!rspq_batch.active, "cannot create a block while batching commands");
 
     // Allocate a new block (at minimum size) and initialize it.
     rspq_block_size = RSPQ_BLOCK_MIN_SIZE;
     rspq_block = malloc_uncached(sizeof(rspq_block_t) + rspq_block_size*sizeof(uint32_t));
     rspq_block->nesting_level = 0;
     rspq_block->rdp_block = NULL;
+    rspq_block->loaded = false;
 
     // Switch to the block buffer. From now on, all rspq_writes will
     // go into the block.
@@ -1140,6 +1271,12 @@ rspq_block_t* rspq_block_end(void)
 
 void rspq_block_free(rspq_block_t *block)
 {
+    // Deserialized blocks are made by a single allocation
+    if (block->loaded) {
+        free_uncached(block);
+        return;
+    }
+
     // Free RDP blocks first
     __rdpq_block_free(block->rdp_block);
 
@@ -1211,6 +1348,500 @@ void rspq_block_run_rsp(int nesting_level)
     }    
 }
 
+/** @brief Chunk of a block being serialized (see #rspq_block_serialize) */
+typedef struct {
+    volatile uint32_t *cmds;    ///< Start of the chunk
+    int size;                   ///< Used size of the chunk in 32-bit words
+    int offset;                 ///< Offset of the chunk in the image (bytes)
+} rspq_block_chunk_t;
+
+void* rspq_block_serialize(rspq_block_t *block, int *size)
+{
+    assertf(!block->loaded, "cannot serialize a block that was deserialized");
+    assertf(block->nesting_level == 0, "cannot serialize a block that calls other blocks");
+
+    // Go through the chunks of the block, like rspq_block_free does. The
+    // commands of each chunk are copied up to the JUMP to the next chunk,
+    // so that they end up contiguous in the image.
+    rspq_block_chunk_t rspq_chunks[32], rdp_chunks[32];
+    int num_rspq_chunks = 0, num_rdp_chunks = 0;
+    int offset = sizeof(rspq_block_t);
+
+    int chunk_size = RSPQ_BLOCK_MIN_SIZE;
+    volatile uint32_t *start = block->cmds;
+    volatile uint32_t *ptr = (uint32_t*)block->cmds + chunk_size;
+    while (1) {
+        while (*--ptr == 0x00) {}
+        uint32_t cmd = *ptr;
+        assertf(num_rspq_chunks < 32, "block too big to be serialized");
+        rspq_block_chunk_t *c = &rspq_chunks[num_rspq_chunks++];
+        c->cmds = start;
+        c->offset = offset;
+        if (cmd>>24 == RSPQ_CMD_JUMP) {
+            c->size = ptr - start;
+            offset += c->size * sizeof(uint32_t);
+            start = UncachedAddr(0x80000000 | (cmd & 0xFFFFFF));
+            if (chunk_size < RSPQ_BLOCK_MAX_SIZE) chunk_size *= 2;
+            ptr = start + chunk_size;
+            continue;
+        }
+        assertf(cmd>>24 == RSPQ_CMD_RET, "invalid terminator command in block: %08lx\n", cmd);
+        c->size = ptr - start + 1;
+        offset += c->size * sizeof(uint32_t);
+        break;
+    }
+
+    // RDP static buffers are copied as-is (including the unused space at the
+    // end, as the last one is used for dynamic commands after the block runs).
+    offset = ROUND_UP(offset, 8);
+    int rdp_offset = offset;
+    chunk_size = RDPQ_BLOCK_MIN_SIZE;
+    for (rdpq_block_t *b = block->rdp_block; b; b = b->next) {
+        assertf(num_rdp_chunks < 32, "block too big to be serialized");
+        rspq_block_chunk_t *c = &rdp_chunks[num_rdp_chunks++];
+        c->cmds = (uint32_t*)b;
+        c->size = (sizeof(rdpq_block_t) + chunk_size * sizeof(uint32_t)) / sizeof(uint32_t);
+        c->offset = offset;
+        offset += c->size * sizeof(uint32_t);
+        if (chunk_size < RDPQ_BLOCK_MAX_SIZE) chunk_size *= 2;
+    }
+    if (!num_rdp_chunks) rdp_offset = 0;
+
+    int num_relocs = block->rdp_block ? block->rdp_block->num_relocs : 0;
+    int total_size = sizeof(rspq_block_header_t) + offset + num_relocs * sizeof(uint32_t);
+    uint8_t *buf = malloc(total_size);
+    rspq_block_header_t *header = (rspq_block_header_t*)buf;
+    uint8_t *image = buf + sizeof(rspq_block_header_t);
+    uint32_t *relocs = (uint32_t*)(image + offset);
+    memset(image, 0, offset);
+
+    *header = (rspq_block_header_t){
+        .magic = RSPQ_BLOCK_MAGIC,
+        .version = RSPQ_BLOCK_VERSION,
+        .image_size = offset,
+        .rdp_offset = rdp_offset,
+        .num_relocs = num_relocs,
+    };
+
+    for (int i=0; i<num_rspq_chunks; i++)
+        memcpy(image + rspq_chunks[i].offset, (void*)rspq_chunks[i].cmds, rspq_chunks[i].size * sizeof(uint32_t));
+    for (int i=0; i<num_rdp_chunks; i++) {
+        rdpq_block_t *b = (rdpq_block_t*)(image + rdp_chunks[i].offset);
+        memcpy(b, (void*)rdp_chunks[i].cmds, rdp_chunks[i].size * sizeof(uint32_t));
+        b->next = NULL;
+        b->relocs = NULL;
+        b->num_relocs = 0;
+    }
+
+    // Convert the addresses of the RDP buffers (in RSPQ_CMD_RDP_SET_BUFFER and
+    // RSPQ_CMD_RDP_APPEND_BUFFER) into offsets within the image.
+    for (int i=0; i<num_relocs; i++) {
+        volatile uint32_t *word = block->rdp_block->relocs[i];
+        int word_offset = -1;
+        for (int j=0; j<num_rspq_chunks; j++) {
+            if (word >= rspq_chunks[j].cmds && word < rspq_chunks[j].cmds + rspq_chunks[j].size) {
+                word_offset = rspq_chunks[j].offset + (word - rspq_chunks[j].cmds) * sizeof(uint32_t);
+                break;
+            }
+        }
+        assertf(word_offset >= 0, "relocation outside of the block");
+
+        uint32_t value = *word;
+        uint32_t addr = value & 0xFFFFFF;
+        int addr_offset = -1;
+        for (int j=0; j<num_rdp_chunks; j++) {
+            uint32_t rdp_start = PhysicalAddr(rdp_chunks[j].cmds) + offsetof(rdpq_block_t, cmds);
+            uint32_t rdp_end = PhysicalAddr(rdp_chunks[j].cmds + rdp_chunks[j].size);
+            // The end pointer of a buffer is a valid address as well
+            if (addr >= rdp_start && addr <= rdp_end) {
+                addr_offset = rdp_chunks[j].offset + (addr - PhysicalAddr(rdp_chunks[j].cmds));
+                break;
+            }
+        }
+        assertf(addr_offset >= 0, "RDP buffer address not within the block: %08lx", addr);
+
+        *(uint32_t*)(image + word_offset) = (value & 0xFF000000) | addr_offset;
+        relocs[i] = word_offset;
+    }
+
+    if (size) *size = total_size;
+    return buf;
+}
+
+rspq_block_t* rspq_block_deserialize(const void *buf, int size)
+{
+    const rspq_block_header_t *header = buf;
+    assertf(size >= sizeof(rspq_block_header_t) && header->magic == RSPQ_BLOCK_MAGIC, "invalid serialized block");
+    assertf(header->version == RSPQ_BLOCK_VERSION, "unsupported serialized block version: %ld", header->version);
+    assertf(size >= sizeof(rspq_block_header_t) + header->image_size + header->num_relocs * sizeof(uint32_t),
+        "truncated serialized block");
+
+    const uint8_t *image = (const uint8_t*)buf + sizeof(rspq_block_header_t);
+    const uint32_t *relocs = (const uint32_t*)(image + header->image_size);
+
+    // Relocate in cached memory, then write back the block into its
+    // final uncached allocation in one go.
+    rspq_block_t *block = malloc_uncached(header->image_size);
+    rspq_block_t *block_cached = CachedAddr(block);
+    data_cache_hit_invalidate(block_cached, header->image_size);
+    memcpy(block_cached, image, header->image_size);
+
+    uint32_t base = PhysicalAddr(block);
+    for (int i=0; i<header->num_relocs; i++) {
+        uint32_t *word = (uint32_t*)((uint8_t*)block_cached + relocs[i]);
+        *word = (*word & 0xFF000000) | ((*word & 0xFFFFFF) + base);
+    }
+
+    block_cached->nesting_level = 0;
+    block_cached->rdp_block = header->rdp_offset ? (rdpq_block_t*)((uint8_t*)block + header->rdp_offset) : NULL;
+    block_cached->loaded = true;
+    data_cache_hit_writeback_invalidate(block_cached, header->image_size);
+    return block;
+}
+
+void rspq_block_save(rspq_block_t *block, const char *fn)
+{
+    int size;
+    void *buf = rspq_block_serialize(block, &size);
+
+    FILE *f = fopen(fn, "wb");
+    assertf(f, "cannot create file: %s", fn);
+    fwrite(buf, 1, size, f);
+    fclose(f);
+    free(buf);
+}
+
+rspq_block_t* rspq_block_load(const char *fn)
+{
+    int size;
+    void *buf = asset_load(fn, &size);
+    rspq_block_t *block = rspq_block_deserialize(buf, size);
+    free(buf);
+    return block;
+}
+
+/**
+ * @brief Get the size of a command collected in a batch, and the overlay that runs it
+ * 
+ * The size is read from the command descriptor, either in the internal
+ * command table, or in the header of the overlay the command belongs to.
+ * 
+ * @param cmd           First word of the command
+ * @param[out] ovl_idx  Index of the overlay (0 for internal commands)
+ * @return              Size of the command in 32-bit words
+ */
+static int rspq_batch_command_size(uint32_t cmd, int *ovl_idx)
+{
+    uint32_t id = cmd >> 24;
+    uint16_t *commands;
+
+    if ((id >> 4) == 0) {
+        *ovl_idx = 0;
+        commands = (uint16_t*)(rsp_queue.data + RSPQ_UCODE_STATE->internal_command_table);
+        assertf(id < RSPQ_UCODE_STATE->internal_command_table_size / 2, "invalid batched command %02lx", id);
+    } else {
+        *ovl_idx = rspq_data.tables.overlay_table[id >> 4] / sizeof(rspq_overlay_t);
+        assertf(*ovl_idx != 0, "batched command %02lx belongs to an unregistered overlay", id);
+
+        uint32_t rspq_data_size = rsp_queue_data_end - rsp_queue_data_start;
+        rspq_overlay_header_t *header = (rspq_overlay_header_t*)(rspq_overlay_ucodes[*ovl_idx]->data + rspq_data_size);
+        commands = header->commands;
+        id -= header->command_base >> 1;
+    }
+
+    int size = (commands[id] >> 8) & 0xFC;
+    assertf(size > 0, "invalid batched command %02lx", cmd >> 24);
+    return size / 4;
+}
+
+/** @brief Copy a command collected in a batch into the lowpri queue */
+static void rspq_batch_emit(const uint32_t *cmd, int size)
+{
+    if (__builtin_expect(rspq_cur_pointer > rspq_cur_sentinel - size, 0))
+        rspq_next_buffer();
+
+    // Write the first word last, as the RSP might be already waiting for it.
+    volatile uint32_t *cur = rspq_cur_pointer;
+    for (int i = size - 1; i > 0; i--)
+        cur[i] = cmd[i];
+    cur[0] = cmd[0];
+    rspq_cur_pointer += size;
+}
+
+/**
+ * @brief Submit the commands collected in the batch buffer to the lowpri queue
+ * 
+ * Commands are grouped by overlay (keeping their relative order within each
+ * overlay), so that the RSP switches overlay only once per group. Internal
+ * commands (eg: DMA, block calls, RDP buffer management) are never moved and
+ * act as barriers: commands are only grouped between two internal commands.
+ * The group of the overlay submitted last is submitted first, as it will be
+ * already loaded in the RSP. At the end, the batch buffer is empty.
+ * 
+ * Groups that contain rdpq commands are submitted in their original order:
+ * the sync commands emitted by the rdpq autosync engine (and the RDP commands
+ * in general) must not be moved past the commands of other overlays that
+ * might generate RDP commands too.
+ */
+static void rspq_batch_submit(void)
+{
+    uint32_t *start = rspq_batch.buffer;
+    uint32_t *end = (uint32_t*)rspq_cur_pointer;
+
+    // Temporarily go back to the lowpri queue.
+    rspq_batch.active = false;
+    rspq_switch_context(&lowpri);
+
+    // Index of the rdpq overlay (0 if rdpq is not initialized)
+    int rdpq_ovl_idx = rspq_data.tables.overlay_table[RDPQ_OVL_ID >> 28] / sizeof(rspq_overlay_t);
+
+    uint32_t *cur = start;
+    while (cur < end) {
+        // Find the overlays used up to the next internal command, in order
+        // of first appearance, and count the switches in the original order.
+        int order[RSPQ_MAX_OVERLAY_COUNT];
+        int num_ovls = 0;
+        uint32_t seen = 0;
+        int prev = rspq_batch.last_ovl;
+        int orig_switches = 0;
+        bool has_rdpq = false;
+        uint32_t *group_start = cur;
+        int ovl_idx, size;
+
+        while (cur < end) {
+            size = rspq_batch_command_size(*cur, &ovl_idx);
+            if (ovl_idx == 0) break;
+            if (!(seen & (1 << ovl_idx))) {
+                seen |= 1 << ovl_idx;
+                // Move the overlay that is already loaded to the front
+                if (ovl_idx == rspq_batch.last_ovl) {
+                    memmove(order+1, order, num_ovls*sizeof(int));
+                    order[0] = ovl_idx;
+                    num_ovls++;
+                } else {
+                    order[num_ovls++] = ovl_idx;
+                }
+            }
+            if (ovl_idx != prev) orig_switches++;
+            if (ovl_idx == rdpq_ovl_idx) has_rdpq = true;
+            prev = ovl_idx;
+            cur += size;
+        }
+
+        int switches = 0;
+        if (has_rdpq) {
+            // Do not reorder: submit the commands as they were written.
+            for (uint32_t *ptr = group_start; ptr < cur; ptr += size) {
+                size = rspq_batch_command_size(*ptr, &ovl_idx);
+                rspq_batch_emit(ptr, size);
+            }
+            switches = orig_switches;
+            if (cur > group_start) rspq_batch.last_ovl = prev;
+        } else {
+            // Submit the commands, one overlay at a time.
+            for (int i = 0; i < num_ovls; i++) {
+                for (uint32_t *ptr = group_start; ptr < cur; ptr += size) {
+                    size = rspq_batch_command_size(*ptr, &ovl_idx);
+                    if (ovl_idx == order[i])
+                        rspq_batch_emit(ptr, size);
+                }
+                if (order[i] != rspq_batch.last_ovl) switches++;
+                rspq_batch.last_ovl = order[i];
+            }
+        }
+        rspq_stats.batch_switches += switches;
+        rspq_stats.batch_switches_saved += orig_switches - switches;
+
+        // Submit the internal command (if any) that stopped the grouping.
+        if (cur < end) {
+            size = rspq_batch_command_size(*cur, &ovl_idx);
+            rspq_batch_emit(cur, size);
+            cur += size;
+        }
+    }
+
+    // Switch back to the (now empty) batch buffer.
+    rspq_switch_context(NULL);
+    rspq_switch_buffer(rspq_batch.buffer, RSPQ_BATCH_BUFFER_SIZE, false);
+    rspq_batch.active = true;
+}
+
+void rspq_batch_begin(void)
+{
+    assertf(!rspq_batch.active, "commands are already being batched");
+    assertf(!rspq_block, "cannot batch commands while creating a block");
+    assertf(rspq_ctx != &highpri, "cannot batch commands in highpri mode");
+
+    if (!rspq_batch.buffer)
+        rspq_batch.buffer = malloc(RSPQ_BATCH_BUFFER_SIZE * sizeof(uint32_t));
+
+    // The overlay loaded in the RSP at the end of the queue is unknown.
+    rspq_batch.last_ovl = -1;
+    rspq_batch.active = true;
+
+    // Switch to the batch buffer. From now on, all rspq_writes will
+    // go into the batch buffer.
+    rspq_switch_context(NULL);
+    rspq_switch_buffer(rspq_batch.buffer, RSPQ_BATCH_BUFFER_SIZE, false);
+}
+
+void rspq_batch_end(void)
+{
+    assertf(rspq_batch.active, "commands were not being batched");
+
+    rspq_batch_submit();
+    rspq_batch.active = false;
+    rspq_switch_context(&lowpri);
+}
+
+#if RSPQ_PROFILE
+
+/** @brief State of the command profiler */
+static struct {
+    uint32_t *buffers[2];           ///< RDRAM buffers receiving the log (alternated at each frame)
+    int cur;                        ///< Index of the buffer currently written by RSP
+    bool pending;                   ///< True if the other buffer contains a frame not yet parsed
+    rspq_syncpoint_t sync;          ///< Syncpoint after the end of the pending frame
+    uint32_t frame_ticks;           ///< CPU ticks at the start of the current frame
+    rspq_profile_data_t data;       ///< Statistics accumulated so far
+} rspq_prof;
+
+/** @brief Accumulate the statistics of a frame written by #RSPQ_CMD_PROFILE */
+static void rspq_profile_parse(uint32_t *buf)
+{
+    rspq_profile_header_t *hdr = (rspq_profile_header_t*)buf;
+    uint32_t *log = buf + RSPQ_PROFILE_HEADER_SIZE / sizeof(uint32_t);
+
+    for (int i = 0; i < hdr->log_size / sizeof(uint32_t); i++) {
+        if (log[i] == RSPQ_PROFILE_PAD)
+            continue;
+        uint32_t cycles = log[i] & 0xFFFFFF;
+        rspq_profile_cmd_t *cmd = &rspq_prof.data.cmds[log[i] >> 24];
+        int bucket = cycles ? 32 - __builtin_clz(cycles) : 0;
+        if (bucket >= RSPQ_PROFILE_HIST_BUCKETS) bucket = RSPQ_PROFILE_HIST_BUCKETS-1;
+        cmd->count++;
+        cmd->total += cycles;
+        if (cycles > cmd->max) cmd->max = cycles;
+        cmd->hist[bucket]++;
+    }
+
+    rspq_prof.data.frames++;
+    rspq_prof.data.clock += hdr->clock;
+    rspq_prof.data.rdp_busy += hdr->busy;
+    rspq_prof.data.rdp_pipe += hdr->pipe;
+    rspq_prof.data.rdp_tmem += hdr->tmem;
+    rspq_prof.data.dropped += hdr->dropped;
+    rspq_prof.data.switches += hdr->switches;
+    rspq_prof.data.switch_cycles += hdr->switch_cycles;
+}
+
+/** @brief Close the current profiling frame, switching the RSP to the specified buffer */
+static void rspq_profile_frame(uint32_t *next)
+{
+    // Parse the frame that was closed last time, as its buffer is going
+    // to be reused for the next frame.
+    if (rspq_prof.pending) {
+        rspq_syncpoint_wait(rspq_prof.sync);
+        rspq_profile_parse(rspq_prof.buffers[rspq_prof.cur^1]);
+        rspq_prof.pending = false;
+    }
+
+    rspq_int_write(RSPQ_CMD_PROFILE, next ? PhysicalAddr(next) : 0, RSPQ_PROFILE_BUFFER_SIZE);
+    rspq_prof.sync = rspq_syncpoint_new();
+    rspq_prof.pending = true;
+    rspq_prof.cur ^= 1;
+
+    uint32_t now = TICKS_READ();
+    rspq_prof.data.cpu_ticks += TICKS_DISTANCE(rspq_prof.frame_ticks, now);
+    rspq_prof.frame_ticks = now;
+}
+
+void rspq_profile_start(void)
+{
+    assertf(!rspq_prof.buffers[0], "rspq profiler already started");
+    rspq_prof.buffers[0] = malloc_uncached(RSPQ_PROFILE_BUFFER_SIZE);
+    rspq_prof.buffers[1] = malloc_uncached(RSPQ_PROFILE_BUFFER_SIZE);
+    rspq_prof.cur = 0;
+    rspq_prof.pending = false;
+
+    rspq_int_write(RSPQ_CMD_PROFILE, PhysicalAddr(rspq_prof.buffers[0]), RSPQ_PROFILE_BUFFER_SIZE);
+    rspq_prof.frame_ticks = TICKS_READ();
+}
+
+void rspq_profile_next_frame(void)
+{
+    if (!rspq_prof.buffers[0])
+        return;
+    rspq_profile_frame(rspq_prof.buffers[rspq_prof.cur^1]);
+}
+
+void rspq_profile_stop(void)
+{
+    if (!rspq_prof.buffers[0])
+        return;
+
+    // Close the last frame, and wait for it to be written
+    rspq_profile_frame(NULL);
+    rspq_syncpoint_wait(rspq_prof.sync);
+    rspq_profile_parse(rspq_prof.buffers[rspq_prof.cur^1]);
+
+    free_uncached(rspq_prof.buffers[0]);
+    free_uncached(rspq_prof.buffers[1]);
+    rspq_prof.buffers[0] = rspq_prof.buffers[1] = NULL;
+    rspq_prof.pending = false;
+}
+
+void rspq_profile_reset(void)
+{
+    memset(&rspq_prof.data, 0, sizeof(rspq_prof.data));
+}
+
+void rspq_profile_get_data(rspq_profile_data_t *data)
+{
+    *data = rspq_prof.data;
+}
+
+void rspq_profile_dump(void)
+{
+    debugf("[rspq_profile] frames %llu cpu_us %llu clock %llu rdp_busy %llu rdp_pipe %llu rdp_tmem %llu dropped %llu switches %llu switch_cycles %llu\n",
+        rspq_prof.data.frames, TICKS_TO_US(rspq_prof.data.cpu_ticks), rspq_prof.data.clock,
+        rspq_prof.data.rdp_busy, rspq_prof.data.rdp_pipe, rspq_prof.data.rdp_tmem, rspq_prof.data.dropped,
+        rspq_prof.data.switches, rspq_prof.data.switch_cycles);
+
+    for (int id = 0; id < 256; id++) {
+        rspq_profile_cmd_t *cmd = &rspq_prof.data.cmds[id];
+        if (!cmd->count)
+            continue;
+
+        const char *ovl_name = "builtin";
+        if (id >> 4) {
+            int ovl_idx = rspq_data.tables.overlay_table[id >> 4] / sizeof(rspq_overlay_t);
+            ovl_name = rspq_overlay_ucodes[ovl_idx] ? rspq_overlay_ucodes[ovl_idx]->name : "?";
+        }
+
+        char hist[RSPQ_PROFILE_HIST_BUCKETS*11+1]; int n = 0;
+        for (int i = 0; i < RSPQ_PROFILE_HIST_BUCKETS; i++)
+            n += sprintf(hist+n, " %lu", cmd->hist[i]);
+        debugf("[rspq_profile] cmd 0x%02x %s %llu %llu %lu%s\n",
+            id, ovl_name, cmd->count, cmd->total, cmd->max, hist);
+    }
+}
+
+#else
+
+void rspq_profile_start(void)
+{
+    assertf(0, "rspq profiler not available: rebuild libdragon and the RSP ucodes with RSPQ_PROFILE=1");
+}
+
+void rspq_profile_next_frame(void) {}
+void rspq_profile_stop(void) {}
+void rspq_profile_reset(void) {}
+void rspq_profile_dump(void) {}
+void rspq_profile_get_data(rspq_profile_data_t *data) { memset(data, 0, sizeof(*data)); }
+
+#endif /* RSPQ_PROFILE */
+
 void rspq_noop()
 {
     rspq_int_write(RSPQ_CMD_NOOP);
@@ -1220,6 +1851,7 @@ rspq_syncpoint_t rspq_syncpoint_new(void)
 {   
     assertf(rspq_ctx != &highpri, "cannot create syncpoint in highpri mode");
     assertf(!rspq_block, "cannot create syncpoint in a block");
+    assertf(!rspq_batch.active, "cannot create syncpoint while batching commands");
     assertf(rspq_ctx != &highpri, "cannot create syncpoint in highpri mode");
 
     // To create a syncpoint, schedule a CMD_TEST_WRITE_STATUS command that:
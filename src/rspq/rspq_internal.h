@@ -140,8 +140,49 @@ enum {
      * commands appended in the current buffer to be sent to RDP.
      */
     RSPQ_CMD_RDP_APPEND_BUFFER = 0x0B,
+
+    /**
+     * @brief RSPQ Command: notify that a buffer of the lowpri queue has been executed
+     * 
+     * This command writes a sequence number to a 8-byte aligned word in RDRAM.
+     * It is placed at the end of each buffer of the lowpri queue, so that the
+     * CPU knows when a buffer of the ring can be reused (see #rspq_next_buffer).
+     */
+    RSPQ_CMD_BUFFER_DONE       = 0x0C,
+
+    /**
+     * @brief RSPQ Command: close the current profiling frame and start a new one
+     * 
+     * This command is only available if #RSPQ_PROFILE is enabled. It writes
+     * the profiling log of the current frame (if any) to its RDRAM buffer,
+     * prefixed by a #rspq_profile_header_t, and then starts logging into the
+     * new buffer specified as argument (or stops profiling, if it is NULL).
+     */
+    RSPQ_CMD_PROFILE           = 0x0D,
 };
 
+/**
+ * @brief Header of a profiling buffer, written by #RSPQ_CMD_PROFILE
+ * 
+ * The header is followed by the log of the commands executed during the frame.
+ * Each entry is a 32-bit word containing the command ID in the top 8 bits, and
+ * its duration in RCP cycles in the lower 24 bits (#RSPQ_PROFILE_PAD entries
+ * must be skipped). The RDP counters are reset at the start of each frame, so
+ * they refer to the frame only.
+ */
+typedef struct {
+    uint32_t log_size;          ///< Size of the log following the header (in bytes)
+    uint32_t clock;             ///< DP_CLOCK: RCP cycles elapsed in the frame
+    uint32_t busy;              ///< DP_BUSY: cycles in which the RDP was busy
+    uint32_t pipe;              ///< DP_PIPE_BUSY: cycles in which the RDP pipeline was busy
+    uint32_t tmem;              ///< DP_TMEM_BUSY: cycles in which TMEM was busy
+    uint32_t dropped;           ///< Number of log entries dropped because the buffer was full
+    uint32_t switches;          ///< Number of overlay switches
+    uint32_t switch_cycles;     ///< RCP cycles spent switching overlays (DMA transfers)
+} rspq_profile_header_t;
+
+_Static_assert(sizeof(rspq_profile_header_t) == RSPQ_PROFILE_HEADER_SIZE);
+
 /** @brief Write an internal command to the RSP queue */
 #define rspq_int_write(cmd_id, ...) rspq_write(0, cmd_id, ##__VA_ARGS__)
 
@@ -160,9 +201,35 @@ typedef struct rdpq_block_s rdpq_block_t;
 typedef struct rspq_block_s {
     uint32_t nesting_level;     ///< Nesting level of the block
     rdpq_block_t *rdp_block;    ///< Option RDP static buffer (with RDP commands)
+    bool loaded;                ///< True if the block was deserialized (it is a single allocation)
     uint32_t cmds[];            ///< Block contents (commands)
 } rspq_block_t;
 
+/** @brief Magic value at the start of a serialized block ("RSPB") */
+#define RSPQ_BLOCK_MAGIC        0x52535042
+/** @brief Version of the serialized block format */
+#define RSPQ_BLOCK_VERSION      1
+
+/**
+ * @brief Header of a serialized block (see #rspq_block_serialize)
+ * 
+ * The header is followed by the block image, which is the memory layout
+ * of the block as it will be after loading: a #rspq_block_t with all the
+ * commands in a single contiguous buffer (chunks are merged, so no
+ * #RSPQ_CMD_JUMP is needed), followed by the RDP static buffers, if any.
+ * 
+ * The image is followed by the relocation table: one entry per word of
+ * the image whose lowest 24 bits contain an offset within the image, that
+ * must be converted to a physical address when the block is loaded. 
+ */
+typedef struct {
+    uint32_t magic;             ///< Magic value (#RSPQ_BLOCK_MAGIC)
+    uint32_t version;           ///< Version of the format (#RSPQ_BLOCK_VERSION)
+    uint32_t image_size;        ///< Size of the block image in bytes
+    uint32_t rdp_offset;        ///< Offset of the first RDP static buffer in the image (0 if none)
+    uint32_t num_relocs;        ///< Number of relocations (offsets of words in the image)
+} rspq_block_header_t;
+
 /** @brief RDP render mode definition 
  * 
  * This is the definition of the current RDP render mode 
@@ -226,8 +293,9 @@ typedef struct rsp_queue_s {
     uint8_t rdp_target_bitdepth;         ///< Current RDP target buffer bitdepth
     uint8_t rdp_syncfull_ongoing;        ///< True if a SYNC_FULL is currently ongoing
     uint8_t rdpq_debug;                  ///< Debug mode flag
-    uint8_t __padding0;
+    uint8_t internal_command_table_size; ///< Size of the internal command table in bytes (exported by the ucode, not used by RSP)
     int16_t current_ovl;                 ///< Current overlay index
+    uint16_t internal_command_table;     ///< DMEM address of the internal command table (exported by the ucode, not used by RSP)
 } __attribute__((aligned(16), packed)) rsp_queue_t;
 
 /** @brief Address of the RSPQ data header in DMEM (see #rsp_queue_t) */
@@ -0,0 +1,33 @@
+
+static void check_asset_load_async(TestContext *ctx, const char *fn) {
+	int ref_size;
+	uint8_t *ref = asset_load(fn, &ref_size);
+	DEFER(free(ref));
+
+	asset_async_t *h = asset_load_async(fn, NULL, NULL);
+	int polls = 0;
+	while (!asset_async_poll(h))
+		polls++;
+
+	int size;
+	uint8_t *buf = asset_async_wait(h, &size);
+	DEFER(free(buf));
+
+	ASSERT_EQUAL_SIGNED(size, ref_size, "%s: wrong size", fn);
+	ASSERT_EQUAL_MEM(buf, ref, size, "%s: wrong data (after %d polls)", fn, polls);
+}
+
+void test_asset_load_async(TestContext *ctx) {
+	// Uncompressed file, streamed in multiple DMA chunks
+	check_asset_load_async(ctx, "rom:/random.dat");
+	if (ctx->result == TEST_FAILED) return;
+
+	// Compressed files, decompressed while streaming
+	check_asset_load_async(ctx, "rom:/grass1.ci8.sprite");
+	if (ctx->result == TEST_FAILED) return;
+	check_asset_load_async(ctx, "rom:/grass2.rgba32.sprite");
+	if (ctx->result == TEST_FAILED) return;
+
+	// Blocked file, decompressed one block per poll
+	check_asset_load_async(ctx, "rom:/blocked/grass2.rgba32.sprite");
+}
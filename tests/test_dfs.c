@@ -88,3 +88,86 @@ void test_dfs_rom_addr(TestContext *ctx) {
 
 	ASSERT_EQUAL_MEM(buf1, buf2, 128, "DMA ROM access is different");
 }
+
+void test_dfs_open_index(TestContext *ctx) {
+	uint32_t rom = dfs_rom_addr("counter.dat");
+	ASSERT(rom != 0, "counter.dat not found by dfs_rom_addr");
+
+	// These paths are resolved by the path index (when present)
+	ASSERT_EQUAL_HEX(dfs_rom_addr("/counter.dat"), rom, "absolute path lookup failed");
+	ASSERT_EQUAL_HEX(dfs_rom_addr("random.dat") != 0, 1, "random.dat not found");
+
+	// These paths must go through the directory walk
+	ASSERT_EQUAL_HEX(dfs_rom_addr("./counter.dat"), rom, "relative path lookup failed");
+	ASSERT_EQUAL_HEX(dfs_rom_addr("/../counter.dat"), rom, "parent path lookup failed");
+
+	// Missing files
+	ASSERT_EQUAL_SIGNED(dfs_open("missing.dat"), DFS_ENOFILE, "missing file was found");
+	ASSERT_EQUAL_SIGNED(dfs_open("counter.dat/x"), DFS_ENOFILE, "file used as directory");
+	ASSERT_EQUAL_HEX(dfs_rom_addr("counter.da"), 0, "prefix of a file was found");
+
+	int fh = dfs_open("/counter.dat");
+	ASSERT(fh >= 0, "counter.dat not found");
+	DEFER(dfs_close(fh));
+
+	uint32_t data __attribute__((aligned(8)));
+	dfs_read(&data, 1, 4, fh);
+	ASSERT_EQUAL_HEX(data, io_read(rom), "invalid data read");
+}
+
+void test_dfs_readahead(TestContext *ctx) {
+	int fh = dfs_open("counter.dat");
+	ASSERT(fh >= 0, "counter.dat not found");
+	DEFER(dfs_close(fh));
+
+	// Use small buffers, so that reads often cross buffer boundaries
+	ASSERT_EQUAL_SIGNED(dfs_readahead(fh, 250), DFS_ESUCCESS, "dfs_readahead failed");
+
+	uint8_t buf[128] __attribute__((aligned(16)));
+
+	// sequential reads of random sizes, unaligned buffers
+	int loc = 0;
+	while (loc < 4096) {
+		uint8_t *ubuf = buf+RANDN(16);
+		int to_read = RANDN(100)+1;
+		int n = dfs_read(ubuf, 1, to_read, fh);
+		ASSERT_EQUAL_SIGNED(n, MIN(to_read, 4096-loc), "invalid sequential read size");
+		for (int j=0;j<n;j++)
+			ASSERT_EQUAL_HEX(ubuf[j], (loc+j)&0xFF, "invalid sequential read at %d", loc+j);
+		loc += n;
+	}
+	ASSERT_EQUAL_SIGNED(dfs_eof(fh), 1, "end of file not reached");
+
+	// random seeks
+	for (int i=0;i<256;i++) {
+		int seek = RANDN(4096);
+		int to_read = RANDN(64)+1;
+
+		dfs_seek(fh, seek, SEEK_SET);
+		memset(buf, 0xAA, sizeof(buf));
+		int n = dfs_read(buf+2, 1, to_read, fh);
+		ASSERT_EQUAL_SIGNED(n, MIN(to_read, 4096-seek), "invalid read size after seek");
+		for (int j=0;j<n;j++)
+			ASSERT_EQUAL_HEX(buf[2+j], (seek+j)&0xFF, "invalid read at %d after seek", seek+j);
+		ASSERT_EQUAL_MEM(buf+2+n, (uint8_t*)"\xaa\xaa", 2, "buffer overflow");
+	}
+
+	// large reads bypass the buffers
+	dfs_seek(fh, 8, SEEK_SET);
+	uint8_t *large = malloc(1024);
+	DEFER(free(large));
+	ASSERT_EQUAL_SIGNED(dfs_read(large, 1, 1024, fh), 1024, "invalid large read size");
+	for (int j=0;j<1024;j++)
+		ASSERT_EQUAL_HEX(large[j], (8+j)&0xFF, "invalid large read at %d", 8+j);
+
+	// the standard C API uses the default readahead
+	dfs_set_default_readahead(512);
+	FILE *f = fopen("rom:/counter.dat", "rb");
+	dfs_set_default_readahead(0);
+	ASSERT(f, "counter.dat not found via fopen");
+	DEFER(fclose(f));
+	setvbuf(f, NULL, _IOFBF, 64);
+	for (loc=0; loc<4096; loc++)
+		ASSERT_EQUAL_HEX(fgetc(f), loc&0xFF, "invalid fgetc at %d", loc);
+	ASSERT_EQUAL_SIGNED(fgetc(f), EOF, "end of file not reached");
+}
@@ -442,6 +442,58 @@ void test_rdpq_block_dynamic(TestContext *ctx)
     if (ctx->result == TEST_FAILED) return;
 }
 
+void test_rdpq_block_serialize(TestContext *ctx)
+{
+    RDPQ_INIT();
+
+    const int WIDTH = 64;
+    surface_t fb = surface_alloc(FMT_RGBA16, WIDTH, WIDTH);
+    DEFER(surface_free(&fb));
+    surface_clear(&fb, 0xAA);
+
+    uint16_t expected_fb[WIDTH*WIDTH];
+    memset(expected_fb, 0, sizeof(expected_fb));
+
+    // Record a block big enough to span multiple rspq chunks and RDP static
+    // buffers, mixing passthrough and fixup commands.
+    rspq_block_begin();
+    rdpq_set_mode_fill(RGBA32(0,0,0,0));
+
+    for (uint32_t y = 0; y < WIDTH; y++)
+    {
+        for (uint32_t x = 0; x < WIDTH; x += 4)
+        {
+            color_t c = RGBA16(y, x, x^y, x+y);
+            expected_fb[y * WIDTH + x]     = color_to_packed16(c);
+            expected_fb[y * WIDTH + x + 1] = color_to_packed16(c);
+            expected_fb[y * WIDTH + x + 2] = color_to_packed16(c);
+            expected_fb[y * WIDTH + x + 3] = color_to_packed16(c);
+            rdpq_set_fill_color(c);
+            rdpq_set_scissor(x, y, x + 4, y + 1);
+            rdpq_fill_rectangle(0, 0, WIDTH, WIDTH);
+        }
+    }
+    rspq_block_t *recorded = rspq_block_end();
+    ASSERT(recorded->rdp_block && recorded->rdp_block->next, "block should have multiple RDP buffers");
+
+    // Serialize it, and free the original so that the memory gets reused
+    int size;
+    void *buf = rspq_block_serialize(recorded, &size);
+    DEFER(free(buf));
+    rspq_block_free(recorded);
+
+    rspq_block_t *block = rspq_block_deserialize(buf, size);
+    DEFER(rspq_block_free(block));
+
+    rdpq_set_color_image(&fb);
+    rspq_block_run(block);
+    // Run it twice, to check that the block is left in a consistent state
+    rspq_block_run(block);
+    rspq_wait();
+    
+    ASSERT_EQUAL_MEM((uint8_t*)fb.buffer, (uint8_t*)expected_fb, WIDTH*WIDTH*2, "Framebuffer contains wrong data!");
+}
+
 void test_rdpq_change_other_modes(TestContext *ctx)
 {
     RDPQ_INIT();
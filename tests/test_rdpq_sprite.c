@@ -77,3 +77,48 @@ void test_rdpq_sprite_lod(TestContext *ctx)
         return color_from_packed32(0);
     });
 }
+
+void test_rdpq_sprite_atlas(TestContext *ctx)
+{
+    RDPQ_INIT();
+
+    // The atlas contains the same images of the two standalone sprites
+    atlas_t *atlas = atlas_load("rom:/grass.atlas");
+    DEFER(atlas_free(atlas));
+    sprite_t *s1 = sprite_load("rom:/grass1.rgba32.sprite");
+    DEFER(sprite_free(s1));
+    sprite_t *s2 = sprite_load("rom:/grass2.rgba32.sprite");
+    DEFER(sprite_free(s2));
+
+    ASSERT_EQUAL_SIGNED(atlas_get_count(atlas), 2, "invalid number of images");
+    ASSERT_EQUAL_SIGNED(atlas_find(atlas, "grass1.rgba32"), 0, "grass1 not found");
+    ASSERT_EQUAL_SIGNED(atlas_find(atlas, "grass2.rgba32"), 1, "grass2 not found");
+    ASSERT_EQUAL_SIGNED(atlas_find(atlas, "grass3.rgba32"), -1, "grass3 should not exist");
+
+    sprite_t *sprites[2] = { s1, s2 };
+    for (int i=0; i<2; i++) {
+        LOG("Testing image %d\n", i);
+        surface_t ref = sprite_get_pixels(sprites[i]);
+        atlas_rect_t r = atlas_get_rect(atlas, i);
+        ASSERT_EQUAL_SIGNED(r.s1 - r.s0, ref.width, "invalid width");
+        ASSERT_EQUAL_SIGNED(r.t1 - r.t0, ref.height, "invalid height");
+
+        surface_t fb = surface_alloc(FMT_RGBA32, ref.width, ref.height);
+        DEFER(surface_free(&fb));
+        surface_clear(&fb, 0);
+
+        // Upload the rectangle from the page and draw it
+        surface_t page = sprite_get_pixels(r.page);
+        rdpq_attach(&fb, NULL);
+        rdpq_set_mode_standard();
+        rdpq_tex_upload_sub(TILE0, &page, NULL, r.s0, r.t0, r.s1, r.t1);
+        rdpq_texture_rectangle(TILE0, 0, 0, ref.width, ref.height, r.s0, r.t0);
+        rdpq_detach_wait();
+
+        ASSERT_SURFACE(&fb, {
+            color_t c = color_from_packed32(((uint32_t*)ref.buffer)[y*ref.width + x]);
+            c.a = 0xE0;
+            return c;
+        });
+    }
+}
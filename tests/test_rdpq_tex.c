@@ -308,6 +308,140 @@ void test_rdpq_tex_upload_multi(TestContext *ctx) {
 
 }
 
+void test_rdpq_tex_cache(TestContext *ctx) {
+    RDPQ_INIT();
+
+    const int FBWIDTH = 16;
+    surface_t fb = surface_alloc(FMT_RGBA32, FBWIDTH, FBWIDTH);
+    DEFER(surface_free(&fb));
+    surface_clear(&fb, 0);
+
+    surface_t tex = surface_alloc(FMT_I8, 8, 8);
+    DEFER(surface_free(&tex));
+
+    uint16_t* tlut = malloc_uncached(16*2);
+    DEFER(free_uncached(tlut));
+    for (int i=0;i<16;i++) {
+        tlut[i] = color_to_packed16(palette_debug_color(i));
+    }
+
+    uint32_t old_cfg = rdpq_config_enable(RDPQ_CFG_TEXCACHE);
+    DEFER(rdpq_config_set(old_cfg));
+
+    rdpq_attach(&fb, NULL);
+    DEFER(rdpq_detach());
+    rdpq_set_mode_standard();
+
+    #define DRAW_AND_CHECK(value) ({ \
+        surface_clear(&fb, 0); \
+        rdpq_tex_upload(TILE0, &tex, NULL); \
+        rdpq_texture_rectangle(TILE0, 0, 0, 8, 8, 0, 0); \
+        rspq_wait(); \
+        ASSERT_SURFACE(&fb, { \
+            if (x < 8 && y < 8) \
+                return RGBA32(value, value, value, 0xE0); \
+            else \
+                return color_from_packed32(0); \
+        }); \
+    })
+
+    surface_clear(&tex, 0x40);
+    DRAW_AND_CHECK(0x40);
+
+    // Modify the texture without invalidating the cache: the upload must be
+    // skipped, so the old contents are still drawn.
+    surface_clear(&tex, 0x80);
+    DRAW_AND_CHECK(0x40);
+
+    // After an explicit invalidation, the new contents are uploaded.
+    rdpq_tex_cache_invalidate();
+    DRAW_AND_CHECK(0x80);
+
+    // Any TMEM load not done via rdpq_tex must invalidate the cache as well,
+    // even if it does not overwrite the texture.
+    surface_clear(&tex, 0xC0);
+    rdpq_set_texture_image_raw(0, PhysicalAddr(tlut), FMT_RGBA16, 16, 1);
+    rdpq_set_tile(TILE1, FMT_I4, 0x800, 16, NULL);
+    rdpq_load_tlut_raw(TILE1, 0, 16);
+    DRAW_AND_CHECK(0xC0);
+
+    // Uploading a palette through the cache instead does not affect the texture.
+    surface_clear(&tex, 0x20);
+    rdpq_tex_upload_tlut(tlut, 0, 16);
+    DRAW_AND_CHECK(0xC0);
+
+    #undef DRAW_AND_CHECK
+}
+
+void test_rdpq_tex_cache_multi(TestContext *ctx) {
+    RDPQ_INIT();
+
+    const int FBWIDTH = 16;
+    surface_t fb = surface_alloc(FMT_RGBA32, FBWIDTH, FBWIDTH);
+    DEFER(surface_free(&fb));
+    surface_clear(&fb, 0);
+
+    surface_t tex1 = surface_alloc(FMT_I8, 8, 8);
+    DEFER(surface_free(&tex1));
+    surface_t tex2 = surface_alloc(FMT_I8, 8, 8);
+    DEFER(surface_free(&tex2));
+    surface_clear(&tex1, 0x40);
+    surface_clear(&tex2, 0x80);
+
+    uint32_t old_cfg = rdpq_config_enable(RDPQ_CFG_TEXCACHE);
+    DEFER(rdpq_config_set(old_cfg));
+
+    rspq_block_begin();
+    rdpq_tex_multi_begin();
+        rdpq_tex_upload(TILE1, &tex1, NULL);
+    rdpq_tex_multi_end();
+    rspq_block_t *tex1_loader = rspq_block_end();
+    DEFER(rspq_block_free(tex1_loader));
+
+    rdpq_attach(&fb, NULL);
+    DEFER(rdpq_detach());
+    rdpq_set_mode_standard();
+
+    #define DRAW_AND_CHECK(tile, value) ({ \
+        surface_clear(&fb, 0); \
+        rdpq_texture_rectangle(tile, 0, 0, 8, 8, 0, 0); \
+        rspq_wait(); \
+        ASSERT_SURFACE(&fb, { \
+            if (x < 8 && y < 8) \
+                return RGBA32(value, value, value, 0xE0); \
+            else \
+                return color_from_packed32(0); \
+        }); \
+    })
+
+    // The block allocates TMEM for tex1, so tex2 is loaded after it.
+    rdpq_tex_multi_begin();
+        rspq_block_run(tex1_loader);
+        rdpq_tex_upload(TILE2, &tex2, NULL);
+    rdpq_tex_multi_end();
+    DRAW_AND_CHECK(TILE2, 0x80);
+
+    // Now tex2 goes at the start of TMEM, where tex1 is: the upload must
+    // not be skipped.
+    rdpq_tex_multi_begin();
+        rdpq_tex_upload(TILE2, &tex2, NULL);
+    rdpq_tex_multi_end();
+    DRAW_AND_CHECK(TILE2, 0x80);
+
+    // Two placeholders with the same format and size must not share
+    // cache entries.
+    surface_t ph1 = surface_make_placeholder_linear(1, FMT_I8, 8, 8);
+    surface_t ph2 = surface_make_placeholder_linear(2, FMT_I8, 8, 8);
+    rdpq_set_lookup_address(1, tex1.buffer);
+    rdpq_set_lookup_address(2, tex2.buffer);
+    rdpq_tex_upload(TILE0, &ph1, NULL);
+    DRAW_AND_CHECK(TILE0, 0x40);
+    rdpq_tex_upload(TILE0, &ph2, NULL);
+    DRAW_AND_CHECK(TILE0, 0x80);
+
+    #undef DRAW_AND_CHECK
+}
+
 void test_rdpq_tex_multi_i4(TestContext *ctx) {
     RDPQ_INIT();
     debug_rdp_stream_init();
@@ -404,3 +538,85 @@ void test_rdpq_tex_blit_normal(TestContext *ctx)
         }
     }
 }
+
+void test_rdpq_tex_blit_batch(TestContext *ctx)
+{
+    RDPQ_INIT();
+
+    static const tex_format_t fmts[] = { 
+        FMT_RGBA32, FMT_RGBA16, FMT_CI8, FMT_CI4, FMT_I4,
+    };
+
+    const int FBWIDTH = 32;
+    surface_t fb = surface_alloc(FMT_RGBA32, FBWIDTH, FBWIDTH);
+    DEFER(surface_free(&fb));
+
+    uint16_t* tlut = malloc_uncached(256*2);
+    for (int i=0;i<256;i++) {
+        tlut[i] = color_to_packed16(palette_debug_color(i));
+    }
+
+    rdpq_attach(&fb, NULL);
+    DEFER(rdpq_detach());
+    rdpq_set_mode_standard();
+
+    // Four 16x16 frames taken from different rows of a texture that does not
+    // fit in TMEM, so that the batch must be split in strips, and some frames
+    // are split between two strips.
+    static const int frames[4][2] = { {0, 0}, {33, 30}, {2, 61}, {64, 64} };
+
+    for (int i=0; i<sizeof(fmts) / sizeof(fmts[0]); i++) {
+        LOG("Testing format %s\n", tex_format_name(fmts[i]));
+        SRAND(i);
+        tex_format_t fmt = fmts[i];
+        surface_t surf = surface_create_random(80, 80, fmt);
+        DEFER(surface_free(&surf));
+
+        if (fmt == FMT_CI4 || fmt == FMT_CI8) {
+            rdpq_tex_upload_tlut(tlut, 0, 256);
+            rdpq_mode_tlut(TLUT_RGBA16);
+        } else {
+            rdpq_mode_tlut(TLUT_NONE);
+        }
+
+        rdpq_blitinst_t insts[4];
+        for (int j=0; j<4; j++) {
+            insts[j] = (rdpq_blitinst_t){
+                .x = (j&1) * 16, .y = (j>>1) * 16,
+                .s0 = frames[j][0], .t0 = frames[j][1], .width = 16, .height = 16,
+            };
+        }
+
+        surface_clear(&fb, 0);
+        rdpq_tex_blit_batch(&surf, insts, 4, NULL);
+        rspq_wait();
+
+        ASSERT_SURFACE(&fb, {
+            int j = (x/16) + (y/16)*2;
+            return surface_debug_expected_color(&surf, x%16 + frames[j][0], y%16 + frames[j][1]);
+        });
+    }
+
+    // A texture so wide that only two lines fit in TMEM: with filtering,
+    // the batch must fall back to blitting each instance.
+    LOG("Testing wide texture with filtering\n");
+    surface_t wide = surface_alloc(FMT_RGBA16, 1024, 8);
+    DEFER(surface_free(&wide));
+    surface_clear(&wide, 0xFF);
+    rdpq_mode_tlut(TLUT_NONE);
+
+    rdpq_blitinst_t wide_insts[2] = {
+        { .x = 0,  .y = 0, .s0 = 0,    .t0 = 0, .width = 16, .height = 8 },
+        { .x = 16, .y = 0, .s0 = 1000, .t0 = 0, .width = 16, .height = 8 },
+    };
+    surface_clear(&fb, 0);
+    rdpq_tex_blit_batch(&wide, wide_insts, 2, &(rdpq_blitparms_t){ .filtering = true });
+    rspq_wait();
+
+    ASSERT_SURFACE(&fb, {
+        if (y < 8)
+            return surface_debug_expected_color(&wide, x, y);
+        else
+            return color_from_packed32(0x0);
+    });
+}
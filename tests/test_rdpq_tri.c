@@ -192,3 +192,73 @@ void test_rdpq_triangle_w1(TestContext *ctx) {
     ASSERT_EQUAL_HEX(BITS(rdp_stream[0],56,61), RDPQ_CMD_TRI_TEX, "invalid command");
     ASSERT_EQUAL_HEX(BITS(rdp_stream[4],16,31), 0x7FFF, "invalid W coordinate");
 }
+
+void test_rdpq_triangle_batch(TestContext *ctx) {
+    RDPQ_INIT();
+    debug_rdp_stream_init();
+
+    const int FBWIDTH = 16;
+    surface_t fb = surface_alloc(FMT_RGBA16, FBWIDTH, FBWIDTH);
+    DEFER(surface_free(&fb));
+    surface_clear(&fb, 0);
+
+    rdpq_set_color_image(&fb);
+    rdpq_set_mode_standard();
+    rdpq_mode_combiner(RDPQ_COMBINER_SHADE);
+    rspq_wait();
+
+    const rdpq_trifmt_t trifmt = (rdpq_trifmt_t){
+        .pos_offset = 0, .z_offset = 2, .tex_offset = -1, .shade_offset = 3,
+    };
+
+    // Use more triangles than those fetched in a single chunk by the RSP,
+    // and share vertices among them.
+    const int NUM_VTX = 12;
+    const int NUM_TRIS = RDPQ_TRI_BATCH_CHUNK + 5;
+
+    float vtx[NUM_VTX][7];
+    SRAND(1);
+    for (int i=0;i<NUM_VTX;i++) {
+        float v[] = { RANDN(64*4)/4.0f, RANDN(64*4)/4.0f, RANDN(0x8000)/32767.f,
+            RANDN(256)/255.0f, RANDN(256)/255.0f, RANDN(256)/255.0f, RANDN(256)/255.0f };
+        memcpy(vtx[i], v, sizeof(v));
+    }
+
+    uint16_t indices[NUM_TRIS*3] __attribute__((aligned(8)));
+    for (int i=0;i<NUM_TRIS*3;i++)
+        indices[i] = RANDN(NUM_VTX);
+
+    rdpq_trivtx_t *fixvtx = malloc_uncached(NUM_VTX * sizeof(rdpq_trivtx_t));
+    DEFER(free_uncached(fixvtx));
+
+    uint64_t *ref = malloc(sizeof(rdp_stream));
+    DEFER(free(ref));
+
+    // Run the test twice, changing the vertices in between: the second
+    // batch must not reuse the vertices cached by the RSP for the first one.
+    for (int pass=0;pass<2;pass++) {
+        if (pass == 1) {
+            for (int i=0;i<NUM_VTX;i++)
+                vtx[i][0] = 63.0f - vtx[i][0];
+        }
+        rdpq_trivtx_convert(&trifmt, &vtx[0][0], 7, NUM_VTX, fixvtx);
+
+        // Draw the triangles one by one, as reference
+        debug_rdp_stream_reset();
+        for (int i=0;i<NUM_TRIS;i++)
+            rdpq_triangle(&trifmt, vtx[indices[i*3+0]], vtx[indices[i*3+1]], vtx[indices[i*3+2]]);
+        rspq_wait();
+
+        int ref_size = rdp_stream_ctx.idx;
+        ASSERT(ref_size > 0, "no RDP commands generated");
+        memcpy(ref, rdp_stream, ref_size * sizeof(uint64_t));
+
+        // Draw them in a batch: the RDP commands must be identical
+        debug_rdp_stream_reset();
+        rdpq_triangle_batch(&trifmt, fixvtx, indices, NUM_TRIS);
+        rspq_wait();
+
+        ASSERT_EQUAL_SIGNED(rdp_stream_ctx.idx, ref_size, "invalid RDP stream size (pass %d)", pass);
+        ASSERT_EQUAL_MEM((uint8_t*)rdp_stream, (uint8_t*)ref, ref_size * sizeof(uint64_t), "batched triangles are different (pass %d)", pass);
+    }
+}
@@ -5,6 +5,7 @@
 #include <rspq_constants.h>
 #include <rdp.h>
 #include <rdpq_constants.h>
+#include "../src/rspq/rspq_internal.h"
 
 #define ASSERT_GP_BACKWARD           0xF001   // Also defined in rsp_test.S
 #define ASSERT_TOO_MANY_NOPS         0xF002
@@ -205,6 +206,118 @@ void test_rspq_wrap(TestContext *ctx)
     TEST_RSPQ_EPILOG(0, rspq_timeout);
 }
 
+void test_rspq_ring(TestContext *ctx)
+{
+    const int num_buffers = 4;
+    rspq_init_ex(num_buffers, 0x100);
+    DEFER(rspq_close());
+    test_ovl_init();
+    DEFER(test_ovl_close());
+
+    rspq_reset_stats();
+
+    // Enqueue slow commands, so that the CPU runs ahead of the RSP
+    // and fills the whole ring.
+    uint64_t expected_sum = 0;
+    for (uint32_t i = 0; i < 0x400; i++) {
+        rspq_test_wait(500);
+        rspq_test_4(i);
+        expected_sum += i;
+    }
+
+    uint64_t actual_sum[2] __attribute__((aligned(16))) = {0};
+    data_cache_hit_writeback_invalidate(actual_sum, 16);
+
+    rspq_test_output(actual_sum);
+
+    TEST_RSPQ_EPILOG(0, rspq_timeout*10);
+
+    ASSERT_EQUAL_UNSIGNED(*actual_sum, expected_sum, "Possibly not all commands have been executed!");
+
+    rspq_stats_t stats;
+    rspq_get_stats(&stats);
+    ASSERT(stats.buffers >= num_buffers, "not enough buffers submitted: %ld", stats.buffers);
+    ASSERT(stats.stalls > 0, "CPU never waited for the RSP");
+    ASSERT(stats.max_buffers_ahead > 1 && stats.max_buffers_ahead < num_buffers,
+        "invalid number of buffers ahead: %d", stats.max_buffers_ahead);
+}
+
+void test_rspq_batch(TestContext *ctx)
+{
+    TEST_RSPQ_PROLOG();
+    test_ovl_init();
+    DEFER(test_ovl_close());
+
+    rspq_reset_stats();
+
+    // Interleave the commands of two overlays. Make sure the batch buffer
+    // gets full a few times, and put a builtin command (barrier) in the middle.
+    uint64_t expected_sum = 0;
+    rspq_batch_begin();
+    for (uint32_t i = 0; i < 0x800; i++) {
+        rspq_test_4(i);
+        rspq_test2(i, ~i);
+        expected_sum += i;
+        if (i == 0x400)
+            rspq_noop();
+    }
+    rspq_batch_end();
+
+    uint64_t actual_sum[2] __attribute__((aligned(16))) = {0};
+    data_cache_hit_writeback_invalidate(actual_sum, 16);
+
+    rspq_test_output(actual_sum);
+
+    TEST_RSPQ_EPILOG(0, rspq_timeout);
+
+    ASSERT_EQUAL_UNSIGNED(*actual_sum, expected_sum, "Possibly not all commands have been executed!");
+
+    // The commands of each overlay must have been run in order
+    uint32_t *test2_state = UncachedAddr(rspq_overlay_get_state(&rsp_test2));
+    ASSERT_EQUAL_HEX(test2_state[0], test2_ovl_id | 0x7FF, "Commands were reordered within the overlay!");
+    ASSERT_EQUAL_HEX(test2_state[1], ~0x7FF, "Commands were reordered within the overlay!");
+
+    rspq_stats_t stats;
+    rspq_get_stats(&stats);
+    ASSERT(stats.batch_switches_saved > 0x800, "not enough switches saved: %ld", stats.batch_switches_saved);
+    ASSERT(stats.batch_switches < 0x40, "too many switches: %ld", stats.batch_switches);
+}
+
+void test_rspq_batch_rdpq(TestContext *ctx)
+{
+    TEST_RSPQ_PROLOG();
+    rdpq_init();
+    DEFER(rdpq_close());
+    test_ovl_init();
+    DEFER(test_ovl_close());
+
+    rspq_reset_stats();
+
+    // Interleave rdpq commands with the commands of another overlay: they
+    // must not be reordered, as rdpq autosync depends on the command order.
+    uint64_t expected_sum = 0;
+    rspq_batch_begin();
+    for (uint32_t i = 0; i < 0x100; i++) {
+        rspq_test_4(i);
+        rdpq_set_prim_color(RGBA32(i, i, i, 0xFF));
+        expected_sum += i;
+    }
+    rspq_batch_end();
+
+    uint64_t actual_sum[2] __attribute__((aligned(16))) = {0};
+    data_cache_hit_writeback_invalidate(actual_sum, 16);
+
+    rspq_test_output(actual_sum);
+
+    TEST_RSPQ_EPILOG(0, rspq_timeout);
+
+    ASSERT_EQUAL_UNSIGNED(*actual_sum, expected_sum, "Possibly not all commands have been executed!");
+
+    rspq_stats_t stats;
+    rspq_get_stats(&stats);
+    ASSERT_EQUAL_UNSIGNED(stats.batch_switches_saved, 0, "commands were reordered around rdpq commands");
+}
+
 void test_rspq_high_load(TestContext *ctx)
 {
     TEST_RSPQ_PROLOG();
@@ -814,3 +927,51 @@ void test_rspq_rdp_dynamic_switch(TestContext *ctx)
     }
 }
 
+
+void test_rspq_profile(TestContext *ctx)
+{
+    if (!RSPQ_PROFILE)
+        SKIP("rspq profiler not available (RSPQ_PROFILE=0)");
+
+    TEST_RSPQ_PROLOG();
+    test_ovl_init();
+    DEFER(test_ovl_close());
+
+    rspq_profile_reset();
+    rspq_profile_start();
+    for (int frame = 0; frame < 4; frame++) {
+        for (int i = 0; i < 16; i++)
+            rspq_test_wait(100);
+        // Force the log to be flushed in the middle of the frame
+        for (int i = 0; i < RSPQ_PROFILE_LOG_SIZE + 1; i++)
+            rspq_noop();
+        // The last frame is closed by rspq_profile_stop
+        if (frame < 3)
+            rspq_profile_next_frame();
+    }
+    rspq_profile_stop();
+
+    TEST_RSPQ_EPILOG(0, rspq_timeout);
+    rspq_profile_dump();
+
+    rspq_profile_data_t *data = malloc(sizeof(rspq_profile_data_t));
+    DEFER(free(data));
+    rspq_profile_get_data(data);
+
+    ASSERT_EQUAL_UNSIGNED(data->frames, 4, "wrong number of frames");
+    ASSERT_EQUAL_UNSIGNED(data->dropped, 0, "log entries were dropped");
+    ASSERT(data->clock > 0, "RCP clock not recorded");
+
+    rspq_profile_cmd_t *noop = &data->cmds[RSPQ_CMD_NOOP];
+    ASSERT(noop->count >= 4*(RSPQ_PROFILE_LOG_SIZE+1),
+        "noop commands not recorded: %llu", noop->count);
+
+    rspq_profile_cmd_t *wait = &data->cmds[(test_ovl_id >> 24) | 0x3];
+    ASSERT_EQUAL_UNSIGNED(wait->count, 4*16, "wrong number of wait commands");
+    ASSERT(wait->max > 0 && wait->total >= wait->max, "wait durations not recorded");
+
+    uint64_t hist = 0;
+    for (int i = 0; i < RSPQ_PROFILE_HIST_BUCKETS; i++)
+        hist += wait->hist[i];
+    ASSERT_EQUAL_UNSIGNED(hist, wait->count, "histogram does not match the count");
+}
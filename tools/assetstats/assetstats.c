@@ -0,0 +1,289 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include "../common/polyfill.h"
+
+/** @brief Prefix of the lines written by asset_stats_dump() */
+#define STATS_PREFIX        "[asset_stats]"
+/** @brief Number of numeric columns following the filename */
+#define STATS_COLUMNS       9
+
+bool flag_sum_dumps = false;
+
+/** @brief Statistics of a single asset, aggregated across logs */
+typedef struct {
+    char *fn;               ///< Filename
+    int algo;               ///< Compression algorithm (0 = not compressed)
+    int winsize;            ///< Window size in KiB
+    bool inplace;           ///< True if the in-place path was taken
+    bool stream;            ///< True if opened via asset_fopen()
+    uint64_t loads;         ///< Number of loads
+    uint64_t cmp_bytes;     ///< Compressed bytes
+    uint64_t dec_bytes;     ///< Decompressed bytes
+    uint64_t io_us;         ///< Time spent waiting for I/O
+    uint64_t dec_us;        ///< Time spent decompressing
+} entry_t;
+
+typedef struct {
+    entry_t *entries;
+    int count;
+} table_t;
+
+void print_args(char * name)
+{
+    fprintf(stderr, "%s -- Libdragon asset load statistics aggregator\n\n", name);
+    fprintf(stderr, "This tool aggregates the tables written by asset_stats_dump() on the debug\n");
+    fprintf(stderr, "channel, and reports where the load time goes, so that compression levels\n");
+    fprintf(stderr, "and window sizes can be selected from measured data.\n\n");
+    fprintf(stderr, "Usage: %s [flags] <log files...>\n", name);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Command-line flags:\n");
+    fprintf(stderr, "   -s/--sum-dumps          Sum all the dumps within each log (use if asset_stats_reset()\n");
+    fprintf(stderr, "                           is called after each dump). By default, statistics are\n");
+    fprintf(stderr, "                           cumulative, so only the last dump of each log is used.\n");
+    fprintf(stderr, "\nStatistics from different logs are always summed. Use \"-\" to read from stdin.\n");
+    fprintf(stderr, "\n");
+}
+
+static entry_t *table_find(table_t *t, const char *fn, bool stream)
+{
+    for (int i = 0; i < t->count; i++)
+        if (t->entries[i].stream == stream && !strcmp(t->entries[i].fn, fn))
+            return &t->entries[i];
+
+    t->entries = realloc(t->entries, (t->count + 1) * sizeof(entry_t));
+    entry_t *e = &t->entries[t->count++];
+    memset(e, 0, sizeof(entry_t));
+    e->fn = strdup(fn);
+    e->stream = stream;
+    return e;
+}
+
+static void table_free(table_t *t)
+{
+    for (int i = 0; i < t->count; i++)
+        free(t->entries[i].fn);
+    free(t->entries);
+    t->entries = NULL;
+    t->count = 0;
+}
+
+/** @brief Parse a line of the dump. Returns false if it is not a valid data line. */
+static bool parse_line(char *line, char **fn, uint64_t vals[STATS_COLUMNS])
+{
+    char *p = strstr(line, STATS_PREFIX);
+    if (!p) return false;
+    p += strlen(STATS_PREFIX);
+
+    // Strip trailing whitespace
+    char *end = p + strlen(p);
+    while (end > p && isspace((unsigned char)end[-1])) *--end = 0;
+
+    // Parse the numeric columns starting from the end, so that filenames
+    // containing spaces are supported.
+    for (int i = STATS_COLUMNS-1; i >= 0; i--) {
+        while (end > p && isspace((unsigned char)end[-1])) end--;
+        char *tok = end;
+        while (tok > p && !isspace((unsigned char)tok[-1])) tok--;
+        if (tok == end) return false;
+
+        char *num_end;
+        vals[i] = strtoull(tok, &num_end, 10);
+        if (num_end == tok) return false;
+        // The window size column has a "K" suffix
+        if (num_end != end && !(i == 1 && *num_end == 'K' && num_end+1 == end))
+            return false;
+        *tok = 0;
+        end = tok;
+    }
+
+    while (isspace((unsigned char)*p)) p++;
+    while (end > p && isspace((unsigned char)end[-1])) *--end = 0;
+    if (!*p) return false;
+    *fn = p;
+    return true;
+}
+
+static void entry_add(entry_t *e, uint64_t vals[STATS_COLUMNS])
+{
+    e->algo = vals[0];
+    e->winsize = vals[1];
+    e->inplace = vals[2];
+    e->loads += vals[4];
+    e->cmp_bytes += vals[5];
+    e->dec_bytes += vals[6];
+    e->io_us += vals[7];
+    e->dec_us += vals[8];
+}
+
+static bool read_log(const char *fn, table_t *total)
+{
+    FILE *f = strcmp(fn, "-") ? fopen(fn, "r") : stdin;
+    if (!f) {
+        fprintf(stderr, "error opening input file: %s\n", fn);
+        return false;
+    }
+
+    // Entries of the dump being parsed. Since statistics are cumulative, each
+    // dump replaces the previous one, unless dumps must be summed.
+    table_t dump = {0};
+    bool in_dump = false;
+
+    char *line = NULL; size_t line_size = 0;
+    while (getline(&line, &line_size, f) != -1) {
+        char *afn; uint64_t vals[STATS_COLUMNS];
+        if (!parse_line(line, &afn, vals)) {
+            // The header line starts a new dump
+            if (strstr(line, STATS_PREFIX)) {
+                if (!flag_sum_dumps) table_free(&dump);
+                in_dump = true;
+            }
+            continue;
+        }
+        if (!in_dump) continue;
+        entry_add(table_find(&dump, afn, vals[3]), vals);
+    }
+    free(line);
+    if (f != stdin) fclose(f);
+
+    for (int i = 0; i < dump.count; i++) {
+        entry_t *e = &dump.entries[i];
+        entry_t *t = table_find(total, e->fn, e->stream);
+        uint64_t vals[STATS_COLUMNS] = { e->algo, e->winsize, e->inplace, e->stream,
+            e->loads, e->cmp_bytes, e->dec_bytes, e->io_us, e->dec_us };
+        entry_add(t, vals);
+    }
+    table_free(&dump);
+    return true;
+}
+
+static int cmp_entry_time(const void *a, const void *b)
+{
+    const entry_t *ea = a, *eb = b;
+    uint64_t ta = ea->io_us + ea->dec_us, tb = eb->io_us + eb->dec_us;
+    return ta < tb ? 1 : ta > tb ? -1 : strcmp(ea->fn, eb->fn);
+}
+
+/** @brief Throughput in KiB/s (0 if not measurable) */
+static uint64_t kbps(uint64_t bytes, uint64_t us)
+{
+    return us ? bytes * 1000000 / 1024 / us : 0;
+}
+
+static const char *hint(entry_t *e)
+{
+    if (e->io_us + e->dec_us == 0)
+        return "";
+    if (e->inplace && e->io_us == 0)
+        return "dma overlapped";
+    if (e->io_us > e->dec_us) {
+        // For streaming, a larger window improves the ratio at the cost of RAM
+        if (e->stream && e->algo && e->winsize < 256)
+            return "io-bound: try a larger window or a higher level";
+        if (e->algo == 0)
+            return "io-bound: try compressing";
+        if (e->algo < 3)
+            return "io-bound: try a higher level";
+        return "io-bound";
+    }
+    if (e->algo > 1)
+        return "cpu-bound: try a lower level";
+    return "cpu-bound";
+}
+
+static void print_report(table_t *t)
+{
+    qsort(t->entries, t->count, sizeof(entry_t), cmp_entry_time);
+
+    printf("%-40s %4s %4s %4s %7s %6s %10s %10s %10s  %s\n",
+        "file", "algo", "win", "mode", "loads", "ratio", "io_ms", "dec_ms", "total_ms", "hint");
+    uint64_t total_io = 0, total_dec = 0;
+    for (int i = 0; i < t->count; i++) {
+        entry_t *e = &t->entries[i];
+        double ratio = e->dec_bytes ? (double)e->cmp_bytes / e->dec_bytes * 100.0 : 100.0;
+        const char *mode = e->stream ? "strm" : e->inplace ? "inpl" : "full";
+        printf("%-40s %4d %3dK %4s %7llu %5.1f%% %10.2f %10.2f %10.2f  %s\n",
+            e->fn, e->algo, e->winsize, mode, (unsigned long long)e->loads, ratio,
+            e->io_us / 1000.0, e->dec_us / 1000.0, (e->io_us + e->dec_us) / 1000.0, hint(e));
+        total_io += e->io_us;
+        total_dec += e->dec_us;
+    }
+    printf("%-40s %4s %4s %4s %7s %6s %10.2f %10.2f %10.2f\n", "TOTAL", "", "", "", "", "",
+        total_io / 1000.0, total_dec / 1000.0, (total_io + total_dec) / 1000.0);
+
+    // Per-level measured throughput. Decompression speed is measured on the
+    // decompressed output, I/O speed on the compressed input. In-place loads
+    // from ROM overlap I/O and decompression, so they are excluded from I/O speed.
+    printf("\n%-5s %4s %6s %14s %14s %14s %14s\n",
+        "algo", "win", "files", "dec_bytes", "dec_kib/s", "io_bytes", "io_kib/s");
+    for (int algo = 0; algo <= 3; algo++) {
+        for (int win = 0; win <= 256; win = win ? win * 2 : 1) {
+            int files = 0;
+            uint64_t dec_bytes = 0, dec_us = 0, io_bytes = 0, io_us = 0;
+            for (int i = 0; i < t->count; i++) {
+                entry_t *e = &t->entries[i];
+                if (e->algo != algo || e->winsize != win) continue;
+                files++;
+                dec_bytes += e->dec_bytes;
+                dec_us += e->dec_us;
+                if (!e->inplace || e->io_us) {
+                    io_bytes += e->cmp_bytes;
+                    io_us += e->io_us;
+                }
+            }
+            if (!files) continue;
+            printf("%-5d %3dK %6d %14llu %14llu %14llu %14llu\n", algo, win, files,
+                (unsigned long long)dec_bytes, (unsigned long long)(algo ? kbps(dec_bytes, dec_us) : 0),
+                (unsigned long long)io_bytes, (unsigned long long)kbps(io_bytes, io_us));
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    table_t table = {0};
+    char **logs = NULL; int nlogs = 0;
+
+    if (argc < 2) {
+        print_args(argv[0]);
+        return 1;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] == '-' && argv[i][1] != 0) {
+            if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+                print_args(argv[0]);
+                return 0;
+            } else if (!strcmp(argv[i], "-s") || !strcmp(argv[i], "--sum-dumps")) {
+                flag_sum_dumps = true;
+            } else {
+                fprintf(stderr, "invalid flag: %s\n", argv[i]);
+                return 1;
+            }
+            continue;
+        }
+        logs = realloc(logs, (nlogs + 1) * sizeof(char*));
+        logs[nlogs++] = argv[i];
+    }
+
+    if (nlogs == 0) {
+        fprintf(stderr, "no log files specified\n");
+        return 1;
+    }
+    for (int i = 0; i < nlogs; i++)
+        if (!read_log(logs[i], &table))
+            return 1;
+    free(logs);
+    if (table.count == 0) {
+        fprintf(stderr, "no asset statistics found (did you call asset_stats_dump()?)\n");
+        return 1;
+    }
+
+    print_report(&table);
+    table_free(&table);
+    return 0;
+}
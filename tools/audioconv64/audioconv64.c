@@ -8,9 +8,18 @@
 #include <dirent.h>
 #include <stdlib.h>
 #include <sys/stat.h>
+#include "../common/parallel.h"
 
-bool flag_verbose = false;
-bool flag_debug = false;
+// Options are thread-local because files are converted in parallel: each
+// conversion restores the options that were given before its file on the
+// command line (see convert_job_t).
+__thread bool flag_verbose = false;
+__thread bool flag_debug = false;
+
+// Number of threads, and number of conversions currently running. Converters
+// can use the threads that are not busy converting other files.
+int num_jobs = 1;
+int num_jobs_running = 0;
 
 #if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
 	#define LE32_TO_HOST(i) __builtin_bswap32(i)
@@ -72,6 +81,7 @@ void usage(void) {
 	printf("   -o / --output <dir>       Specify output directory\n");
 	printf("   -v / --verbose            Verbose mode\n");
 	printf("   -d / --debug              Dump uncompressed files in output directory for debugging\n");
+	printf("   -j / --jobs <N>           Number of files converted in parallel (default: number of CPUs)\n");
 	printf("\n");
 	printf("WAV/MP3 options:\n");
 	printf("   --wav-mono                Force mono output\n");
@@ -80,6 +90,10 @@ void usage(void) {
 	printf("   --wav-loop <true|false>   Activate playback loop by default\n");
 	printf("   --wav-loop-offset <N>     Set looping offset (in samples; default: 0)\n");
 	printf("\n");
+	printf("XM options:\n");
+	printf("   --xm-bake-ticks <true|false>  Pre-bake patterns and effects into a per-tick event stream\n");
+	printf("                                 (default: false; faster playback, larger file)\n");
+	printf("\n");
 	printf("YM options:\n");
 	printf("   --ym-compress <true|false>  Compress output file\n");
 	printf("\n");
@@ -109,8 +123,13 @@ void convert(char *infn, char *outfn1) {
 		xm_convert(infn, outfn);
 		free(outfn);
 	} else if (strcasecmp(ext, ".ym") == 0) {
+		// The LZH5 compressor uses global state (and ym_convert a fixed
+		// temporary file), so YM files are converted one at a time.
+		static pthread_mutex_t ym_mutex = PTHREAD_MUTEX_INITIALIZER;
 		char *outfn = changeext(outfn1, ".ym64");
+		pthread_mutex_lock(&ym_mutex);
 		ym_convert(infn, outfn);
+		pthread_mutex_unlock(&ym_mutex);
 		free(outfn);
 	} else {
 		fprintf(stderr, "WARNING: ignoring unknown file: %s\n", infn);
@@ -181,6 +200,51 @@ void walkdir(char *inpath, char *outpath, void (*func)(char *, char*)) {
 		fprintf(stderr, "WARNING: ignoring special file: %s\n", inpath);
 	}
 }
+// A file to convert, with a snapshot of the options active for it
+typedef struct {
+	char *infn, *outfn;
+	bool verbose, debug;
+	bool wav_looping, wav_mono;
+	int wav_looping_offset, wav_compress, wav_resample;
+	bool xm_bake_ticks, ym_compress;
+} convert_job_t;
+
+static convert_job_t *jobs = NULL;
+static int njobs = 0;
+
+// Queue a file for conversion (called by walkdir)
+void queue_convert(char *infn, char *outfn) {
+	jobs = realloc(jobs, (njobs+1) * sizeof(convert_job_t));
+	jobs[njobs++] = (convert_job_t){
+		.infn = strdup(infn), .outfn = strdup(outfn),
+		.verbose = flag_verbose, .debug = flag_debug,
+		.wav_looping = flag_wav_looping, .wav_mono = flag_wav_mono,
+		.wav_looping_offset = flag_wav_looping_offset,
+		.wav_compress = flag_wav_compress, .wav_resample = flag_wav_resample,
+		.xm_bake_ticks = flag_xm_bake_ticks, .ym_compress = flag_ym_compress,
+	};
+}
+
+static void convert_job(void *ctx, int idx) {
+	convert_job_t *job = &((convert_job_t*)ctx)[idx];
+	flag_verbose = job->verbose;
+	flag_debug = job->debug;
+	flag_wav_looping = job->wav_looping;
+	flag_wav_mono = job->wav_mono;
+	flag_wav_looping_offset = job->wav_looping_offset;
+	flag_wav_compress = job->wav_compress;
+	flag_wav_resample = job->wav_resample;
+	flag_xm_bake_ticks = job->xm_bake_ticks;
+	flag_ym_compress = job->ym_compress;
+
+	__atomic_add_fetch(&num_jobs_running, 1, __ATOMIC_RELAXED);
+	convert(job->infn, job->outfn);
+	__atomic_sub_fetch(&num_jobs_running, 1, __ATOMIC_RELAXED);
+
+	free(job->infn);
+	free(job->outfn);
+}
+
 int main(int argc, char *argv[]) {
 	if (argc < 2) {
 		usage();
@@ -188,6 +252,7 @@ int main(int argc, char *argv[]) {
 	}
 
 	char *outdir = ".";
+	num_jobs = parallel_cpu_count();
 
 	int i;
 	for (i=1; i<argc; i++) {
@@ -205,6 +270,16 @@ int main(int argc, char *argv[]) {
 				outdir = argv[i];
 			} else if (!strcmp(argv[i], "-d") || !strcmp(argv[i], "--debug")) {
 				flag_debug = true;
+			} else if (!strcmp(argv[i], "-j") || !strcmp(argv[i], "--jobs")) {
+				if (++i == argc) {
+					fprintf(stderr, "missing argument for -j/--jobs\n");
+					return 1;
+				}
+				char extra;
+				if (sscanf(argv[i], "%d%c", &num_jobs, &extra) != 1 || num_jobs < 1) {
+					fprintf(stderr, "invalid argument for -j/--jobs: %s\n", argv[i]);
+					return 1;
+				}
 			} else if (!strcmp(argv[i], "--wav-loop")) {
 				if (++i == argc) {
 					fprintf(stderr, "missing argument for --wav-loop\n");
@@ -251,6 +326,19 @@ int main(int argc, char *argv[]) {
 					fprintf(stderr, "invalid argument for --wav-resample: %s\n", argv[i]);
 					return 1;
 				}
+			} else if (!strcmp(argv[i], "--xm-bake-ticks")) {
+				if (++i == argc) {
+					fprintf(stderr, "missing argument for --xm-bake-ticks\n");
+					return 1;
+				}
+				if (!strcmp(argv[i], "true") || !strcmp(argv[i], "1"))
+					flag_xm_bake_ticks = true;
+				else if (!strcmp(argv[i], "false") || !strcmp(argv[i], "0"))
+					flag_xm_bake_ticks = false;
+				else {
+					fprintf(stderr, "invalid boolean argument for --xm-bake-ticks: %s\n", argv[i]);
+					return 1;
+				}
 			} else if (!strcmp(argv[i], "--ym-compress")) {
 				if (++i == argc) {
 					fprintf(stderr, "missing argument for --ym-compress\n");
@@ -273,10 +361,15 @@ int main(int argc, char *argv[]) {
 			if (!exists(argv[i])) {
 				fprintf(stderr, "ERROR: file %s does not exist\n", argv[i]);
 			} else {
-				walkdir(argv[i], outdir, convert);
+				walkdir(argv[i], outdir, queue_convert);
 			}
 		}
 	}
 
+	// Convert all the files. Output directories have already been created
+	// by walkdir.
+	parallel_for(num_jobs, njobs, convert_job, jobs);
+	free(jobs);
+
 	return 0;
 }
@@ -27,11 +27,11 @@
 #undef MIN
 #undef MAX
 
-bool flag_wav_looping = false;
-int flag_wav_looping_offset = 0;
-int flag_wav_compress = 1;
-int flag_wav_resample = 0;
-bool flag_wav_mono = false;
+__thread bool flag_wav_looping = false;
+__thread int flag_wav_looping_offset = 0;
+__thread int flag_wav_compress = 1;
+__thread int flag_wav_resample = 0;
+__thread bool flag_wav_mono = false;
 
 typedef struct {
 	int16_t *samples;
@@ -268,7 +268,12 @@ int wav_convert(const char *infn, const char *outfn) {
 		int nframes = cnt / kVADPCMFrameSampleCount;
 		void *scratch = malloc(vadpcm_encode_scratch_size(nframes));
 		struct vadpcm_vector *codebook = alloca(kPREDICTORS * kVADPCMEncodeOrder * wav.channels * sizeof(struct vadpcm_vector));
-		struct vadpcm_params parms = { .predictor_count = kPREDICTORS };
+		// Use the threads that are not busy converting other files
+		int running = __atomic_load_n(&num_jobs_running, __ATOMIC_RELAXED);
+		struct vadpcm_params parms = {
+			.predictor_count = kPREDICTORS,
+			.thread_count = num_jobs / (running > 0 ? running : 1),
+		};
 		void *dest = malloc(nframes * kVADPCMFrameByteSize * wav.channels);
 		
 		if (flag_verbose)
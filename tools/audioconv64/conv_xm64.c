@@ -16,6 +16,14 @@
  *    that must contain enough samples for playing one "tick", so the exact
  *    size depends on the playing speed, sample pitch, etc. across the whole
  *    module.
+ *  * Optionally (--xm-bake-ticks), the whole song is played back at conversion
+ *    time and the result of each tick (sample triggers, frequencies, volumes)
+ *    is recorded as a compact stream of deltas. At runtime, xm64.c then just
+ *    applies those deltas to the mixer, instead of running the XM effect
+ *    processing for each tick. The stream covers the first pass of the song,
+ *    and the second pass until it plays the same as the first one; from
+ *    there, it jumps back into the first pass. The patterns are not needed
+ *    anymore, so they are not saved.
  */
 
 #include "mixer.h"
@@ -30,6 +38,167 @@
 #include "../../src/audio/libxm/context.c"
 #include "../../src/audio/libxm/load.c"
 
+// Maximum number of ticks that are baked. This is just a safety net against
+// songs that never loop (about 10 hours at the default speed).
+#define XM64_BAKE_MAX_TICKS         (1<<20)
+
+__thread bool flag_xm_bake_ticks = false;
+
+// Tick stream being baked
+typedef struct {
+	uint8_t *data;
+	uint32_t size, cap;
+} xm_ticks_buf_t;
+
+// Channel state as seen by the runtime player, used to compute deltas
+typedef struct {
+	int inst, samp;
+	uint32_t freq;          // Frequency (IEEE float bits)
+	uint16_t vol, pan;      // Volume (global volume included) and panning
+} xm_ticks_ch_t;
+
+// Effect seen in the current tick on a channel (via the effect callback)
+typedef struct {
+	bool set;
+	uint8_t type, param;
+} xm_ticks_effect_t;
+
+// State of the runtime player at the beginning of a row, and offset of the
+// row in the stream. Used to find where the stream can jump back to when the
+// song loops.
+typedef struct {
+	uint32_t offset;
+	int key;                // Position in the song (see ticks_row_key)
+	int bpm;
+	xm_ticks_ch_t ch[32];
+} xm_ticks_row_t;
+
+static void ticks_w8(xm_ticks_buf_t *tb, uint8_t x) {
+	if (tb->size == tb->cap) {
+		tb->cap = tb->cap ? tb->cap*2 : 65536;
+		tb->data = realloc(tb->data, tb->cap);
+	}
+	tb->data[tb->size++] = x;
+}
+static void ticks_w16(xm_ticks_buf_t *tb, uint16_t x) { ticks_w8(tb, x >> 8); ticks_w8(tb, x); }
+static void ticks_w32(xm_ticks_buf_t *tb, uint32_t x) { ticks_w16(tb, x >> 16); ticks_w16(tb, x); }
+static void ticks_wvar(xm_ticks_buf_t *tb, uint32_t x) {
+	while (x >= 0x80) { ticks_w8(tb, x | 0x80); x >>= 7; }
+	ticks_w8(tb, x);
+}
+static void ticks_wdelta(xm_ticks_buf_t *tb, uint32_t cur, uint32_t last) {
+	int32_t d = cur - last;
+	ticks_wvar(tb, ((uint32_t)d << 1) ^ (uint32_t)(d >> 31));
+}
+
+static void ticks_effect_cb(void *ctx, uint8_t ch, uint8_t type, uint8_t param) {
+	xm_ticks_effect_t *effects = ctx;
+	effects[ch].set = true;
+	effects[ch].type = type;
+	effects[ch].param = param;
+}
+
+// Position in the song (as index in row_loop_count) of the row that the next
+// call to xm_tick() will play, if it starts a new row. This follows xm_row().
+static int ticks_row_key(xm_context_t *ctx) {
+	int idx = ctx->current_table_index, row = ctx->current_row;
+	if (ctx->position_jump) {
+		idx = ctx->jump_dest;
+		row = ctx->jump_row;
+	} else if (ctx->pattern_break) {
+		idx++;
+		row = ctx->jump_row;
+	}
+	if (idx >= ctx->module.length)
+		idx = ctx->module.restart_position;
+	return MAX_NUM_ROWS * idx + row;
+}
+
+// Emit the changes of a channel from last to cur. pos is the new sample
+// position (-1 to stop the channel, -2 if unchanged).
+static void ticks_channel(xm_ticks_buf_t *tb, int i, xm_ticks_ch_t *last, const xm_ticks_ch_t *cur, int pos, const xm_ticks_effect_t *effect) {
+	uint8_t flags = 0;
+	if (cur->inst != last->inst || cur->samp != last->samp) flags |= XM_TICK_CH_SAMPLE;
+	if (pos != -2) flags |= XM_TICK_CH_POS;
+	if (cur->freq != last->freq) flags |= XM_TICK_CH_FREQ;
+	if (cur->vol != last->vol) flags |= XM_TICK_CH_VOL;
+	if (cur->pan != last->pan) flags |= XM_TICK_CH_PAN;
+	if (effect && effect->set) flags |= XM_TICK_CH_EFFECT;
+	if (!flags) return;
+
+	static const uint8_t short_flags[] = XM_TICK_SHORT_FLAGS;
+	int op = XM_TICK_OP_CHANNEL;
+	for (int j=0;j<sizeof(short_flags);j++)
+		if (flags == short_flags[j])
+			op = XM_TICK_OP_CHANNEL_SHORT + 0x20*j;
+	ticks_w8(tb, op | i);
+	if (op == XM_TICK_OP_CHANNEL)
+		ticks_w8(tb, flags);
+	if (flags & XM_TICK_CH_SAMPLE) { ticks_w8(tb, cur->inst); ticks_w8(tb, cur->samp); }
+	if (flags & XM_TICK_CH_POS) ticks_wvar(tb, pos + 1);
+	if (flags & XM_TICK_CH_FREQ) ticks_wdelta(tb, cur->freq, last->freq);
+	if (flags & XM_TICK_CH_VOL) ticks_wdelta(tb, cur->vol, last->vol);
+	if (flags & XM_TICK_CH_PAN) ticks_wdelta(tb, cur->pan, last->pan);
+	if (flags & XM_TICK_CH_EFFECT) { ticks_w8(tb, effect->type); ticks_w8(tb, effect->param); }
+	*last = *cur;
+}
+
+// Record the result of the tick that was just played in ctx. new_row is true
+// if the tick started a new row (the player relies on this for seeking).
+static void ticks_bake(xm_context_t *ctx, xm_ticks_buf_t *tb, xm_ticks_ch_t *last, xm_ticks_effect_t *effects, int *last_bpm, bool new_row) {
+	if (new_row) {
+		ticks_w8(tb, XM_TICK_OP_ROW);
+		ticks_w8(tb, ctx->current_table_index);
+		ticks_w8(tb, ctx->current_row);
+	}
+	if (ctx->bpm != *last_bpm) {
+		ticks_w8(tb, XM_TICK_OP_BPM);
+		ticks_w16(tb, ctx->bpm);
+		*last_bpm = ctx->bpm;
+	}
+
+	for (int i=0;i<ctx->module.num_channels;i++) {
+		xm_channel_context_t *ch = &ctx->channels[i];
+
+		// The channel is stopped: frequency, volume and panning are
+		// irrelevant until a new sample is triggered.
+		xm_ticks_ch_t cur = last[i];
+		cur.inst = cur.samp = 0;
+
+		if (ch->sample) {
+			// Find the instrument that contains this sample
+			for (int j=0;j<ctx->module.num_instruments;j++) {
+				xm_instrument_t *ins = &ctx->module.instruments[j];
+				if (ch->sample >= ins->samples && ch->sample < ins->samples + ins->num_samples) {
+					cur.inst = j+1;
+					cur.samp = ch->sample - ins->samples;
+					break;
+				}
+			}
+			assert(cur.inst);
+			memcpy(&cur.freq, &ch->frequency, 4);
+
+			// libxm computes the volumes as volume*sqrt(1-panning) and
+			// volume*sqrt(panning): go back to volume and panning, as the
+			// panning rarely changes.
+			float l = ch->actual_volume[0], r = ch->actual_volume[1];
+			float vol = sqrtf(l*l + r*r);
+			float v = ctx->global_volume * vol;
+			if (v > 1) v = 1;
+			cur.vol = lrintf(v * 65535.0f);
+			if (vol > 0)
+				cur.pan = lrintf(r*r / (vol*vol) * 65535.0f);
+		}
+
+		int pos = -2;
+		if (ch->sample && ch->sample_position != -2)
+			pos = ch->sample_position < 0 ? -1 : ch->sample_position;
+		ticks_channel(tb, i, &last[i], &cur, pos, &effects[i]);
+	}
+
+	ticks_w8(tb, XM_TICK_OP_END);
+}
+
 int xm_convert(const char *infn, const char *outfn) {
 	if (flag_verbose)
 		fprintf(stderr, "Converting: %s => %s\n", infn, outfn);
@@ -151,14 +320,71 @@ int xm_convert(const char *infn, const char *outfn) {
 	// for every tick, check which waveforms are currently played and at what
 	// frequency, calculate the sample buffer size required at that tick,
 	// and keep the maximum.
+	// If requested, the same dry run is used to bake the tick stream. The
+	// first pass of the song is recorded, then the second pass only until it
+	// becomes identical to the first one (the channels might still be playing
+	// notes from the end of the song when it loops), and then the stream
+	// jumps back into the first pass.
 	int ch_buf[32] = {0};
+	xm_ticks_buf_t tb = {0};
+	xm_ticks_ch_t last[32] = {0};
+	xm_ticks_effect_t effects[32];
+	int last_bpm = ctx->bpm;
+	int nticks = 0;
+	int *row_first = NULL;
+	xm_ticks_row_t *rows = NULL;
+	int num_rows = 0, first_pass_rows = 0;
+	uint32_t first_pass_end = 0;
+
+	if (flag_xm_bake_ticks) {
+		xm_set_effect_callback(ctx, ticks_effect_cb, effects);
+		row_first = malloc(MAX_NUM_ROWS * ctx->module.length * sizeof(int));
+		for (int i=0;i<MAX_NUM_ROWS * ctx->module.length;i++)
+			row_first[i] = -1;
+	}
+
+	while (1) {
+		bool new_row = ctx->current_tick == 0;
+		int row_key = new_row ? ticks_row_key(ctx) : -1;
+		if (flag_xm_bake_ticks) {
+			// Use an impossible position to detect whether xm_tick() changes it.
+			for (int i=0;i<ctx->module.num_channels;i++)
+				ctx->channels[i].sample_position = -2;
+			memset(effects, 0, sizeof(effects));
+		}
 
-	while (xm_get_loop_count(ctx) == 0) {
 		xm_tick(ctx);
+		int loops = xm_get_loop_count(ctx);
+
+		// The sample buffers are sized on the first pass only (plus the
+		// first tick after the loop).
+		bool first_pass = loops == 0 || first_pass_end == 0;
+
+		if (flag_xm_bake_ticks && loops < 2) {
+			if (++nticks > XM64_BAKE_MAX_TICKS)
+				fatal("cannot bake ticks: song is too long or never loops\n");
+			if (loops > 0 && first_pass_end == 0) {
+				assert(new_row);
+				first_pass_end = tb.size;
+				first_pass_rows = num_rows;
+				ticks_w8(&tb, XM_TICK_OP_LOOP);
+			}
+			if (new_row) {
+				rows = realloc(rows, (num_rows+1) * sizeof(xm_ticks_row_t));
+				rows[num_rows].offset = tb.size;
+				rows[num_rows].key = row_key;
+				rows[num_rows].bpm = last_bpm;
+				memcpy(rows[num_rows].ch, last, sizeof(last));
+				if (loops == 0 && row_first[row_key] < 0)
+					row_first[row_key] = num_rows;
+				num_rows++;
+			}
+			ticks_bake(ctx, &tb, last, effects, &last_bpm, new_row);
+		}
 
 		// Number of samples that will be generated for this tick.
 		int nsamples = ceilf(ctx->remaining_samples_in_tick);
-		for(int i = 0; i < ctx->module.num_channels; ++i) {
+		for(int i = 0; i < ctx->module.num_channels && first_pass; ++i) {
 			xm_channel_context_t *ch = &ctx->channels[i];
 
 			if (ch->instrument && ch->sample) {
@@ -182,8 +408,50 @@ int xm_convert(const char *infn, const char *outfn) {
 			}
 		}
 		ctx->remaining_samples_in_tick -= nsamples;
+
+		if (loops > (flag_xm_bake_ticks ? 1 : 0))
+			break;
+	}
+
+	if (flag_xm_bake_ticks) {
+		// Find the first row of the second pass from which the stream is
+		// the same as the first pass until its end, starting from the same
+		// state. The second pass is cut there, with a jump into the first pass.
+		uint32_t second_pass_end = tb.size;
+		int j;
+		for (j=first_pass_rows; j<num_rows; j++) {
+			xm_ticks_row_t *r2 = &rows[j];
+			if (row_first[r2->key] < 0) continue;
+			xm_ticks_row_t *r1 = &rows[row_first[r2->key]];
+			uint32_t len = second_pass_end - r2->offset;
+			if (r1->bpm == r2->bpm && !memcmp(r1->ch, r2->ch, sizeof(r1->ch)) &&
+				first_pass_end - r1->offset == len &&
+				!memcmp(tb.data + r1->offset, tb.data + r2->offset, len))
+				break;
+		}
+		if (j < num_rows) {
+			tb.size = rows[j].offset;
+			ticks_w8(&tb, XM_TICK_OP_JUMP);
+			ticks_w32(&tb, rows[row_first[rows[j].key]].offset);
+		} else {
+			// The second pass never converges: play it again on each loop,
+			// bringing the channels back to the state they had at its start.
+			xm_ticks_row_t *r = &rows[first_pass_rows];
+			ticks_w8(&tb, XM_TICK_OP_LOOP);
+			if (r->bpm != last_bpm) {
+				ticks_w8(&tb, XM_TICK_OP_BPM);
+				ticks_w16(&tb, r->bpm);
+			}
+			for (int i=0;i<ctx->module.num_channels;i++)
+				ticks_channel(&tb, i, &last[i], &r->ch[i], -2, NULL);
+			ticks_w8(&tb, XM_TICK_OP_JUMP);
+			ticks_w32(&tb, r->offset);
+		}
 	}
 
+	free(row_first);
+	free(rows);
+
 	int sam_size = 0;
 	for (int i=0;i<ctx->module.num_channels;i++) {
 		// Add a 5% of margin, just in case there is a bug somewhere. We're still
@@ -201,7 +469,7 @@ int xm_convert(const char *infn, const char *outfn) {
 
 	FILE *out = fopen(outfn, "wb");
 	if (!out) fatal("cannot create: %s", outfn);
-	xm_context_save(ctx, out);
+	xm_context_save(ctx, out, flag_xm_bake_ticks ? tb.data : NULL, tb.size);
 	int romsize = ftell(out);
 	fclose(out);
 
@@ -215,6 +483,8 @@ int xm_convert(const char *infn, const char *outfn) {
 			ctx->ctx_size_stream_pattern_buf / 1024,
 			sam_size / 1024
 		);
+		if (flag_xm_bake_ticks)
+			fprintf(stderr, "  * Baked ticks: %u KiB (%d ticks)\n", tb.size / 1024, nticks);
 		fprintf(stderr, "  * Samples RAM per channel: [");
 		for (int i=0;i<ctx->module.num_channels;i++) {
 			if (i!=0) fprintf(stderr, ", ");
@@ -231,9 +501,10 @@ int xm_convert(const char *infn, const char *outfn) {
 	xm_context_t *ctx2;
 	out = fopen(outfn, "rb");
 	if (!out) fatal("cannot open: %s", outfn);
-	int ret = xm_context_load(&ctx2, out, 48000);
+	int ret = xm_context_load(&ctx2, out, 48000, NULL);
 	if (ret != 0) fatal("internal error: loading just created module: %s (ret:%d)", outfn, ret);
 	fclose(out);
+	free(tb.data);
 
 	return 0;
 }
@@ -25,7 +25,7 @@
 #include <stdalign.h>
 
 
-bool flag_ym_compress = false;
+__thread bool flag_ym_compress = false;
 
 typedef struct __attribute__((packed)) {
     uint8_t size;
@@ -2,6 +2,7 @@
 // This file is part of Skelly 64. Skelly 64 is licensed under the terms of the
 // Mozilla Public License, version 2.0. See LICENSE.txt for details.
 #include "vadpcm.h"
+#include "../../common/parallel.h"
 
 #include <math.h>
 #include <stdlib.h>
@@ -16,6 +17,10 @@ enum {
 
     // Iterations for predictor assignment.
     kVADPCMIterations = 20,
+
+    // Number of frames processed by each parallel job. This is fixed so that
+    // the output does not depend on the number of threads.
+    kVADPCMChunkFrames = 4096,
 };
 
 // Autocorrelation is a symmetric 3x3 matrix.
@@ -26,14 +31,19 @@ enum {
 // [_ 2 4]
 // [_ _ 5]
 
-// Calculate the autocorrelation matrix for each frame.
-static void vadpcm_autocorr(size_t frame_count, float (*restrict corr)[6],
-                            const int16_t *restrict src) {
+// Calculate the autocorrelation matrix for each frame in [start, end).
+static void vadpcm_autocorr_range(size_t start, size_t end,
+                                  float (*restrict corr)[6],
+                                  const int16_t *restrict src) {
     float x0 = 0.0f, x1 = 0.0f, x2 = 0.0f, m[6];
     size_t frame;
     int i;
 
-    for (frame = 0; frame < frame_count; frame++) {
+    if (start > 0) {
+        x0 = src[start * kVADPCMFrameSampleCount - 1] * (1.0f / 32768.0f);
+        x1 = src[start * kVADPCMFrameSampleCount - 2] * (1.0f / 32768.0f);
+    }
+    for (frame = start; frame < end; frame++) {
         for (i = 0; i < 6; i++) {
             m[i] = 0.0f;
         }
@@ -219,11 +229,90 @@ static void vadpcm_best_error(size_t frame_count,
     }
 }
 
+// Assign each frame in [start, end) to the predictor with the lowest error,
+// and record the error. Count how many frames use each predictor.
+static void vadpcm_assign_range(size_t start, size_t end, int active_count,
+                                const float (*restrict corr)[6],
+                                const float (*restrict coeff)[2],
+                                float *restrict error,
+                                uint8_t *restrict predictors,
+                                int *restrict count) {
+    for (int i = 0; i < active_count; i++) {
+        count[i] = 0;
+    }
+    for (size_t frame = start; frame < end; frame++) {
+        int fpredictor = 0;
+        float ferror = 0.0f;
+        for (int i = 0; i < active_count; i++) {
+            float e = vadpcm_eval(corr[frame], coeff[i]);
+            if (i == 0 || e < ferror) {
+                fpredictor = i;
+                ferror = e;
+            }
+        }
+        predictors[frame] = fpredictor;
+        error[frame] = ferror;
+        count[fpredictor]++;
+    }
+}
+
+// State shared by the parallel jobs of the encoder. Each job processes the
+// frames of one chunk of kVADPCMChunkFrames frames.
+struct vadpcm_jobs {
+    int thread_count;
+    size_t frame_count;
+    const int16_t *src;
+    float (*corr)[6];
+    float *best_error;
+    float *error;
+    uint8_t *predictors;
+    // Predictor assignment
+    int active_count;
+    const float (*coeff)[2];
+    int (*chunk_count)[kVADPCMMaxPredictorCount];
+    // Encoding
+    uint8_t *dest;
+    const struct vadpcm_vector *codebook;
+    int (*frame_state)[2];
+};
+
+static size_t vadpcm_chunk_count(size_t frame_count) {
+    return (frame_count + kVADPCMChunkFrames - 1) / kVADPCMChunkFrames;
+}
+
+static void vadpcm_chunk_range(const struct vadpcm_jobs *jobs, int idx,
+                               size_t *start, size_t *end) {
+    *start = (size_t)idx * kVADPCMChunkFrames;
+    *end = *start + kVADPCMChunkFrames;
+    if (*end > jobs->frame_count) {
+        *end = jobs->frame_count;
+    }
+}
+
+static void vadpcm_analyze_job(void *ctx, int idx) {
+    struct vadpcm_jobs *jobs = ctx;
+    size_t start, end;
+    vadpcm_chunk_range(jobs, idx, &start, &end);
+    vadpcm_autocorr_range(start, end, jobs->corr, jobs->src);
+    vadpcm_best_error(end - start, (const float(*)[6])jobs->corr + start,
+                      jobs->best_error + start);
+}
+
+static void vadpcm_assign_job(void *ctx, int idx) {
+    struct vadpcm_jobs *jobs = ctx;
+    size_t start, end;
+    vadpcm_chunk_range(jobs, idx, &start, &end);
+    vadpcm_assign_range(start, end, jobs->active_count,
+                        (const float(*)[6])jobs->corr, jobs->coeff,
+                        jobs->error, jobs->predictors, jobs->chunk_count[idx]);
+}
+
 // Refine (improve) the existing predictor assignments. Does not assign
 // unassigned predictors. Record the amount of error, squared, for each frame.
 // Returns the index of an unassigned predictor, or predictor_count, if no
 // predictor is unassigned.
-static int vadpcm_refine_predictors(size_t frame_count, int predictor_count,
+static int vadpcm_refine_predictors(struct vadpcm_jobs *jobs,
+                                    size_t frame_count, int predictor_count,
                                     const float (*restrict corr)[6],
                                     float *restrict error,
                                     uint8_t *restrict predictors) {
@@ -247,24 +336,17 @@ static int vadpcm_refine_predictors(size_t frame_count, int predictor_count,
     }
 
     // Assign frames to the best predictor for each frame, and record the amount
-    // of error.
+    // of error. Frames are independent, so this is done in parallel.
     int count2[kVADPCMMaxPredictorCount];
+    size_t nchunks = vadpcm_chunk_count(frame_count);
+    jobs->active_count = active_count;
+    jobs->coeff = (const float(*)[2])coeff;
+    parallel_for(jobs->thread_count, nchunks, vadpcm_assign_job, jobs);
     for (int i = 0; i < active_count; i++) {
         count2[i] = 0;
-    }
-    for (size_t frame = 0; frame < frame_count; frame++) {
-        int fpredictor = 0;
-        float ferror = 0.0f;
-        for (int i = 0; i < active_count; i++) {
-            float e = vadpcm_eval(corr[frame], coeff[i]);
-            if (i == 0 || e < ferror) {
-                fpredictor = i;
-                ferror = e;
-            }
+        for (size_t c = 0; c < nchunks; c++) {
+            count2[i] += jobs->chunk_count[c][i];
         }
-        predictors[frame] = fpredictor;
-        error[frame] = ferror;
-        count2[fpredictor]++;
     }
     for (int i = 0; i < active_count; i++) {
         if (count2[i] == 0) {
@@ -292,7 +374,8 @@ static size_t vadpcm_worst_frame(size_t frame_count,
 
 // Assign a predictor to each frame. The predictors array should be initialized
 // to zero.
-static void vadpcm_assign_predictors(size_t frame_count, int predictor_count,
+static void vadpcm_assign_predictors(struct vadpcm_jobs *jobs,
+                                     size_t frame_count, int predictor_count,
                                      const float (*restrict corr)[6],
                                      const float *restrict best_error,
                                      float *restrict error,
@@ -307,8 +390,8 @@ static void vadpcm_assign_predictors(size_t frame_count, int predictor_count,
                 active_count = unassigned + 1;
             }
         }
-        unassigned = vadpcm_refine_predictors(frame_count, active_count, corr,
-                                              error, predictors);
+        unassigned = vadpcm_refine_predictors(jobs, frame_count, active_count,
+                                              corr, error, predictors);
     }
 }
 
@@ -374,7 +457,9 @@ static int vadpcm_getshift(int min, int max) {
 }
 
 size_t vadpcm_encode_scratch_size(size_t frame_count) {
-    return frame_count * (sizeof(float) * 8 + 1);
+    return frame_count * (sizeof(float) * 8 + sizeof(int) * 2 + 1) +
+           vadpcm_chunk_count(frame_count) * sizeof(int) *
+               kVADPCMMaxPredictorCount;
 }
 
 static uint32_t vadpcm_rng(uint32_t state) {
@@ -386,105 +471,196 @@ static uint32_t vadpcm_rng(uint32_t state) {
     return state * 0xd9f5 + 0x6487ed51;
 }
 
-// Encode audio as VADPCM, given the assignment of each frame to a predictor.
-static void vadpcm_encode_data(size_t frame_count, void *restrict dest,
-                               const int16_t *restrict src,
-                               const uint8_t *restrict predictors,
-                               const struct vadpcm_vector *restrict codebook) {
-    uint32_t rng_state = 0;
-    uint8_t *destptr = dest;
-    int state[4];
-    state[0] = 0;
-    state[1] = 0;
-    for (size_t frame = 0; frame < frame_count; frame++) {
-        unsigned predictor = predictors[frame];
-        const struct vadpcm_vector *restrict pvec = codebook + 2 * predictor;
-        int accumulator[8], s0, s1, s, a, r, min, max;
-
-        // Calculate the residual with full precision, and figure out the
-        // scaling factor necessary to encode it.
-        state[2] = src[frame * 16 + 6];
-        state[3] = src[frame * 16 + 7];
-        min = 0;
-        max = 0;
+// Advance the RNG state by the given number of steps.
+static uint32_t vadpcm_rng_skip(uint32_t state, size_t steps) {
+    // The generator is affine (x -> a*x + c), so it can be composed with
+    // itself by squaring.
+    uint32_t a = 0xd9f5, c = 0x6487ed51;
+    while (steps) {
+        if (steps & 1) {
+            state = state * a + c;
+        }
+        c = c * a + c;
+        a = a * a;
+        steps >>= 1;
+    }
+    return state;
+}
+
+// Encode one frame as VADPCM. The decoder state (last two output samples)
+// is updated. The RNG state is advanced by 16 steps for each frame.
+static void vadpcm_encode_frame(const int16_t *restrict src,
+                                uint8_t *restrict dest, unsigned predictor,
+                                const struct vadpcm_vector *restrict codebook,
+                                int *restrict state, uint32_t rng_state) {
+    const struct vadpcm_vector *restrict pvec = codebook + 2 * predictor;
+    int accumulator[8], s0, s1, s, a, r, min, max;
+    int new_state[2] = {0, 0};
+
+    // Calculate the residual with full precision, and figure out the
+    // scaling factor necessary to encode it.
+    const int pstate[4] = {state[0], state[1], src[6], src[7]};
+    min = 0;
+    max = 0;
+    for (int vector = 0; vector < 2; vector++) {
+        s0 = pstate[vector * 2];
+        s1 = pstate[vector * 2 + 1];
+        for (int i = 0; i < 8; i++) {
+            accumulator[i] = (src[vector * 8 + i] << 11) -
+                             s0 * pvec[0].v[i] - s1 * pvec[1].v[i];
+        }
+        for (int i = 0; i < 8; i++) {
+            s = accumulator[i] >> 11;
+            if (s < min) {
+                min = s;
+            }
+            if (s > max) {
+                max = s;
+            }
+            for (int j = 0; j < 7 - i; j++) {
+                accumulator[i + 1 + j] -= s * pvec[1].v[j];
+            }
+        }
+    }
+    int shift = vadpcm_getshift(min, max);
+
+    // Try a range of 3 shift values, and use the shift value that produces
+    // the lowest error.
+    double best_error = 0.0;
+    int min_shift = shift > 0 ? shift - 1 : 0;
+    int max_shift = shift < 12 ? shift + 1 : 12;
+    uint32_t init_state = rng_state;
+    for (shift = min_shift; shift <= max_shift; shift++) {
+        rng_state = init_state;
+        uint8_t fout[8];
+        double error = 0.0;
+        s0 = state[0];
+        s1 = state[1];
         for (int vector = 0; vector < 2; vector++) {
-            s0 = state[vector * 2];
-            s1 = state[vector * 2 + 1];
             for (int i = 0; i < 8; i++) {
-                accumulator[i] = (src[frame * 16 + vector * 8 + i] << 11) -
-                                 s0 * pvec[0].v[i] - s1 * pvec[1].v[i];
+                accumulator[i] = s0 * pvec[0].v[i] + s1 * pvec[1].v[i];
             }
             for (int i = 0; i < 8; i++) {
-                s = accumulator[i] >> 11;
-                if (s < min) {
-                    min = s;
-                }
-                if (s > max) {
-                    max = s;
+                s = src[vector * 8 + i];
+                a = accumulator[i] >> 11;
+                // Calculate the residual, encode as 4 bits.
+                int bias = (rng_state >> 16) >> (16 - shift);
+                rng_state = vadpcm_rng(rng_state);
+                r = (s - a + bias) >> shift;
+                if (r > 7) {
+                    r = 7;
+                } else if (r < -8) {
+                    r = -8;
                 }
+                accumulator[i] = r;
+                // Update state to match decoder.
+                int sout = r << shift;
                 for (int j = 0; j < 7 - i; j++) {
-                    accumulator[i + 1 + j] -= s * pvec[1].v[j];
+                    accumulator[i + 1 + j] += sout * pvec[1].v[j];
                 }
+                sout += a;
+                s0 = s1;
+                s1 = sout;
+                // Track encoding error.
+                double serror = s - sout;
+                error += serror * serror;
             }
-        }
-        int shift = vadpcm_getshift(min, max);
-
-        // Try a range of 3 shift values, and use the shift value that produces
-        // the lowest error.
-        double best_error = 0.0;
-        int min_shift = shift > 0 ? shift - 1 : 0;
-        int max_shift = shift < 12 ? shift + 1 : 12;
-        uint32_t init_state = rng_state;
-        for (shift = min_shift; shift <= max_shift; shift++) {
-            rng_state = init_state;
-            uint8_t fout[8];
-            double error = 0.0;
-            s0 = state[0];
-            s1 = state[1];
-            for (int vector = 0; vector < 2; vector++) {
-                for (int i = 0; i < 8; i++) {
-                    accumulator[i] = s0 * pvec[0].v[i] + s1 * pvec[1].v[i];
-                }
-                for (int i = 0; i < 8; i++) {
-                    s = src[frame * 16 + vector * 8 + i];
-                    a = accumulator[i] >> 11;
-                    // Calculate the residual, encode as 4 bits.
-                    int bias = (rng_state >> 16) >> (16 - shift);
-                    rng_state = vadpcm_rng(rng_state);
-                    r = (s - a + bias) >> shift;
-                    if (r > 7) {
-                        r = 7;
-                    } else if (r < -8) {
-                        r = -8;
-                    }
-                    accumulator[i] = r;
-                    // Update state to match decoder.
-                    int sout = r << shift;
-                    for (int j = 0; j < 7 - i; j++) {
-                        accumulator[i + 1 + j] += sout * pvec[1].v[j];
-                    }
-                    sout += a;
-                    s0 = s1;
-                    s1 = sout;
-                    // Track encoding error.
-                    double serror = s - sout;
-                    error += serror * serror;
-                }
-                for (int i = 0; i < 4; i++) {
-                    fout[vector * 4 + i] = ((accumulator[2 * i] & 15) << 4) |
-                                           (accumulator[2 * i + 1] & 15);
-                }
+            for (int i = 0; i < 4; i++) {
+                fout[vector * 4 + i] = ((accumulator[2 * i] & 15) << 4) |
+                                       (accumulator[2 * i + 1] & 15);
             }
-            if (shift == min_shift || error < best_error) {
-                destptr[frame * 9] = (shift << 4) | predictor;
-                memcpy(destptr + frame * 9 + 1, fout, 8);
-                state[2] = s0;
-                state[3] = s1;
-                best_error = error;
+        }
+        if (shift == min_shift || error < best_error) {
+            dest[0] = (shift << 4) | predictor;
+            memcpy(dest + 1, fout, 8);
+            new_state[0] = s0;
+            new_state[1] = s1;
+            best_error = error;
+        }
+    }
+    state[0] = new_state[0];
+    state[1] = new_state[1];
+}
+
+// Encode the frames in [start, end), starting from the given decoder state,
+// which is updated. If frame_state is not NULL, the state after each frame
+// is recorded.
+static void vadpcm_encode_range(size_t start, size_t end, uint8_t *restrict dest,
+                                const int16_t *restrict src,
+                                const uint8_t *restrict predictors,
+                                const struct vadpcm_vector *restrict codebook,
+                                int *restrict state, int (*frame_state)[2]) {
+    uint32_t rng_state = vadpcm_rng_skip(0, start * kVADPCMFrameSampleCount);
+    for (size_t frame = start; frame < end; frame++) {
+        vadpcm_encode_frame(src + frame * kVADPCMFrameSampleCount,
+                            dest + frame * kVADPCMFrameByteSize,
+                            predictors[frame], codebook, state, rng_state);
+        rng_state = vadpcm_rng_skip(rng_state, kVADPCMFrameSampleCount);
+        if (frame_state) {
+            frame_state[frame][0] = state[0];
+            frame_state[frame][1] = state[1];
+        }
+    }
+}
+
+// Encode audio as VADPCM, given the assignment of each frame to a predictor.
+static void vadpcm_encode_data(size_t frame_count, void *restrict dest,
+                               const int16_t *restrict src,
+                               const uint8_t *restrict predictors,
+                               const struct vadpcm_vector *restrict codebook) {
+    int state[2] = {0, 0};
+    vadpcm_encode_range(0, frame_count, dest, src, predictors, codebook, state,
+                        NULL);
+}
+
+// Guess the decoder state at the beginning of a chunk: the decoder output
+// is usually very close to the input, so use the input samples.
+static void vadpcm_guess_state(const int16_t *src, size_t start, int *state) {
+    state[0] = start ? src[start * kVADPCMFrameSampleCount - 2] : 0;
+    state[1] = start ? src[start * kVADPCMFrameSampleCount - 1] : 0;
+}
+
+static void vadpcm_encode_job(void *ctx, int idx) {
+    struct vadpcm_jobs *jobs = ctx;
+    size_t start, end;
+    int state[2];
+    vadpcm_chunk_range(jobs, idx, &start, &end);
+    vadpcm_guess_state(jobs->src, start, state);
+    vadpcm_encode_range(start, end, jobs->dest, jobs->src, jobs->predictors,
+                        jobs->codebook, state, jobs->frame_state);
+}
+
+// Encode audio as VADPCM in parallel. The output is identical to
+// vadpcm_encode_data.
+//
+// Each frame depends on the decoder state left by the previous one, so chunks
+// are first encoded in parallel starting from a guessed state. Then, each
+// chunk is re-encoded serially from the actual state, only until the state
+// matches the one of the parallel pass: from there on, the output is the same.
+// In practice, this happens after a few frames.
+static void vadpcm_encode_data_parallel(struct vadpcm_jobs *jobs) {
+    size_t nchunks = vadpcm_chunk_count(jobs->frame_count);
+    parallel_for(jobs->thread_count, nchunks, vadpcm_encode_job, jobs);
+
+    int state[2] = {0, 0};
+    for (size_t c = 0; c < nchunks; c++) {
+        size_t start, end, frame;
+        int spec[2];
+        vadpcm_chunk_range(jobs, c, &start, &end);
+        vadpcm_guess_state(jobs->src, start, spec);
+        for (frame = start; frame < end; frame++) {
+            if (state[0] == spec[0] && state[1] == spec[1]) {
+                break;
             }
+            // Speculative state after this frame, before it is overwritten.
+            spec[0] = jobs->frame_state[frame][0];
+            spec[1] = jobs->frame_state[frame][1];
+            vadpcm_encode_range(frame, frame + 1, jobs->dest, jobs->src,
+                                jobs->predictors, jobs->codebook, state,
+                                jobs->frame_state);
         }
-        state[0] = state[2];
-        state[1] = state[3];
+        state[0] = jobs->frame_state[end - 1][0];
+        state[1] = jobs->frame_state[end - 1][1];
     }
 }
 
@@ -507,6 +683,8 @@ vadpcm_error vadpcm_encode(const struct vadpcm_params *restrict params,
     float(*restrict corr)[6];
     float *restrict best_error;
     float *restrict error;
+    int(*frame_state)[2];
+    int(*chunk_count)[kVADPCMMaxPredictorCount];
     uint8_t *restrict predictors;
     {
         char *ptr = scratch;
@@ -516,21 +694,46 @@ vadpcm_error vadpcm_encode(const struct vadpcm_params *restrict params,
         ptr += sizeof(*best_error) * frame_count;
         error = (void *)ptr;
         ptr += sizeof(*error) * frame_count;
+        frame_state = (void *)ptr;
+        ptr += sizeof(*frame_state) * frame_count;
+        chunk_count = (void *)ptr;
+        ptr += sizeof(*chunk_count) * vadpcm_chunk_count(frame_count);
         predictors = (void *)ptr;
     }
 
-    vadpcm_autocorr(frame_count, corr, src);
+    // Frames are split in chunks that are processed in parallel. The chunks
+    // do not depend on the number of threads, and the results are combined
+    // in order, so the output is always the same.
+    struct vadpcm_jobs jobs = {
+        .thread_count = params->thread_count > 1 ? params->thread_count : 1,
+        .frame_count = frame_count,
+        .src = src,
+        .corr = corr,
+        .best_error = best_error,
+        .error = error,
+        .predictors = predictors,
+        .chunk_count = chunk_count,
+        .dest = dest,
+        .codebook = codebook,
+        .frame_state = frame_state,
+    };
+    size_t nchunks = vadpcm_chunk_count(frame_count);
+
+    parallel_for(jobs.thread_count, nchunks, vadpcm_analyze_job, &jobs);
     for (size_t i = 0; i < frame_count; i++) {
         predictors[i] = 0;
     }
     if (predictor_count > 1) {
-        vadpcm_best_error(frame_count, corr, best_error);
-        vadpcm_assign_predictors(frame_count, predictor_count, corr, best_error,
-                                 error, predictors);
+        vadpcm_assign_predictors(&jobs, frame_count, predictor_count, corr,
+                                 best_error, error, predictors);
     }
     vadpcm_make_codebook(frame_count, predictor_count, corr, predictors,
                          codebook);
-    vadpcm_encode_data(frame_count, dest, src, predictors, codebook);
+    if (jobs.thread_count > 1) {
+        vadpcm_encode_data_parallel(&jobs);
+    } else {
+        vadpcm_encode_data(frame_count, dest, src, predictors, codebook);
+    }
     return 0;
 }
 
@@ -571,7 +774,7 @@ static void test_autocorr(void) {
 
         // Get the autocorrelation.
         float corr[2][6];
-        vadpcm_autocorr(2, corr, data);
+        vadpcm_autocorr_range(0, 2, corr, data);
 
         // Calculate error directly.
         float s1 = (float)data[kVADPCMFrameSampleCount - 2] * (1.0f / 32768.0f);
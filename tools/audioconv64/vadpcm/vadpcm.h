@@ -131,6 +131,10 @@ vadpcm_error vadpcm_decode(int predictor_count, int order,
 struct vadpcm_params {
     // The number of predictors to put in the codebook.
     int predictor_count;
+
+    // The number of threads to use for encoding (0 or 1: no threads). The
+    // output does not depend on the number of threads.
+    int thread_count;
 };
 
 // Return the amount of scratch space needed to encode a file with the given
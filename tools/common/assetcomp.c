@@ -2,8 +2,12 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "binout.h"
+#include "fnv.h"
 #include "aplib_compress.h"
 #include "shrinkler_compress.h"
 #undef SWAP
@@ -20,16 +24,423 @@
 #undef LZ4_DECOMPRESS_INPLACE_MARGIN
 
 #include "lz4_compress.h"
+#include "assetcomp.h"
 
-void asset_compress_mem(int compression, const uint8_t *data, int sz, uint8_t **output, int *cmp_size, int *winsize, int *margin)
+/** @brief Estimated decompression speed on N64 for each level (bytes of output per millisecond) */
+static const int dec_speed[MAX_COMPRESSION+1] = {
+    [0] = 0,                    // no decompression
+    [1] = 12*1024*1024/1000,    // lz4
+    [2] = 5*1024*1024/1000,     // aplib
+    [3] = 1*1024*1024/2000,     // shrinkler
+};
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+static void asset_compress_init(void)
 {
+    asset_init_compression(2);
+    asset_init_compression(3);
+}
+
+/**
+ * @brief Estimate the time required to decompress an asset on N64, in microseconds
+ */
+int asset_estimate_dec_time(int compression, int dec_size)
+{
+    if (compression == 0) return 0;
+    return (int64_t)dec_size * 1000 / dec_speed[compression];
+}
+
+/**
+ * @brief Version of the format of the compression cache entries.
+ * 
+ * Changes to the compressors do not require bumping this: entries are also
+ * keyed on #ASSETCOMP_SOURCE_HASH.
+ */
+#define CACHE_VERSION           3
+
+#ifndef ASSETCOMP_SOURCE_HASH
+/**
+ * @brief Checksum of the sources of the compressors, computed by the Makefile.
+ * 
+ * Any change to a compressor (updated library, different parameters) changes
+ * it, so that entries created by a different encoder are ignored.
+ */
+#define ASSETCOMP_SOURCE_HASH   0
+#endif
+#define CACHE_MAGIC             "DCC"
+
+/** @brief Header of an entry of the compression cache */
+typedef struct {
+    char magic[3];              ///< Magic header
+    uint8_t version;            ///< Cache version (#CACHE_VERSION)
+    uint8_t compression;        ///< Compression level
+    uint8_t reserved[3];
+    uint32_t req_winsize;       ///< Window size requested by the caller
+    uint32_t winsize;           ///< Window size used
+    uint32_t dec_size;          ///< Size of the input data
+    uint32_t cmp_size;          ///< Size of the compressed data
+    uint32_t margin;            ///< Inplace margin
+    uint32_t dict_id;           ///< ID of the dictionary used (0 = none)
+    uint32_t source_hash;       ///< Compressors that created the entry (#ASSETCOMP_SOURCE_HASH)
+    uint64_t check;             ///< Secondary hash of the input data
+} cache_header_t;
+
+/** @brief Shared dictionary used for compression (see #asset_compress_set_dictionary) */
+static uint8_t *comp_dict = NULL;
+static int comp_dict_size = 0;
+static uint32_t comp_dict_id = 0;
+
+/** @brief Return true if the dictionary is used to compress at the specified level */
+static bool dict_used(int compression)
+{
+    // Shrinkler does not support dictionaries
+    return comp_dict && (compression == 1 || compression == 2);
+}
+
+static const char *cache_dir = NULL;
+static bool cache_dir_set = false;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+/** @brief Maximum amount of data compressed with each level to select the level of a blocked asset */
+#define BLOCKS_AUTO_SAMPLE_SIZE (64*1024)
+/** @brief Size of the k-mers used to find content shared between samples */
+#define DICT_KMER_SIZE          8
+/** @brief Size of the segments that are copied from the samples into the dictionary */
+#define DICT_SEGMENT_SIZE       64
+/** @brief Number of bits of the k-mer hash table */
+#define DICT_HASH_BITS          20
+
+static void cache_init(void)
+{
+    if (!cache_dir_set)
+        cache_dir = getenv("N64_ASSET_CACHE");
+}
+
+/**
+ * @brief Configure the directory used to cache compression results.
+ * 
+ * If never called, the directory is taken from the N64_ASSET_CACHE environment
+ * variable. Pass NULL to disable the cache. This must be called before
+ * any compression is started.
+ */
+void asset_compress_set_cache_dir(const char *dir)
+{
+    cache_dir = dir;
+    cache_dir_set = true;
+}
+
+/**
+ * @brief Configure the dictionary used for compression.
+ * 
+ * The dictionary file must have been created with #asset_build_dictionary.
+ * It is also loaded for decompression, so that assets compressed with it
+ * can be recompressed. This must be called before any compression is started.
+ * 
+ * @param fn            Dictionary file, or NULL to disable the dictionary
+ * @return true         Dictionary loaded correctly
+ * @return false        Error loading the dictionary
+ */
+bool asset_compress_set_dictionary(const char *fn)
+{
+    free(comp_dict);
+    comp_dict = NULL;
+    comp_dict_size = 0;
+    comp_dict_id = 0;
+    asset_set_dictionary(NULL);
+    if (!fn)
+        return true;
+
+    FILE *f = fopen(fn, "rb");
+    if (!f) {
+        fprintf(stderr, "error opening dictionary file: %s\n", fn);
+        return false;
+    }
+
+    asset_dict_header_t header;
+    bool ok = fread(&header, 1, sizeof(header), f) == sizeof(header) &&
+        !memcmp(header.magic, ASSET_DICT_MAGIC, 3) && header.version == '1';
+    if (ok) {
+        comp_dict_id = __builtin_bswap32(header.id);
+        comp_dict_size = __builtin_bswap32(header.size);
+        ok = comp_dict_size > 0 && comp_dict_size <= ASSET_DICT_MAX_SIZE;
+    }
+    if (ok) {
+        comp_dict = malloc(comp_dict_size);
+        ok = fread(comp_dict, 1, comp_dict_size, f) == comp_dict_size;
+    }
+    fclose(f);
+
+    if (!ok) {
+        fprintf(stderr, "invalid dictionary file: %s\n", fn);
+        free(comp_dict);
+        comp_dict = NULL;
+        comp_dict_size = 0;
+        comp_dict_id = 0;
+        return false;
+    }
+
+    asset_set_dictionary(fn);
+    return true;
+}
+
+static uint32_t dict_kmer_hash(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 0x9E3779B97F4A7C15ull) >> (64 - DICT_HASH_BITS);
+}
+
+/** @brief A candidate segment of a sample for the dictionary */
+typedef struct {
+    const uint8_t *data;        ///< Segment data (DICT_SEGMENT_SIZE bytes)
+    uint64_t score;             ///< Score of the segment
+} dict_segment_t;
+
+static int dict_segment_cmp(const void *a, const void *b)
+{
+    const dict_segment_t *sa = a, *sb = b;
+    if (sa->score != sb->score) return sa->score < sb->score ? 1 : -1;
+    return sa->data < sb->data ? -1 : sa->data > sb->data;
+}
+
+/** @brief Score a segment: k-mers shared by more samples are worth more */
+static uint64_t dict_segment_score(const uint8_t *seg, const uint32_t *freq, const uint8_t *covered)
+{
+    uint64_t score = 0;
+    for (int i = 0; i + DICT_KMER_SIZE <= DICT_SEGMENT_SIZE; i++) {
+        uint32_t h = dict_kmer_hash(seg + i);
+        if (!covered || !(covered[h >> 3] & (1 << (h & 7))))
+            score += freq[h] - 1;
+    }
+    return score;
+}
+
+/**
+ * @brief Build a dictionary from a set of sample files.
+ * 
+ * The dictionary is made of the segments of the samples that contain the
+ * most content shared across different samples (a simplified version of the
+ * COVER algorithm used by zstd). The most valuable segments are placed at the
+ * end of the dictionary, closer to the data, so that matches to them use
+ * shorter offsets.
+ * 
+ * @param files         Sample files (they can be compressed assets)
+ * @param nfiles        Number of sample files
+ * @param dict_size     Maximum size of the dictionary in bytes
+ * @param outfn         Output dictionary file
+ * @return true         Dictionary was built correctly
+ * @return false        Error building the dictionary
+ */
+bool asset_build_dictionary(const char **files, int nfiles, int dict_size, const char *outfn)
+{
+    pthread_once(&init_once, asset_compress_init);
+
+    if (dict_size <= 0 || dict_size > ASSET_DICT_MAX_SIZE) {
+        fprintf(stderr, "invalid dictionary size: %d (max: %d)\n", dict_size, ASSET_DICT_MAX_SIZE);
+        return false;
+    }
+    if (nfiles < 2) {
+        fprintf(stderr, "at least two sample files are required to build a dictionary\n");
+        return false;
+    }
+
+    uint8_t **samples = calloc(nfiles, sizeof(uint8_t*));
+    int *sizes = calloc(nfiles, sizeof(int));
+    uint32_t *freq = calloc(1 << DICT_HASH_BITS, sizeof(uint32_t));
+    int *last = malloc((1 << DICT_HASH_BITS) * sizeof(int));
+    memset(last, 0xFF, (1 << DICT_HASH_BITS) * sizeof(int));
+    dict_segment_t *segs = NULL; int nsegs = 0;
+    bool ok = true;
+
+    for (int i = 0; i < nfiles && ok; i++) {
+        FILE *in = fopen(files[i], "rb");
+        if (!in) {
+            fprintf(stderr, "error opening input file: %s\n", files[i]);
+            ok = false;
+            break;
+        }
+        fclose(in);
+        samples[i] = asset_load(files[i], &sizes[i]);
+
+        // Count in how many samples each k-mer appears
+        for (int j = 0; j + DICT_KMER_SIZE <= sizes[i]; j++) {
+            uint32_t h = dict_kmer_hash(samples[i] + j);
+            if (last[h] != i) {
+                last[h] = i;
+                freq[h]++;
+            }
+        }
+    }
+
+    if (ok) {
+        // Score all the segments of all samples (with 50% overlap)
+        for (int i = 0; i < nfiles; i++) {
+            for (int j = 0; j + DICT_SEGMENT_SIZE <= sizes[i]; j += DICT_SEGMENT_SIZE/2) {
+                uint64_t score = dict_segment_score(samples[i] + j, freq, NULL);
+                if (!score) continue;
+                segs = realloc(segs, (nsegs + 1) * sizeof(dict_segment_t));
+                segs[nsegs++] = (dict_segment_t){ .data = samples[i] + j, .score = score };
+            }
+        }
+        qsort(segs, nsegs, sizeof(dict_segment_t), dict_segment_cmp);
+
+        // Pick the best segments, skipping those whose content is mostly
+        // covered by segments already picked.
+        uint8_t *covered = calloc(1 << (DICT_HASH_BITS-3), 1);
+        uint8_t *dict = malloc(dict_size);
+        int size = 0;
+        for (int i = 0; i < nsegs && size + DICT_SEGMENT_SIZE <= dict_size; i++) {
+            uint64_t score = dict_segment_score(segs[i].data, freq, covered);
+            if (score * 2 < segs[i].score)
+                continue;
+            for (int j = 0; j + DICT_KMER_SIZE <= DICT_SEGMENT_SIZE; j++) {
+                uint32_t h = dict_kmer_hash(segs[i].data + j);
+                covered[h >> 3] |= 1 << (h & 7);
+            }
+            // Fill the dictionary backward, so that the best segments are at the end
+            size += DICT_SEGMENT_SIZE;
+            memcpy(dict + dict_size - size, segs[i].data, DICT_SEGMENT_SIZE);
+        }
+        free(covered);
+
+        if (size == 0) {
+            fprintf(stderr, "no content shared between the sample files\n");
+            ok = false;
+        } else {
+            FILE *out = fopen(outfn, "wb");
+            if (!out) {
+                fprintf(stderr, "error opening output file: %s\n", outfn);
+                ok = false;
+            } else {
+                uint8_t *data = dict + dict_size - size;
+                uint32_t id = (uint32_t)fnv1a64(data, size);
+                if (!id) id = 1;
+                fwrite(ASSET_DICT_MAGIC "1", 1, 4, out);
+                w32(out, id);
+                w32(out, size);
+                fwrite(data, 1, size, out);
+                fclose(out);
+            }
+        }
+        free(dict);
+    }
+
+    for (int i = 0; i < nfiles; i++)
+        free(samples[i]);
+    free(samples);
+    free(sizes);
+    free(freq);
+    free(last);
+    free(segs);
+    return ok;
+}
+
+static char* cache_entry_path(int compression, const uint8_t *data, int sz, int winsize, uint32_t dict_id, uint64_t *check)
+{
+    pthread_once(&cache_once, cache_init);
+    if (!cache_dir || !cache_dir[0])
+        return NULL;
+
+    // The entry name is a hash of the input data and all the parameters
+    // that affect the output. A second hash with a different seed is stored
+    // in the entry itself, to make collisions practically impossible.
+    uint32_t params[6] = { CACHE_VERSION, ASSETCOMP_SOURCE_HASH, compression, winsize, sz, dict_id };
+    uint64_t key = fnv1a64(data, sz);
+    key = fnv1a64_update(key, params, sizeof(params));
+    *check = fnv1a64_update(~FNV1A64_INIT, data, sz);
+
+    char *path;
+    asprintf(&path, "%s/%016llx.dcc", cache_dir, (unsigned long long)key);
+    return path;
+}
+
+static bool cache_lookup(int compression, const uint8_t *data, int sz, uint32_t dict_id, uint8_t **output, int *cmp_size, int *winsize, int *margin)
+{
+    uint64_t check;
+    char *path = cache_entry_path(compression, data, sz, *winsize, dict_id, &check);
+    if (!path)
+        return false;
+
+    FILE *f = fopen(path, "rb");
+    free(path);
+    if (!f)
+        return false;
+
+    cache_header_t header;
+    bool ok = fread(&header, 1, sizeof(header), f) == sizeof(header) &&
+        !memcmp(header.magic, CACHE_MAGIC, 3) && header.version == CACHE_VERSION &&
+        header.compression == compression && header.req_winsize == *winsize &&
+        header.dec_size == sz && header.dict_id == dict_id && header.source_hash == ASSETCOMP_SOURCE_HASH &&
+        header.check == check;
+
+    if (ok) {
+        uint8_t *out = malloc(header.cmp_size ? header.cmp_size : 1);
+        ok = fread(out, 1, header.cmp_size, f) == header.cmp_size;
+        if (ok) {
+            *output = out;
+            *cmp_size = header.cmp_size;
+            *winsize = header.winsize;
+            *margin = header.margin;
+        } else {
+            free(out);
+        }
+    }
+
+    fclose(f);
+    return ok;
+}
+
+static void cache_store(int compression, const uint8_t *data, int sz, uint32_t dict_id, int req_winsize, const uint8_t *output, int cmp_size, int winsize, int margin)
+{
+    uint64_t check;
+    char *path = cache_entry_path(compression, data, sz, req_winsize, dict_id, &check);
+    if (!path)
+        return;
+
+    #ifndef __MINGW32__
+    mkdir(cache_dir, 0777);
+    #else
+    mkdir(cache_dir);
+    #endif
+
+    // Write to a temporary file and rename it, so that concurrent processes
+    // never see a partially written entry.
+    char *tmppath;
+    asprintf(&tmppath, "%s.%d.%lx.tmp", path, (int)getpid(), (unsigned long)pthread_self());
+
+    FILE *f = fopen(tmppath, "wb");
+    if (f) {
+        cache_header_t header = {
+            .magic = CACHE_MAGIC, .version = CACHE_VERSION,
+            .compression = compression, .req_winsize = req_winsize, .winsize = winsize,
+            .dec_size = sz, .cmp_size = cmp_size, .margin = margin, .dict_id = dict_id,
+            .source_hash = ASSETCOMP_SOURCE_HASH, .check = check,
+        };
+        bool ok = fwrite(&header, 1, sizeof(header), f) == sizeof(header) &&
+                  fwrite(output, 1, cmp_size, f) == cmp_size;
+        ok = (fclose(f) == 0) && ok;
+        if (!ok || rename(tmppath, path) != 0)
+            remove(tmppath);
+    }
+
+    free(tmppath);
+    free(path);
+}
+
+static void asset_compress_mem_nocache(int compression, const uint8_t *data, int sz, bool use_dict, uint8_t **output, int *cmp_size, int *winsize, int *margin)
+{
+    // Farthest distance a match can refer to: with a dictionary, matches
+    // can also refer to it.
+    int reach = sz + (use_dict ? comp_dict_size : 0);
+
     switch (compression) {
     case 1: { // lz4hc
         // Default for LZ4HC is 8 KiB, which makes sense given the little
         // data cache of VR4300 to improve decompression speed.
         if (*winsize == 0) {
             *winsize = 8*1024;
-            while (sz < *winsize && *winsize > 2*1024)
+            while (reach < *winsize && *winsize > 2*1024)
                 *winsize /= 2;
         }
 
@@ -46,6 +457,11 @@ void asset_compress_mem(int compression, const uint8_t *data, int sz, uint8_t **
         // "favor decompression speed", as we prefer to leave a bit of
         // compression ratio on the table in exchange for faster decompression.
         LZ4_streamHC_t* state = LZ4_createStreamHC();
+        if (use_dict) {
+            // Matches into the dictionary are limited by the window as well
+            int dsize = comp_dict_size < lz4_distance_max ? comp_dict_size : lz4_distance_max;
+            LZ4_loadDictHC(state, (char*)comp_dict + comp_dict_size - dsize, dsize);
+        }
         LZ4_setCompressionLevel(state, LZ4HC_CLEVEL_MAX);
         LZ4_favorDecompressionSpeed(state, 1);
         *cmp_size = LZ4_compress_HC_continue(state, (char*)data, (char*)*output, sz, cmp_max_size);
@@ -56,23 +472,37 @@ void asset_compress_mem(int compression, const uint8_t *data, int sz, uint8_t **
     case 2: { // aplib
         if (*winsize == 0) {
             *winsize = 256*1024;
-            while (sz < *winsize && *winsize > 2*1024)
+            while (reach < *winsize && *winsize > 2*1024)
                 *winsize /= 2;
         }
     
+        // With a dictionary, apultra expects it right before the input data
+        int dsize = 0;
+        const uint8_t *input = data;
+        if (use_dict) {
+            dsize = comp_dict_size < *winsize ? comp_dict_size : *winsize;
+            uint8_t *buf = malloc(dsize + sz);
+            memcpy(buf, comp_dict + comp_dict_size - dsize, dsize);
+            memcpy(buf + dsize, data, sz);
+            input = buf;
+        }
+
         apultra_stats stats;
         int max_cmp_size = apultra_get_max_compressed_size(sz);
         *output = calloc(1, max_cmp_size);  // note: apultra.c clears the buffer, not sure why
-        *cmp_size = apultra_compress(data, *output, sz, max_cmp_size, 
+        *cmp_size = apultra_compress(input, *output, dsize + sz, max_cmp_size, 
             0,          // flags
             *winsize,    // window size
-            0,          // dictionary size
+            dsize,      // dictionary size
             NULL,       // progress callback
             &stats);
 
-        *margin = stats.safe_dist + *cmp_size - sz;
+        // Assets compressed with a dictionary are never decompressed in-place
+        *margin = use_dict ? 0 : stats.safe_dist + *cmp_size - sz;
+        if (input != data) free((void*)input);
     }   break;
     case 3: { // shrinkler
+        assert(!use_dict);
         *winsize = 256*1024; // FIXME
         int inplace_margin;
         *output = shrinkler_compress(data, sz, 3, cmp_size, &inplace_margin);
@@ -85,23 +515,271 @@ void asset_compress_mem(int compression, const uint8_t *data, int sz, uint8_t **
     }  
 }
 
+/**
+ * @brief Compress a buffer with the specified level.
+ * 
+ * Results are cached on disk (see #asset_compress_set_cache_dir), so that
+ * compressing the same data with the same parameters again is immediate.
+ * 
+ * If a dictionary was configured (see #asset_compress_set_dictionary), it is
+ * used for the levels that support it.
+ * 
+ * @param compression   Compression level (1-3)
+ * @param data          Input data
+ * @param sz            Size of the input data
+ * @param output        Compressed data (allocated with malloc)
+ * @param cmp_size      Size of the compressed data
+ * @param winsize       Window size: if zero, the best one for the level is selected
+ * @param margin        Inplace margin of the compressed data
+ */
+static void asset_compress_mem_dict(int compression, const uint8_t *data, int sz, bool use_dict, uint8_t **output, int *cmp_size, int *winsize, int *margin)
+{
+    int req_winsize = *winsize;
+    uint32_t dict_id = use_dict ? comp_dict_id : 0;
+
+    if (cache_lookup(compression, data, sz, dict_id, output, cmp_size, winsize, margin))
+        return;
+
+    asset_compress_mem_nocache(compression, data, sz, use_dict, output, cmp_size, winsize, margin);
+    cache_store(compression, data, sz, dict_id, req_winsize, *output, *cmp_size, *winsize, *margin);
+}
+
+void asset_compress_mem(int compression, const uint8_t *data, int sz, uint8_t **output, int *cmp_size, int *winsize, int *margin)
+{
+    asset_compress_mem_dict(compression, data, sz, dict_used(compression), output, cmp_size, winsize, margin);
+}
+
+/**
+ * @brief Compress a buffer trying all compression levels, and keep the best one.
+ * 
+ * The best result is the smallest one whose estimated decompression time on N64
+ * (see #asset_estimate_dec_time) fits within the specified budget. Level 1 is
+ * used if no level fits, as it is the fastest one; level 0 (no compression)
+ * is selected if compression does not reduce the size at all.
+ * 
+ * @param data          Input data
+ * @param sz            Size of the input data
+ * @param budget_us     Decompression time budget in microseconds (0 = no limit)
+ * @param compression   Selected compression level
+ * @param output        Compressed data (NULL for level 0)
+ * @param cmp_size      Size of the compressed data
+ * @param winsize       Window size: if not zero on input, it is used for all levels
+ * @param margin        Inplace margin of the compressed data
+ */
+void asset_compress_mem_auto(const uint8_t *data, int sz, int budget_us, int *compression, uint8_t **output, int *cmp_size, int *winsize, int *margin)
+{
+    int req_winsize = *winsize;
+
+    *compression = 0;
+    *output = NULL;
+    *cmp_size = sz;
+    *margin = 0;
+
+    // Size of the best result as stored in the file: compressed levels
+    // also store the asset header.
+    int best_size = sz;
+
+    for (int level = 1; level <= MAX_COMPRESSION; level++) {
+        uint8_t *out; int out_size, out_winsize = req_winsize, out_margin;
+
+        // Skip levels that would never fit the budget
+        if (level > 1 && budget_us && asset_estimate_dec_time(level, sz) > budget_us)
+            break;
+
+        asset_compress_mem(level, data, sz, &out, &out_size, &out_winsize, &out_margin);
+
+        // Level 1 is the fallback when nothing fits the budget, so always keep
+        // it if it is better than no compression.
+        int stored_size = out_size + sizeof(asset_header_t);
+        if (stored_size < best_size) {
+            free(*output);
+            best_size = stored_size;
+            *compression = level;
+            *output = out;
+            *cmp_size = out_size;
+            *winsize = out_winsize;
+            *margin = out_margin;
+        } else {
+            free(out);
+        }
+    }
+}
+
+static bool asset_write(const char *outfn, int compression, const uint8_t *data, int sz, const uint8_t *output, int cmp_size, int winsize, int margin)
+{
+    FILE *out = fopen(outfn, "wb");
+    if (!out) {
+        fprintf(stderr, "error opening output file: %s\n", outfn);
+        return false;
+    }
+
+    if (compression == 0) {
+        fwrite(data, 1, sz, out);
+    } else {
+        fwrite("DCA3", 1, 4, out);
+        w16(out, compression); // algo
+        if (dict_used(compression)) {
+            w16(out, asset_winsize_to_flags(winsize) | ASSET_FLAG_DICT); // flags
+            w32(out, cmp_size); // cmp_size
+            w32(out, sz); // dec_size
+            w32(out, comp_dict_id); // dictionary ID
+        } else {
+            w16(out, asset_winsize_to_flags(winsize) | ASSET_FLAG_INPLACE); // flags
+            w32(out, cmp_size); // cmp_size
+            w32(out, sz); // dec_size
+            w32(out, margin); // inplace margin
+        }
+        fwrite(output, 1, cmp_size, out);
+    }
+
+    fclose(out);
+    return true;
+}
+
+/** @brief Compress a single block of a blocked asset */
+static void asset_compress_block(int compression, const uint8_t *data, int sz, int block_size, int idx, uint8_t **blocks, int *sizes, int *winsizes)
+{
+    int off = idx * block_size;
+    int len = sz - off < block_size ? sz - off : block_size;
+    int margin;
+
+    // The window size is chosen per block, as it does not affect the memory
+    // required at runtime (blocks are always decompressed in full).
+    // Dictionaries are not supported, as blocks are decompressed directly
+    // into the output buffer.
+    winsizes[idx] = 0;
+    asset_compress_mem_dict(compression, data + off, len, false, &blocks[idx], &sizes[idx], &winsizes[idx], &margin);
+}
+
+/**
+ * @brief Select the compression level of a blocked asset, for #COMPRESSION_AUTO
+ * 
+ * Instead of compressing the whole file with each level, only a sample of
+ * blocks (at most #BLOCKS_AUTO_SAMPLE_SIZE bytes, evenly spread across the file)
+ * is compressed with each level. The sample blocks compressed with the selected
+ * level are stored into @p blocks, so that they are not compressed again.
+ * 
+ * @return The selected level (never 0, as uncompressed files cannot be seeked)
+ */
+static int asset_select_blocks_level(const uint8_t *data, int sz, int block_size, int budget_us, uint8_t **blocks, int *sizes, int *winsizes)
+{
+    int num_blocks = (sz + block_size - 1) / block_size;
+    int num_samples = BLOCKS_AUTO_SAMPLE_SIZE / block_size;
+    if (num_samples < 1) num_samples = 1;
+    if (num_samples > num_blocks) num_samples = num_blocks;
+
+    uint8_t **lvl_blocks = calloc(num_blocks, sizeof(uint8_t*));
+    int *lvl_sizes = calloc(num_blocks, sizeof(int));
+    int *lvl_winsizes = calloc(num_blocks, sizeof(int));
+    int best_level = 0, best_size = 0;
+
+    for (int level = 1; level <= MAX_COMPRESSION; level++) {
+        // Skip levels that would never fit the budget
+        if (level > 1 && budget_us && asset_estimate_dec_time(level, sz) > budget_us)
+            break;
+
+        int total = 0;
+        for (int j = 0; j < num_samples; j++) {
+            int idx = (int64_t)j * num_blocks / num_samples;
+            asset_compress_block(level, data, sz, block_size, idx, lvl_blocks, lvl_sizes, lvl_winsizes);
+            total += lvl_sizes[idx];
+        }
+
+        // Level 1 is the fallback when nothing fits the budget
+        bool better = best_level == 0 || total < best_size;
+        for (int j = 0; j < num_samples; j++) {
+            int idx = (int64_t)j * num_blocks / num_samples;
+            if (better) {
+                free(blocks[idx]);
+                blocks[idx] = lvl_blocks[idx];
+                sizes[idx] = lvl_sizes[idx];
+                winsizes[idx] = lvl_winsizes[idx];
+            } else {
+                free(lvl_blocks[idx]);
+            }
+            lvl_blocks[idx] = NULL;
+        }
+        if (better) {
+            best_level = level;
+            best_size = total;
+        }
+    }
+
+    free(lvl_blocks);
+    free(lvl_sizes);
+    free(lvl_winsizes);
+    return best_level;
+}
+
+/**
+ * @brief Write a blocked asset
+ * 
+ * Blocks that are not already compressed (NULL entries of @p blocks) are
+ * compressed independently with the specified level.
+ */
+static bool asset_write_blocks(const char *outfn, int compression, const uint8_t *data, int sz, int block_size, uint8_t **blocks, int *sizes, int *winsizes)
+{
+    int num_blocks = (sz + block_size - 1) / block_size;
+    uint32_t *offsets = calloc(num_blocks + 1, sizeof(uint32_t));
+    int max_winsize = 2*1024;
+
+    for (int i = 0; i < num_blocks; i++) {
+        if (!blocks[i])
+            asset_compress_block(compression, data, sz, block_size, i, blocks, sizes, winsizes);
+        offsets[i+1] = offsets[i] + sizes[i];
+        if (winsizes[i] > max_winsize) max_winsize = winsizes[i];
+    }
+
+    FILE *out = fopen(outfn, "wb");
+    bool ok = out != NULL;
+    if (!out) {
+        fprintf(stderr, "error opening output file: %s\n", outfn);
+    } else {
+        fwrite("DCA4", 1, 4, out);
+        w16(out, compression); // algo
+        w16(out, asset_winsize_to_flags(max_winsize)); // flags
+        w32(out, offsets[num_blocks]); // cmp_size
+        w32(out, sz); // dec_size
+        w32(out, 0); // inplace margin (blocks are decompressed into a separate buffer)
+        w32(out, block_size);
+        w32(out, num_blocks);
+        for (int i = 0; i <= num_blocks; i++)
+            w32(out, offsets[i]);
+        for (int i = 0; i < num_blocks; i++)
+            fwrite(blocks[i], 1, offsets[i+1] - offsets[i], out);
+        fclose(out);
+    }
+
+    free(offsets);
+    return ok;
+}
+
 /**
  * @brief Compress or recompress a file in the libdragon asset format.
  * 
+ * This function is thread-safe, so multiple files can be compressed in parallel.
+ * 
  * @param infn          Input file to (re-)compress
  * @param outfn         Output file
- * @param compression   Requested compression level (0 = none, 1 = lz4hc, 2 = lzh5)
+ * @param compression   Requested compression level (0 = none, 1 = lz4hc, 2 = aplib,
+ *                      3 = shrinkler, #COMPRESSION_AUTO = best level within budget_us)
  * @param winsize       If zero, the compressor will choose the best window size
  *                      for optimal compression ratio/dec-speed. If not zero, the specified
  *                      window size will be used for compression. This can be useful
  *                      to decrease the amount of RAM used by the decompressor.
+ * @param budget_us     Decompression time budget in microseconds for #COMPRESSION_AUTO
+ *                      (0 = no limit). Ignored for other levels.
+ * @param block_size    If not zero, the file is split into blocks of this size that
+ *                      are compressed independently, so that it can be seeked
+ *                      freely at runtime via asset_fopen(). In this case, winsize
+ *                      is ignored.
+ * @param selected      If not NULL, receives the compression level that was used
  * @return true         File was compressed correctly
  * @return false        Error compressing the file
  */
-bool asset_compress(const char *infn, const char *outfn, int compression, int winsize)
+bool asset_compress_ex(const char *infn, const char *outfn, int compression, int winsize, int budget_us, int block_size, int *selected)
 {
-    asset_init_compression(2);
-    asset_init_compression(3);
+    pthread_once(&init_once, asset_compress_init);
 
     // Make sure the file exists before calling asset_load,
     // which would just assert.
@@ -128,111 +806,54 @@ bool asset_compress(const char *infn, const char *outfn, int compression, int wi
     // if the file is smaller, as there is no functional difference and we can save
     // some RAM at decompression time.
     if (winsize) {
-        while (sz < winsize && winsize > 2*1024)
+        int reach = sz + (comp_dict && !block_size ? comp_dict_size : 0);
+        while (reach < winsize && winsize > 2*1024)
             winsize /= 2;
     }
 
-    // FIXME: use asset_compress_mem() instead of duplicating the code here
-    switch (compression) {
-    case 0: { // none
-        FILE *out = fopen(outfn, "wb");
-        if (!out) {
-            fprintf(stderr, "error opening output file: %s\n", outfn);
-            return 1;
-        }
-        fwrite(data, 1, sz, out);
-        fclose(out);
-    }   break;
-    case 3: { // shrinkler
-        winsize = 256*1024; // FIXME
-        int cmp_size; int inplace_margin;
-        uint8_t *output = shrinkler_compress(data, sz, 3, &cmp_size, &inplace_margin);
-        // Shrinkler seems to return negative margin values because we asked to
-        // verify using 4 byte reads. Just clamp to zero.
-        inplace_margin = inplace_margin > 0 ? inplace_margin : 0;
-
-        FILE *out = fopen(outfn, "wb");
-        fwrite("DCA3", 1, 4, out);
-        w16(out, 3); // algo
-        w16(out, asset_winsize_to_flags(winsize) | ASSET_FLAG_INPLACE); // flags
-        w32(out, cmp_size); // cmp_size
-        w32(out, sz); // dec_size
-        w32(out, inplace_margin); // inplace margin
-        fwrite(output, 1, cmp_size, out);
-        fclose(out);
-        free(output);
-    }   break;
-    case 2: { // aplib
-        if (winsize == 0) {
-            winsize = 256*1024;
-            while (sz < winsize && winsize > 2*1024)
-                winsize /= 2;
-        }
-    
-        apultra_stats stats;
-        int max_cmp_size = apultra_get_max_compressed_size(sz);
-        void *output = calloc(1, max_cmp_size);  // note: apultra.c clears the buffer, not sure why
-        int cmp_size = apultra_compress(data, output, sz, max_cmp_size, 
-            0,          // flags
-            winsize,    // window size
-            0,          // dictionary size
-            NULL,       // progress callback
-            &stats);
-
-        int inplace_margin = stats.safe_dist + cmp_size - sz;
-        FILE *out = fopen(outfn, "wb");
-        fwrite("DCA3", 1, 4, out);
-        w16(out, 2); // algo
-        w16(out, asset_winsize_to_flags(winsize) | ASSET_FLAG_INPLACE); // flags
-        w32(out, cmp_size); // cmp_size
-        w32(out, sz); // dec_size
-        w32(out, inplace_margin); // inplace margin
-        fwrite(output, 1, cmp_size, out);
-        fclose(out);
-        free(output);
-    }   break;
-    case 1: { // lz4hc
-        // Default for LZ4HC is 8 KiB, which makes sense given the little
-        // data cache of VR4300 to improve decompression speed.
-        if (winsize == 0) {
-            winsize = 8*1024;
-            while (sz < winsize && winsize > 2*1024)
-                winsize /= 2;
-        }
+    uint8_t *output = NULL;
+    int cmp_size = 0, margin = 0;
+    bool ok;
 
-        // The actual max distance of the LZ4 format is 64KiB-1, make sure we
-        // don't go over that.
-        if (winsize > 64*1024) winsize = 64*1024;
-        lz4_distance_max = winsize;
-        if (lz4_distance_max > 65535) lz4_distance_max = 65535;
+    if (block_size) {
+        int num_blocks = (sz + block_size - 1) / block_size;
+        uint8_t **blocks = calloc(num_blocks, sizeof(uint8_t*));
+        int *sizes = calloc(num_blocks, sizeof(int));
+        int *winsizes = calloc(num_blocks, sizeof(int));
 
-        int cmp_max_size = LZ4_COMPRESSBOUND(sz);
-        void *output = malloc(cmp_max_size);
+        // Select the level on a sample of the blocks
+        if (compression == COMPRESSION_AUTO)
+            compression = asset_select_blocks_level(data, sz, block_size, budget_us, blocks, sizes, winsizes);
+        ok = compression != 0 ?
+            asset_write_blocks(outfn, compression, data, sz, block_size, blocks, sizes, winsizes) :
+            asset_write(outfn, compression, data, sz, NULL, 0, 0, 0);
 
-        // Compress the file. Use compression level LZ4HC_CLEVEL_MAX and
-        // "favor decompression speed", as we prefer to leave a bit of
-        // compression ratio on the table in exchange for faster decompression.
-        LZ4_streamHC_t* state = LZ4_createStreamHC();
-        LZ4_setCompressionLevel(state, LZ4HC_CLEVEL_MAX);
-        LZ4_favorDecompressionSpeed(state, 1);
-        int cmp_size = LZ4_compress_HC_continue(state, (char*)data, output, sz, cmp_max_size);
-        LZ4_freeStreamHC(state);
-        assert(cmp_size <= cmp_max_size);
+        for (int i = 0; i < num_blocks; i++)
+            free(blocks[i]);
+        free(blocks);
+        free(sizes);
+        free(winsizes);
+    } else {
+        if (compression == COMPRESSION_AUTO)
+            asset_compress_mem_auto(data, sz, budget_us, &compression, &output, &cmp_size, &winsize, &margin);
+        else if (compression != 0)
+            asset_compress_mem(compression, data, sz, &output, &cmp_size, &winsize, &margin);
 
-        FILE *out = fopen(outfn, "wb");
-        fwrite("DCA3", 1, 4, out);
-        w16(out, 1); // algo
-        w16(out, asset_winsize_to_flags(winsize) | ASSET_FLAG_INPLACE); // flags
-        w32(out, cmp_size); // cmp_size
-        w32(out, sz); // dec_size
-        w32(out, LZ4_DECOMPRESS_INPLACE_MARGIN(cmp_size)); // inplace margin
-        fwrite(output, 1, cmp_size, out);
-        fclose(out);
-        free(output);
-    }   break;
-    default:
-        assert(0);
+        ok = asset_write(outfn, compression, data, sz, output, cmp_size, winsize, margin);
     }
+    if (selected) *selected = compression;
 
-    return true;
+    free(output);
+    free(data);
+    return ok;
+}
+
+/**
+ * @brief Compress or recompress a file in the libdragon asset format.
+ * 
+ * See #asset_compress_ex for details.
+ */
+bool asset_compress(const char *infn, const char *outfn, int compression, int winsize)
+{
+    return asset_compress_ex(infn, outfn, compression, winsize, 0, 0, NULL);
 }
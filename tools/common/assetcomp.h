@@ -4,10 +4,22 @@
 #define DEFAULT_COMPRESSION     1
 #define MAX_COMPRESSION         3
 
+// Try all levels and select the best one (see asset_compress_mem_auto)
+#define COMPRESSION_AUTO        -1
+
 // Default window size for streaming decompression (asset_fopen())
 #define DEFAULT_WINSIZE_STREAMING    (4*1024)
 
+// Default size of a dictionary built with asset_build_dictionary()
+#define DEFAULT_DICT_SIZE            (8*1024)
+
 bool asset_compress(const char *infn, const char *outfn, int compression, int winsize);
+bool asset_compress_ex(const char *infn, const char *outfn, int compression, int winsize, int budget_us, int block_size, int *selected);
 void asset_compress_mem(int compression, const uint8_t *inbuf, int size, uint8_t **outbuf, int *cmp_size, int *winsize, int *margin);
+void asset_compress_mem_auto(const uint8_t *inbuf, int size, int budget_us, int *compression, uint8_t **outbuf, int *cmp_size, int *winsize, int *margin);
+int asset_estimate_dec_time(int compression, int dec_size);
+void asset_compress_set_cache_dir(const char *dir);
+bool asset_compress_set_dictionary(const char *fn);
+bool asset_build_dictionary(const char **files, int nfiles, int dict_size, const char *outfn);
 
 #endif
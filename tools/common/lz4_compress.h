@@ -1,5 +1,5 @@
 
-extern int lz4_distance_max;
+extern __thread int lz4_distance_max;
 
 #define LZ4_HC_STATIC_LINKING_ONLY
 #include "lz4/lz4.h"
@@ -0,0 +1,82 @@
+#ifndef LIBDRAGON_TOOLS_PARALLEL_H
+#define LIBDRAGON_TOOLS_PARALLEL_H
+
+/**
+ * Minimal helper to run independent jobs on a pool of worker threads.
+ * 
+ * Jobs are identified by an index in [0, count), and are handed out to
+ * workers in increasing order. Each job is expected to store its results
+ * in a slot owned by its index, so that the caller can then consume them
+ * serially in a deterministic order, independently of the number of threads.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+typedef void (*parallel_job_t)(void *ctx, int idx);
+
+typedef struct {
+    parallel_job_t fn;
+    void *ctx;
+    int count;
+    int next;
+} parallel_state_t;
+
+// Return the number of CPUs available, used as default number of threads
+static int parallel_cpu_count(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return si.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+#endif
+}
+
+static void* parallel_worker(void *arg)
+{
+    parallel_state_t *st = arg;
+    while (1) {
+        int idx = __atomic_fetch_add(&st->next, 1, __ATOMIC_RELAXED);
+        if (idx >= st->count) break;
+        st->fn(st->ctx, idx);
+    }
+    return NULL;
+}
+
+// Run fn(ctx, idx) for each idx in [0, count), using up to nthreads threads.
+// If nthreads is <= 0, the number of CPUs is used. Returns when all jobs
+// are finished.
+static void parallel_for(int nthreads, int count, parallel_job_t fn, void *ctx)
+{
+    parallel_state_t st = { .fn = fn, .ctx = ctx, .count = count, .next = 0 };
+
+    if (nthreads <= 0) nthreads = parallel_cpu_count();
+    if (nthreads > count) nthreads = count;
+    if (nthreads <= 1) {
+        parallel_worker(&st);
+        return;
+    }
+
+    // The calling thread works as well, so spawn one thread less
+    pthread_t *threads = malloc((nthreads-1) * sizeof(pthread_t));
+    int spawned = 0;
+    for (int i = 0; i < nthreads-1; i++) {
+        if (pthread_create(&threads[spawned], NULL, parallel_worker, &st) == 0)
+            spawned++;
+    }
+    parallel_worker(&st);
+    for (int i = 0; i < spawned; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+}
+
+#endif
@@ -1,5 +1,6 @@
 #define _GNU_SOURCE
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -20,6 +21,9 @@ struct directory_entry root_dirent = {
     .path = ROOT_PATH,
 };
 
+/* The root sector is searched without its file_pointer, which points to the path index */
+#define ROOT_SEARCH_SIZE    offsetof(struct directory_entry, file_pointer)
+
 /* Directory walking flags */
 enum
 {
@@ -778,7 +782,7 @@ int main( int argc, char *argv[] )
             int offset = 0;
             if (strstr(argv[2], ".z64"))
             {
-                void *fs = memmem(filesystem, lSize, &root_dirent, sizeof(root_dirent));
+                void *fs = memmem(filesystem, lSize, &root_dirent, ROOT_SEARCH_SIZE);
                 if (!fs)
                 {
                     fprintf(stderr, "cannot find DragonFS in ROM\n");
@@ -821,7 +825,7 @@ int main( int argc, char *argv[] )
             int offset = 0;
             if (strstr(argv[2], ".z64"))
             {
-                void *fs = memmem(filesystem, lSize, &root_dirent, sizeof(root_dirent));
+                void *fs = memmem(filesystem, lSize, &root_dirent, ROOT_SEARCH_SIZE);
                 if (!fs)
                 {
                     fprintf(stderr, "cannot find DragonFS in ROM\n");
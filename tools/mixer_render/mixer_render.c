@@ -0,0 +1,803 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <math.h>
+#include <stdarg.h>
+
+// Build the mixer of the runtime library for the host. The host build of
+// mixer.c replaces the RSP ucode with its bit-exact C reference.
+#include "../../src/audio/mixer.c"
+#include "../../src/audio/samplebuffer.c"
+#include "wav64.h"
+#include "../../src/audio/wav64internal.h"
+#include "xm64.h"
+#include "ym64.h"
+#include "dragonfs.h"
+
+/** @brief Emulated ROM address of the first file (like the start of a DFS image) */
+#define ROM_BASE_ADDR       0x10001000
+/** @brief Files in the emulated ROM are aligned to DFS sectors */
+#define ROM_SECTOR_SIZE     256
+/** @brief Maximum number of files in the emulated ROM */
+#define ROM_MAX_FILES       256
+
+/** @brief Length in seconds of each run of --bench */
+#define BENCH_SECONDS       5
+/** @brief Length in samples of the synthetic waveform used by --bench */
+#define BENCH_WAVE_LEN      8192
+/** @brief Length in samples of the synthetic waveforms used by --voices */
+#define VOICES_WAVE_LEN     8192
+/** @brief Length in samples of the loop of the synthetic waveforms used by --voices */
+#define VOICES_LOOP_LEN     4096
+/** @brief Samples after a voice is resumed during which its volume ramps up (see the mixer volume filter) */
+#define VOICES_RAMP_LEN     2048
+
+bool flag_verbose = false;
+bool flag_stream = false;
+
+/** @brief Output sample rate (returned by audio_get_frequency) */
+static int output_rate = 44100;
+
+/** @brief A file of the emulated ROM */
+typedef struct {
+    char *path;             ///< Host path of the file
+    uint8_t *data;          ///< Contents of the file
+    uint32_t size;          ///< Size of the file in bytes
+    uint32_t rom_addr;      ///< Emulated ROM address of the file
+    uint32_t loc;           ///< Current read offset (dfs_read)
+} rom_file_t;
+
+static rom_file_t rom_files[ROM_MAX_FILES];
+static int rom_num_files = 0;
+static uint32_t rom_end = ROM_BASE_ADDR;
+
+/** @brief Statistics of a render */
+typedef struct {
+    int64_t samples;        ///< Output samples rendered
+    int64_t ch_samples;     ///< Sum over output samples of the playing channels
+    int64_t total_ns;       ///< Time spent in mixer_poll (nanoseconds)
+    int64_t mixer_ns;       ///< Time spent in the mixer ucode reference (nanoseconds)
+} render_stats_t;
+
+void print_args(char * name)
+{
+    fprintf(stderr, "%s -- Offline renderer for the audio mixer\n\n", name);
+    fprintf(stderr, "This tool runs the audio mixer and the WAV64/XM64/YM64 players on the host, to\n");
+    fprintf(stderr, "render audio and profile the mixer without running on the console. The RSP ucode\n");
+    fprintf(stderr, "is replaced by a bit-exact C reference, so the output is the same PCM stream that\n");
+    fprintf(stderr, "the console would play.\n\n");
+    fprintf(stderr, "Usage: %s [flags] <file> [<file>...]\n", name);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Files are played one after the other, each one from the beginning to its end.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Command-line flags:\n");
+    fprintf(stderr, "   -o/--output <file>      Write the rendered audio to <file>. A .wav file is written as\n");
+    fprintf(stderr, "                           16-bit stereo WAV; any other file as raw big-endian stereo PCM\n");
+    fprintf(stderr, "                           (same layout of the audio buffers on the console)\n");
+    fprintf(stderr, "   -r/--rate <hz>          Output sample rate (default: 44100). Use the value returned by\n");
+    fprintf(stderr, "                           audio_get_frequency() to reproduce the console output exactly\n");
+    fprintf(stderr, "   -p/--poll <samples>     Number of samples per mixer_poll call (default: same as audio.c)\n");
+    fprintf(stderr, "   -t/--time <secs>        Maximum length of each file (default: whole file)\n");
+    fprintf(stderr, "   -s/--stream             Stream VADPCM WAV64 files through a ring buffer (wav64_set_streaming),\n");
+    fprintf(stderr, "                           and report how close the buffer came to underrun\n");
+    fprintf(stderr, "   -b/--bench              Measure the mixer cost with 1 to 32 playing channels\n");
+    fprintf(stderr, "   -V/--voices             Check the virtual voices (mixer_voice_play) and exit: voice stealing,\n");
+    fprintf(stderr, "                           stale handles, and resume of virtualized voices. Mono WAV64 files\n");
+    fprintf(stderr, "                           on the command line are also resumed at different positions, and\n");
+    fprintf(stderr, "                           compared with an uninterrupted playback\n");
+    fprintf(stderr, "   -v/--verbose            Verbose output\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "For each file, the tool reports the rendering speed in samples per second, and\n");
+    fprintf(stderr, "the CPU time of the mixer (the C reference of the RSP ucode) per output sample and\n");
+    fprintf(stderr, "per playing channel.\n");
+    fprintf(stderr, "\n");
+}
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** @brief Find a file in the emulated ROM, loading it if necessary */
+static rom_file_t *rom_find(const char *path)
+{
+    for (int i = 0; i < rom_num_files; i++)
+        if (!strcmp(rom_files[i].path, path))
+            return &rom_files[i];
+
+    if (rom_num_files == ROM_MAX_FILES) {
+        fprintf(stderr, "too many files in the emulated ROM\n");
+        exit(1);
+    }
+
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    rom_file_t *rf = &rom_files[rom_num_files++];
+    rf->path = strdup(path);
+    rf->size = size;
+    rf->data = malloc(size);
+    rf->rom_addr = rom_end;
+    rf->loc = 0;
+    if (fread(rf->data, 1, size, f) != size) {
+        fprintf(stderr, "error reading: %s\n", path);
+        exit(1);
+    }
+    fclose(f);
+
+    rom_end += ROUND_UP(rf->size, ROM_SECTOR_SIZE);
+    return rf;
+}
+
+int dfs_open(const char * const path)
+{
+    rom_file_t *rf = rom_find(path);
+    if (!rf)
+        return DFS_ENOFILE;
+    rf->loc = 0;
+    return rf - rom_files;
+}
+
+int dfs_read(void * const buf, int size, int count, uint32_t handle)
+{
+    rom_file_t *rf = &rom_files[handle];
+    int n = MIN(size * count, (int)(rf->size - rf->loc));
+    memcpy(buf, rf->data + rf->loc, n);
+    rf->loc += n;
+    return n;
+}
+
+int dfs_close(uint32_t handle)
+{
+    return DFS_ESUCCESS;
+}
+
+uint32_t dfs_rom_addr(const char *path)
+{
+    rom_file_t *rf = rom_find(path);
+    return rf ? rf->rom_addr : 0;
+}
+
+const char *dfs_strerror(int error)
+{
+    return error == DFS_ENOFILE ? "File not found" : "Error";
+}
+
+void dma_read_async(void *ram_address, unsigned long pi_address, unsigned long len)
+{
+    // The emulated PI completes transfers immediately
+    dma_read(ram_address, pi_address, len);
+}
+
+void dma_wait(void)
+{
+}
+
+void dma_read(void *ram_address, unsigned long pi_address, unsigned long len)
+{
+    uint8_t *dst = ram_address;
+
+    // Reads past the end of a file return the padding up to the next sector
+    // (zeros), or the beginning of the next file, like on the console.
+    memset(dst, 0, len);
+    for (int i = 0; i < rom_num_files; i++) {
+        rom_file_t *rf = &rom_files[i];
+        uint32_t start = MAX(pi_address, (unsigned long)rf->rom_addr);
+        uint32_t end = MIN(pi_address + len, (unsigned long)rf->rom_addr + rf->size);
+        if (start < end)
+            memcpy(dst + (start - pi_address), rf->data + (start - rf->rom_addr), end - start);
+    }
+}
+
+FILE *must_fopen(const char *fn)
+{
+    if (!strncmp(fn, "rom:/", 5))
+        fn += 5;
+    FILE *f = fopen(fn, "rb");
+    if (!f) {
+        fprintf(stderr, "cannot open: %s\n", fn);
+        exit(1);
+    }
+    return f;
+}
+
+int audio_get_frequency(void)
+{
+    return output_rate;
+}
+
+/** @brief Write the header of a 16-bit stereo WAV file (sizes are patched by #wav_finish) */
+static void wav_write_header(FILE *out)
+{
+    uint8_t head[44] = "RIFF\0\0\0\0WAVEfmt \x10\0\0\0\x01\0\x02\0\0\0\0\0\0\0\0\0\x04\0\x10\0data";
+    uint32_t rate = output_rate, byte_rate = output_rate * 4;
+    for (int i = 0; i < 4; i++) {
+        head[24+i] = rate >> (8*i);
+        head[28+i] = byte_rate >> (8*i);
+    }
+    fwrite(head, 1, sizeof(head), out);
+}
+
+static void wav_finish(FILE *out, int64_t samples)
+{
+    uint32_t data_size = samples * 4;
+    uint32_t riff_size = data_size + 36;
+    uint8_t le[4];
+
+    for (int i = 0; i < 4; i++) le[i] = riff_size >> (8*i);
+    fseek(out, 4, SEEK_SET);
+    fwrite(le, 1, 4, out);
+    for (int i = 0; i < 4; i++) le[i] = data_size >> (8*i);
+    fseek(out, 40, SEEK_SET);
+    fwrite(le, 1, 4, out);
+}
+
+/** @brief Count the channels that are currently playing a waveform */
+static int playing_channels(void)
+{
+    int n = 0;
+    for (int i = 0; i < Mixer.num_channels; i++) {
+        mixer_channel_t *c = &Mixer.channels[i];
+        if (c->ptr)
+            n += (c->flags & CH_FLAGS_STEREO) ? 2 : 1;
+    }
+    return n;
+}
+
+/**
+ * @brief Render audio until the current file is finished
+ *
+ * @param out           Output file (or NULL)
+ * @param wav           True if the output file is a WAV file (little-endian)
+ * @param poll          Number of samples per mixer_poll call
+ * @param max_samples   Maximum number of samples to render
+ * @param playing       Callback that returns false when the file is finished
+ * @param ctx           Context for the callback
+ * @param stats         Statistics of the render
+ */
+static void render(FILE *out, bool wav, int poll, int64_t max_samples,
+    bool (*playing)(void *ctx), void *ctx, render_stats_t *stats)
+{
+    int16_t *buf = malloc_uncached(poll * 2 * sizeof(int16_t));
+    uint8_t *pcm = malloc(poll * 2 * sizeof(int16_t));
+
+    memset(stats, 0, sizeof(*stats));
+    int64_t mixer_t0 = __mixer_profile_rsp;
+
+    while (stats->samples < max_samples && playing(ctx)) {
+        int n = MIN((int64_t)poll, max_samples - stats->samples);
+        int nch = playing_channels();
+
+        int64_t t0 = now_ns();
+        mixer_poll(buf, n);
+        stats->total_ns += now_ns() - t0;
+
+        stats->samples += n;
+        stats->ch_samples += (int64_t)nch * n;
+
+        if (out) {
+            for (int i = 0; i < n*2; i++) {
+                uint16_t s = buf[i];
+                pcm[i*2+0] = wav ? s : s >> 8;
+                pcm[i*2+1] = wav ? s >> 8 : s;
+            }
+            fwrite(pcm, 1, n*4, out);
+        }
+    }
+
+    stats->mixer_ns = __mixer_profile_rsp - mixer_t0;
+    free(pcm);
+    free_uncached(buf);
+}
+
+static void print_stats(const char *name, render_stats_t *stats)
+{
+    double secs = (double)stats->samples / output_rate;
+    double cpu = stats->total_ns * 1e-9;
+    double avg_ch = stats->samples ? (double)stats->ch_samples / stats->samples : 0;
+
+    fprintf(stderr, "%s: %.2f s rendered in %.3f s, %.0f samples/s (%.1fx realtime)\n",
+        name, secs, cpu, cpu > 0 ? stats->samples / cpu : 0, cpu > 0 ? secs / cpu : 0);
+    fprintf(stderr, "    mixer: %.1f ns/sample, %.2f channels playing on average, %.1f ns per channel per sample\n",
+        stats->samples ? (double)stats->mixer_ns / stats->samples : 0, avg_ch,
+        stats->ch_samples ? (double)stats->mixer_ns / stats->ch_samples : 0);
+    if (flag_verbose)
+        fprintf(stderr, "    players and sample buffers: %.1f ns/sample\n",
+            stats->samples ? (double)(stats->total_ns - stats->mixer_ns) / stats->samples : 0);
+}
+
+static bool wav64_playing(void *ctx)  { return mixer_ch_playing(0); }
+static bool xm64_playing(void *ctx)   { return ((xm64player_t*)ctx)->playing; }
+static bool always_playing(void *ctx) { return true; }
+
+/** @brief Render a WAV64, XM64 or YM64 file */
+static bool render_file(const char *fn, FILE *out, bool wav, int poll, float max_secs, render_stats_t *stats)
+{
+    const char *ext = strrchr(fn, '.');
+    int64_t max_samples = max_secs > 0 ? (int64_t)(max_secs * output_rate) & ~1 : INT64_MAX;
+
+    // The players only accept files in the ROM filesystem.
+    char *romfn;
+    if (asprintf(&romfn, "rom:/%s", fn) < 0)
+        return false;
+
+    if (ext && !strcasecmp(ext, ".wav64")) {
+        wav64_t wav64;
+        wav64_open(&wav64, romfn);
+        bool stream = flag_stream && wav64.format == WAV64_FORMAT_VADPCM;
+        if (stream)
+            wav64_set_streaming(&wav64, 0);
+        mixer_ch_set_limits(0, 16, wav64.wave.frequency * wav64.wave.channels, 0);
+        wav64_play(&wav64, 0);
+        render(out, wav, poll, max_samples, wav64_playing, NULL, stats);
+        mixer_ch_stop(0);
+        if (stream) {
+            wav64_stream_stats_t ss;
+            wav64_get_stream_stats(&wav64, &ss, false);
+            fprintf(stderr, "%s: stream buffer: %d bytes, minimum level: %d bytes (%.1f ms), underruns: %d\n",
+                fn, ss.buffer_size, ss.min_level, ss.min_level_ms, ss.underruns);
+        }
+        wav64_close(&wav64);
+    } else if (ext && !strcasecmp(ext, ".xm64")) {
+        xm64player_t xm;
+        xm64player_open(&xm, romfn);
+        xm64player_set_loop(&xm, false);
+        xm64player_play(&xm, 0);
+        render(out, wav, poll, max_samples, xm64_playing, &xm, stats);
+        xm64player_close(&xm);
+    } else if (ext && !strcasecmp(ext, ".ym64")) {
+        ym64player_t ym;
+        float secs;
+        ym64player_open(&ym, romfn, NULL);
+        ym64player_duration(&ym, NULL, &secs);
+        max_samples = MIN(max_samples, (int64_t)(secs * output_rate) & ~1);
+        ym64player_play(&ym, 0);
+        render(out, wav, poll, max_samples, always_playing, NULL, stats);
+        ym64player_close(&ym);
+    } else {
+        fprintf(stderr, "unsupported file type: %s\n", fn);
+        free(romfn);
+        return false;
+    }
+
+    free(romfn);
+    return true;
+}
+
+/** @brief Samples of the synthetic waveform used by --bench (big-endian) */
+static uint8_t *bench_samples;
+
+static void bench_wave_read(void *ctx, samplebuffer_t *sbuf, int wpos, int wlen, bool seeking)
+{
+    uint8_t *dst = samplebuffer_append(sbuf, wlen);
+    memcpy(dst, bench_samples + wpos*2, wlen*2);
+}
+
+/** @brief Measure the cost of the mixer with a growing number of channels */
+static void bench(int poll)
+{
+    static const int num_channels[] = { 1, 2, 4, 8, 16, 32 };
+    waveform_t waves[MIXER_MAX_CHANNELS];
+
+    // Noise with the overread area required by the mixer
+    bench_samples = malloc((BENCH_WAVE_LEN + MIXER_LOOP_OVERREAD) * 2);
+    uint32_t rng = 1;
+    for (int i = 0; i < (BENCH_WAVE_LEN + MIXER_LOOP_OVERREAD) * 2; i++) {
+        rng ^= rng << 13; rng ^= rng >> 17; rng ^= rng << 5;
+        bench_samples[i] = rng;
+    }
+
+    // Each channel resamples at a different frequency, both lower and
+    // higher than the output rate.
+    for (int i = 0; i < MIXER_MAX_CHANNELS; i++) {
+        waves[i] = (waveform_t){
+            .name = "bench",
+            .bits = 16,
+            .channels = 1,
+            .frequency = output_rate * (0.5f + i / 32.0f),
+            .len = BENCH_WAVE_LEN,
+            .loop_len = BENCH_WAVE_LEN,
+            .read = bench_wave_read,
+        };
+    }
+
+    fprintf(stderr, "channels     samples/s    realtime   mixer ns/sample   ns/channel/sample\n");
+    for (int n = 0; n < sizeof(num_channels) / sizeof(num_channels[0]); n++) {
+        int nch = num_channels[n];
+        render_stats_t stats;
+
+        // The cost of the ucode depends on the number of channels the mixer
+        // was initialized with, so use exactly the ones that are playing.
+        mixer_init(nch);
+        for (int i = 0; i < nch; i++)
+            mixer_ch_set_limits(i, 16, output_rate * 2, 0);
+        for (int i = 0; i < nch; i++)
+            mixer_ch_play(i, &waves[i]);
+        render(NULL, false, poll, (int64_t)BENCH_SECONDS * output_rate & ~1, always_playing, NULL, &stats);
+        mixer_close();
+
+        double cpu = stats.total_ns * 1e-9;
+        fprintf(stderr, "%8d  %12.0f  %9.1fx  %16.1f  %18.2f\n", nch,
+            stats.samples / cpu, (double)stats.samples / output_rate / cpu,
+            (double)stats.mixer_ns / stats.samples, (double)stats.mixer_ns / stats.ch_samples);
+    }
+
+    free(bench_samples);
+}
+
+/** @brief Number of failed checks of --voices */
+static int voices_failed = 0;
+
+/** @brief Report the result of a check of --voices */
+static void voices_check(bool ok, const char *fmt, ...)
+{
+    va_list va;
+    va_start(va, fmt);
+    if (!ok || flag_verbose) {
+        fprintf(stderr, "%s: ", ok ? "ok" : "FAILED");
+        vfprintf(stderr, fmt, va);
+        fprintf(stderr, "\n");
+    }
+    va_end(va);
+    if (!ok)
+        voices_failed++;
+}
+
+/** @brief Render samples without writing them anywhere (or into out, if not NULL) */
+static void voices_render(int16_t *out, int num_samples, int poll)
+{
+    int16_t *buf = malloc_uncached(poll * 2 * sizeof(int16_t));
+    while (num_samples > 0) {
+        int n = MIN(poll, num_samples);
+        mixer_poll(buf, n);
+        if (out) {
+            memcpy(out, buf, n * 2 * sizeof(int16_t));
+            out += n * 2;
+        }
+        num_samples -= n;
+    }
+    free_uncached(buf);
+}
+
+/** @brief Expected position of a voice after playing the synthetic waveform for num_samples output samples */
+static float voices_expected_pos(waveform_t *wave, int num_samples)
+{
+    double pos = (double)num_samples * wave->frequency / output_rate;
+    if (wave->loop_len && pos >= wave->len)
+        pos = fmod(pos - wave->len, wave->loop_len) + (wave->len - wave->loop_len);
+    return pos;
+}
+
+/** @brief Check stealing, virtualization and resume of voices with synthetic waveforms */
+static void voices_check_synth(int poll)
+{
+    // Reuse the --bench noise (with the overread area required by the mixer)
+    bench_samples = malloc((VOICES_WAVE_LEN + MIXER_LOOP_OVERREAD) * 2);
+    uint32_t rng = 1;
+    for (int i = 0; i < (VOICES_WAVE_LEN + MIXER_LOOP_OVERREAD) * 2; i++) {
+        rng ^= rng << 13; rng ^= rng >> 17; rng ^= rng << 5;
+        bench_samples[i] = rng;
+    }
+
+    waveform_t loop = {
+        .name = "loop", .bits = 16, .channels = 1,
+        .frequency = output_rate * 0.75f,
+        .len = VOICES_WAVE_LEN, .loop_len = VOICES_LOOP_LEN,
+        .read = bench_wave_read,
+    };
+    waveform_t oneshot = {
+        .name = "oneshot", .bits = 16, .channels = 1,
+        .frequency = output_rate,
+        .len = VOICES_WAVE_LEN,
+        .read = bench_wave_read,
+    };
+
+    mixer_init(4);
+    for (int i = 0; i < 4; i++)
+        mixer_ch_set_limits(i, 16, output_rate * 2, 0);
+
+    // A voice is virtualized when a voice with higher priority needs its
+    // channel, and resumed at the position it would have reached.
+    mixer_voices_init(0, 1);
+    int a = mixer_voice_play(&loop, 0);
+    voices_render(NULL, 4000, poll);
+    voices_check(mixer_voice_get_ch(a) == 0, "voice is mixed on the only channel (ch=%d)", mixer_voice_get_ch(a));
+
+    int b = mixer_voice_play(&oneshot, 1);
+    voices_render(NULL, 6000, poll);
+    voices_check(mixer_voice_get_ch(b) == 0 && mixer_voice_get_ch(a) == -1,
+        "higher priority voice takes the channel (ch=%d, %d)", mixer_voice_get_ch(a), mixer_voice_get_ch(b));
+    voices_check(mixer_voice_playing(a), "virtualized voice is still playing");
+    float pos = mixer_voice_get_pos(a), exp = voices_expected_pos(&loop, 10000);
+    voices_check(fabsf(pos - exp) < 0.01f, "virtualized voice advances (pos=%.2f, expected %.2f)", pos, exp);
+
+    // Stopping the voice with higher priority resumes the virtualized voice,
+    // past the end of the waveform (so the position wraps within the loop).
+    mixer_voice_stop(b);
+    voices_render(NULL, 2000, poll);
+    pos = mixer_voice_get_pos(a), exp = voices_expected_pos(&loop, 12000);
+    voices_check(mixer_voice_get_ch(a) == 0, "virtualized voice is resumed (ch=%d)", mixer_voice_get_ch(a));
+    voices_check(fabsf(pos - exp) < 0.01f, "resumed voice position (pos=%.2f, expected %.2f)", pos, exp);
+    pos = mixer_ch_get_pos(0);
+    voices_check(fabsf(pos - exp) < 0.01f, "resumed channel position (pos=%.2f, expected %.2f)", pos, exp);
+    mixer_voice_stop(a);
+
+    // Voices are stolen from the least audible ones with the same or lower
+    // priority, and the handles of stolen voices become stale.
+    mixer_voices_init(0, 2);
+    int h[MIXER_MAX_VOICES];
+    for (int i = 0; i < MIXER_MAX_VOICES; i++) {
+        h[i] = mixer_voice_play(&loop, 1);
+        mixer_voice_set_vol(h[i], 0.5f + 0.5f * i / MIXER_MAX_VOICES, 0.5f);
+    }
+    voices_render(NULL, poll, poll);
+
+    int none = mixer_voice_play(&loop, 0);
+    voices_check(none == MIXER_VOICE_NONE, "voice with lower priority is not played when all voices are busy (%d)", none);
+
+    int c = mixer_voice_play(&oneshot, 1);
+    voices_check(c != MIXER_VOICE_NONE, "voice with the same priority steals a voice");
+    int stolen = 0;
+    for (int i = 0; i < MIXER_MAX_VOICES; i++)
+        stolen += !mixer_voice_playing(h[i]);
+    voices_check(!mixer_voice_playing(h[0]) && stolen == 1, "only the least audible voice is stolen (%d stolen)", stolen);
+    voices_check(c != h[0] && c % MIXER_MAX_VOICES == h[0] % MIXER_MAX_VOICES,
+        "stolen voice is reused with a new handle (%d, %d)", h[0], c);
+
+    // The stale handle must not affect the voice that reused its slot
+    mixer_voice_set_vol(h[0], 0, 0);
+    mixer_voice_set_freq(h[0], output_rate * 0.25f);
+    mixer_voice_stop(h[0]);
+    voices_check(mixer_voice_get_ch(h[0]) == -1 && mixer_voice_get_pos(h[0]) == 0, "stale handle has no channel nor position");
+    voices_render(NULL, 2000, poll);
+    voices_check(mixer_voice_playing(c), "stale handle does not stop the new voice");
+    voices_check(mixer_voice_get_ch(c) >= 0, "stale handle does not mute the new voice (ch=%d)", mixer_voice_get_ch(c));
+    pos = mixer_voice_get_pos(c), exp = voices_expected_pos(&oneshot, 2000);
+    voices_check(fabsf(pos - exp) < 0.01f, "stale handle does not change the frequency of the new voice (pos=%.2f, expected %.2f)", pos, exp);
+
+    // Voices that reach the end of a waveform that does not loop are freed,
+    // both when they are mixed and when they are virtual (no volume). This
+    // steals h[1], the least audible voice now.
+    int d = mixer_voice_play(&oneshot, 2);
+    mixer_voice_set_vol(d, 0, 0);
+    mixer_voice_set_vol(h[2], 0, 0);
+    voices_render(NULL, VOICES_WAVE_LEN + poll, poll);
+    voices_check(!mixer_voice_playing(c), "mixed voice is freed at the end of the waveform");
+    voices_check(!mixer_voice_playing(d), "virtual voice is freed at the end of the waveform");
+    voices_check(mixer_voice_playing(h[2]), "looping voice with no volume keeps playing");
+
+    mixer_voices_init(0, 0);
+    mixer_close();
+    free(bench_samples);
+}
+
+/**
+ * @brief Check that a WAV64 file played on a voice resumes correctly after being virtualized
+ *
+ * The file is played once without interruptions, and then virtualized (by
+ * setting its volume to zero) at different positions: after the voice is
+ * resumed, the output must be the same as the uninterrupted playback. For
+ * VADPCM files, this checks seeking within the compressed stream.
+ *
+ * The volume of a resumed voice ramps up from zero through the volume filter
+ * of the mixer, so the first #VOICES_RAMP_LEN samples are not compared.
+ */
+static bool voices_check_wav64(const char *fn, int poll)
+{
+    char *romfn;
+    if (asprintf(&romfn, "rom:/%s", fn) < 0)
+        return false;
+
+    wav64_t wav64;
+    wav64_open(&wav64, romfn);
+    free(romfn);
+    if (wav64.wave.channels != 1) {
+        fprintf(stderr, "%s: skipped (voices only support mono waveforms)\n", fn);
+        wav64_close(&wav64);
+        return true;
+    }
+
+    // Render the whole file (up to 10 seconds), plus some silence
+    int len = MIN(wav64.wave.len, (int)wav64.wave.frequency * 10);
+    int num_samples = (int)((int64_t)len * output_rate / wav64.wave.frequency) & ~1;
+    int16_t *ref = malloc((num_samples + poll) * 2 * sizeof(int16_t));
+    int16_t *out = malloc((num_samples + poll) * 2 * sizeof(int16_t));
+
+    mixer_init(1);
+    mixer_ch_set_limits(0, 16, wav64.wave.frequency, 0);
+    mixer_voices_init(0, 1);
+    int v = mixer_voice_play(&wav64.wave, 0);
+    voices_render(ref, num_samples, poll);
+    mixer_voice_stop(v);
+
+    // Virtualize the voice at 1/4 of the file, and resume it at 1/2, 3/4
+    // of the file or right away. Positions are multiples of the number of
+    // samples per poll, so that they match a mixer_poll call.
+    static const int steps[][2] = { { 1, 2 }, { 2, 3 }, { 1, 1 } };
+    for (int i = 0; i < sizeof(steps) / sizeof(steps[0]); i++) {
+        int stop = num_samples * steps[i][0] / 4 / poll * poll;
+        int resume = MAX(num_samples * steps[i][1] / 4 / poll * poll, stop + poll);
+        if (resume + VOICES_RAMP_LEN >= num_samples)
+            continue;
+
+        v = mixer_voice_play(&wav64.wave, 0);
+        voices_render(out, stop, poll);
+        mixer_voice_set_vol(v, 0, 0);
+        voices_render(out + stop*2, resume - stop, poll);
+        voices_check(mixer_voice_get_ch(v) == -1, "%s: voice is virtual when muted", fn);
+        mixer_voice_set_vol(v, 1, 1);
+        voices_render(out + resume*2, num_samples - resume, poll);
+        mixer_voice_stop(v);
+
+        int max_diff = 0, first = -1;
+        for (int j = (resume + VOICES_RAMP_LEN)*2; j < num_samples*2; j++) {
+            int diff = abs(out[j] - ref[j]);
+            if (diff && first < 0) first = j/2;
+            max_diff = MAX(max_diff, diff);
+        }
+        voices_check(max_diff == 0, "%s: resumed at sample %d (virtual from %d), max diff %d (first at %d)",
+            fn, resume, stop, max_diff, first);
+    }
+
+    mixer_voices_init(0, 0);
+    mixer_close();
+    wav64_close(&wav64);
+    free(ref);
+    free(out);
+    return true;
+}
+
+/** @brief Run the checks of --voices, and return the exit code of the tool */
+static int voices(int poll, char **files, int num_files)
+{
+    voices_check_synth(poll);
+    for (int i = 0; i < num_files; i++) {
+        const char *ext = strrchr(files[i], '.');
+        if (!ext || strcasecmp(ext, ".wav64")) {
+            fprintf(stderr, "%s: skipped (only WAV64 files are supported by --voices)\n", files[i]);
+            continue;
+        }
+        if (!voices_check_wav64(files[i], poll))
+            return 1;
+    }
+
+    if (voices_failed) {
+        fprintf(stderr, "%d voice checks failed\n", voices_failed);
+        return 1;
+    }
+    fprintf(stderr, "All voice checks passed\n");
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *out_fn = NULL;
+    int poll = 0;
+    float max_secs = 0;
+    bool flag_bench = false;
+    bool flag_voices = false;
+    int i;
+
+    if (argc < 2) {
+        print_args(argv[0]);
+        return 1;
+    }
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+            print_args(argv[0]);
+            return 0;
+        } else if (!strcmp(argv[i], "-v") || !strcmp(argv[i], "--verbose")) {
+            flag_verbose = true;
+        } else if (!strcmp(argv[i], "-s") || !strcmp(argv[i], "--stream")) {
+            flag_stream = true;
+        } else if (!strcmp(argv[i], "-b") || !strcmp(argv[i], "--bench")) {
+            flag_bench = true;
+        } else if (!strcmp(argv[i], "-V") || !strcmp(argv[i], "--voices")) {
+            flag_voices = true;
+        } else if (!strcmp(argv[i], "-o") || !strcmp(argv[i], "--output")) {
+            if (++i == argc) {
+                fprintf(stderr, "missing argument for %s\n", argv[i-1]);
+                return 1;
+            }
+            out_fn = argv[i];
+        } else if (!strcmp(argv[i], "-r") || !strcmp(argv[i], "--rate")) {
+            if (++i == argc) {
+                fprintf(stderr, "missing argument for %s\n", argv[i-1]);
+                return 1;
+            }
+            char *extra;
+            output_rate = strtol(argv[i], &extra, 0);
+            if (extra == argv[i] || *extra != 0 || output_rate <= 0) {
+                fprintf(stderr, "invalid argument for %s: %s\n", argv[i-1], argv[i]);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "-p") || !strcmp(argv[i], "--poll")) {
+            if (++i == argc) {
+                fprintf(stderr, "missing argument for %s\n", argv[i-1]);
+                return 1;
+            }
+            char *extra;
+            poll = strtol(argv[i], &extra, 0);
+            if (extra == argv[i] || *extra != 0 || poll <= 0 || poll % 2) {
+                fprintf(stderr, "invalid argument for %s: %s (must be even)\n", argv[i-1], argv[i]);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "-t") || !strcmp(argv[i], "--time")) {
+            if (++i == argc) {
+                fprintf(stderr, "missing argument for %s\n", argv[i-1]);
+                return 1;
+            }
+            char *extra;
+            max_secs = strtof(argv[i], &extra);
+            if (extra == argv[i] || *extra != 0 || max_secs <= 0) {
+                fprintf(stderr, "invalid argument for %s: %s\n", argv[i-1], argv[i]);
+                return 1;
+            }
+        } else {
+            fprintf(stderr, "invalid flag: %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if (i == argc && !flag_bench && !flag_voices) {
+        fprintf(stderr, "missing input files\n");
+        return 1;
+    }
+
+    // Same buffer size of audio_init(), which is what mixer_poll is usually called with
+    if (!poll)
+        poll = (output_rate / 25) & ~7;
+
+    if (flag_bench)
+        bench(poll);
+    if (flag_voices)
+        return voices(poll, argv + i, argc - i);
+
+    mixer_init(MIXER_MAX_CHANNELS);
+
+    FILE *out = NULL;
+    bool wav = false;
+    if (out_fn) {
+        out = fopen(out_fn, "wb");
+        if (!out) {
+            fprintf(stderr, "cannot create: %s\n", out_fn);
+            return 1;
+        }
+        const char *ext = strrchr(out_fn, '.');
+        wav = ext && !strcasecmp(ext, ".wav");
+        if (wav)
+            wav_write_header(out);
+    }
+
+    render_stats_t total = {0};
+    for (; i < argc; i++) {
+        render_stats_t stats;
+        if (!render_file(argv[i], out, wav, poll, max_secs, &stats))
+            return 1;
+        print_stats(argv[i], &stats);
+        total.samples += stats.samples;
+        total.ch_samples += stats.ch_samples;
+        total.total_ns += stats.total_ns;
+        total.mixer_ns += stats.mixer_ns;
+    }
+
+    if (out) {
+        if (wav)
+            wav_finish(out, total.samples);
+        fclose(out);
+    }
+
+    mixer_close();
+    return 0;
+}
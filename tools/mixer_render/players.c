@@ -0,0 +1,16 @@
+// Host build of the WAV64, XM64 and YM64 players (see src/audio/audio_host.h).
+// They are compiled separately from the mixer because some static functions
+// share the same names.
+
+// Stream patterns and waveforms from the file like the N64 player does
+#define XM64_HOST_PLAYER
+
+#include "../../src/audio/wav64.c"
+#include "../../src/audio/xm64.c"
+#include "../../src/audio/ym64.c"
+#include "../../src/audio/ay8910.c"
+#include "../../src/compress/ringbuf.c"
+#include "../../src/audio/libxm/play.c"
+#include "../../src/audio/libxm/context.c"
+#include "../../src/audio/libxm/load.c"
+#include "../../src/compress/lzh5.c"
@@ -6,11 +6,28 @@
 #include <stdlib.h>
 #include "../common/binout.c"
 #include "../common/assetcomp.h"
+#include "../common/parallel.h"
+#include "../common/polyfill.h"
 
 #include "../../src/asset_internal.h"
 
 bool flag_verbose = false;
 
+typedef struct {
+    char *infn;             ///< Input file
+    char *outfn;            ///< Output file
+    int selected;           ///< Compression level selected (for auto)
+    bool ok;                ///< Compression succeeded
+} job_t;
+
+typedef struct {
+    job_t *jobs;
+    int compression;
+    int winsize;
+    int budget_us;
+    int block_size;
+} batch_t;
+
 void print_args(char * name)
 {
     fprintf(stderr, "%s -- Libdragon asset compression tool\n\n", name);
@@ -22,19 +39,90 @@ void print_args(char * name)
     fprintf(stderr, "Command-line flags:\n");
     fprintf(stderr, "   -v/--verbose            Verbose output\n");
     fprintf(stderr, "   -o/--output <dir>       Specify output directory (default: .)\n");
-    fprintf(stderr, "   -c/--compress <algo>    Compression level 0-%d (default: %d)\n", MAX_COMPRESSION, DEFAULT_COMPRESSION);
+    fprintf(stderr, "   -c/--compress <algo>    Compression level 0-%d, or \"auto\" (default: %d)\n", MAX_COMPRESSION, DEFAULT_COMPRESSION);
     fprintf(stderr, "   -w/--winsize <window>   Maximum size of the matching window in KiB. (default: %d)\n", DEFAULT_WINSIZE_STREAMING/1024);
+    fprintf(stderr, "   -b/--budget <ms>        With -c auto, maximum estimated decompression time on N64 (default: no limit)\n");
+    fprintf(stderr, "   -B/--blocks <size>      Compress in independent blocks of <size> KiB, to allow seeking with asset_fopen()\n");
+    fprintf(stderr, "   -D/--dict <file>        Compress using the shared dictionary <file> (levels 1 and 2)\n");
+    fprintf(stderr, "   --build-dict <file>     Build a shared dictionary from the input files, and write it to <file>\n");
+    fprintf(stderr, "   --dict-size <size>      Maximum size of the dictionary built with --build-dict in KiB (default: %d)\n", DEFAULT_DICT_SIZE/1024);
+    fprintf(stderr, "   -m/--manifest <file>    Read the list of input files from <file> (one per line)\n");
+    fprintf(stderr, "   -j/--jobs <n>           Number of files compressed in parallel (default: number of CPUs)\n");
+    fprintf(stderr, "   --cache <dir>           Cache compression results in <dir> (default: $N64_ASSET_CACHE)\n");
+    fprintf(stderr, "   --no-cache              Do not use the compression cache\n");
     fprintf(stderr, "\nSupported window sizes: 2, 4, 8, 16, 32, 64, 128, 256\n");
     fprintf(stderr, "The window size affects the memory used by asset_fopen() only.\n");
     fprintf(stderr, "If you only use asset_load(), use the biggest window (256 KiB) to improve ratio.\n");
+    fprintf(stderr, "With -B, the window size is chosen automatically for each block.\n");
+    fprintf(stderr, "\nDictionaries improve the ratio of families of small files with shared content.\n");
+    fprintf(stderr, "The dictionary file must be added to the ROM and loaded at runtime with\n");
+    fprintf(stderr, "asset_set_dictionary(). Matches can reach into the dictionary only within the\n");
+    fprintf(stderr, "window, so use a window at least as big as the dictionary.\n");
+    fprintf(stderr, "\nWith -c auto, all levels are tried on each file, and the smallest result\n");
+    fprintf(stderr, "whose estimated decompression time fits the budget is kept. With -B, the\n");
+    fprintf(stderr, "levels are only tried on a sample of the blocks (at most 64 KiB).\n");
     fprintf(stderr, "\n");
 }
 
+void add_job(job_t **jobs, int *njobs, const char *infn, const char *outdir)
+{
+    const char *basename = strrchr(infn, '/');
+    if (!basename) basename = infn; else basename += 1;
+
+    *jobs = realloc(*jobs, (*njobs + 1) * sizeof(job_t));
+    job_t *job = &(*jobs)[(*njobs)++];
+    job->infn = strdup(infn);
+    asprintf(&job->outfn, "%s/%s", outdir, basename);
+    job->selected = 0;
+    job->ok = false;
+}
+
+bool add_manifest(job_t **jobs, int *njobs, const char *manifest, const char *outdir)
+{
+    FILE *f = fopen(manifest, "r");
+    if (!f) {
+        fprintf(stderr, "error opening manifest: %s\n", manifest);
+        return false;
+    }
+
+    char *line = NULL; size_t linesize = 0; ssize_t n;
+    while ((n = getline(&line, &linesize, f)) >= 0) {
+        // Trim whitespace, skip empty lines and comments
+        while (n > 0 && (line[n-1] == '\n' || line[n-1] == '\r' || line[n-1] == ' ' || line[n-1] == '\t'))
+            line[--n] = 0;
+        char *fn = line;
+        while (*fn == ' ' || *fn == '\t') fn++;
+        if (!*fn || *fn == '#')
+            continue;
+        add_job(jobs, njobs, fn, outdir);
+    }
+
+    free(line);
+    fclose(f);
+    return true;
+}
+
+void compress_job(void *ctx, int idx)
+{
+    batch_t *batch = ctx;
+    job_t *job = &batch->jobs[idx];
+
+    job->ok = asset_compress_ex(job->infn, job->outfn, batch->compression, batch->winsize, batch->budget_us, batch->block_size, &job->selected);
+}
+
 int main(int argc, char *argv[])
 {
-    char *infn = NULL, *outdir = ".", *outfn = NULL;
+    char *outdir = ".";
     int compression = DEFAULT_COMPRESSION;
     int winsize = DEFAULT_WINSIZE_STREAMING;
+    int budget_us = 0;
+    int block_size = 0;
+    int dict_size = DEFAULT_DICT_SIZE;
+    const char *dict_fn = NULL, *build_dict_fn = NULL;
+    int num_jobs = 0;
+    job_t *jobs = NULL; int njobs = 0;
+    char **inputs = NULL; int ninputs = 0;
+    char **manifests = NULL; int nmanifests = 0;
 
     if (argc < 2) {
         print_args(argv[0]);
@@ -76,14 +164,85 @@ int main(int argc, char *argv[])
                     return 1;
                 }
                 char extra;
-                if (sscanf(argv[i], "%d%c", &compression, &extra) != 1) {
+                if (!strcmp(argv[i], "auto")) {
+                    compression = COMPRESSION_AUTO;
+                } else if (sscanf(argv[i], "%d%c", &compression, &extra) != 1) {
                     fprintf(stderr, "invalid argument for %s: %s\n", argv[i-1], argv[i]);
                     return 1;
-                }
-                if (compression < 0 || compression > MAX_COMPRESSION) {
+                } else if (compression < 0 || compression > MAX_COMPRESSION) {
                     fprintf(stderr, "invalid compression algorithm: %d\n", compression);
                     return 1;
                 }
+            } else if (!strcmp(argv[i], "-b") || !strcmp(argv[i], "--budget")) {
+                if (++i == argc) {
+                    fprintf(stderr, "missing argument for %s\n", argv[i-1]);
+                    return 1;
+                }
+                char extra; float ms;
+                if (sscanf(argv[i], "%f%c", &ms, &extra) != 1 || ms < 0) {
+                    fprintf(stderr, "invalid argument for %s: %s\n", argv[i-1], argv[i]);
+                    return 1;
+                }
+                budget_us = ms * 1000;
+            } else if (!strcmp(argv[i], "-B") || !strcmp(argv[i], "--blocks")) {
+                if (++i == argc) {
+                    fprintf(stderr, "missing argument for %s\n", argv[i-1]);
+                    return 1;
+                }
+                char extra;
+                if (sscanf(argv[i], "%d%c", &block_size, &extra) != 1 || block_size < 1) {
+                    fprintf(stderr, "invalid argument for %s: %s\n", argv[i-1], argv[i]);
+                    return 1;
+                }
+                block_size = block_size * 1024;
+            } else if (!strcmp(argv[i], "-D") || !strcmp(argv[i], "--dict")) {
+                if (++i == argc) {
+                    fprintf(stderr, "missing argument for %s\n", argv[i-1]);
+                    return 1;
+                }
+                dict_fn = argv[i];
+            } else if (!strcmp(argv[i], "--build-dict")) {
+                if (++i == argc) {
+                    fprintf(stderr, "missing argument for %s\n", argv[i-1]);
+                    return 1;
+                }
+                build_dict_fn = argv[i];
+            } else if (!strcmp(argv[i], "--dict-size")) {
+                if (++i == argc) {
+                    fprintf(stderr, "missing argument for %s\n", argv[i-1]);
+                    return 1;
+                }
+                char extra;
+                if (sscanf(argv[i], "%d%c", &dict_size, &extra) != 1 || dict_size < 1 || dict_size > ASSET_DICT_MAX_SIZE/1024) {
+                    fprintf(stderr, "invalid argument for %s: %s\n", argv[i-1], argv[i]);
+                    return 1;
+                }
+                dict_size = dict_size * 1024;
+            } else if (!strcmp(argv[i], "-j") || !strcmp(argv[i], "--jobs")) {
+                if (++i == argc) {
+                    fprintf(stderr, "missing argument for %s\n", argv[i-1]);
+                    return 1;
+                }
+                char extra;
+                if (sscanf(argv[i], "%d%c", &num_jobs, &extra) != 1 || num_jobs < 1) {
+                    fprintf(stderr, "invalid argument for %s: %s\n", argv[i-1], argv[i]);
+                    return 1;
+                }
+            } else if (!strcmp(argv[i], "--cache")) {
+                if (++i == argc) {
+                    fprintf(stderr, "missing argument for %s\n", argv[i-1]);
+                    return 1;
+                }
+                asset_compress_set_cache_dir(argv[i]);
+            } else if (!strcmp(argv[i], "--no-cache")) {
+                asset_compress_set_cache_dir(NULL);
+            } else if (!strcmp(argv[i], "-m") || !strcmp(argv[i], "--manifest")) {
+                if (++i == argc) {
+                    fprintf(stderr, "missing argument for %s\n", argv[i-1]);
+                    return 1;
+                }
+                manifests = realloc(manifests, (nmanifests + 1) * sizeof(char*));
+                manifests[nmanifests++] = argv[i];
             } else {
                 fprintf(stderr, "invalid flag: %s\n", argv[i]);
                 return 1;
@@ -91,17 +250,69 @@ int main(int argc, char *argv[])
             continue;
         }
 
-        infn = argv[i];
-        char *basename = strrchr(infn, '/');
-        if (!basename) basename = infn; else basename += 1;
+        inputs = realloc(inputs, (ninputs + 1) * sizeof(char*));
+        inputs[ninputs++] = argv[i];
+    }
 
-        asprintf(&outfn, "%s/%s", outdir, basename);
+    // Build the list of jobs once all flags are parsed, so that the output
+    // directory applies to all input files.
+    for (int i = 0; i < ninputs; i++)
+        add_job(&jobs, &njobs, inputs[i], outdir);
+    for (int i = 0; i < nmanifests; i++)
+        if (!add_manifest(&jobs, &njobs, manifests[i], outdir))
+            return 1;
 
+    if (build_dict_fn) {
+        // Build the dictionary using the input files as samples
+        const char **files = malloc(njobs * sizeof(char*));
+        for (int i = 0; i < njobs; i++)
+            files[i] = jobs[i].infn;
         if (flag_verbose)
-            printf("Compressing: %s => %s [algo=%d]\n", infn, outfn, compression);
+            printf("Building dictionary: %s [%d samples]\n", build_dict_fn, njobs);
+        bool ok = asset_build_dictionary(files, njobs, dict_size, build_dict_fn);
+        free(files);
+        return ok ? 0 : 1;
+    }
 
-        asset_compress(infn, outfn, compression, winsize);
+    if (dict_fn) {
+        if (block_size) {
+            fprintf(stderr, "--dict cannot be used together with --blocks\n");
+            return 1;
+        }
+        if (!asset_compress_set_dictionary(dict_fn))
+            return 1;
+    }
 
-        free(outfn);
+    if (flag_verbose) {
+        for (int i = 0; i < njobs; i++) {
+            if (compression == COMPRESSION_AUTO)
+                printf("Compressing: %s => %s [algo=auto]\n", jobs[i].infn, jobs[i].outfn);
+            else
+                printf("Compressing: %s => %s [algo=%d]\n", jobs[i].infn, jobs[i].outfn, compression);
+        }
     }
+
+    batch_t batch = {
+        .jobs = jobs,
+        .compression = compression,
+        .winsize = winsize,
+        .budget_us = budget_us,
+        .block_size = block_size,
+    };
+    parallel_for(num_jobs, njobs, compress_job, &batch);
+
+    int ret = 0;
+    for (int i = 0; i < njobs; i++) {
+        if (!jobs[i].ok)
+            ret = 1;
+        else if (flag_verbose && compression == COMPRESSION_AUTO)
+            printf("Selected: %s [algo=%d]\n", jobs[i].outfn, jobs[i].selected);
+        free(jobs[i].infn);
+        free(jobs[i].outfn);
+    }
+
+    free(jobs);
+    free(inputs);
+    free(manifests);
+    return ret;
 }
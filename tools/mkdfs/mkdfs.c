@@ -1,14 +1,19 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <dirent.h>
 #include <sys/stat.h>
 #include <string.h>
 #include <errno.h>
 #include <stdint.h>
+#include <unistd.h>
 #include <sys/types.h>
 #include <sys/param.h>
 #include "dragonfs.h"
 #include "dfsinternal.h"
+#include "../common/parallel.h"
+#include "fnv.h"
+#include "../common/polyfill.h"
 
 #if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
 #define SWAPLONG(i) (i)
@@ -16,295 +21,1221 @@
 #define SWAPLONG(i) (((uint32_t)((i) & 0xFF000000) >> 24) | ((uint32_t)((i) & 0x00FF0000) >>  8) | ((uint32_t)((i) & 0x0000FF00) <<  8) | ((uint32_t)((i) & 0x000000FF) << 24))
 #endif
 
-uint8_t *dfs = NULL;
+/* Round a size up to a full sector */
+#define SECTOR_ROUND(x)     (((x) + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE)
+
+/* Size of the buffer used to stream file contents */
+#define COPY_CHUNK_SIZE     (64*1024)
+
+/* Prefix of the access trace lines logged by dfs_trace_enable() */
+#define TRACE_PREFIX        "[dfs_trace]"
+
+/* An entry (file or directory) of the tree being added to the filesystem */
+typedef struct
+{
+    char *path;                         /* Path on the host filesystem */
+    char *relpath;                      /* Path within the DFS image */
+    char name[MAX_FILENAME_LEN+1];      /* Name stored in the directory entry */
+    bool is_dir;
+    int first_child;                    /* Directories: index of first child, or -1 */
+    int next;                           /* Index of next entry in the same directory, or -1 */
+
+    /* Files only */
+    uint32_t size;                      /* Size in bytes */
+    uint64_t hash;                      /* Hash of the contents */
+    bool error;                         /* Set if the file could not be read */
+    int trace_open;                     /* Sequence number of the first open in the access trace, or -1 */
+    int trace_read;                     /* Sequence number of the first read in the access trace, or -1 */
+
+    /* Layout */
+    uint32_t dirent;                    /* Offset of the directory entry */
+    uint32_t file_pointer;              /* Offset of the contents (or first child dirent) */
+} node_t;
+
+/* A blob of file contents placed in the image */
+typedef struct
+{
+    uint64_t hash;
+    uint32_t offset;
+    uint32_t size;
+    int node;                           /* Node providing the data, or -1 if it comes from the old image */
+} blob_t;
+
+/* A range of free space in the image */
+typedef struct
+{
+    uint32_t offset;
+    uint32_t size;
+} range_t;
+
+node_t *nodes = NULL;
+int nodes_count = 0;
+
+/* Previous image, when updating */
+const char *old_file = NULL;
+uint32_t old_size = 0;
+blob_t *old_blobs = NULL;
+int old_blobs_count = 0;
+
+/* Image being built */
 uint32_t fs_size = 0;
+uint32_t index_offset = 0;
+
+/* Free ranges left in the old image, sorted by offset */
+range_t *holes = NULL;
+int holes_count = 0;
+
+/* Access trace: number of events seen so far */
+int trace_seq = 0;
+
+/* Alignment of file contents in the image */
+uint32_t file_align = SECTOR_SIZE;
+
+bool flag_verbose = false;
+
+/* Allocate space in the image, reusing holes left by the previous image if possible.
+ * The returned offset is a multiple of align (which must be a multiple of the sector size). */
+uint32_t dfs_alloc(uint32_t size, uint32_t align)
+{
+    uint32_t rsize = SECTOR_ROUND(size);
+
+    for(int i = 0; i < holes_count && rsize; i++)
+    {
+        uint32_t pad = (align - holes[i].offset % align) % align;
+
+        if(holes[i].size >= rsize + pad)
+        {
+            uint32_t offset = holes[i].offset + pad;
+            holes[i].offset += pad + rsize;
+            holes[i].size -= pad + rsize;
+            return offset;
+        }
+    }
 
-/* Offset from start of filesystem */
-inline uint32_t sector_offset(void *sector)
+    uint32_t offset = (fs_size + align - 1) / align * align;
+    fs_size = offset + rsize;
+    return offset;
+}
+
+void kill_fs()
 {
-    uint32_t x = (uint8_t *)sector - dfs;
+    for(int i = 0; i < nodes_count; i++)
+    {
+        free(nodes[i].path);
+        free(nodes[i].relpath);
+    }
+    free(nodes);
+    free(old_blobs);
+    free(holes);
+}
 
-    return x;
+void print_help(const char * const prog_name)
+{
+    fprintf(stderr, "Usage: %s [flags] <File> <Directory>\n", prog_name);
+    fprintf(stderr, "  where <File> is the resulting filesystem image\n");
+    fprintf(stderr, "  and <Directory> is the directory (including subdirectories) to include\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Command-line flags:\n");
+    fprintf(stderr, "   -v/--verbose            Verbose output\n");
+    fprintf(stderr, "   -j/--jobs <n>           Number of threads used to read files (default: number of CPUs)\n");
+    fprintf(stderr, "   -u/--update             Update <File>: files already present in the existing\n");
+    fprintf(stderr, "                           image keep their position, so that the new image only\n");
+    fprintf(stderr, "                           differs where files changed\n");
+    fprintf(stderr, "   -t/--trace <log>        Lay out files in the order they are accessed in a debug log\n");
+    fprintf(stderr, "                           recorded with dfs_trace_enable(), so that files loaded\n");
+    fprintf(stderr, "                           together are contiguous in ROM. Can be repeated.\n");
+    fprintf(stderr, "   -a/--align <bytes>      Alignment of file contents in the image (power of two,\n");
+    fprintf(stderr, "                           at least %d, default: %d)\n", SECTOR_SIZE, SECTOR_SIZE);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Files with identical contents are stored only once in the image.\n");
+    fprintf(stderr, "The image is written to a temporary file which then replaces <File>.\n");
 }
 
-inline void *sector_to_memory(uint32_t offset)
+int node_cmp_name(const void *a, const void *b)
 {
-    return (void *)(dfs + offset);
+    return strcmp(*(const char **)a, *(const char **)b);
 }
 
-uint32_t dfs_alloc(int size)
+/* Add the contents of a directory to the tree, returning the index of its first entry (or -1 if empty) */
+int scan_directory(const char * const path, const char * const relpath)
 {
-    void *end;
-    int rsize = (size + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+    DIR *dirp;
+    struct dirent *dp;
+    char **names = NULL;
+    int names_count = 0;
+
+    if((dirp = opendir(path)) == NULL)
+    {
+        return -1;
+    }
 
-    if(!dfs)
+    while((dp = readdir(dirp)) != NULL)
     {
-        dfs = malloc(rsize);
-        fs_size = rsize;
+        if(strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0)
+        {
+            /* Ignore */
+            continue;
+        }
 
-        end = dfs;
+        names = realloc(names, (names_count + 1) * sizeof(char *));
+        names[names_count++] = strdup(dp->d_name);
     }
-    else
+
+    closedir(dirp);
+
+    /* Sort entries so that the image does not depend on the host filesystem order */
+    qsort(names, names_count, sizeof(char *), node_cmp_name);
+
+    int first_entry = -1;
+    int cur_entry = -1;
+
+    for(int i = 0; i < names_count; i++)
     {
-        dfs = realloc(dfs, fs_size + rsize);
+        char *file = malloc(strlen(path) + strlen(names[i]) + 2);
+        char *relfile = malloc(strlen(relpath) + MAX_FILENAME_LEN + 2);
+        struct stat stats;
+
+        /* Only add a / if there isn't one */
+        sprintf(file, "%s%s%s", path, path[strlen(path) - 1] != '/' ? "/" : "", names[i]);
+        sprintf(relfile, "%s%s%.*s", relpath, relpath[0] ? "/" : "", MAX_FILENAME_LEN, names[i]);
+
+        /* Figure out if it is a directory or regular (windows doesn't include d_type in dirent) */
+        if(stat(file, &stats) != 0 || (!S_ISREG(stats.st_mode) && !S_ISDIR(stats.st_mode)))
+        {
+            free(relfile);
+            free(file);
+            continue;
+        }
+
+        int idx = nodes_count++;
+        nodes = realloc(nodes, nodes_count * sizeof(node_t));
+        memset(&nodes[idx], 0, sizeof(node_t));
+        nodes[idx].path = file;
+        nodes[idx].relpath = relfile;
+        nodes[idx].is_dir = S_ISDIR(stats.st_mode);
+        nodes[idx].first_child = -1;
+        nodes[idx].next = -1;
+        nodes[idx].trace_open = -1;
+        nodes[idx].trace_read = -1;
+
+        /* Copy over filename */
+        strncpy(nodes[idx].name, names[i], MAX_FILENAME_LEN);
+        nodes[idx].name[MAX_FILENAME_LEN] = 0;
+
+        if(nodes[idx].is_dir)
+        {
+            int first_child = scan_directory(file, relfile);
+
+            if(first_child < 0)
+            {
+                /* Nothing was added after this node, so we can just drop it */
+                fprintf(stderr, "Skipping empty directory: %s\n", file);
+                free(relfile);
+                free(file);
+                nodes_count--;
+                continue;
+            }
 
-        end = dfs + fs_size;
-        fs_size += rsize;
+            nodes[idx].first_child = first_child;
+        }
+
+        if(cur_entry >= 0)
+        {
+            /* Link up! */
+            nodes[cur_entry].next = idx;
+        }
+
+        /* This is now the current working entry */
+        cur_entry = idx;
+
+        if(first_entry < 0)
+        {
+            /* Return pointer to first file on list */
+            first_entry = idx;
+        }
     }
 
-    /* Zero out last bytes */
-    memset(end, 0, rsize);
+    for(int i = 0; i < names_count; i++)
+    {
+        free(names[i]);
+    }
+    free(names);
 
-    return sector_offset(end);    
+    /* Will return -1 if we don't find any entries (don't support directories without files) */
+    return first_entry;
 }
 
-/* Add a new sector to the filesystem, return that sector pointer */
-uint32_t new_sector(void)
+/* Hash size bytes of a file, from the current position */
+bool hash_file(FILE *fp, uint32_t size, uint64_t *hash)
 {
-    return dfs_alloc(SECTOR_SIZE);
+    uint8_t *buf = malloc(COPY_CHUNK_SIZE);
+    bool ok = true;
+
+    *hash = FNV1A64_INIT;
+    while(ok && size > 0)
+    {
+        uint32_t len = MIN(size, COPY_CHUNK_SIZE);
+        ok = fread(buf, 1, len, fp) == len;
+        *hash = fnv1a64_update(*hash, buf, len);
+        size -= len;
+    }
+
+    free(buf);
+    return ok;
 }
 
-uint32_t new_blob(int size)
+/* Compare size bytes of two files, starting at the given offsets */
+bool same_contents(const char *path_a, uint32_t offset_a, const char *path_b, uint32_t offset_b, uint32_t size)
 {
-    return dfs_alloc(size);    
+    FILE *fa = fopen(path_a, "rb");
+    FILE *fb = fopen(path_b, "rb");
+    uint8_t *buf_a = malloc(COPY_CHUNK_SIZE);
+    uint8_t *buf_b = malloc(COPY_CHUNK_SIZE);
+    bool same = fa && fb && fseek(fa, offset_a, SEEK_SET) == 0 && fseek(fb, offset_b, SEEK_SET) == 0;
+
+    while(same && size > 0)
+    {
+        uint32_t len = MIN(size, COPY_CHUNK_SIZE);
+        same = fread(buf_a, 1, len, fa) == len && fread(buf_b, 1, len, fb) == len &&
+               memcmp(buf_a, buf_b, len) == 0;
+        size -= len;
+    }
+
+    free(buf_b);
+    free(buf_a);
+    if(fb) { fclose(fb); }
+    if(fa) { fclose(fa); }
+    return same;
 }
 
-void kill_fs()
+/* Job: hash a file of the tree. Contents are streamed, so that they are never
+ * all in memory at once. */
+void read_file_job(void *ctx, int idx)
+{
+    node_t *node = &nodes[idx];
+    FILE *fp;
+
+    if(node->is_dir)
+    {
+        return;
+    }
+
+    fp = fopen(node->path, "rb");
+
+    if(!fp)
+    {
+        fprintf(stderr, "Cannot open file '%s' for read!\n", node->path);
+        node->error = true;
+        return;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    if(size > 0x0FFFFFFF)
+    {
+        fprintf(stderr, "File '%s' too big for the filesystem!\n", node->path);
+        node->error = true;
+        fclose(fp);
+        return;
+    }
+
+    node->size = size;
+
+    if(!hash_file(fp, node->size, &node->hash))
+    {
+        fprintf(stderr, "Cannot add all contents of file '%s' to filesystem!\n", node->path);
+        node->error = true;
+    }
+
+    fclose(fp);
+}
+
+/* Job: hash a blob of the old image */
+void hash_old_blob_job(void *ctx, int idx)
 {
-    if(dfs)
+    blob_t *blob = &old_blobs[idx];
+    FILE *fp = fopen(old_file, "rb");
+
+    /* On error, leave a hash that is checked anyway by comparing contents */
+    if(fp && fseek(fp, blob->offset, SEEK_SET) == 0)
     {
-        free(dfs);
+        hash_file(fp, blob->size, &blob->hash);
     }
+    if(fp) { fclose(fp); }
 }
 
-void print_help(const char * const prog_name)
+/* Read a sector of the old image */
+bool read_old_sector(FILE *fp, uint32_t offset, void *sector)
 {
-    fprintf(stderr, "Usage: %s <File> <Directory>\n", prog_name);
-    fprintf(stderr, "  where <File> is the resulting filesystem image\n");
-    fprintf(stderr, "  and <Directory> is the directory (including subdirectories) to include\n");
+    return offset % SECTOR_SIZE == 0 && offset + SECTOR_SIZE <= old_size &&
+           fseek(fp, offset, SEEK_SET) == 0 && fread(sector, 1, SECTOR_SIZE, fp) == SECTOR_SIZE;
 }
 
-uint32_t add_file(const char * const file, uint32_t *size)
+int blob_cmp_offset(const void *a, const void *b)
 {
-    FILE *fp;
+    const blob_t *ba = a, *bb = b;
+    return ba->offset < bb->offset ? -1 : (ba->offset > bb->offset);
+}
 
-    printf("Adding '%s' to filesystem image.\n", file);
+int blob_cmp_hash(const void *a, const void *b)
+{
+    const blob_t *ba = a, *bb = b;
+    if(ba->hash != bb->hash) { return ba->hash < bb->hash ? -1 : 1; }
+    return blob_cmp_offset(a, b);
+}
 
-    fp = fopen(file, "rb");
+/* Collect the file contents stored in a directory of the old image */
+bool scan_old_directory(FILE *fp, uint32_t first_entry, int depth)
+{
+    uint32_t cur_entry = first_entry;
+
+    while(cur_entry)
+    {
+        directory_entry_t entry;
+
+        if(depth > MAX_DIRECTORY_DEPTH || !read_old_sector(fp, cur_entry, &entry))
+        {
+            return false;
+        }
+
+        uint32_t flags = SWAPLONG(entry.flags);
+        uint32_t file_pointer = SWAPLONG(entry.file_pointer);
+
+        if(FILETYPE(flags >> 28) == FLAGS_DIR)
+        {
+            if(file_pointer && !scan_old_directory(fp, file_pointer, depth + 1))
+            {
+                return false;
+            }
+        }
+        else
+        {
+            uint32_t size = flags & 0x0FFFFFFF;
+
+            if(file_pointer % SECTOR_SIZE || file_pointer > old_size || size > old_size - file_pointer)
+            {
+                return false;
+            }
+
+            old_blobs = realloc(old_blobs, (old_blobs_count + 1) * sizeof(blob_t));
+            old_blobs[old_blobs_count++] = (blob_t){ .offset = file_pointer, .size = size, .node = -1 };
+        }
+
+        cur_entry = SWAPLONG(entry.next_entry);
+    }
+
+    return true;
+}
+
+/* Load the previous image, to reuse its layout. Returns false if it is not a valid image. */
+bool load_old_image(const char * const file, int jobs)
+{
+    FILE *fp = fopen(file, "rb");
 
     if(!fp)
     {
-        fprintf(stderr, "Cannot open file '%s' for read!\n", file);
-        return 0;
+        return false;
     }
 
     fseek(fp, 0, SEEK_END);
-    *size = ftell(fp);
+    old_size = ftell(fp);
     fseek(fp, 0, SEEK_SET);
 
-    if (*size > 0x0FFFFFFF)
+    directory_entry_t id;
+    bool ok = old_size >= 2*SECTOR_SIZE && read_old_sector(fp, 0, &id) &&
+              SWAPLONG(id.flags) == ROOT_FLAGS && SWAPLONG(id.next_entry) == ROOT_NEXT_ENTRY &&
+              memchr(id.path, 0, sizeof(id.path)) && !strcmp(id.path, ROOT_PATH) &&
+              scan_old_directory(fp, SECTOR_SIZE, 0);
+    fclose(fp);
+
+    if(!ok)
     {
-        fprintf(stderr, "File '%s' too big for the filesystem!\n", file);
-        return 0;
+        free(old_blobs);
+        old_blobs = NULL;
+        old_blobs_count = 0;
+        old_size = 0;
+        return false;
     }
 
-    uint32_t blob = new_blob(*size);
-    uint8_t *data = sector_to_memory(blob);
+    old_file = file;
 
-    int read = fread(data, 1, *size, fp);
-    if (read < 0) {
-        /* Wat? */
-        fprintf(stderr, "Cannot add all contents of file '%s' to filesystem!\n", file);
-        fclose(fp);
-        return 0;    
+    /* Deduplicate blobs shared by multiple entries, and hash them */
+    qsort(old_blobs, old_blobs_count, sizeof(blob_t), blob_cmp_offset);
+    int count = 0;
+    for(int i = 0; i < old_blobs_count; i++)
+    {
+        if(count == 0 || old_blobs[count-1].offset != old_blobs[i].offset)
+        {
+            old_blobs[count++] = old_blobs[i];
+        }
     }
+    old_blobs_count = count;
 
-    fclose(fp);
-    return blob;
+    parallel_for(jobs, old_blobs_count, hash_old_blob_job, NULL);
+    qsort(old_blobs, old_blobs_count, sizeof(blob_t), blob_cmp_hash);
+    return true;
 }
 
-uint32_t add_directory(const char * const path)
+/* Find a blob with the same contents as a node in a hash-sorted array */
+blob_t *find_blob(blob_t *blobs, int count, node_t *node)
 {
-    directory_entry_t *tmp_entry;
-    uint32_t first_entry = 0;
-    uint32_t cur_entry = 0;
-    DIR *dirp;
-    struct dirent *dp;
+    int lo = 0, hi = count;
+    while(lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if(blobs[mid].hash < node->hash) { lo = mid + 1; }
+        else { hi = mid; }
+    }
 
-    if((dirp = opendir(path)) == NULL)
+    for(int i = lo; i < count && blobs[i].hash == node->hash; i++)
     {
-        return 0;
+        const char *path = blobs[i].node >= 0 ? nodes[blobs[i].node].path : old_file;
+        uint32_t offset = blobs[i].node >= 0 ? 0 : blobs[i].offset;
+
+        if(blobs[i].size == node->size && same_contents(path, offset, node->path, 0, node->size))
+        {
+            return &blobs[i];
+        }
     }
 
-    do {
-        if((dp = readdir(dirp)) != NULL)
+    return NULL;
+}
+
+/* Compute the free ranges of the old image, given the blobs that are kept */
+void compute_holes(blob_t *kept, int kept_count)
+{
+    /* Root sector and first directory entry are always in use */
+    uint32_t cur = 2 * SECTOR_SIZE;
+
+    qsort(kept, kept_count, sizeof(blob_t), blob_cmp_offset);
+
+    for(int i = 0; i <= kept_count; i++)
+    {
+        uint32_t start = i < kept_count ? kept[i].offset : old_size;
+
+        if(start > cur)
+        {
+            holes = realloc(holes, (holes_count + 1) * sizeof(range_t));
+            holes[holes_count++] = (range_t){ .offset = cur, .size = start - cur };
+        }
+
+        if(i < kept_count)
         {
-            if(strcmp(dp->d_name, ".") == 0)
+            cur = MAX(cur, kept[i].offset + SECTOR_ROUND(kept[i].size));
+        }
+    }
+
+    fs_size = old_size;
+}
+
+int index_cmp(const void *a, const void *b)
+{
+    const dfs_index_entry_t *ea = a, *eb = b;
+    if(ea->hash != eb->hash) { return ea->hash < eb->hash ? -1 : 1; }
+    return ea->dirent < eb->dirent ? -1 : (ea->dirent > eb->dirent);
+}
+
+/* Build the path index, and return its size in bytes */
+dfs_index_entry_t *build_index(uint32_t *count)
+{
+    dfs_index_entry_t *entries = malloc(nodes_count * sizeof(dfs_index_entry_t));
+    *count = nodes_count;
+
+    for(int i = 0; i < nodes_count; i++)
+    {
+        entries[i].hash = dfs_path_hash(nodes[i].relpath, strlen(nodes[i].relpath));
+        entries[i].dirent = nodes[i].dirent;
+        entries[i].parent = 0;
+    }
+
+    /* Entries in the root directory keep a zero parent, which is the offset of the root sector */
+    for(int i = 0; i < nodes_count; i++)
+    {
+        if(nodes[i].is_dir)
+        {
+            for(int c = nodes[i].first_child; c >= 0; c = nodes[c].next)
             {
-                /* Ignore */
+                entries[c].parent = nodes[i].dirent;
             }
-            else if(strcmp(dp->d_name, "..") == 0)
+        }
+    }
+
+    qsort(entries, *count, sizeof(dfs_index_entry_t), index_cmp);
+
+    /* Flag hashes shared by multiple paths: the runtime will walk the directories for them */
+    int collisions = 0;
+    for(uint32_t i = 1; i < *count; i++)
+    {
+        if(entries[i].hash == entries[i-1].hash)
+        {
+            if(!(entries[i-1].dirent & INDEX_FLAG_COLLISION)) { collisions++; }
+            entries[i-1].dirent |= INDEX_FLAG_COLLISION;
+            entries[i].dirent |= INDEX_FLAG_COLLISION;
+        }
+    }
+    if(collisions)
+    {
+        fprintf(stderr, "Warning: %d path hash collisions in index\n", collisions);
+    }
+
+    return entries;
+}
+
+/* Find the node of a file given its path, as logged in an access trace */
+int find_node(const char *path)
+{
+    /* Normalize the path: drop the filesystem prefix and leading slashes */
+    if(!strncmp(path, "rom:", 4)) { path += 4; }
+    while(path[0] == '/' || (path[0] == '.' && path[1] == '/')) { path += path[0] == '/' ? 1 : 2; }
+
+    for(int i = 0; i < nodes_count; i++)
+    {
+        if(!nodes[i].is_dir && !strcmp(nodes[i].relpath, path))
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/* Load an access trace, recording the first open and read of each file */
+bool load_trace(const char * const file)
+{
+    FILE *fp = fopen(file, "r");
+
+    if(!fp)
+    {
+        return false;
+    }
+
+    /* Map of the open handles to nodes. Handles are reused after close,
+     * so each open replaces the previous mapping. */
+    struct { uint32_t handle; int node; } *handles = NULL;
+    int handles_count = 0;
+    int events = 0, missing = 0;
+
+    char *line = NULL;
+    size_t line_size = 0;
+
+    while(getline(&line, &line_size, fp) != -1)
+    {
+        char *p = strstr(line, TRACE_PREFIX);
+
+        if(!p)
+        {
+            continue;
+        }
+
+        p += strlen(TRACE_PREFIX);
+        line[strcspn(line, "\r\n")] = 0;
+
+        unsigned int handle;
+        int pos = -1;
+        int node = -1;
+
+        if(sscanf(p, " open %x %n", &handle, &pos) == 1 && pos >= 0)
+        {
+            node = find_node(p + pos);
+
+            int h;
+            for(h = 0; h < handles_count && handles[h].handle != handle; h++) {}
+            if(h == handles_count)
             {
-                /* Ignore */
+                handles = realloc(handles, (handles_count + 1) * sizeof(*handles));
+                handles_count++;
             }
-            else
+            handles[h].handle = handle;
+            handles[h].node = node;
+
+            if(node < 0)
             {
-                char *file = malloc(strlen(path) + strlen(dp->d_name) + 2);
-                struct stat stats;
+                if(flag_verbose) { printf("Trace: file not found in directory: %s\n", p + pos); }
+                missing++;
+            }
+            else if(nodes[node].trace_open < 0)
+            {
+                nodes[node].trace_open = trace_seq++;
+            }
+        }
+        else if(sscanf(p, " addr %n", &pos) == 0 && pos >= 0)
+        {
+            node = find_node(p + pos);
 
-                if(!file)
+            /* The data is accessed directly via DMA, so consider it read */
+            if(node < 0)
+            {
+                if(flag_verbose) { printf("Trace: file not found in directory: %s\n", p + pos); }
+                missing++;
+            }
+            else if(nodes[node].trace_read < 0)
+            {
+                nodes[node].trace_read = trace_seq++;
+            }
+        }
+        else if(sscanf(p, " read %x", &handle) == 1)
+        {
+            for(int h = 0; h < handles_count; h++)
+            {
+                if(handles[h].handle == handle)
                 {
-                    /* Out of memory */
-                    return 0;
+                    node = handles[h].node;
                 }
+            }
 
-                strcpy(file, path);
+            if(node >= 0 && nodes[node].trace_read < 0)
+            {
+                nodes[node].trace_read = trace_seq++;
+            }
+        }
+        else
+        {
+            continue;
+        }
 
-                /* Only add a / if there isn't one */
-                if(path[strlen(path) - 1] != '/')
-                {
-                    strcat(file, "/");
-                }
+        events++;
+    }
 
-                strcat(file, dp->d_name);
+    free(line);
+    free(handles);
+    fclose(fp);
 
-                /* Figure out if it is a directory or regular (windows doesn't include d_type in dirent) */
-                stat( file, &stats );
+    if(missing)
+    {
+        fprintf(stderr, "Warning: %d files in trace '%s' not found in the directory\n", missing, file);
+    }
+    if(flag_verbose)
+    {
+        printf("Loaded %d events from trace '%s'.\n", events, file);
+    }
 
-                if(S_ISREG(stats.st_mode))
-                {
-                    uint32_t new_entry = new_sector();
-                    uint32_t file_size = 0;
+    return true;
+}
 
-                    tmp_entry = sector_to_memory(new_entry);
-                    tmp_entry->next_entry = 0;
+/* Position of a file in the access trace: files are ordered by their first read
+ * (or by their first open, if never read). Returns -1 if the file was not accessed. */
+int trace_key(const node_t *node)
+{
+    return node->trace_read >= 0 ? node->trace_read : node->trace_open;
+}
 
-                    /* Copy over filename */
-                    strncpy(tmp_entry->path, dp->d_name, MAX_FILENAME_LEN);
-                    tmp_entry->path[MAX_FILENAME_LEN] = 0;
+int node_cmp_trace(const void *a, const void *b)
+{
+    int ka = trace_key(&nodes[*(const int *)a]), kb = trace_key(&nodes[*(const int *)b]);
+    return ka - kb;
+}
 
-                    uint32_t new_file = add_file(file, &file_size);
+/* Assign an offset to every directory entry and file content, and build the image */
+void layout(int root)
+{
+    blob_t *blobs = NULL;
+    int blobs_count = 0;
+    blob_t *kept = NULL;
+    int kept_count = 0;
+    int reused = 0, added = 0, dedup = 0;
+    int *traced = NULL;
+    int traced_count = 0;
+
+    /* First, find which contents can be reused from the old image */
+    for(int i = 0; i < nodes_count; i++)
+    {
+        node_t *node = &nodes[i];
 
-                    if(!new_file)
-                    {
-                        free(file);
-                        return 0;
-                    }
+        if(node->is_dir)
+        {
+            continue;
+        }
 
-                    tmp_entry = sector_to_memory(new_entry);
-                    tmp_entry->file_pointer = SWAPLONG(new_file);
-                    tmp_entry->flags = SWAPLONG((FLAGS_FILE << 28) | (file_size & 0x0FFFFFFF));
+        node->file_pointer = 0;
 
-                    if(cur_entry)
-                    {
-                        /* Link up! */
-                        tmp_entry = sector_to_memory(cur_entry);
-                        tmp_entry->next_entry = SWAPLONG(new_entry);
-                    }
+        if(old_file)
+        {
+            blob_t *old = find_blob(old_blobs, old_blobs_count, node);
+            if(old)
+            {
+                node->file_pointer = old->offset;
+                kept = realloc(kept, (kept_count + 1) * sizeof(blob_t));
+                kept[kept_count++] = *old;
+            }
+        }
+    }
 
-                    /* This is now the current working entry */
-                    cur_entry = new_entry;
-                }
-                else if(S_ISDIR(stats.st_mode))
-                {
-                    uint32_t new_entry = new_sector();
+    if(old_file)
+    {
+        compute_holes(kept, kept_count);
+    }
+    else
+    {
+        /* Root sector */
+        fs_size = SECTOR_SIZE;
+    }
 
-                    tmp_entry = sector_to_memory(new_entry);
-                    tmp_entry->flags = SWAPLONG(FLAGS_DIR << 28); /* Size doesn't matter for directories */
-                    tmp_entry->next_entry = 0;
+    /* Now assign offsets in tree order, so that new images keep each file next to its entry.
+     * Files in the access trace are placed afterwards, contiguously, in access order. */
+    for(int n = 0; n < nodes_count + traced_count; n++)
+    {
+        int i = n;
 
-                    /* Copy over filename */
-                    strncpy(tmp_entry->path, dp->d_name, MAX_FILENAME_LEN);
-                    tmp_entry->path[MAX_FILENAME_LEN] = 0;
+        if(n == nodes_count)
+        {
+            qsort(traced, traced_count, sizeof(int), node_cmp_trace);
+        }
 
-                    uint32_t new_directory = add_directory(file);
+        if(n >= nodes_count)
+        {
+            i = traced[n - nodes_count];
+        }
+        else
+        {
+            nodes[i].dirent = (i == root) ? SECTOR_SIZE : dfs_alloc(SECTOR_SIZE, SECTOR_SIZE);
 
-                    if(!new_directory)
-                    {
-                        fprintf(stderr, "Skipping empty directory: %s\n", file);
-                        free(file);
-                        continue;
-                    }
+            if(i == root && !old_file)
+            {
+                fs_size = 2 * SECTOR_SIZE;
+            }
 
-                    tmp_entry = sector_to_memory(new_entry);
-                    tmp_entry->file_pointer = SWAPLONG(new_directory);
+            if(!nodes[i].is_dir && !nodes[i].file_pointer && trace_key(&nodes[i]) >= 0)
+            {
+                traced = realloc(traced, (traced_count + 1) * sizeof(int));
+                traced[traced_count++] = i;
+                continue;
+            }
+        }
 
-                    if(cur_entry)
-                    {
-                        /* Link up! */
-                        tmp_entry = sector_to_memory(cur_entry);
-                        tmp_entry->next_entry = SWAPLONG(new_entry);
-                    }
+        node_t *node = &nodes[i];
 
-                    /* This is now the current working entry */
-                    cur_entry = new_entry;
-                }
+        if(node->is_dir)
+        {
+            continue;
+        }
 
-                free(file);
+        if(node->file_pointer)
+        {
+            if(flag_verbose) { printf("Keeping '%s' in filesystem image.\n", node->path); }
+            reused++;
+        }
+        else
+        {
+            blob_t *blob = find_blob(blobs, blobs_count, node);
+
+            if(blob)
+            {
+                if(flag_verbose) { printf("Adding '%s' to filesystem image (duplicate of '%s').\n", node->path, nodes[blob->node].path); }
+                node->file_pointer = blob->offset;
+                dedup++;
+                continue;
+            }
+
+            printf("Adding '%s' to filesystem image.\n", node->path);
+            node->file_pointer = dfs_alloc(node->size, file_align);
+            added++;
+        }
+
+        /* Keep the blobs sorted by hash for the lookup */
+        blob_t nb = { .hash = node->hash, .offset = node->file_pointer, .size = node->size, .node = i };
+        int pos = blobs_count;
+        blobs = realloc(blobs, (blobs_count + 1) * sizeof(blob_t));
+        while(pos > 0 && blob_cmp_hash(&blobs[pos-1], &nb) > 0)
+        {
+            blobs[pos] = blobs[pos-1];
+            pos--;
+        }
+        blobs[pos] = nb;
+        blobs_count++;
+    }
+
+    /* Reserve space for the index, which has an entry per node */
+    index_offset = dfs_alloc(sizeof(dfs_index_header_t) + nodes_count * sizeof(dfs_index_entry_t), SECTOR_SIZE);
+
+    /* Shrink the image if the tail of the old image is not used anymore */
+    if(old_file && holes_count && holes[holes_count-1].offset + holes[holes_count-1].size == fs_size)
+    {
+        fs_size = holes[holes_count-1].offset;
+    }
+
+    if(old_file)
+    {
+        printf("Updated filesystem image: %d files added, %d kept, %d duplicates.\n", added, reused, dedup);
+    }
+    else if(dedup)
+    {
+        printf("Created filesystem image: %d files stored, %d duplicates.\n", added, dedup);
+    }
+
+    free(traced);
+    free(blobs);
+    free(kept);
+}
+
+/* Amount of free space left in the image after layout */
+uint32_t wasted_space(void)
+{
+    uint32_t wasted = 0;
+    for(int i = 0; i < holes_count; i++)
+    {
+        if(holes[i].offset + holes[i].size <= fs_size)
+        {
+            wasted += holes[i].size;
+        }
+    }
+    return wasted;
+}
+
+/* A part of the image to write: a sector, the contents of a file or the index */
+typedef struct
+{
+    uint32_t offset;
+    int node;                           /* Node of the directory entry or file contents, or -1 */
+    bool contents;                      /* True for file contents, false for the directory entry */
+} extent_t;
+
+int extent_cmp_offset(const void *a, const void *b)
+{
+    const extent_t *ea = a, *eb = b;
+    return ea->offset < eb->offset ? -1 : (ea->offset > eb->offset);
+}
+
+/* Write zeros up to the given offset */
+bool write_padding(FILE *fp, uint32_t *pos, uint32_t offset)
+{
+    static const uint8_t zeros[SECTOR_SIZE];
+
+    while(*pos < offset)
+    {
+        uint32_t len = MIN(offset - *pos, SECTOR_SIZE);
+        if(fwrite(zeros, 1, len, fp) != len)
+        {
+            return false;
+        }
+        *pos += len;
+    }
+    return true;
+}
+
+/* Write a buffer at the given offset, which must not precede the current position */
+bool write_at(FILE *fp, uint32_t *pos, uint32_t offset, const void *data, uint32_t size)
+{
+    if(!write_padding(fp, pos, offset) || fwrite(data, 1, size, fp) != size)
+    {
+        return false;
+    }
+    *pos += size;
+    return true;
+}
+
+/* Copy the contents of a file at the given offset, streaming it */
+bool write_file_at(FILE *fp, uint32_t *pos, uint32_t offset, const node_t *node)
+{
+    FILE *in = fopen(node->path, "rb");
+    uint8_t *buf = malloc(COPY_CHUNK_SIZE);
+    bool ok = in && write_padding(fp, pos, offset);
+
+    for(uint32_t done = 0; ok && done < node->size; )
+    {
+        uint32_t len = MIN(node->size - done, COPY_CHUNK_SIZE);
+        ok = fread(buf, 1, len, in) == len && write_at(fp, pos, *pos, buf, len);
+        done += len;
+    }
+
+    free(buf);
+    if(in) { fclose(in); }
+    return ok;
+}
+
+/* Write the path index at the given offset */
+bool write_index_at(FILE *fp, uint32_t *pos, uint32_t offset)
+{
+    uint32_t index_count;
+    dfs_index_entry_t *index_entries = build_index(&index_count);
 
-                if(!first_entry)
+    dfs_index_header_t header = { .magic = SWAPLONG(INDEX_MAGIC), .count = SWAPLONG(index_count) };
+    bool ok = write_at(fp, pos, offset, &header, sizeof(header));
+
+    for(uint32_t i = 0; ok && i < index_count; i++)
+    {
+        dfs_index_entry_t entry = {
+            .hash = SWAPLONG(index_entries[i].hash),
+            .dirent = SWAPLONG(index_entries[i].dirent),
+            .parent = SWAPLONG(index_entries[i].parent),
+        };
+        ok = write_at(fp, pos, *pos, &entry, sizeof(entry));
+    }
+
+    free(index_entries);
+    return ok;
+}
+
+/* Write the image, in offset order. File contents are streamed from the source files. */
+bool write_image_file(FILE *fp)
+{
+    extent_t *extents = malloc((2 * nodes_count + 2) * sizeof(extent_t));
+    int extents_count = 0;
+
+    extents[extents_count++] = (extent_t){ .offset = 0, .node = -1 };
+    extents[extents_count++] = (extent_t){ .offset = index_offset, .node = -1, .contents = true };
+    for(int i = 0; i < nodes_count; i++)
+    {
+        extents[extents_count++] = (extent_t){ .offset = nodes[i].dirent, .node = i };
+        if(!nodes[i].is_dir)
+        {
+            extents[extents_count++] = (extent_t){ .offset = nodes[i].file_pointer, .node = i, .contents = true };
+        }
+    }
+    qsort(extents, extents_count, sizeof(extent_t), extent_cmp_offset);
+
+    uint32_t pos = 0;
+    bool ok = true;
+
+    for(int i = 0; ok && i < extents_count; i++)
+    {
+        extent_t *ext = &extents[i];
+
+        /* Duplicated contents are written once */
+        if(ext->offset < pos)
+        {
+            continue;
+        }
+
+        if(ext->node < 0 && ext->contents)
+        {
+            ok = write_index_at(fp, &pos, ext->offset);
+        }
+        else if(ext->contents)
+        {
+            ok = write_file_at(fp, &pos, ext->offset, &nodes[ext->node]);
+        }
+        else
+        {
+            directory_entry_t entry;
+            memset(&entry, 0, sizeof(entry));
+
+            if(ext->node < 0)
+            {
+                /* Identifier */
+                entry.flags = SWAPLONG(ROOT_FLAGS);
+                entry.next_entry = SWAPLONG(ROOT_NEXT_ENTRY);
+                strcpy(entry.path, ROOT_PATH);
+                entry.file_pointer = SWAPLONG(index_offset);
+            }
+            else
+            {
+                node_t *node = &nodes[ext->node];
+
+                strcpy(entry.path, node->name);
+                entry.next_entry = SWAPLONG(node->next >= 0 ? nodes[node->next].dirent : 0);
+
+                if(node->is_dir)
                 {
-                    /* Return pointer to first file on list */
-                    first_entry = cur_entry;
+                    entry.flags = SWAPLONG(FLAGS_DIR << 28); /* Size doesn't matter for directories */
+                    entry.file_pointer = SWAPLONG(nodes[node->first_child].dirent);
+                }
+                else
+                {
+                    entry.flags = SWAPLONG((FLAGS_FILE << 28) | (node->size & 0x0FFFFFFF));
+                    entry.file_pointer = SWAPLONG(node->file_pointer);
                 }
             }
+
+            ok = write_at(fp, &pos, ext->offset, &entry, sizeof(entry));
         }
-    } while (dp != NULL);
 
-    closedir(dirp);
+        /* Pad to a full sector */
+        ok = ok && write_padding(fp, &pos, SECTOR_ROUND(pos));
+    }
 
-    /* Will return 0 if we don't find any entries (don't support directories without files) */
-    return first_entry;
+    ok = ok && write_padding(fp, &pos, fs_size);
+
+    free(extents);
+    return ok;
 }
 
-int main(int argc, char *argv[])
+/* Write the image to a temporary file, then replace the output with it, so that
+ * an interrupted run never leaves a corrupted image behind. */
+bool write_image(const char * const file)
 {
-    if(argc != 3)
+    char *tmpfile = malloc(strlen(file) + 5);
+    sprintf(tmpfile, "%s.tmp", file);
+
+    FILE *fp = fopen(tmpfile, "wb");
+    bool ok = fp && write_image_file(fp);
+
+    if(fp && fclose(fp) != 0)
     {
-        print_help(argv[0]);
-        return -1;
+        ok = false;
     }
 
-    /* Add in identifier */
-    directory_entry_t *id = sector_to_memory(new_sector());
+#ifdef __MINGW32__
+    /* rename() does not replace existing files on Windows */
+    if(ok)
+    {
+        remove(file);
+    }
+#endif
 
-    if(!id)
+    if(ok && rename(tmpfile, file) != 0)
     {
-        fprintf(stderr, "Out of memory!\n");
+        ok = false;
+    }
+    if(!ok)
+    {
+        remove(tmpfile);
+    }
 
+    free(tmpfile);
+    return ok;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *outfn = NULL, *indir = NULL;
+    bool update = false;
+    int jobs = 0;
+    const char **traces = NULL;
+    int traces_count = 0;
+
+    for(int i = 1; i < argc; i++)
+    {
+        if(argv[i][0] == '-')
+        {
+            if(!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help"))
+            {
+                print_help(argv[0]);
+                return 0;
+            }
+            else if(!strcmp(argv[i], "-v") || !strcmp(argv[i], "--verbose"))
+            {
+                flag_verbose = true;
+            }
+            else if(!strcmp(argv[i], "-u") || !strcmp(argv[i], "--update"))
+            {
+                update = true;
+            }
+            else if(!strcmp(argv[i], "-t") || !strcmp(argv[i], "--trace"))
+            {
+                if(++i == argc)
+                {
+                    fprintf(stderr, "missing argument for %s\n", argv[i-1]);
+                    return -1;
+                }
+                traces = realloc(traces, (traces_count + 1) * sizeof(char *));
+                traces[traces_count++] = argv[i];
+            }
+            else if(!strcmp(argv[i], "-a") || !strcmp(argv[i], "--align"))
+            {
+                char extra;
+                if(++i == argc || sscanf(argv[i], "%u%c", &file_align, &extra) != 1 ||
+                   file_align < SECTOR_SIZE || (file_align & (file_align - 1)))
+                {
+                    fprintf(stderr, "invalid argument for %s\n", argv[i-1]);
+                    return -1;
+                }
+            }
+            else if(!strcmp(argv[i], "-j") || !strcmp(argv[i], "--jobs"))
+            {
+                char extra;
+                if(++i == argc || sscanf(argv[i], "%d%c", &jobs, &extra) != 1 || jobs < 1)
+                {
+                    fprintf(stderr, "invalid argument for %s\n", argv[i-1]);
+                    return -1;
+                }
+            }
+            else
+            {
+                fprintf(stderr, "invalid flag: %s\n", argv[i]);
+                return -1;
+            }
+            continue;
+        }
+
+        if(!outfn) { outfn = argv[i]; }
+        else if(!indir) { indir = argv[i]; }
+        else
+        {
+            print_help(argv[0]);
+            return -1;
+        }
+    }
+
+    if(!outfn || !indir)
+    {
+        print_help(argv[0]);
         return -1;
     }
 
-    id->flags = SWAPLONG(ROOT_FLAGS);
-    id->next_entry = SWAPLONG(ROOT_NEXT_ENTRY);
-    strcpy(id->path, ROOT_PATH);
+    int root = scan_directory(indir, "");
 
-    if(!add_directory(argv[2]))
+    if(root < 0)
     {
         /* Error adding directory */
-        fprintf(stderr, "Error creating filesystem: directory is empty or does not exist: %s\n", argv[2]);
+        fprintf(stderr, "Error creating filesystem: directory is empty or does not exist: %s\n", indir);
 
         kill_fs();
 
         return -1;
     }
 
-    /* Write out filesystem */
-    FILE *fp = fopen(argv[1], "wb");
+    /* Read and hash all the files in parallel */
+    parallel_for(jobs, nodes_count, read_file_job, NULL);
 
-    if(!fp)
+    for(int i = 0; i < nodes_count; i++)
+    {
+        if(nodes[i].error)
+        {
+            fprintf(stderr, "Error creating filesystem: cannot add file: %s\n", nodes[i].path);
+
+            kill_fs();
+
+            return -1;
+        }
+    }
+
+    for(int i = 0; i < traces_count; i++)
+    {
+        if(!load_trace(traces[i]))
+        {
+            fprintf(stderr, "Error creating filesystem: cannot open trace: %s\n", traces[i]);
+
+            kill_fs();
+
+            return -1;
+        }
+    }
+    free(traces);
+
+    if(update && !load_old_image(outfn, jobs) && access(outfn, F_OK) == 0)
+    {
+        fprintf(stderr, "Warning: '%s' is not a valid filesystem image, rebuilding it\n", outfn);
+    }
+
+    layout(root);
+
+    /* If the old layout left too much free space around, start over with a compact image */
+    if(old_file && wasted_space() > fs_size / 4)
+    {
+        printf("Too much free space in updated image, rebuilding it.\n");
+        free(holes);
+        free(old_blobs);
+        holes = NULL;
+        holes_count = 0;
+        old_blobs = NULL;
+        old_blobs_count = 0;
+        old_file = NULL;
+        layout(root);
+    }
+
+    /* Write out filesystem */
+    if(!write_image(outfn))
     {
         /* Error writing file out */
-        fprintf(stderr, "Error opening '%s' for writing.\n", argv[1]);
+        fprintf(stderr, "Error writing '%s'.\n", outfn);
 
         kill_fs();
 
         return -1;
     }
 
-    fwrite(dfs, 1, fs_size, fp);
-    fclose(fp);
-
     kill_fs();
 
     return 0;
@@ -26,6 +26,7 @@ SOFTWARE.
 #include <math.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #ifndef NULL
 #define NULL (0)
@@ -36,12 +37,45 @@ SOFTWARE.
 #define SCALE_B 0.8f
 #define SCALE_A 1.0f
 
+#ifdef EXQ_SIMD
+typedef exq_float exq_float4 __attribute__((vector_size(4*sizeof(exq_float))));
+typedef long long exq_mask4 __attribute__((vector_size(4*sizeof(long long))));
+#endif
+
+/* Copy the palette colors into lut, as used by exq_find_nearest_color. Unused
+   entries are set far away from any color, so that they are never selected. */
+static void exq_update_lut(exq_data *pExq)
+{
+	int i;
+
+	for(i = 0; i < 256; i++)
+	{
+		int used = i < pExq->numColors;
+		pExq->lut[0][i] = used ? pExq->node[i].avg.r : 1e10;
+		pExq->lut[1][i] = used ? pExq->node[i].avg.g : 1e10;
+		pExq->lut[2][i] = used ? pExq->node[i].avg.b : 1e10;
+		pExq->lut[3][i] = used ? pExq->node[i].avg.a : 1e10;
+	}
+}
+
+/* xorshift32, used instead of rand() to make random dithering deterministic
+   and safe to use from multiple threads */
+static int exq_rand(exq_data *pExq)
+{
+	unsigned int x = pExq->rngState;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	pExq->rngState = x;
+	return (int)(x >> 8);
+}
+
 exq_data *exq_init()
 {
 	int i;
 	exq_data *pExq;
 
-	pExq = (exq_data*)malloc(sizeof(exq_data));
+	pExq = (exq_data*)calloc(1, sizeof(exq_data));	/* zeroed: unused nodes must have a defined color */
 	
 	for(i = 0; i < EXQ_HASH_SIZE; i++)
 		pExq->pHash[i] = NULL;
@@ -50,6 +84,7 @@ exq_data *exq_init()
 	pExq->optimized = 0;
 	pExq->transparency = 1;
 	pExq->numBitsPerChannel = 8;
+	pExq->rngState = 0x12345678;
 
 	return pExq;
 }
@@ -420,6 +455,7 @@ void exq_optimize_palette(exq_data *pExq, int iter)
 
 	for(n = 0; n < iter; n++)
 	{
+		exq_update_lut(pExq);
 		for(i = 0; i < pExq->numColors; i++)
 			pExq->node[i].pHistogram = NULL;
 
@@ -445,6 +481,7 @@ void exq_map_image(exq_data *pExq, int nPixels, unsigned char *pIn,
 
 	if(!pExq->optimized)
 		exq_optimize_palette(pExq, 4);
+	exq_update_lut(pExq);
 
 	for(i = 0; i < nPixels; i++)
 	{
@@ -496,6 +533,7 @@ void exq_map_image_dither(exq_data *pExq, int width, int height,
 
 	if(!pExq->optimized)
 		exq_optimize_palette(pExq, 4);
+	exq_update_lut(pExq);
 
 	for(y = 0; y < height; y++)
 		for(x = 0; x < width; x++)
@@ -503,7 +541,7 @@ void exq_map_image_dither(exq_data *pExq, int width, int height,
 			if(ordered)
 				d = (x & 1) + (y & 1) * 2;
 			else
-				d = rand() & 3;
+				d = exq_rand(pExq) & 3;
 			pHist = exq_find_histogram(pExq, pIn);
 			p.r = *pIn++ / 255.0f * SCALE_R;
 			p.g = *pIn++ / 255.0f * SCALE_G;
@@ -602,10 +640,40 @@ unsigned char exq_find_nearest_color(exq_data *pExq, exq_color *pColor)
 {
 	exq_float bestv;
 	int besti, i;
+#ifndef EXQ_SIMD
 	exq_color dif;
+#endif
 
 	bestv = 16;
 	besti = 0;
+#ifdef EXQ_SIMD
+	/* Compute the distance from 4 palette colors at once (lut is padded) */
+	for(i = 0; i < pExq->numColors; i += 4)
+	{
+		exq_float4 r, g, b, a, d;
+		exq_mask4 lt;
+		int j;
+
+		memcpy(&r, &pExq->lut[0][i], sizeof(r));
+		memcpy(&g, &pExq->lut[1][i], sizeof(g));
+		memcpy(&b, &pExq->lut[2][i], sizeof(b));
+		memcpy(&a, &pExq->lut[3][i], sizeof(a));
+		r = pColor->r - r;
+		g = pColor->g - g;
+		b = pColor->b - b;
+		a = pColor->a - a;
+		d = r*r + g*g + b*b + a*a;
+		lt = d < bestv;
+		if(!(lt[0] | lt[1] | lt[2] | lt[3]))
+			continue;
+		for(j = 0; j < 4; j++)
+			if(d[j] < bestv)
+			{
+				bestv = d[j];
+				besti = i + j;
+			}
+	}
+#else
 	for(i = 0; i < pExq->numColors; i++)
 	{
 		dif.r = pColor->r - pExq->node[i].avg.r;
@@ -618,6 +686,7 @@ unsigned char exq_find_nearest_color(exq_data *pExq, exq_color *pColor)
 			besti = i;
 		}
 	}
+#endif
 
 	return (unsigned char)besti;
 }
@@ -696,7 +765,7 @@ exq_float exq_sort_by_a(const exq_histogram *pHist)
 	return pHist->color.a;
 }
 
-exq_color exq_sort_dir;
+__thread exq_color exq_sort_dir;
 
 exq_float exq_sort_by_dir(const exq_histogram *pHist)
 {
@@ -96,6 +96,8 @@ typedef struct _exq_data
 	int						numBitsPerChannel;
 	int						optimized;
 	int						transparency;
+	exq_float				lut[4][256];	/* palette colors as r,g,b,a arrays, for exq_find_nearest_color */
+	unsigned int			rngState;		/* random dithering state (per quantizer, so that it is reproducible) */
 } exq_data;
 
 /* interface */
@@ -141,7 +143,7 @@ exq_float			exq_sort_by_b(const exq_histogram *pHist);
 exq_float			exq_sort_by_a(const exq_histogram *pHist);
 exq_float			exq_sort_by_dir(const exq_histogram *pHist);
 
-extern exq_color	exq_sort_dir;
+extern __thread exq_color	exq_sort_dir;	/* thread-local: quantizers may run in parallel */
 
 #ifdef __cplusplus
 }
@@ -9,8 +9,28 @@
 #include "../common/binout.c"
 #include "../common/binout.h"
 #include "../common/polyfill.h"
+#include "../common/parallel.h"
 #include "exoquant.h"
 
+// Pixel kernels are vectorized using GCC/Clang vector extensions, so that the
+// same code compiles to SSE/AVX/NEON on any host. They must produce output that
+// is byte-identical to the scalar code: build with -DMKSPRITE_NO_SIMD to get
+// the scalar reference and compare.
+#if !defined(MKSPRITE_NO_SIMD) && (defined(__clang__) || __GNUC__ >= 9) && \
+    __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define MKSPRITE_SIMD   1
+#define EXQ_SIMD        1
+typedef uint8_t  u8x8   __attribute__((vector_size(8)));
+typedef uint8_t  u8x16  __attribute__((vector_size(16)));
+typedef uint16_t u16x8  __attribute__((vector_size(16)));
+typedef uint16_t u16x16 __attribute__((vector_size(32)));
+typedef uint32_t u32x4  __attribute__((vector_size(16)));
+typedef uint32_t u32x8  __attribute__((vector_size(32)));
+typedef uint64_t u64x4  __attribute__((vector_size(32)));
+typedef int32_t  i32x16 __attribute__((vector_size(64)));
+typedef float    f32x16 __attribute__((vector_size(64)));
+#endif
+
 #define LODEPNG_NO_COMPILE_ANCILLARY_CHUNKS    // No need to parse PNG extra fields
 #define LODEPNG_NO_COMPILE_CPP                 // No need to use C++ API
 #include "../common/lodepng.h"
@@ -26,6 +46,7 @@
 // Bring in tex_format_t definition
 #include "surface.h"
 #include "sprite.h"
+#include "../../src/atlas_internal.h"
 
 #define FMT_ZBUF   (64 + 0)
 #define FMT_IHQ    (64 + 1)
@@ -35,6 +56,8 @@
 	typeof(n) _n = n; typeof(d) _d = d; \
 	(((_n) + (_d) - 1) / (_d) * (_d)); \
 })
+#define MIN(a, b) ({ typeof(a) _a = a; typeof(b) _b = b; _a < _b ? _a : _b; })
+#define MAX(a, b) ({ typeof(a) _a = a; typeof(b) _b = b; _a > _b ? _a : _b; })
 
 const char* tex_format_name(tex_format_t fmt) {
     switch ((int)fmt) {
@@ -121,7 +144,9 @@ typedef struct {
         bool         use_main_tex;
         bool         enabled;
     } detail;
-
+    const char *atlas;      // Name of the atlas to create (NULL if not in atlas mode)
+    int atlas_width;        // Maximum width of an atlas page
+    int atlas_height;       // Maximum height of an atlas page
 } parms_t;
 
 
@@ -151,6 +176,7 @@ void print_args( char * name )
     fprintf(stderr, "   -D/--dither <dither>  Dithering algorithm (default: NONE)\n");
     fprintf(stderr, "   -c/--compress <level> Compress output files (default: %d)\n", DEFAULT_COMPRESSION);
     fprintf(stderr, "   -d/--debug            Dump computed images (eg: mipmaps) as PNG files in output directory\n");
+    fprintf(stderr, "   -j/--jobs <n>         Number of files converted in parallel (default: number of CPUs)\n");
     fprintf(stderr, "\nSampling flags:\n");
     fprintf(stderr, "   --texparms <x,s,r,m>          Sampling parameters:\n");
     fprintf(stderr, "                                 x=translation, s=scale, r=repetitions, m=mirror\n");
@@ -162,6 +188,9 @@ void print_args( char * name )
     fprintf(stderr, "                                         <fmt> is the output format (default: AUTO)\n");
     fprintf(stderr, "                                         <factor> is the blend factor in range 0..1 (default: 0.5)\n");
     fprintf(stderr, "   --detail-texparms <x,x,s,s,r,r,m,m>   Sampling parameters for the detail texture\n");
+    fprintf(stderr, "\nAtlas flags:\n");
+    fprintf(stderr, "   --atlas <name>                Pack all input files into an atlas: <name>.atlas (index) + <name>.N.sprite (pages)\n");
+    fprintf(stderr, "   --atlas-size <w,h>            Maximum size of an atlas page (default: 256,256)\n");
     fprintf(stderr, "\n");
     print_supported_formats();
     print_supported_mipmap();
@@ -289,12 +318,12 @@ bool load_png_image(const char *infn, tex_format_t fmt, image_t *imgout, palette
     // Try first inspecting the extension
     if (fmt == FMT_NONE) {
         // Check the filename string if it contains a texformat for output
-        char *fntok = strdup(infn);
-        char *sect = strtok(fntok, ".");
+        char *fntok = strdup(infn), *saveptr;
+        char *sect = strtok_r(fntok, ".", &saveptr);
         while (sect) {
             fmt = tex_format_from_name(sect);
             if (fmt != FMT_NONE) break;
-            sect = strtok(NULL, ".");
+            sect = strtok_r(NULL, ".", &saveptr);
         }
         if (fmt != FMT_NONE) {
             if (flag_verbose)
@@ -500,11 +529,43 @@ bool spritemaker_fit_tmem(spritemaker_t *spr, int *out_tmem_usage)
     return tmem_usage <= 4096;
 }
 
+// Average 2x2 blocks of RGBA32 pixels from two rows into a row of new_width pixels
+static void shrink_box_2x2(const uint8_t *src1, const uint8_t *src2, uint8_t *dst, int new_width) {
+    int x = 0;
+#if MKSPRITE_SIMD
+    // Each 64-bit lane holds two horizontally adjacent pixels. Components are
+    // split into 16-bit fields (even and odd bytes) so that the sum of four
+    // of them cannot overflow, then the two pixels of the lane are folded.
+    const uint64_t mask = 0x00FF00FF00FF00FFull;
+    for (; x+4 <= new_width; x+=4) {
+        u64x4 a, b;
+        memcpy(&a, src1 + x*8, sizeof(a));
+        memcpy(&b, src2 + x*8, sizeof(b));
+        u64x4 lo = (a & mask) + (b & mask);
+        u64x4 hi = ((a >> 8) & mask) + ((b >> 8) & mask);
+        lo = ((lo + (lo >> 32)) >> 2) & mask;
+        hi = ((hi + (hi >> 32)) >> 2) & mask;
+        u32x4 px = __builtin_convertvector(lo | (hi << 8), u32x4);
+        memcpy(dst + x*4, &px, sizeof(px));
+    }
+#endif
+    for (; x<new_width; x++) {
+        const uint8_t *s1 = src1 + x*8, *s2 = src2 + x*8;
+        for (int c=0; c<4; c++)
+            dst[x*4+c] = (s1[c] + s1[c+4] + s2[c] + s2[c+4]) / 4;
+    }
+}
+
 static uint8_t *image_shrink_box(uint8_t *src, int width, int height, bool half_w, bool half_h) {
     int new_width = half_w ? width/2 : width;
     int new_height = half_h ? height/2 : height;
     uint8_t *imgdst = malloc(new_width * new_height * 4);
     int wstep = half_w ? 8 : 4;
+    if (half_w && half_h) {
+        for (int y=0; y<new_height; y++)
+            shrink_box_2x2(src + y*2*width*4, src + (y*2+1)*width*4, imgdst + y*new_width*4, new_width);
+        return imgdst;
+    }
     for (int y=0; y<new_height; y++) {
         uint8_t *src1, *src2, *src3, *src4;
         if (half_h) {
@@ -559,19 +620,7 @@ bool spritemaker_calc_lods(spritemaker_t *spr, int algo) {
         uint8_t *mipmap = NULL;
         switch (prev->ct) {
         case LCT_RGBA:
-            mipmap = malloc(mw * mh * 4);
-            for (int y=0;y<mh;y++) {
-                uint8_t *src1 = prev->image + y*prev->width*4*2;
-                uint8_t *src2 = src1 + prev->width*4;
-                uint8_t *dst = mipmap + y*mw*4;
-                for (int x=0;x<mw;x++) {
-                    dst[0] = (src1[0] + src1[4] + src2[0] + src2[4]) / 4;
-                    dst[1] = (src1[1] + src1[5] + src2[1] + src2[5]) / 4;
-                    dst[2] = (src1[2] + src1[6] + src2[2] + src2[6]) / 4;
-                    dst[3] = (src1[3] + src1[7] + src2[3] + src2[7]) / 4;
-                    dst += 4; src1 += 8; src2 += 8;
-                }
-            }
+            mipmap = image_shrink_box(prev->image, prev->width, prev->height, true, true);
             break;
         case LCT_GREY:
             assert(prev->fmt == FMT_I8);  // only I8 supported for now
@@ -724,6 +773,27 @@ static uint8_t ihq_calc_best_i4(float ifactor, uint8_t r0, uint8_t g0, uint8_t b
     // will give the closest value to (y0, u0, v0).
     uint8_t best_i = 0;
     float best_err = 999999;
+#if MKSPRITE_SIMD
+    // Evaluate all 16 candidates at once, with the same operations (and
+    // rounding) of the scalar loop below.
+    const f32x16 steps = { 0, 16, 32, 48, 64, 80, 96, 112, 128, 144, 160, 176, 192, 208, 224, 240 };
+    f32x16 ii = steps * ifactor;
+    f32x16 ri = __builtin_convertvector(__builtin_convertvector(rf+ii, i32x16), f32x16);
+    f32x16 gi = __builtin_convertvector(__builtin_convertvector(gf+ii, i32x16), f32x16);
+    f32x16 bi = __builtin_convertvector(__builtin_convertvector(bf+ii, i32x16), f32x16);
+
+    f32x16 ydiff = (0.299f*ri     + 0.587f*gi   + 0.114f*bi) - y0;
+    f32x16 udiff = (-0.14713f*ri  - 0.28886f*gi + 0.436f*bi) - u0;
+    f32x16 vdiff = (0.615f*ri     - 0.51499f*gi - 0.10001f*bi) - v0;
+    f32x16 errs = ydiff*ydiff + udiff*udiff + vdiff*vdiff;
+
+    for (int i=0; i<16; i++) {
+        if (errs[i] < best_err) {
+            best_err = errs[i];
+            best_i = i*16;
+        }
+    }
+#else
     for (int i=0; i<256; i+=16) {
         float ii = i*ifactor;
         int ri = rf+ii;
@@ -745,6 +815,7 @@ static uint8_t ihq_calc_best_i4(float ifactor, uint8_t r0, uint8_t g0, uint8_t b
             best_i = i;
         }
     }
+#endif
 
     *err = best_err;
     return best_i;
@@ -810,7 +881,7 @@ bool spritemaker_convert_ihq(spritemaker_t *spr) {
             for (int y=0; y<height; y++) {
                 float yy = y * hstep;
                 int yy0 = (int)yy;
-                int yy1 = yy0+1;
+                int yy1 = MIN(yy0+1, ih-1);
                 float yyf = yy - yy0;
 
                 for (int x=0; x<width; x++) {
@@ -820,7 +891,7 @@ bool spritemaker_convert_ihq(spritemaker_t *spr) {
 
                     float xx = x * wstep;
                     int xx0 = (int)xx;
-                    int xx1 = xx0+1;
+                    int xx1 = MIN(xx0+1, iw-1);
                     float xxf = xx - xx0;
 
                     uint8_t rm0 = img[(yy0*iw + xx0)*4 + 0];
@@ -910,6 +981,81 @@ bool spritemaker_convert_ihq(spritemaker_t *spr) {
     return true;
 }
 
+// Convert RGBA32 pixels to big-endian RGBA16 (5551)
+static void pack_rgba16(const uint8_t *src, uint8_t *dst, int npixels) {
+    int i = 0;
+#if MKSPRITE_SIMD
+    for (; i+8 <= npixels; i+=8) {
+        u32x8 p; memcpy(&p, src + i*4, sizeof(p));
+        u32x8 a = (u32x8)((p >> 24) != 0) & 1;
+        u32x8 v = (((p >> 3) & 0x1F) << 11) | (((p >> 11) & 0x1F) << 6) | (((p >> 19) & 0x1F) << 1) | a;
+        u16x8 be = __builtin_convertvector((v >> 8) | ((v & 0xFF) << 8), u16x8);
+        memcpy(dst + i*2, &be, sizeof(be));
+    }
+#endif
+    for (; i<npixels; i++) {
+        const uint8_t *px = src + i*4;
+        uint16_t v = conv_rgb5551(px[0], px[1], px[2], px[3]);
+        dst[i*2+0] = v >> 8;
+        dst[i*2+1] = v & 0xFF;
+    }
+}
+
+// Pack pairs of bytes (a,b) into (a & 0xF0) | (b >> 4). Used for IA8 (I,A) and I4 (I0,I1)
+static void pack_nibbles(const uint8_t *src, uint8_t *dst, int npairs) {
+    int i = 0;
+#if MKSPRITE_SIMD
+    for (; i+16 <= npairs; i+=16) {
+        u16x16 q; memcpy(&q, src + i*2, sizeof(q));
+        u8x16 v = __builtin_convertvector((q & 0xF0) | (q >> 12), u8x16);
+        memcpy(dst + i, &v, sizeof(v));
+    }
+#endif
+    for (; i<npairs; i++)
+        dst[i] = (src[i*2+0] & 0xF0) | (src[i*2+1] >> 4);
+}
+
+// Pack pairs of 4-bit palette indices (ix0,ix1) into (ix0 << 4) | ix1 (CI4)
+static void pack_ci4(const uint8_t *src, uint8_t *dst, int npairs) {
+    int i = 0;
+#if MKSPRITE_SIMD
+    u16x16 bad = {0};
+    for (; i+16 <= npairs; i+=16) {
+        u16x16 q; memcpy(&q, src + i*2, sizeof(q));
+        bad |= q;
+        u8x16 v = __builtin_convertvector(((q << 4) & 0xF0) | (q >> 8), u8x16);
+        memcpy(dst + i, &v, sizeof(v));
+    }
+    for (int j=0; j<16; j++)
+        assert((bad[j] & 0xF0F0) == 0);
+#endif
+    for (; i<npairs; i++) {
+        uint8_t ix0 = src[i*2+0], ix1 = src[i*2+1];
+        assert(ix0 < 16 && ix1 < 16);
+        dst[i] = (uint8_t)((ix0 << 4) | ix1);
+    }
+}
+
+// Pack pairs of IA pixels (I0,A0,I1,A1) into IA4 (3 bit intensity, 1 bit alpha)
+static void pack_ia4(const uint8_t *src, uint8_t *dst, int npairs) {
+    int i = 0;
+#if MKSPRITE_SIMD
+    for (; i+8 <= npairs; i+=8) {
+        u32x8 p; memcpy(&p, src + i*4, sizeof(p));
+        u32x8 a0 = (u32x8)((p & 0xFF00) != 0) & 0x10;
+        u32x8 a1 = (u32x8)((p >> 24) != 0) & 0x01;
+        u32x8 v = (p & 0xE0) | a0 | ((p >> 20) & 0x0E) | a1;
+        u8x8 v8 = __builtin_convertvector(v, u8x8);
+        memcpy(dst + i, &v8, sizeof(v8));
+    }
+#endif
+    for (; i<npairs; i++) {
+        const uint8_t *px = src + i*4;
+        uint8_t A0 = px[1] ? 1 : 0, A1 = px[3] ? 1 : 0;
+        dst[i] = (uint8_t)((px[0] & 0xE0) | (A0 << 4) | ((px[2] & 0xE0) >> 4) | A1);
+    }
+}
+
 bool spritemaker_write(spritemaker_t *spr) {
     FILE *out;
     if (strcmp(spr->outfn, "(stdout)") == 0) {
@@ -958,68 +1104,66 @@ bool spritemaker_write(spritemaker_t *spr) {
         case FMT_RGBA16: {
             assert(image->ct == LCT_RGBA);
             // Convert to 16-bit RGB5551 format.
-            uint8_t *img = image->image;
-            for (int i=0;i<image->width*image->height;i++) {
-                w16(out, conv_rgb5551(img[0], img[1], img[2], img[3]));
-                img += 4;
-            }
-            break;
-        }
-
-        case FMT_CI4: {
-            assert(image->ct == LCT_PALETTE);
-            assert(spr->palette.used_colors <= 16);
-            // Convert image to 4 bit.
-            uint8_t *img = image->image;
-            for (int j=0; j<image->height; j++) {
-                for (int i=0; i<image->width; i+=2) {
-                    uint8_t ix0 = *img++;
-                    uint8_t ix1 = (i+1 == image->width) ? 0 : *img++;
-                    assert(ix0 < 16 && ix1 < 16);
-                    w8(out, (uint8_t)((ix0 << 4) | ix1));
-                }
-            }
+            int npixels = image->width*image->height;
+            uint8_t *buf = malloc(npixels*2);
+            pack_rgba16(image->image, buf, npixels);
+            fwrite(buf, 1, npixels*2, out);
+            free(buf);
             break;
         }
 
-        case FMT_IA8: {
-            assert(image->ct == LCT_GREY_ALPHA);
-            uint8_t *img = image->image;
-            for (int i=0; i<image->width*image->height; i++) {
-                uint8_t I = *img++; uint8_t A = *img++;
-                w8(out, (uint8_t)((I & 0xF0) | (A >> 4)));
+        case FMT_CI4:
+        case FMT_I4:
+        case FMT_IA4: {
+            // 4-bit formats: pack two pixels per byte, padding odd rows with zero.
+            int bpp = image->fmt == FMT_IA4 ? 2 : 1;
+            int pitch = (image->width+1)/2;
+            uint8_t *buf = malloc(pitch*image->height);
+            uint8_t last[4] = {0};
+            if (image->fmt == FMT_CI4) {
+                assert(image->ct == LCT_PALETTE);
+                assert(spr->palette.used_colors <= 16);
+            } else if (image->fmt == FMT_I4) {
+                assert(image->ct == LCT_GREY);
+            } else {
+                // IA4 is 3 bit intensity and 1 bit alpha.
+                assert(image->ct == LCT_GREY_ALPHA);
             }
-            break;
-        }
-
-        case FMT_I4: {
-            assert(image->ct == LCT_GREY);
-            uint8_t *img = image->image;
             for (int j=0; j<image->height; j++) {
-                for (int i=0; i<image->width; i+=2) {
-                    uint8_t I0 = *img++;
-                    uint8_t I1 = (i+1 == image->width) ? 0 : *img++;
-                    w8(out, (uint8_t)((I0 & 0xF0) | (I1 >> 4)));
+                const uint8_t *src = image->image + j*image->width*bpp;
+                uint8_t *dst = buf + j*pitch;
+                int npairs = image->width/2;
+                if (image->width & 1) {
+                    // Last pixel of the row is paired with a zero pixel
+                    memcpy(last, src + npairs*2*bpp, bpp);
+                }
+                switch ((int)image->fmt) {
+                case FMT_CI4:
+                    pack_ci4(src, dst, npairs);
+                    if (image->width & 1) pack_ci4(last, dst+npairs, 1);
+                    break;
+                case FMT_I4:
+                    pack_nibbles(src, dst, npairs);
+                    if (image->width & 1) pack_nibbles(last, dst+npairs, 1);
+                    break;
+                case FMT_IA4:
+                    pack_ia4(src, dst, npairs);
+                    if (image->width & 1) pack_ia4(last, dst+npairs, 1);
+                    break;
                 }
             }
+            fwrite(buf, 1, pitch*image->height, out);
+            free(buf);
             break;
         }
 
-        case FMT_IA4: {
+        case FMT_IA8: {
             assert(image->ct == LCT_GREY_ALPHA);
-            // IA4 is 3 bit intensity and 1 bit alpha. Pack it
-            uint8_t *img = image->image;
-            for (int j=0; j<image->height; j++) {
-                for (int i=0; i<image->width; i+=2) {
-                    uint8_t I0 = *img++;
-                    uint8_t A0 = *img++;
-                    uint8_t I1 = (i+1 == image->width) ? 0 : *img++;
-                    uint8_t A1 = (i+1 == image->width) ? 0 : *img++;
-                    A0 = A0 ? 1 : 0;
-                    A1 = A1 ? 1 : 0;
-                    w8(out, (uint8_t)((I0 & 0xE0) | (A0 << 4) | ((I1 & 0xE0) >> 4) | A1));
-                }
-            }
+            int npixels = image->width*image->height;
+            uint8_t *buf = malloc(npixels);
+            pack_nibbles(image->image, buf, npixels);
+            fwrite(buf, 1, npixels, out);
+            free(buf);
             break;
         }
 
@@ -1319,6 +1463,368 @@ error:
     return 1;
 }
 
+void compress_output(const char *outfn, int compression)
+{
+    if (compression == -1)
+        compression = DEFAULT_COMPRESSION;
+    if (compression) {
+        struct stat st_decomp = {0}, st_comp = {0};
+        stat(outfn, &st_decomp);
+        asset_compress(outfn, outfn, compression, 0);
+        stat(outfn, &st_comp);
+        if (flag_verbose)
+            fprintf(stderr, "compressed: %s (%d -> %d, ratio %.1f%%)\n", outfn,
+            (int)st_decomp.st_size, (int)st_comp.st_size, 100.0 * (float)st_comp.st_size / (float)(st_decomp.st_size == 0 ? 1 :st_decomp.st_size));
+    }
+}
+
+typedef struct {
+    char *name;             // Name of the image (filename without directory and extension)
+    image_t img;            // Pixels
+    int page;               // Page where the image was placed
+    int x, y;               // Position of the image in the page
+    bool loaded;            // True if the image was decoded successfully
+} atlas_item_t;
+
+typedef struct {
+    int x, y, w;            // A horizontal segment of the skyline
+} skyline_node_t;
+
+typedef struct {
+    skyline_node_t *nodes;  // Skyline (sorted by x, covering the whole page width)
+    int num_nodes;          // Number of nodes in the skyline
+    int used_w, used_h;     // Bounding box of the placed images
+} atlas_page_t;
+
+/**
+ * @brief Find the best position for a rectangle in a page (skyline bottom-left)
+ * 
+ * @return The index of the skyline node where the rectangle must be placed
+ *         (with its Y coordinate in *out_y), or -1 if it does not fit.
+ */
+static int skyline_find(atlas_page_t *page, int w, int h, int page_w, int page_h, int *out_y)
+{
+    int best = -1, best_y = 0, best_waste = 0;
+    for (int i=0; i<page->num_nodes; i++) {
+        int x = page->nodes[i].x;
+        if (x + w > page_w) break;
+
+        // The rectangle lies on the highest segment it spans
+        int y = 0, waste = 0;
+        for (int j=i, left=w; left > 0; j++) {
+            if (page->nodes[j].y > y) y = page->nodes[j].y;
+            left -= page->nodes[j].w;
+        }
+        if (y + h > page_h) continue;
+        for (int j=i, left=w; left > 0; j++) {
+            int span = MIN(left, page->nodes[j].w);
+            waste += (y - page->nodes[j].y) * span;
+            left -= span;
+        }
+
+        // Prefer the lowest position, then the one that wastes less space
+        if (best == -1 || y + h < best_y + h || (y == best_y && waste < best_waste)) {
+            best = i; best_y = y; best_waste = waste;
+        }
+    }
+    *out_y = best_y;
+    return best;
+}
+
+/** @brief Place a rectangle in a page at the position returned by #skyline_find */
+static void skyline_place(atlas_page_t *page, int idx, int w, int h, int y)
+{
+    int x = page->nodes[idx].x;
+
+    // Remove the nodes covered by the new rectangle. The last one might be
+    // covered only partially, so it is shrunk instead.
+    int end = idx;
+    int left = w;
+    while (left > 0 && end < page->num_nodes) {
+        if (page->nodes[end].w <= left) {
+            left -= page->nodes[end].w;
+            end++;
+        } else {
+            page->nodes[end].x += left;
+            page->nodes[end].w -= left;
+            left = 0;
+        }
+    }
+    int removed = end - idx;
+    memmove(&page->nodes[idx+1], &page->nodes[end], (page->num_nodes - end) * sizeof(skyline_node_t));
+    page->num_nodes += 1 - removed;
+    page->nodes[idx] = (skyline_node_t){ x, y + h, w };
+
+    // Merge adjacent nodes at the same height
+    for (int i=0; i<page->num_nodes-1; i++) {
+        if (page->nodes[i].y == page->nodes[i+1].y) {
+            page->nodes[i].w += page->nodes[i+1].w;
+            memmove(&page->nodes[i+1], &page->nodes[i+2], (page->num_nodes - i - 2) * sizeof(skyline_node_t));
+            page->num_nodes--;
+            i--;
+        }
+    }
+
+    page->used_w = MAX(page->used_w, x + w);
+    page->used_h = MAX(page->used_h, y + h);
+}
+
+static atlas_item_t *sort_items;
+
+/** @brief qsort comparator for image indices: taller images first, then wider */
+static int atlas_cmp_items(const void *a, const void *b)
+{
+    const image_t *ia = &sort_items[*(const int*)a].img, *ib = &sort_items[*(const int*)b].img;
+    if (ia->height != ib->height) return ib->height - ia->height;
+    if (ia->width != ib->width) return ib->width - ia->width;
+    return *(const int*)a - *(const int*)b;
+}
+
+/** @brief Bytes per pixel of an image loaded by load_png_image */
+static int image_bpp(const image_t *img)
+{
+    switch (img->ct) {
+    case LCT_RGBA: return 4;
+    case LCT_GREY_ALPHA: return 2;
+    case LCT_GREY: return 1;
+    case LCT_PALETTE: return 1;
+    default: assert(0); return 0;
+    }
+}
+
+typedef struct {
+    const char **infns;
+    atlas_item_t *items;
+    tex_format_t fmt;
+} atlas_load_t;
+
+static void atlas_load_job(void *ctx, int idx)
+{
+    atlas_load_t *load = ctx;
+    palette_t pal;
+    load->items[idx].loaded = load_png_image(load->infns[idx], load->fmt, &load->items[idx].img, &pal);
+}
+
+int convert_atlas(const char **infns, int num_files, const char *outdir, const parms_t *pm, int compression, int num_jobs)
+{
+    int page_w = pm->atlas_width ? pm->atlas_width : 256;
+    int page_h = pm->atlas_height ? pm->atlas_height : 256;
+
+    // All images in the atlas must share the same format. Autodetection per
+    // image would not work, so default to RGBA16 as for RGB images.
+    tex_format_t fmt = pm->outfmt;
+    if (fmt == FMT_NONE) fmt = FMT_RGBA16;
+    if (fmt == FMT_IHQ || fmt == FMT_ZBUF || fmt == FMT_YUV16) {
+        fprintf(stderr, "ERROR: format %s is not supported in atlas mode\n", tex_format_name(fmt));
+        return 1;
+    }
+    if (pm->mipmap_algo != MIPMAP_ALGO_NONE || pm->detail.enabled) {
+        fprintf(stderr, "ERROR: mipmaps and detail textures are not supported in atlas mode\n");
+        return 1;
+    }
+    if (num_files > ATLAS_MAX_ENTRIES) {
+        fprintf(stderr, "ERROR: too many images for an atlas (%d, max %d)\n", num_files, ATLAS_MAX_ENTRIES);
+        return 1;
+    }
+
+    // Color-indexed pages are quantized as a whole (each page has its own palette),
+    // so load images as RGBA.
+    bool is_ci = fmt == FMT_CI4 || fmt == FMT_CI8;
+    tex_format_t load_fmt = is_ci ? FMT_RGBA32 : fmt;
+    // Keep 4bpp images byte-aligned in the page, so that they can be uploaded
+    // without touching the pixels of the neighbours.
+    int align = TEX_FORMAT_BITDEPTH(fmt) == 4 ? 2 : 1;
+
+    int ret = 1;
+    int num_pages = 0;
+    atlas_page_t *pages = NULL;
+    atlas_item_t *items = calloc(num_files, sizeof(atlas_item_t));
+    int *order = malloc(num_files * sizeof(int));
+
+    // The hash table of the index has at least twice the slots of the
+    // images, to keep the probe sequences short.
+    int hash_size = 1;
+    while (hash_size < num_files*2) hash_size *= 2;
+    assert(hash_size <= 0x8000);
+    uint16_t *table = malloc(hash_size * sizeof(uint16_t));
+    for (int i=0; i<hash_size; i++) table[i] = ATLAS_EMPTY_SLOT;
+
+    // Decode all the images in parallel
+    atlas_load_t load = { .infns = infns, .items = items, .fmt = load_fmt };
+    parallel_for(num_jobs, num_files, atlas_load_job, &load);
+
+    for (int i=0; i<num_files; i++) {
+        if (!items[i].loaded)
+            goto end;
+
+        const char *basename = strrchr(infns[i], '/');
+        basename = basename ? basename+1 : infns[i];
+        items[i].name = strdup(basename);
+        char *ext = strrchr(items[i].name, '.');
+        if (ext) *ext = '\0';
+
+        // Insert the image in the hash table, rejecting duplicate names
+        int slot = atlas_hash(items[i].name) & (hash_size-1);
+        while (table[slot] != ATLAS_EMPTY_SLOT) {
+            if (!strcmp(items[i].name, items[table[slot]].name)) {
+                fprintf(stderr, "ERROR: duplicate image name in atlas: %s (%s and %s)\n",
+                    items[i].name, infns[table[slot]], infns[i]);
+                goto end;
+            }
+            slot = (slot + 1) & (hash_size-1);
+        }
+        table[slot] = i;
+        if (items[i].img.width > page_w || items[i].img.height > page_h) {
+            fprintf(stderr, "ERROR: image %s (%dx%d) is larger than the atlas page size (%dx%d)\n",
+                infns[i], items[i].img.width, items[i].img.height, page_w, page_h);
+            goto end;
+        }
+        if (calc_tmem_usage(fmt, items[i].img.width, items[i].img.height) > (is_ci || fmt == FMT_RGBA32 ? 2048 : 4096))
+            fprintf(stderr, "WARNING: image %s (%dx%d) does not fit TMEM in format %s\n",
+                infns[i], items[i].img.width, items[i].img.height, tex_format_name(fmt));
+        order[i] = i;
+    }
+
+    // Pack the tallest images first, which gives good results with the skyline algorithm
+    sort_items = items;
+    qsort(order, num_files, sizeof(int), atlas_cmp_items);
+
+    for (int k=0; k<num_files; k++) {
+        atlas_item_t *item = &items[order[k]];
+        int w = ROUND_UP(item->img.width, align), h = item->img.height;
+
+        // Place the image in the first page where it fits, or open a new page
+        int p, node = -1, y = 0;
+        for (p=0; p<num_pages; p++) {
+            node = skyline_find(&pages[p], w, h, page_w, page_h, &y);
+            if (node >= 0) break;
+        }
+        if (p == num_pages) {
+            if (num_pages == 255) {
+                fprintf(stderr, "ERROR: too many atlas pages\n");
+                goto end;
+            }
+            pages = realloc(pages, (num_pages+1) * sizeof(atlas_page_t));
+            pages[p] = (atlas_page_t){ .nodes = malloc((num_files+1) * sizeof(skyline_node_t)), .num_nodes = 1 };
+            pages[p].nodes[0] = (skyline_node_t){ 0, 0, page_w };
+            num_pages++;
+            node = skyline_find(&pages[p], w, h, page_w, page_h, &y);
+            assert(node >= 0);
+        }
+        item->page = p;
+        item->x = pages[p].nodes[node].x;
+        item->y = y;
+        skyline_place(&pages[p], node, w, h, y);
+
+        if (flag_verbose)
+            fprintf(stderr, "atlas: %s (%dx%d) -> page %d at %d,%d\n", item->name, item->img.width, item->img.height, p, item->x, item->y);
+    }
+
+    // Compose and write the pages. Each page is shrunk to the area actually used.
+    for (int p=0; p<num_pages; p++) {
+        const image_t *ref = &items[0].img;
+        int bpp = image_bpp(ref);
+        int width = ROUND_UP(pages[p].used_w, align), height = pages[p].used_h;
+
+        spritemaker_t spr = {0};
+        spr.images[0] = (image_t){
+            .image = calloc(width * height, bpp),
+            .width = width, .height = height,
+            .fmt = fmt, .ct = ref->ct,
+        };
+        for (int i=0; i<num_files; i++) {
+            if (items[i].page != p) continue;
+            for (int y=0; y<items[i].img.height; y++)
+                memcpy(spr.images[0].image + ((items[i].y + y) * width + items[i].x) * bpp,
+                       items[i].img.image + y * items[i].img.width * bpp,
+                       items[i].img.width * bpp);
+        }
+
+        spr.texparms.s.repeats = 1;
+        spr.texparms.t = spr.texparms.s;
+        // Atlas pages are not sliced sprites: images are looked up by name
+        spr.hslices = 1;
+        spr.vslices = 1;
+
+        char *outfn;
+        asprintf(&outfn, "%s/%s.%d.sprite", outdir, pm->atlas, p);
+        spr.outfn = outfn;
+        if (flag_verbose)
+            fprintf(stderr, "atlas: writing page %d (%dx%d, %s): %s\n", p, width, height, tex_format_name(fmt), outfn);
+
+        bool ok = (!is_ci || spritemaker_quantize(&spr, NULL, fmt == FMT_CI8 ? 256 : 16, pm->dither_algo))
+               && spritemaker_write(&spr);
+        if (ok && flag_debug)
+            spritemaker_write_pngs(&spr);
+        spritemaker_free(&spr);
+        if (ok) compress_output(outfn, compression);
+        free(outfn);
+        if (!ok) goto end;
+    }
+
+    // Write the index. All the offsets and indices are 16-bit.
+    int names_size = 0;
+    for (int i=0; i<num_files; i++)
+        names_size += strlen(items[i].name) + 1;
+    if (names_size > 0xFFFF) {
+        fprintf(stderr, "ERROR: image names are too long for an atlas\n");
+        goto end;
+    }
+
+    char *outfn;
+    asprintf(&outfn, "%s/%s.atlas", outdir, pm->atlas);
+    FILE *out = fopen(outfn, "wb");
+    if (!out) {
+        fprintf(stderr, "ERROR: cannot open output file %s\n", outfn);
+        free(outfn);
+        goto end;
+    }
+    fwrite(ATLAS_ID, 1, 4, out);
+    w8(out, ATLAS_FILE_VERSION);
+    w8(out, num_pages);
+    w16(out, num_files);
+    w16(out, hash_size);
+    w16(out, 0);
+    w32(out, names_size);
+    for (int i=0, name_offset=0; i<num_files; i++) {
+        assert(name_offset < names_size);
+        w32(out, atlas_hash(items[i].name));
+        w16(out, name_offset);
+        w8(out, items[i].page);
+        w8(out, 0);
+        w16(out, items[i].x);
+        w16(out, items[i].y);
+        w16(out, items[i].img.width);
+        w16(out, items[i].img.height);
+        name_offset += strlen(items[i].name) + 1;
+    }
+    for (int i=0; i<hash_size; i++) {
+        assert(table[i] == ATLAS_EMPTY_SLOT || table[i] < num_files);
+        w16(out, table[i]);
+    }
+    for (int i=0; i<num_files; i++)
+        fwrite(items[i].name, 1, strlen(items[i].name) + 1, out);
+    fclose(out);
+
+    if (flag_verbose)
+        fprintf(stderr, "atlas: %d images in %d pages: %s\n", num_files, num_pages, outfn);
+    free(outfn);
+    ret = 0;
+
+end:
+    for (int p=0; p<num_pages; p++)
+        free(pages[p].nodes);
+    free(pages);
+    for (int i=0; i<num_files; i++) {
+        free(items[i].name);
+        free(items[i].img.image);
+    }
+    free(items);
+    free(order);
+    free(table);
+    return ret;
+}
+
 bool cli_parse_texparms(const char *opt, texparms_t *parms)
 {
     char extra;
@@ -1359,11 +1865,30 @@ bool cli_parse_texparms(const char *opt, texparms_t *parms)
 }
 
 
+typedef struct {
+    const char *infn;       // Input file
+    char *outfn;            // Output file
+    parms_t pm;             // Conversion parameters
+    int compression;        // Compression level
+    bool ok;                // True if the conversion succeeded
+} convert_job_t;
+
+static void convert_job(void *ctx, int idx)
+{
+    convert_job_t *job = &((convert_job_t*)ctx)[idx];
+    job->ok = convert(job->infn, job->outfn, &job->pm) == 0;
+    if (job->ok)
+        compress_output(job->outfn, job->compression);
+}
+
 int main(int argc, char *argv[])
 {
     char *infn = NULL, *outdir = ".", *outfn = NULL;
     parms_t pm = {0}; int compression = -1;
     bool at_least_one_file = false;
+    char **atlas_files = NULL; int num_atlas_files = 0;
+    convert_job_t *jobs = NULL; int njobs = 0;
+    int num_jobs = parallel_cpu_count();
 
     if (argc < 2) {
         print_args(argv[0]);
@@ -1571,6 +2096,45 @@ int main(int argc, char *argv[])
                     return 1;
             }
             
+            /* ---------------- JOBS console argument ------------------- */
+            /* -j/--jobs <n>            Number of files converted in parallel             */
+            else if (!strcmp(argv[i], "-j") || !strcmp(argv[i], "--jobs")) {
+                if (++i == argc) {
+                    fprintf(stderr, "missing argument for %s\n", argv[i-1]);
+                    return 1;
+                }
+                char extra;
+                if (sscanf(argv[i], "%d%c", &num_jobs, &extra) != 1 || num_jobs < 1) {
+                    fprintf(stderr, "invalid argument for %s: %s\n", argv[i-1], argv[i]);
+                    return 1;
+                }
+            }
+
+            /* ---------------- ATLAS console argument ------------------- */
+            /* --atlas <name>           Pack all input files into an atlas             */
+            else if (!strcmp(argv[i], "--atlas")) {
+                if (++i == argc) {
+                    fprintf(stderr, "missing argument for %s\n", argv[i-1]);
+                    return 1;
+                }
+                pm.atlas = argv[i];
+            }
+
+            /* ---------------- ATLAS SIZE console argument ------------------- */
+            /* --atlas-size <w,h>       Maximum size of an atlas page             */
+            else if (!strcmp(argv[i], "--atlas-size")) {
+                if (++i == argc) {
+                    fprintf(stderr, "missing argument for %s\n", argv[i-1]);
+                    return 1;
+                }
+                char extra;
+                if (sscanf(argv[i], "%d,%d%c", &pm.atlas_width, &pm.atlas_height, &extra) != 2 ||
+                    pm.atlas_width <= 0 || pm.atlas_height <= 0 || pm.atlas_width > 1024 || pm.atlas_height > 1024) {
+                    fprintf(stderr, "invalid argument for %s: %s\n", argv[i-1], argv[i]);
+                    return 1;
+                }
+            }
+
             else {
                 fprintf(stderr, "invalid flag: %s\n", argv[i]);
                 return 1;
@@ -1580,6 +2144,14 @@ int main(int argc, char *argv[])
 
         at_least_one_file = true;
         infn = argv[i];
+
+        // In atlas mode, collect all the files to convert them at the end
+        if (pm.atlas) {
+            atlas_files = realloc(atlas_files, (num_atlas_files+1) * sizeof(char*));
+            atlas_files[num_atlas_files++] = infn;
+            continue;
+        }
+
         char *basename = strrchr(infn, '/');
         if (!basename) basename = infn; else basename += 1;
         char* basename_noext = strdup(basename);
@@ -1587,24 +2159,36 @@ int main(int argc, char *argv[])
         if (ext) *ext = '\0';
 
         asprintf(&outfn, "%s/%s.sprite", outdir, basename_noext);
+        free(basename_noext);
+
+        // Queue the conversion. Flags only apply to the files that follow
+        // them, so take a snapshot of the current parameters.
+        jobs = realloc(jobs, (njobs+1) * sizeof(convert_job_t));
+        jobs[njobs++] = (convert_job_t){
+            .infn = infn,
+            .outfn = outfn,
+            .pm = pm,
+            .compression = compression,
+        };
+    }
 
-        if (convert(infn, outfn, &pm) != 0) {
+    parallel_for(num_jobs, njobs, convert_job, jobs);
+    for (int i=0; i<njobs; i++) {
+        if (!jobs[i].ok)
             error = true;
-        } else {
-            if (compression == -1)
-                compression = DEFAULT_COMPRESSION;
-            if (compression) {
-                struct stat st_decomp = {0}, st_comp = {0};
-                stat(outfn, &st_decomp);
-                asset_compress(outfn, outfn, compression, 0);
-                stat(outfn, &st_comp);
-                if (flag_verbose)
-                    fprintf(stderr, "compressed: %s (%d -> %d, ratio %.1f%%)\n", outfn,
-                    (int)st_decomp.st_size, (int)st_comp.st_size, 100.0 * (float)st_comp.st_size / (float)(st_decomp.st_size == 0 ? 1 :st_decomp.st_size));
-            }
-        }
+        free(jobs[i].outfn);
+    }
+    free(jobs);
 
-        free(outfn);
+    if (pm.atlas) {
+        if (!at_least_one_file) {
+            fprintf(stderr, "atlas mode requires at least one input file\n");
+            return 1;
+        }
+        if (convert_atlas((const char**)atlas_files, num_atlas_files, outdir, &pm, compression, num_jobs) != 0)
+            error = true;
+        free(atlas_files);
+        return error ? 1 : 0;
     }
 
     if (!at_least_one_file) {
@@ -0,0 +1,603 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <math.h>
+
+// Build the triangle setup code of the runtime library for the host. The
+// host build of rdpq_tri.c writes the RDP commands to rspq_cur_pointer.
+#include "../../src/rdpq/rdpq_tri.c"
+
+/** @brief Maximum size of a triangle command in 32-bit words */
+#define TRI_MAX_WORDS       (8+16+16+4)
+/** @brief Number of floats per vertex (enough for all the predefined formats) */
+#define VTX_FLOATS          10
+
+bool flag_verbose = false;
+
+/** @brief Triangle formats exercised by the harness */
+typedef struct {
+    const char *name;
+    rdpq_trifmt_t fmt;
+} trifmt_desc_t;
+
+static trifmt_desc_t formats[] = {
+    { "fill",            { .pos_offset = 0, .shade_offset = -1, .tex_offset = -1, .z_offset = -1 } },
+    { "shade",           { .pos_offset = 0, .shade_offset = 2, .tex_offset = -1, .z_offset = -1 } },
+    { "shade_flat",      { .pos_offset = 0, .shade_offset = 2, .shade_flat = true, .tex_offset = -1, .z_offset = -1 } },
+    { "tex",             { .pos_offset = 0, .shade_offset = -1, .tex_offset = 2, .z_offset = -1 } },
+    { "tex_mip",         { .pos_offset = 0, .shade_offset = -1, .tex_offset = 2, .tex_tile = 3, .tex_mipmaps = 4, .z_offset = -1 } },
+    { "shade_tex",       { .pos_offset = 0, .shade_offset = 2, .tex_offset = 6, .z_offset = -1 } },
+    { "zbuf",            { .pos_offset = 0, .shade_offset = -1, .tex_offset = -1, .z_offset = 2 } },
+    { "zbuf_shade",      { .pos_offset = 0, .shade_offset = 3, .tex_offset = -1, .z_offset = 2 } },
+    { "zbuf_tex",        { .pos_offset = 0, .shade_offset = -1, .tex_offset = 3, .z_offset = 2 } },
+    { "zbuf_shade_tex",  { .pos_offset = 0, .shade_offset = 3, .tex_offset = 7, .z_offset = 2 } },
+};
+#define NUM_FORMATS  (int)(sizeof(formats) / sizeof(formats[0]))
+
+/** @brief A random triangle */
+typedef struct {
+    int fmt;                            ///< Index into formats
+    float v[3][VTX_FLOATS];             ///< Vertices
+} tri_t;
+
+void print_args(char * name)
+{
+    fprintf(stderr, "%s -- Host harness for the rdpq triangle setup\n\n", name);
+    fprintf(stderr, "This tool runs the CPU triangle setup of rdpq (rdpq_triangle_cpu) on the host,\n");
+    fprintf(stderr, "to check and optimize it without running on the console.\n\n");
+    fprintf(stderr, "Usage: %s [flags]\n", name);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Command-line flags:\n");
+    fprintf(stderr, "   -f/--fuzz <count>       Check <count> random triangles against a double precision reference\n");
+    fprintf(stderr, "   -b/--bench              Measure the setup throughput (triangles per second) of each format\n");
+    fprintf(stderr, "   -r/--record <file>      Write <count> random triangles and their RDP commands to <file>\n");
+    fprintf(stderr, "   -c/--check <file>       Run the triangles in <file> and compare the RDP commands bit for bit\n");
+    fprintf(stderr, "   -n/--count <count>      Number of triangles for --record and --bench (default: 10000)\n");
+    fprintf(stderr, "   -s/--seed <seed>        Seed of the random generator (default: 1)\n");
+    fprintf(stderr, "   -v/--verbose            Verbose output\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "The reference check tolerates the rounding errors of single precision math (the\n");
+    fprintf(stderr, "tolerance of each value is derived from the magnitude of its operands), while all\n");
+    fprintf(stderr, "the integer fields (command, Y coordinates, major flag, tile, mipmaps) must match\n");
+    fprintf(stderr, "exactly. Use --record before changing the setup code, and --check afterwards,\n");
+    fprintf(stderr, "to verify that the emitted commands did not change at all.\n");
+    fprintf(stderr, "\n");
+}
+
+/****************************************************************************
+ * Random triangle generation
+ ****************************************************************************/
+
+static uint32_t rng_state = 1;
+
+static uint32_t rng(void)
+{
+    // xorshift32: deterministic on all hosts
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static float rng_float(float min, float max)
+{
+    return min + (max - min) * ((rng() >> 8) / 16777216.0f);
+}
+
+static void random_triangle(tri_t *t, int fmt_idx)
+{
+    const rdpq_trifmt_t *fmt = &formats[fmt_idx].fmt;
+    memset(t, 0, sizeof(tri_t));
+    t->fmt = fmt_idx;
+
+    // Mix all triangle sizes, from subpixel slivers to full screen ones
+    float cx = rng_float(-64, 1088), cy = rng_float(-64, 1088);
+    float radius = exp2f(rng_float(-2, 10));
+
+    for (int i=0; i<3; i++) {
+        float *v = t->v[i];
+        v[fmt->pos_offset+0] = cx + rng_float(-radius, radius);
+        v[fmt->pos_offset+1] = cy + rng_float(-radius, radius);
+        // Sometimes snap the vertices on the pixel grid, to exercise
+        // horizontal edges and integer coordinates.
+        if ((rng() & 7) == 0) {
+            v[fmt->pos_offset+0] = floorf(v[fmt->pos_offset+0]);
+            v[fmt->pos_offset+1] = floorf(v[fmt->pos_offset+1]);
+        }
+        if (fmt->z_offset >= 0)
+            v[fmt->z_offset] = rng_float(0, 1);
+        if (fmt->shade_offset >= 0)
+            for (int j=0; j<4; j++)
+                v[fmt->shade_offset+j] = rng_float(0, 1);
+        if (fmt->tex_offset >= 0) {
+            v[fmt->tex_offset+0] = rng_float(-32, 128);
+            v[fmt->tex_offset+1] = rng_float(-32, 128);
+            v[fmt->tex_offset+2] = rng_float(0.05f, 1);
+        }
+    }
+}
+
+/** @brief Run the setup code on a triangle, returning the number of words written */
+static int run_triangle(const tri_t *t, uint32_t *out)
+{
+    rspq_cur_pointer = out;
+    rdpq_triangle_cpu(&formats[t->fmt].fmt, t->v[0], t->v[1], t->v[2]);
+    return rspq_cur_pointer - out;
+}
+
+/****************************************************************************
+ * Reference check
+ ****************************************************************************/
+
+/** @brief An attribute value (s16.16) computed by the reference, with its tolerance */
+typedef struct {
+    double value;
+    double tol;
+} refval_t;
+
+/** @brief Saturate a value like float_to_s16_16 */
+static double sat_s16_16(double v)
+{
+    if (v >= 32768.0) return 0x7FFFFFFF / 65536.0;
+    if (v < -32768.0) return -32768.0;
+    return v;
+}
+
+static int num_errors = 0;
+
+static void report(const tri_t *t, const char *field, double cpu, double ref, double tol)
+{
+    if (++num_errors > 20) return;
+    fprintf(stderr, "mismatch (%s): %s: cpu=%.6f ref=%.6f tol=%.6f\n", formats[t->fmt].name, field, cpu, ref, tol);
+    if (flag_verbose) {
+        for (int i=0; i<3; i++) {
+            fprintf(stderr, "    v%d:", i+1);
+            for (int j=0; j<VTX_FLOATS; j++)
+                fprintf(stderr, " %.9g", t->v[i][j]);
+            fprintf(stderr, "\n");
+        }
+    }
+}
+
+static void check_value(const tri_t *t, const char *field, int32_t cpu, refval_t ref)
+{
+    // Add one LSB for the truncation performed by float_to_s16_16
+    double tol = ref.tol + 1.0 / 65536.0;
+    double cpuv = cpu / 65536.0;
+    if (fabs(cpuv - sat_s16_16(ref.value)) > tol)
+        report(t, field, cpuv, sat_s16_16(ref.value), tol);
+}
+
+static void check_exact(const tri_t *t, const char *field, uint32_t cpu, uint32_t ref)
+{
+    if (cpu != ref)
+        report(t, field, cpu, ref, 0);
+}
+
+/** @brief Extract a s16.16 value from a 16-word shade/texture block (see __rdpq_write_shade_coeffs) */
+static int32_t attr_fixed(const uint32_t *blk, int base, int chan)
+{
+    uint32_t hi = blk[base + chan/2], lo = blk[base + 4 + chan/2];
+    if (chan & 1)
+        return (hi << 16) | (lo & 0xFFFF);
+    return (hi & 0xFFFF0000) | (lo >> 16);
+}
+
+/** @brief Geometry of the triangle computed by the reference */
+typedef struct {
+    double hx, hy, mx, my, nz, fy, ish;
+    double mag;         ///< Magnitude of the cross product terms (to estimate errors)
+} refedge_t;
+
+/** @brief Compute start value and gradients of an attribute, and check them against the CPU output */
+static void check_attr(const tri_t *t, const char *name, const refedge_t *e, double a1, double a2, double a3,
+    int32_t cpu_start, int32_t cpu_dx, int32_t cpu_de, int32_t cpu_dy)
+{
+    const double eps = FLT_EPSILON * 8;
+    const double ma = a2 - a1, ha = a3 - a1;
+    const double amag = fabs(a1) + fabs(a2) + fabs(a3);
+
+    refval_t dx = {0}, dy = {0}, de = {0}, start = {0};
+    if (fabs(e->nz) > FLT_MIN) {
+        // Solve the plane equation with Cramer's rule
+        dx.value = (ma*e->hy - ha*e->my) / -e->nz;
+        dy.value = (ha*e->mx - ma*e->hx) / -e->nz;
+        // Error of the single precision computation: rounding of the
+        // attribute differences and of the cross products, amplified
+        // by the inverse of the triangle area.
+        dx.tol = eps * ((fabs(e->hy) + fabs(e->my)) * amag + fabs(dx.value) * e->mag) / fabs(e->nz);
+        dy.tol = eps * ((fabs(e->hx) + fabs(e->mx)) * amag + fabs(dy.value) * e->mag) / fabs(e->nz);
+    }
+    de.value = dy.value + dx.value * e->ish;
+    de.tol = dy.tol + dx.tol * fabs(e->ish) + eps * (fabs(dy.value) + fabs(dx.value * e->ish));
+    start.value = a1 + e->fy * de.value;
+    start.tol = eps * (fabs(a1) + fabs(e->fy * de.value)) + fabs(e->fy) * de.tol;
+
+    char field[64];
+    snprintf(field, sizeof(field), "%s", name);        check_value(t, field, cpu_start, start);
+    snprintf(field, sizeof(field), "D%sDx", name);     check_value(t, field, cpu_dx, dx);
+    snprintf(field, sizeof(field), "D%sDe", name);     check_value(t, field, cpu_de, de);
+    snprintf(field, sizeof(field), "D%sDy", name);     check_value(t, field, cpu_dy, dy);
+}
+
+/** @brief Check the RDP command generated for a triangle against the reference */
+static void check_triangle(const tri_t *t, const uint32_t *cmd, int size)
+{
+    const rdpq_trifmt_t *fmt = &formats[t->fmt].fmt;
+    const double eps = FLT_EPSILON * 8;
+
+    // Command ID and size
+    uint32_t cmd_id = RDPQ_CMD_TRI;
+    int exp_size = 8;
+    if (fmt->shade_offset >= 0) { cmd_id |= 0x4; exp_size += 16; }
+    if (fmt->tex_offset >= 0)   { cmd_id |= 0x2; exp_size += 16; }
+    if (fmt->z_offset >= 0)     { cmd_id |= 0x1; exp_size += 4; }
+    check_exact(t, "size", size, exp_size);
+    if (size != exp_size) return;
+    check_exact(t, "cmd", cmd[0] >> 24, 0xC0 | cmd_id);
+
+    // Sort the vertices by Y (with the same tie breaking as the setup code)
+    const float *v[3] = { t->v[0], t->v[1], t->v[2] };
+    const int py = fmt->pos_offset + 1;
+    if (v[0][py] > v[1][py]) SWAP(v[0], v[1]);
+    if (v[1][py] > v[2][py]) SWAP(v[1], v[2]);
+    if (v[0][py] > v[1][py]) SWAP(v[0], v[1]);
+
+    // Edge coefficients. The RDP walks the edges with Y in 11.2 format, so
+    // the Y coordinates are snapped to quarter of pixels.
+    double x[3], y[3];
+    int32_t yf[3];
+    for (int i=0; i<3; i++) {
+        x[i] = v[i][fmt->pos_offset];
+        yf[i] = floor((double)v[i][py] * 4);
+        y[i] = yf[i] / 4.0;
+        yf[i] = yf[i] < -4096*4 ? -4096*4 : yf[i] > 4095*4 ? 4095*4 : yf[i];
+    }
+
+    refedge_t e;
+    e.hx = x[2] - x[0]; e.hy = y[2] - y[0];
+    e.mx = x[1] - x[0]; e.my = y[1] - y[0];
+    double lx = x[2] - x[1], ly = y[2] - y[1];
+    e.nz = e.hx*e.my - e.hy*e.mx;
+    e.mag = fabs(e.hx*e.my) + fabs(e.hy*e.mx);
+    e.fy = floor(y[0]) - y[0];
+    e.ish = e.hy != 0 ? e.hx / e.hy : 0;
+    double ism = e.my != 0 ? e.mx / e.my : 0;
+    double isl = ly != 0 ? lx / ly : 0;
+
+    // In single precision, the X differences are rounded, so the slopes
+    // carry an error relative to the magnitude of the X coordinates.
+    double xmag = fabs(x[0]) + fabs(x[1]) + fabs(x[2]);
+    refval_t xl  = { x[1], eps * fabs(x[1]) };
+    refval_t rish = { e.ish, e.hy != 0 ? eps * xmag / fabs(e.hy) : 0 };
+    refval_t rism = { ism, e.my != 0 ? eps * xmag / fabs(e.my) : 0 };
+    refval_t risl = { isl, ly != 0 ? eps * xmag / fabs(ly) : 0 };
+    refval_t xh = { x[0] + e.fy * e.ish, eps * xmag + fabs(e.fy) * rish.tol };
+    refval_t xm = { x[0] + e.fy * ism,   eps * xmag + fabs(e.fy) * rism.tol };
+
+    check_exact(t, "lft", (cmd[0] >> 23) & 1, e.nz < 0);
+    check_exact(t, "mipmaps", (cmd[0] >> 19) & 7, fmt->tex_mipmaps ? fmt->tex_mipmaps-1 : 0);
+    check_exact(t, "tile", (cmd[0] >> 16) & 7, fmt->tex_tile & 7);
+    check_exact(t, "yl", cmd[0] & 0x3FFF, yf[2] & 0x3FFF);
+    check_exact(t, "ym", cmd[1] >> 16, yf[1] & 0x3FFF);
+    check_exact(t, "yh", cmd[1] & 0xFFFF, yf[0] & 0x3FFF);
+    // The cross product is computed on rounded values: skip the slope checks
+    // for triangles so thin that the major edge direction is ambiguous.
+    if (fabs(e.nz) > eps * e.mag) {
+        check_value(t, "xl", cmd[2], xl);
+        check_value(t, "DxLDy", cmd[3], risl);
+        check_value(t, "xh", cmd[4], xh);
+        check_value(t, "DxHDy", cmd[5], rish);
+        check_value(t, "xm", cmd[6], xm);
+        check_value(t, "DxMDy", cmd[7], rism);
+    }
+    cmd += 8;
+
+    // Gradients are meaningless for degenerate triangles
+    bool degenerate = fabs(e.nz) <= eps * e.mag;
+
+    if (fmt->shade_offset >= 0) {
+        const float *s1 = v[0] + fmt->shade_offset;
+        const float *s2 = (fmt->shade_flat ? v[0] : v[1]) + fmt->shade_offset;
+        const float *s3 = (fmt->shade_flat ? v[0] : v[2]) + fmt->shade_offset;
+        static const char *names[4] = { "r", "g", "b", "a" };
+        for (int c=0; c<4 && !degenerate; c++)
+            check_attr(t, names[c], &e, s1[c]*255.0, s2[c]*255.0, s3[c]*255.0,
+                attr_fixed(cmd, 0, c), attr_fixed(cmd, 2, c), attr_fixed(cmd, 8, c), attr_fixed(cmd, 10, c));
+        cmd += 16;
+    }
+
+    if (fmt->tex_offset >= 0) {
+        const float *t1 = v[0] + fmt->tex_offset;
+        const float *t2 = v[1] + fmt->tex_offset;
+        const float *t3 = v[2] + fmt->tex_offset;
+        // Perspective correction: S/T are divided by W (multiplied by INV_W),
+        // after normalizing INV_W so that the nearest vertex has INV_W=1.
+        double maxw = fmax(fmax(t1[2], t2[2]), t3[2]);
+        double w1 = t1[2] / maxw, w2 = t2[2] / maxw, w3 = t3[2] / maxw;
+        if (!degenerate) {
+            check_attr(t, "s", &e, t1[0]*32*w1, t2[0]*32*w2, t3[0]*32*w3,
+                attr_fixed(cmd, 0, 0), attr_fixed(cmd, 2, 0), attr_fixed(cmd, 8, 0), attr_fixed(cmd, 10, 0));
+            check_attr(t, "t", &e, t1[1]*32*w1, t2[1]*32*w2, t3[1]*32*w3,
+                attr_fixed(cmd, 0, 1), attr_fixed(cmd, 2, 1), attr_fixed(cmd, 8, 1), attr_fixed(cmd, 10, 1));
+            check_attr(t, "w", &e, w1*0x7FFF, w2*0x7FFF, w3*0x7FFF,
+                attr_fixed(cmd, 0, 2), attr_fixed(cmd, 2, 2), attr_fixed(cmd, 8, 2), attr_fixed(cmd, 10, 2));
+        }
+        // The fourth channel is unused, and must be zero
+        for (int i=1; i<16; i+=2)
+            check_exact(t, "w-pad", cmd[i] & 0xFFFF, 0);
+        cmd += 16;
+    }
+
+    if (fmt->z_offset >= 0) {
+        const float *z1 = v[0] + fmt->z_offset;
+        const float *z2 = v[1] + fmt->z_offset;
+        const float *z3 = v[2] + fmt->z_offset;
+        if (!degenerate)
+            check_attr(t, "z", &e, z1[0]*0x7FFF, z2[0]*0x7FFF, z3[0]*0x7FFF, cmd[0], cmd[1], cmd[2], cmd[3]);
+        cmd += 4;
+    }
+}
+
+static int do_fuzz(int count)
+{
+    uint32_t cmd[TRI_MAX_WORDS], cmd2[TRI_MAX_WORDS];
+    for (int i=0; i<count; i++) {
+        tri_t t;
+        random_triangle(&t, i % NUM_FORMATS);
+        int size = run_triangle(&t, cmd);
+        check_triangle(&t, cmd, size);
+
+        // The setup must not depend on the vertex order beyond the sort by Y:
+        // rotating the vertices must produce exactly the same command
+        // (except for flat shading, which uses the first vertex).
+        if (!formats[t.fmt].fmt.shade_flat) {
+            tri_t t2 = t;
+            const float *yv = &t.v[0][formats[t.fmt].fmt.pos_offset+1];
+            bool distinct_y = yv[0] != yv[VTX_FLOATS] && yv[0] != yv[2*VTX_FLOATS] && yv[VTX_FLOATS] != yv[2*VTX_FLOATS];
+            if (distinct_y) {
+                memcpy(t2.v[0], t.v[1], sizeof(t.v[0]));
+                memcpy(t2.v[1], t.v[2], sizeof(t.v[0]));
+                memcpy(t2.v[2], t.v[0], sizeof(t.v[0]));
+                int size2 = run_triangle(&t2, cmd2);
+                if (size2 != size || memcmp(cmd, cmd2, size * 4))
+                    report(&t, "vertex order", 0, 0, 0);
+            }
+        }
+    }
+
+    if (num_errors > 20)
+        fprintf(stderr, "... (%d more)\n", num_errors - 20);
+    printf("fuzz: %d triangles, %d mismatches\n", count, num_errors);
+    return num_errors ? 1 : 0;
+}
+
+/****************************************************************************
+ * Golden files
+ ****************************************************************************/
+
+static int do_record(const char *fn, int count)
+{
+    FILE *f = fopen(fn, "w");
+    if (!f) {
+        fprintf(stderr, "cannot create file: %s\n", fn);
+        return 1;
+    }
+
+    uint32_t cmd[TRI_MAX_WORDS];
+    for (int i=0; i<count; i++) {
+        tri_t t;
+        random_triangle(&t, i % NUM_FORMATS);
+        int size = run_triangle(&t, cmd);
+
+        // Floats are stored as bit patterns, so that the inputs are exact
+        fprintf(f, "%s", formats[t.fmt].name);
+        for (int j=0; j<3; j++)
+            for (int k=0; k<VTX_FLOATS; k++)
+                fprintf(f, " %08x", F2I(t.v[j][k]));
+        fprintf(f, " :");
+        for (int j=0; j<size; j++)
+            fprintf(f, " %08x", cmd[j]);
+        fprintf(f, "\n");
+    }
+
+    fclose(f);
+    printf("record: %d triangles written to %s\n", count, fn);
+    return 0;
+}
+
+static int do_check(const char *fn)
+{
+    FILE *f = fopen(fn, "r");
+    if (!f) {
+        fprintf(stderr, "cannot open file: %s\n", fn);
+        return 1;
+    }
+
+    char *line = NULL; size_t linesize = 0;
+    int count = 0, lineno = 0, errors = 0;
+    while (getline(&line, &linesize, f) != -1) {
+        lineno++;
+        char *p = line;
+        char *name = strsep(&p, " ");
+        if (!p) continue;
+
+        tri_t t; memset(&t, 0, sizeof(t));
+        t.fmt = -1;
+        for (int i=0; i<NUM_FORMATS; i++)
+            if (!strcmp(formats[i].name, name))
+                t.fmt = i;
+        if (t.fmt < 0) {
+            fprintf(stderr, "%s:%d: unknown format: %s\n", fn, lineno, name);
+            errors++;
+            continue;
+        }
+
+        for (int j=0; j<3; j++) {
+            for (int k=0; k<VTX_FLOATS; k++) {
+                uint32_t bits = strtoul(p, &p, 16);
+                t.v[j][k] = I2F(bits);
+            }
+        }
+
+        uint32_t exp[TRI_MAX_WORDS]; int exp_size = 0;
+        p = strchr(p, ':');
+        if (!p) {
+            fprintf(stderr, "%s:%d: invalid line\n", fn, lineno);
+            errors++;
+            continue;
+        }
+        p++;
+        while (exp_size < TRI_MAX_WORDS) {
+            char *end;
+            uint32_t w = strtoul(p, &end, 16);
+            if (end == p) break;
+            exp[exp_size++] = w;
+            p = end;
+        }
+
+        uint32_t cmd[TRI_MAX_WORDS];
+        int size = run_triangle(&t, cmd);
+        count++;
+        if (size != exp_size || memcmp(cmd, exp, size * 4)) {
+            if (++errors <= 20) {
+                fprintf(stderr, "%s:%d: mismatch (%s)\n", fn, lineno, name);
+                for (int i=0; i<size || i<exp_size; i++) {
+                    if (i < size && i < exp_size && cmd[i] == exp[i]) continue;
+                    fprintf(stderr, "    word %2d: expected %08x, got %08x\n", i,
+                        i < exp_size ? exp[i] : 0, i < size ? cmd[i] : 0);
+                }
+            }
+        }
+    }
+
+    free(line);
+    fclose(f);
+    printf("check: %d triangles, %d mismatches\n", count, errors);
+    return errors ? 1 : 0;
+}
+
+/****************************************************************************
+ * Benchmark
+ ****************************************************************************/
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int do_bench(int count)
+{
+    tri_t *tris = malloc(count * sizeof(tri_t));
+    uint32_t cmd[TRI_MAX_WORDS];
+    uint32_t checksum = 0;
+
+    printf("%-16s %12s %10s\n", "format", "tri/s", "ns/tri");
+    for (int f=0; f<NUM_FORMATS; f++) {
+        for (int i=0; i<count; i++)
+            random_triangle(&tris[i], f);
+
+        // Run for at least half a second, to get a stable measure
+        uint64_t done = 0;
+        double t0 = now(), elapsed;
+        do {
+            for (int i=0; i<count; i++) {
+                run_triangle(&tris[i], cmd);
+                checksum += cmd[2];
+            }
+            done += count;
+            elapsed = now() - t0;
+        } while (elapsed < 0.5);
+
+        printf("%-16s %12.0f %10.2f\n", formats[f].name, done / elapsed, elapsed * 1e9 / done);
+    }
+
+    if (flag_verbose)
+        printf("checksum: %08x\n", checksum);
+    free(tris);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int fuzz_count = 0, count = 10000;
+    bool bench = false;
+    const char *record_fn = NULL, *check_fn = NULL;
+
+    if (argc < 2) {
+        print_args(argv[0]);
+        return 1;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+            print_args(argv[0]);
+            return 0;
+        } else if (!strcmp(argv[i], "-v") || !strcmp(argv[i], "--verbose")) {
+            flag_verbose = true;
+        } else if (!strcmp(argv[i], "-b") || !strcmp(argv[i], "--bench")) {
+            bench = true;
+        } else if (!strcmp(argv[i], "-f") || !strcmp(argv[i], "--fuzz")) {
+            if (++i == argc) {
+                fprintf(stderr, "missing argument for %s\n", argv[i-1]);
+                return 1;
+            }
+            char *extra;
+            fuzz_count = strtol(argv[i], &extra, 0);
+            if (extra == argv[i] || *extra != 0 || fuzz_count <= 0) {
+                fprintf(stderr, "invalid argument for %s: %s\n", argv[i-1], argv[i]);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "-n") || !strcmp(argv[i], "--count")) {
+            if (++i == argc) {
+                fprintf(stderr, "missing argument for %s\n", argv[i-1]);
+                return 1;
+            }
+            char *extra;
+            count = strtol(argv[i], &extra, 0);
+            if (extra == argv[i] || *extra != 0 || count <= 0) {
+                fprintf(stderr, "invalid argument for %s: %s\n", argv[i-1], argv[i]);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "-s") || !strcmp(argv[i], "--seed")) {
+            if (++i == argc) {
+                fprintf(stderr, "missing argument for %s\n", argv[i-1]);
+                return 1;
+            }
+            char *extra;
+            rng_state = strtoul(argv[i], &extra, 0);
+            if (extra == argv[i] || *extra != 0 || rng_state == 0) {
+                fprintf(stderr, "invalid argument for %s: %s\n", argv[i-1], argv[i]);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "-r") || !strcmp(argv[i], "--record")) {
+            if (++i == argc) {
+                fprintf(stderr, "missing argument for %s\n", argv[i-1]);
+                return 1;
+            }
+            record_fn = argv[i];
+        } else if (!strcmp(argv[i], "-c") || !strcmp(argv[i], "--check")) {
+            if (++i == argc) {
+                fprintf(stderr, "missing argument for %s\n", argv[i-1]);
+                return 1;
+            }
+            check_fn = argv[i];
+        } else {
+            fprintf(stderr, "invalid flag: %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    int ret = 0;
+    if (check_fn)   ret |= do_check(check_fn);
+    if (fuzz_count) ret |= do_fuzz(fuzz_count);
+    if (record_fn)  ret |= do_record(record_fn, count);
+    if (bench)      ret |= do_bench(count);
+    return ret;
+}
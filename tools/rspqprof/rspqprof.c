@@ -0,0 +1,378 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include "../common/polyfill.h"
+
+/** @brief Prefix of the lines written by rspq_profile_dump() */
+#define PROFILE_PREFIX      "[rspq_profile]"
+/** @brief Number of buckets of the duration histograms (log2 of cycles) */
+#define HIST_BUCKETS        16
+/** @brief RCP clock frequency (cycles per microsecond) */
+#define RCP_MHZ             62.5
+/** @brief Fraction of the frame above which a unit is considered the bottleneck */
+#define BOUND_THRESHOLD     0.85
+
+bool flag_sum_dumps = false;
+int flag_top = 0;
+
+/** @brief Statistics of a command ID, aggregated across logs */
+typedef struct {
+    int id;                         ///< Command ID (overlay ID in the top 4 bits)
+    char *ovl;                      ///< Name of the overlay
+    uint64_t count;                 ///< Number of executions
+    uint64_t total;                 ///< Total duration (RCP cycles)
+    uint64_t max;                   ///< Maximum duration (RCP cycles)
+    uint64_t hist[HIST_BUCKETS];    ///< Histogram of durations
+} cmd_t;
+
+/** @brief Totals of the profiled frames */
+typedef struct {
+    uint64_t frames;                ///< Number of frames
+    uint64_t cpu_us;                ///< Duration of the frames measured by the CPU
+    uint64_t clock;                 ///< RCP cycles
+    uint64_t rdp_busy;              ///< RDP busy cycles
+    uint64_t rdp_pipe;              ///< RDP pipeline busy cycles
+    uint64_t rdp_tmem;              ///< TMEM busy cycles
+    uint64_t dropped;               ///< Dropped log entries
+    uint64_t switches;              ///< Overlay switches
+    uint64_t switch_cycles;         ///< RCP cycles spent switching overlays
+} frames_t;
+
+typedef struct {
+    frames_t frames;
+    cmd_t *cmds;
+    int count;
+} profile_t;
+
+/** @brief Names of the builtin commands of the RSP queue (see rspq_internal.h) */
+static const char *builtin_names[16] = {
+    "idle", "noop", "jump", "call", "ret", "dma", "write_status", "swap_buffers",
+    "test_write_status", "rdp_wait_idle", "rdp_set_buffer", "rdp_append_buffer",
+    "buffer_done", "profile", NULL, NULL,
+};
+
+void print_args(char * name)
+{
+    fprintf(stderr, "%s -- Libdragon RSP queue profile analyzer\n\n", name);
+    fprintf(stderr, "This tool decodes the statistics written by rspq_profile_dump() on the debug\n");
+    fprintf(stderr, "channel, and reports where the RSP time goes and whether the profiled frames\n");
+    fprintf(stderr, "are CPU-, RSP- or RDP-bound.\n\n");
+    fprintf(stderr, "Usage: %s [flags] <log files...>\n", name);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Command-line flags:\n");
+    fprintf(stderr, "   -s/--sum-dumps          Sum all the dumps within each log (use if rspq_profile_reset()\n");
+    fprintf(stderr, "                           is called after each dump). By default, statistics are\n");
+    fprintf(stderr, "                           cumulative, so only the last dump of each log is used.\n");
+    fprintf(stderr, "   -t/--top <N>            Only show the N most expensive commands.\n");
+    fprintf(stderr, "\nStatistics from different logs are always summed. Use \"-\" to read from stdin.\n");
+    fprintf(stderr, "\n");
+}
+
+static cmd_t *profile_find(profile_t *p, int id, const char *ovl)
+{
+    for (int i = 0; i < p->count; i++)
+        if (p->cmds[i].id == id && !strcmp(p->cmds[i].ovl, ovl))
+            return &p->cmds[i];
+
+    p->cmds = realloc(p->cmds, (p->count + 1) * sizeof(cmd_t));
+    cmd_t *c = &p->cmds[p->count++];
+    memset(c, 0, sizeof(cmd_t));
+    c->id = id;
+    c->ovl = strdup(ovl);
+    return c;
+}
+
+static void profile_free(profile_t *p)
+{
+    for (int i = 0; i < p->count; i++)
+        free(p->cmds[i].ovl);
+    free(p->cmds);
+    memset(p, 0, sizeof(profile_t));
+}
+
+static void cmd_add(cmd_t *dst, const cmd_t *src)
+{
+    dst->count += src->count;
+    dst->total += src->total;
+    if (src->max > dst->max) dst->max = src->max;
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        dst->hist[i] += src->hist[i];
+}
+
+static void frames_add(frames_t *dst, const frames_t *src)
+{
+    dst->frames += src->frames;
+    dst->cpu_us += src->cpu_us;
+    dst->clock += src->clock;
+    dst->rdp_busy += src->rdp_busy;
+    dst->rdp_pipe += src->rdp_pipe;
+    dst->rdp_tmem += src->rdp_tmem;
+    dst->dropped += src->dropped;
+    dst->switches += src->switches;
+    dst->switch_cycles += src->switch_cycles;
+}
+
+/** @brief Parse the totals line of a dump. Returns false if it is not one. */
+static bool parse_frames(const char *p, frames_t *f)
+{
+    // Overlay switches are missing in dumps of older versions of libdragon
+    unsigned long long v[9] = {0};
+    int n = sscanf(p, " frames %llu cpu_us %llu clock %llu rdp_busy %llu rdp_pipe %llu rdp_tmem %llu dropped %llu"
+            " switches %llu switch_cycles %llu",
+            &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7], &v[8]);
+    if (n != 7 && n != 9)
+        return false;
+    *f = (frames_t){ v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7], v[8] };
+    return true;
+}
+
+/** @brief Parse a command line of a dump. Returns false if it is not one. */
+static bool parse_cmd(const char *p, cmd_t *c, char ovl[64])
+{
+    unsigned int id; unsigned long long count, total, max; int n;
+    if (sscanf(p, " cmd %x %63s %llu %llu %llu%n", &id, ovl, &count, &total, &max, &n) != 5)
+        return false;
+    if (id > 0xFF) return false;
+    memset(c, 0, sizeof(cmd_t));
+    c->id = id;
+    c->count = count;
+    c->total = total;
+    c->max = max;
+
+    p += n;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        char *end;
+        c->hist[i] = strtoull(p, &end, 10);
+        if (end == p) return false;
+        p = end;
+    }
+    return true;
+}
+
+static bool read_log(const char *fn, profile_t *total)
+{
+    FILE *f = strcmp(fn, "-") ? fopen(fn, "r") : stdin;
+    if (!f) {
+        fprintf(stderr, "error opening input file: %s\n", fn);
+        return false;
+    }
+
+    // Statistics of the dump being parsed. Since statistics are cumulative, each
+    // dump replaces the previous one, unless dumps must be summed.
+    profile_t dump = {0};
+    bool in_dump = false;
+
+    char *line = NULL; size_t line_size = 0;
+    while (getline(&line, &line_size, f) != -1) {
+        char *p = strstr(line, PROFILE_PREFIX);
+        if (!p) continue;
+        p += strlen(PROFILE_PREFIX);
+
+        // The totals line starts a new dump
+        frames_t frames;
+        if (parse_frames(p, &frames)) {
+            if (!flag_sum_dumps) profile_free(&dump);
+            frames_add(&dump.frames, &frames);
+            in_dump = true;
+            continue;
+        }
+
+        cmd_t cmd; char ovl[64];
+        if (in_dump && parse_cmd(p, &cmd, ovl))
+            cmd_add(profile_find(&dump, cmd.id, ovl), &cmd);
+    }
+    free(line);
+    if (f != stdin) fclose(f);
+
+    frames_add(&total->frames, &dump.frames);
+    for (int i = 0; i < dump.count; i++)
+        cmd_add(profile_find(total, dump.cmds[i].id, dump.cmds[i].ovl), &dump.cmds[i]);
+    profile_free(&dump);
+    return true;
+}
+
+static int cmp_cmd_total(const void *a, const void *b)
+{
+    const cmd_t *ca = a, *cb = b;
+    return ca->total < cb->total ? 1 : ca->total > cb->total ? -1 : ca->id - cb->id;
+}
+
+/** @brief Upper bound (in cycles) of the duration of the given percentile of executions */
+static uint64_t percentile(const cmd_t *c, double pct)
+{
+    uint64_t target = c->count * pct, sum = 0;
+    for (int i = 0; i < HIST_BUCKETS-1; i++) {
+        sum += c->hist[i];
+        if (sum > target)
+            return (1ull << i) - 1;
+    }
+    return c->max;
+}
+
+/** @brief Draw the histogram of durations as a row of characters */
+static void sparkline(const cmd_t *c, char out[HIST_BUCKETS+1])
+{
+    static const char levels[] = " .:-=+*#%@";
+    uint64_t peak = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        if (c->hist[i] > peak) peak = c->hist[i];
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        int l = peak ? (c->hist[i] * (sizeof(levels)-2) + peak - 1) / peak : 0;
+        out[i] = levels[l];
+    }
+    out[HIST_BUCKETS] = 0;
+}
+
+static double ms_per_frame(uint64_t cycles, uint64_t frames)
+{
+    return cycles / RCP_MHZ / 1000.0 / frames;
+}
+
+static double pct(uint64_t part, uint64_t whole)
+{
+    return whole ? part * 100.0 / whole : 0;
+}
+
+static void print_report(profile_t *p)
+{
+    frames_t *f = &p->frames;
+    qsort(p->cmds, p->count, sizeof(cmd_t), cmp_cmd_total);
+
+    // RSP time is split into commands, idle time (waiting for new commands,
+    // command 0x00), overlay switches and dispatch overhead (main loop).
+    uint64_t rsp_busy = 0, rsp_idle = 0;
+    for (int i = 0; i < p->count; i++) {
+        if (p->cmds[i].id == 0) rsp_idle += p->cmds[i].total;
+        else rsp_busy += p->cmds[i].total;
+    }
+    uint64_t rsp_other = rsp_busy + rsp_idle + f->switch_cycles;
+    uint64_t rsp_dispatch = f->clock > rsp_other ? f->clock - rsp_other : 0;
+
+    printf("Frames:             %llu\n", (unsigned long long)f->frames);
+    printf("Frame time (CPU):   %8.3f ms\n", f->cpu_us / 1000.0 / f->frames);
+    printf("Frame time (RCP):   %8.3f ms\n", ms_per_frame(f->clock, f->frames));
+    printf("RSP commands:       %8.3f ms  %5.1f%%\n", ms_per_frame(rsp_busy, f->frames), pct(rsp_busy, f->clock));
+    printf("RSP dispatch:       %8.3f ms  %5.1f%%\n", ms_per_frame(rsp_dispatch, f->frames), pct(rsp_dispatch, f->clock));
+    printf("RSP ovl switches:   %8.3f ms  %5.1f%%  (%.1f/frame, %.0f cycles each)\n",
+        ms_per_frame(f->switch_cycles, f->frames), pct(f->switch_cycles, f->clock),
+        f->frames ? (double)f->switches / f->frames : 0,
+        f->switches ? (double)f->switch_cycles / f->switches : 0);
+    printf("RSP idle:           %8.3f ms  %5.1f%%\n", ms_per_frame(rsp_idle, f->frames), pct(rsp_idle, f->clock));
+    printf("RDP busy:           %8.3f ms  %5.1f%%\n", ms_per_frame(f->rdp_busy, f->frames), pct(f->rdp_busy, f->clock));
+    printf("RDP pipe busy:      %8.3f ms  %5.1f%%\n", ms_per_frame(f->rdp_pipe, f->frames), pct(f->rdp_pipe, f->clock));
+    printf("TMEM busy:          %8.3f ms  %5.1f%%\n", ms_per_frame(f->rdp_tmem, f->frames), pct(f->rdp_tmem, f->clock));
+    if (f->dropped)
+        printf("WARNING: %llu log entries were dropped (increase RSPQ_PROFILE_BUFFER_SIZE)\n",
+            (unsigned long long)f->dropped);
+
+    const char *verdict = "CPU-bound";
+    if (f->rdp_busy >= f->clock * BOUND_THRESHOLD)
+        verdict = "RDP-bound";
+    else if (rsp_busy + rsp_dispatch + f->switch_cycles >= f->clock * BOUND_THRESHOLD)
+        verdict = "RSP-bound";
+    printf("Bottleneck:         %s\n", verdict);
+    if (f->switch_cycles * 20 >= f->clock)
+        printf("Hint:               overlay switches take %.1f%% of the frame, consider batching commands (rspq_batch_begin)\n",
+            pct(f->switch_cycles, f->clock));
+
+    // Per-overlay totals (overlays are listed in order of first appearance,
+    // which is by decreasing cost since commands are sorted).
+    printf("\n%-20s %10s %12s %7s\n", "overlay", "cmds/frm", "ms/frame", "rsp%");
+    for (int i = 0; i < p->count; i++) {
+        bool seen = false;
+        for (int j = 0; j < i && !seen; j++)
+            seen = p->cmds[j].id && !strcmp(p->cmds[j].ovl, p->cmds[i].ovl);
+        if (seen || p->cmds[i].id == 0) continue;
+        uint64_t count = 0, total = 0;
+        for (int j = i; j < p->count; j++) {
+            if (p->cmds[j].id == 0 || strcmp(p->cmds[j].ovl, p->cmds[i].ovl)) continue;
+            count += p->cmds[j].count;
+            total += p->cmds[j].total;
+        }
+        printf("%-20s %10.1f %12.3f %6.1f%%\n", p->cmds[i].ovl, (double)count / f->frames,
+            ms_per_frame(total, f->frames), pct(total, rsp_busy));
+    }
+
+    // Per-command statistics
+    printf("\n%-4s %-20s %-18s %10s %8s %8s %8s %10s %7s  %-16s\n",
+        "id", "overlay", "command", "cmds/frm", "avg_cyc", "p90_cyc", "max_cyc", "ms/frame", "rsp%", "histogram");
+    int shown = 0;
+    for (int i = 0; i < p->count; i++) {
+        cmd_t *c = &p->cmds[i];
+        if (c->id == 0) continue;
+        if (flag_top && shown++ == flag_top) break;
+
+        char name[32];
+        if ((c->id >> 4) == 0 && builtin_names[c->id])
+            snprintf(name, sizeof(name), "%s", builtin_names[c->id]);
+        else
+            snprintf(name, sizeof(name), "cmd %d", c->id & 0xF);
+        char spark[HIST_BUCKETS+1];
+        sparkline(c, spark);
+
+        printf("0x%02x %-20s %-18s %10.1f %8llu %8llu %8llu %10.3f %6.1f%%  [%s]\n",
+            c->id, c->ovl, name, (double)c->count / f->frames,
+            (unsigned long long)(c->total / c->count), (unsigned long long)percentile(c, 0.9),
+            (unsigned long long)c->max, ms_per_frame(c->total, f->frames),
+            pct(c->total, rsp_busy), spark);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    profile_t profile = {0};
+    char **logs = NULL; int nlogs = 0;
+
+    if (argc < 2) {
+        print_args(argv[0]);
+        return 1;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] == '-' && argv[i][1] != 0) {
+            if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+                print_args(argv[0]);
+                return 0;
+            } else if (!strcmp(argv[i], "-s") || !strcmp(argv[i], "--sum-dumps")) {
+                flag_sum_dumps = true;
+            } else if (!strcmp(argv[i], "-t") || !strcmp(argv[i], "--top")) {
+                if (++i == argc) {
+                    fprintf(stderr, "missing argument for %s\n", argv[i-1]);
+                    return 1;
+                }
+                char *extra;
+                flag_top = strtol(argv[i], &extra, 10);
+                if (extra == argv[i] || *extra != 0 || flag_top <= 0) {
+                    fprintf(stderr, "invalid argument for %s: %s\n", argv[i-1], argv[i]);
+                    return 1;
+                }
+            } else {
+                fprintf(stderr, "invalid flag: %s\n", argv[i]);
+                return 1;
+            }
+            continue;
+        }
+        logs = realloc(logs, (nlogs + 1) * sizeof(char*));
+        logs[nlogs++] = argv[i];
+    }
+
+    if (nlogs == 0) {
+        fprintf(stderr, "no log files specified\n");
+        return 1;
+    }
+    for (int i = 0; i < nlogs; i++)
+        if (!read_log(logs[i], &profile))
+            return 1;
+    free(logs);
+    if (profile.frames.frames == 0) {
+        fprintf(stderr, "no rspq profile found (did you call rspq_profile_dump()?)\n");
+        return 1;
+    }
+
+    print_report(&profile);
+    profile_free(&profile);
+    return 0;
+}